@@ -0,0 +1,57 @@
+#pragma once
+
+// The pieces shared by the compact binary dumps, the key trace (KeyTrace.h) and the latency probe (LatencyProbe.h):
+// varints, 7 bits per byte, low first, with zigzag for signed values so small negatives stay short; and
+// dump_hex(), which writes a dump to Serial as lines of hex between BEGIN <name> and END <name>, for
+// host/replay to find in a capture of the Serial output.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <Arduino.h>
+
+
+#define VARINT_MAX_SIZE       5                                 // Bytes in the longest varint (32 bits)
+#define DUMP_HEX_LINE         32                                // Bytes per line of dump_hex()
+
+
+// Write value at buffer[position], which must have room for VARINT_MAX_SIZE bytes. Return the position after it.
+//
+inline size_t varint_put(uint8_t* buffer, size_t position, uint32_t value) {
+  while(0x80 <= value) {
+    buffer[position++] = uint8_t(value) | 0x80;
+    value >>= 7;
+  }
+  buffer[position++] = uint8_t(value);
+  return position;
+}
+
+
+// Read a varint at data[position], and move position past it. Return false if it runs past size or is too long.
+//
+inline bool varint_get(const uint8_t* data, size_t size, size_t& position, uint32_t& value) {
+  value = 0;
+  for(uint8_t shift = 0; shift < 7 * VARINT_MAX_SIZE && position < size; shift += 7) {
+    uint8_t byte = data[position++];
+    value |= uint32_t(byte & 0x7F) << shift;
+    if(!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+
+inline uint32_t zigzag(int32_t value)     { return (uint32_t(value) << 1) ^ uint32_t(value >> 31); }
+inline int32_t  unzigzag(uint32_t value)  { return int32_t(value >> 1) ^ -int32_t(value & 1); }
+
+
+// Write size bytes of data to Serial as hex, between BEGIN <name> <size> and END <name> lines
+//
+inline void dump_hex(const char* name, const uint8_t* data, size_t size) {
+  Serial.printf("BEGIN %s %u\n", name, unsigned(size));
+  for(size_t i = 0; i < size; i++) {
+    Serial.printf("%02X", data[i]);
+    if(DUMP_HEX_LINE - 1 == i % DUMP_HEX_LINE || size - 1 == i) Serial.println();
+  }
+  Serial.printf("END %s\n", name);
+}
@@ -9,9 +9,8 @@
 // In the year of the plague
 
 
-#include <vector>
-#include <map>
 #include <Arduino.h>
+#include "FixedStack.h"
 
 
 #define OP_ID_NONE                 0                            // Result of popping an empty operator_stack
@@ -21,7 +20,15 @@
 #define ERROR_DIVIDE_BY_ZERO      -3                            // Calculation error: divide by zero
 #define ERROR_SET_NOERROR         -4                            // You cannot set the error state to NONE, you must use clear_error_state()
 #define ERROR_NO_MATCHING_PAREN   -5                            // Evaluated more close parens than open parens
-#define ERROR_OVERFLOW            -6
+#define ERROR_OVERFLOW            -6                            // Calculation error: a value overflowed, or the value_stack or operator_stack is full
+#define ERROR_INVALID_NUMBER      -7                            // Text could not be converted to a number
+#define ERROR_INVALID_FORMULA     -8                            // A formula could not be compiled
+#define ERROR_CIRCULAR_REFERENCE  -9                            // A formula would depend on its own value
+#define ERROR_INVALID_MEMORY      -10                           // A memory index is out of range
+
+#ifndef CALC_STACK_DEPTH
+#define CALC_STACK_DEPTH          32                            // Capacity of the value_stack and operator_stack
+#endif
 
 #define DEBUG_OPERATORS           0                             // 0 is quiet, 1 spews info for debugging operators
 #define DEBUG_EVALUATION          0                             // 0 is quiet, 1 spews info for debugging evaluations
@@ -35,13 +42,41 @@
 #define CLOSE_PAREN_OPERATOR      (uint8_t(')'))
 #define SQUARE_OPERATOR           (uint8_t('s'))
 #define SQUARE_ROOT_OPERATOR      (uint8_t('r'))
-#define EVALUATE_OPERATOR         (uint8_t('='))                // This is a special operator that is not implemented as a class or added to _operators
+#define NEGATE_OPERATOR           (uint8_t('~'))                // Unary minus prefix. (The keyboard's +/- key is handled by KeyCalculator)
+#define EVALUATE_OPERATOR         (uint8_t('='))                // This is a special operator that is not added to _operators
 
 
-template<typename T> class        Operator;                     // Forward declaration to operator template
+template<typename T> class        CoreCalculator;               // Forward declaration for the operator kernels
+template<typename T> inline bool  value_overflowed(const T&) { return false; }  // Numeric types that can overflow (see Decimal.h) overload this
 typedef int16_t                   Op_Err;                       // Signed error; 0 is no error, errors are normally negative. See #define ERROR_*
 typedef uint16_t                  Op_ID;                        // Operators are normally identified by a single char like '+'. More may be needed.
 
+#define OPERATOR_TABLE_SIZE       128                           // Op_IDs below this value can be dispatched (all 7-bit chars)
+
+
+// One row of the operator dispatch table. Operators are plain functions (kernels) plus the facts the
+// shunting-yard loop needs about them, so dispatching an Op_ID is a single array index with no tree
+// walk and no virtual call. This approach makes operators extensible: see _set_operator().
+// Operator precedence: highest numbers are highest precedence. Values are unsigned 8 bits.
+// Grouping   250   - pairs of (), [], etc.
+// + -        200   - unary + and - prefixes
+// exp root   150   - exponents and roots
+// * / MOD    100   - multiplication, division and modulus
+// + -         50   - addition and subtraction
+// Evaluate     0   - always evaluate (not an operator; handled in push_operator)
+//
+// The kernel must pop the operands, but not the operator. The arity is checked before it is called.
+// Prefix operators (like unary minus) are pushed before their operand, so they never force evaluation of the stack.
+//
+template <typename T>
+struct Operator {
+  typedef Op_Err    (*Kernel)(CoreCalculator<T>* host);           // Signature of an operator implementation
+  uint8_t           precedence;                                   // Determines order of evaluation
+  uint8_t           arity;                                        // Number of operands required on the value_stack
+  bool              prefix;                                       // True if the operator precedes its operand
+  Kernel            operate;                                      // Does what the operator does. nullptr for an empty table slot.
+};
+
 
 // Tempate for the lowest level of the calculator engine, which manages evaluation of the operator_stack and value_stack.
 // Using the shunting-yard algorithm, values and operators can be pushed in the order of ordinary infix notation (1 + 1).
@@ -63,173 +98,74 @@ class CoreCalculator {
     Op_Err                        set_error_state(Op_Err err);  // Set the global error state. Return the previous error state. (Cannot be set to NO_ERROR)
     Op_Err                        get_error_state();            // Return the global error state
     void                          clear_error_state();          // Set _error_state to NO_ERROR and clear operator and value stacks.
-    std::vector<T>                value_stack;                  // Pushdown stack for values. Unfortunately, <stack> is broken
-    std::vector<Op_ID>            operator_stack;               // pushdown stack for operators
+    uint8_t                       get_precedence(Op_ID id);     // Precedence of the operator id, or 0 if it is not an operator
+    FixedStack<T, CALC_STACK_DEPTH>     value_stack;            // Pushdown stack for values. Fixed capacity, so pushes never allocate
+    FixedStack<Op_ID, CALC_STACK_DEPTH> operator_stack;         // pushdown stack for operators
   protected:
-    void                          _initialize_operators();      // Fill the _operators map with instances of available Operators
-    std::map<Op_ID, Operator<T>*> _operators;                   // A map of all the operators (extensible!)
+    void                          _initialize_operators();      // Fill the _operators table with the available Operators
+    Op_Err                        _set_operator(Op_ID id, uint8_t precedence, uint8_t arity, typename Operator<T>::Kernel kernel, bool prefix = false);
+    bool                          _is_operator(Op_ID id);       // Return true if id has an entry in the _operators table
+    Operator<T>                   _operators[OPERATOR_TABLE_SIZE];  // Dispatch table of all the operators, indexed by Op_ID (extensible!)
     Op_Err                        _error_state;                 // Global error state.
 public:
     void                          _spew_stacks();               // Writes operator_stack and value_stack to Serial port for debugging
 };
 
 
-// Base class for all other operators. This approach makes operators extensible.
-// Operator precedence: highest numbers are highest precedence. Values are unsigned 8 bits.
-// Grouping   250   - pairs of (), [], etc.
-// + -        200   - unary + and - prefixes (not currently used)
-// exp root   150   - exponents and roots
-// * / MOD    100   - multiplication, division and modulus
-// + -         50   - addition and subtraction
-// Evaluate     0   - always evaluate (not an operator; handled in push_operator)
-//
-// The Operator must pop the operands, but not the operator.
-//
-template <typename T>
-class Operator {
-  public:
-    Operator(CoreCalculator<T>* host) : _host(host) {}
-    Op_ID             id                = OP_ID_NONE; // Is often a character, like '+' (43)
-    uint8_t           precedence        = 0;          // Determines order of evaluation
-    virtual bool      enough_values()   = 0;          // Override to determine if there are enough operands on the _operand_stack
-    virtual Op_Err    operate()         = 0;          // Override to do what the operator does
-  protected:
-    CoreCalculator<T>*  _host;                        // for calling CoreCalculator<T> functions from the operator
-};
-
-
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  Operators Implementation
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-// Convenience class to make binary operators (n OP n) trivial to implement.
-// Usage:
-// In your derived template's constructor:
-//  BinaryOperator<T>::set_id_and_precedence('-', 100);
-// In your derived template's operate():
-//  BinaryOperator<T>::err = BinaryOperator<T>::prepare();
-//  return BinaryOperator<T>::push_result(BinaryOperator<T>::op2 [BINARY_OPERATOR] BinaryOperator<T>::op1);
+// Binary operators (n OP n) pop op1 (the top of the value_stack) and then op2, and push op2 OP op1.
 //
-template <typename T>
-class BinaryOperator: public Operator<T> {
-  public:
-    BinaryOperator(CoreCalculator<T>* host) : Operator<T>(host) {}
-    void set_id_and_precedence(Op_ID id, uint8_t precedence) {
-      this->id          = id;
-      this->precedence  = precedence;
-    }
-    bool enough_values() {
-      return (2 <= Operator<T>::_host->value_stack.size());
-    }
-    // Call this function to set up member variables before evaluation
-    Op_Err prepare() {
-      if(enough_values()) {
-        op1 = Operator<T>::_host->pop_value();
-        op2 = Operator<T>::_host->pop_value();
-        return NO_ERROR;
-      }
-      return ERROR_TOO_FEW_OPERANDS;
-    }
-    // This expects err to be set by the call to prepare. Pattern is:
-    Op_Err push_result(double result) {
-      if(NO_ERROR == err) {
-        return Operator<T>::_host->push_value(result);
-      }
-      return err;
-    }
-  protected:
-    double  op1     = 0.0;  // The top operand from the value_stack
-    double  op2     = 0.0;  // The second opeand from the value_stack
-    Op_Err  err;            // Shared error
-};
-
-template <typename T>
-class AdditionOperator : public BinaryOperator<T> {
-  public:
-    AdditionOperator(CoreCalculator<T>* host) : BinaryOperator<T>(host) {
-      BinaryOperator<T>::set_id_and_precedence(ADDITION_OPERATOR, 50);
-    }
-    Op_Err operate() {
-      BinaryOperator<T>::err = BinaryOperator<T>::prepare();
-      return BinaryOperator<T>::push_result(BinaryOperator<T>::op2 + BinaryOperator<T>::op1);
-    }
-};
+template <typename T> Op_Err addition_operator(CoreCalculator<T>* host) {
+  T op1 = host->pop_value();
+  T op2 = host->pop_value();
+  return host->push_value(op2 + op1);
+}
 
-template <typename T>
-class SubtractionOperator : public BinaryOperator<T> {
-  public:
-    SubtractionOperator(CoreCalculator<T>* host) : BinaryOperator<T>(host) {
-      BinaryOperator<T>::set_id_and_precedence(SUBTRACTION_OPERATOR, 50);
-    }
-    Op_Err operate() {
-      BinaryOperator<T>::err = BinaryOperator<T>::prepare();
-      return BinaryOperator<T>::push_result(BinaryOperator<T>::op2 - BinaryOperator<T>::op1);
-    }
-};
+template <typename T> Op_Err subtraction_operator(CoreCalculator<T>* host) {
+  T op1 = host->pop_value();
+  T op2 = host->pop_value();
+  return host->push_value(op2 - op1);
+}
 
-template <typename T>
-class MultiplicationOperator : public BinaryOperator<T> {
-  public:
-    MultiplicationOperator(CoreCalculator<T>* host) : BinaryOperator<T>(host) {
-      BinaryOperator<T>::set_id_and_precedence(MULTIPLICATION_OPERATOR, 100);
-    }
-    Op_Err operate() {
-      BinaryOperator<T>::err = BinaryOperator<T>::prepare();
-      return BinaryOperator<T>::push_result(BinaryOperator<T>::op2 * BinaryOperator<T>::op1);
-    }
-};
+template <typename T> Op_Err multiplication_operator(CoreCalculator<T>* host) {
+  T op1 = host->pop_value();
+  T op2 = host->pop_value();
+  return host->push_value(op2 * op1);
+}
 
-template <typename T>
-class DivisionOperator : public BinaryOperator<T> {
-  public:
-    DivisionOperator(CoreCalculator<T>* host) : BinaryOperator<T>(host) {
-      BinaryOperator<T>::set_id_and_precedence(DIVISION_OPERATOR, 100);
-    }
-    Op_Err operate() {
-      BinaryOperator<T>::err = BinaryOperator<T>::prepare();
-      if(T(0) == BinaryOperator<T>::op1) return ERROR_DIVIDE_BY_ZERO;  // Check for divide by zero before proceeding
-      return BinaryOperator<T>::push_result(BinaryOperator<T>::op2 / BinaryOperator<T>::op1);
-    }
-};
+template <typename T> Op_Err division_operator(CoreCalculator<T>* host) {
+  T op1 = host->pop_value();
+  T op2 = host->pop_value();
+  if(T(0) == op1) return ERROR_DIVIDE_BY_ZERO;  // Check for divide by zero before proceeding
+  return host->push_value(op2 / op1);
+}
 
 // Beginning of grouping does nothing, just puts a token on the stack
-template <typename T>
-class OpenParenOperator : public Operator<T> {
-  public:
-    OpenParenOperator(CoreCalculator<T>* host) : Operator<T>(host) {
-      Operator<T>::id          = OPEN_PAREN_OPERATOR;
-      Operator<T>::precedence  = 250;
-    }
-    bool    enough_values() { return true;     }
-    Op_Err  operate()       { return NO_ERROR; }
-};
+//
+template <typename T> Op_Err open_paren_operator(CoreCalculator<T>* host) {
+  return NO_ERROR;
+}
 
 // End of grouping: keep evaluating until an open paren if found.
 // Pop the open paren operator, the result is already on the value_stack.
 //
-template <typename T>
-class CloseParenOperator : public Operator<T> {
-  public:
-    CloseParenOperator(CoreCalculator<T>* host) : Operator<T>(host) {
-      Operator<T>::id          = CLOSE_PAREN_OPERATOR;
-      Operator<T>::precedence  = 250;
-    }
-    bool    enough_values() { return true; }
-    Op_Err  operate() {
-      while(OPEN_PAREN_OPERATOR != Operator<T>::_host->peek_operator()) {
-        Op_Err err = Operator<T>::_host->evaluate_one();
-        if(err) return err;
-        // It's not an error to evaluate an empty operator_stack, but it means
-        // there is no matching OPEN_PAREN and we'd be stuck here forever.
-        if(0 == Operator<T>::_host->operator_stack.size())
-          return ERROR_NO_MATCHING_PAREN;
-      }
-      Operator<T>::_host->pop_operator();
-      return NO_ERROR;
-    }
-};
+template <typename T> Op_Err close_paren_operator(CoreCalculator<T>* host) {
+  while(OPEN_PAREN_OPERATOR != host->peek_operator()) {
+    Op_Err err = host->evaluate_one();
+    if(err) return err;
+    // It's not an error to evaluate an empty operator_stack, but it means
+    // there is no matching OPEN_PAREN and we'd be stuck here forever.
+    if(0 == host->operator_stack.size())
+      return ERROR_NO_MATCHING_PAREN;
+  }
+  host->pop_operator();
+  return NO_ERROR;
+}
 
 // The calculator % operator is unusual and more complicated than most.
 // It doesn't really make sense if T is an integer.
@@ -238,73 +174,47 @@ class CloseParenOperator : public Operator<T> {
 // If +, -, * or / on stack, +-*/ value % from stack
 // In other words, 30 + 5 %  ==>  30 + 30 * 5 / T(100)
 //
-template <typename T>
-class PercentOperator : public Operator<T> {
-  public:
-    PercentOperator(CoreCalculator<T>* host) : Operator<T>(host) {
-      Operator<T>::id          = PERCENT_OPERATOR;
-      Operator<T>::precedence  = 100;
-    }
-    bool    enough_values() { return (1 <= Operator<T>::_host->value_stack.size()); }
-    Op_Err  operate() {
-      // If the perator stack is empty, or has an open paren on top...
-      if(0 == Operator<T>::_host->operator_stack.size() || OPEN_PAREN_OPERATOR == Operator<T>::_host->operator_stack.back()) {
-        Operator<T>::_host->push_operator('/');
-        Operator<T>::_host->push_value(T(100));
-        Operator<T>::_host->evaluate_one();
-      }
-      else {
-        // BUGBUG: HOW SHOULD 30 / 6 % = ACT?
-        T temp = Operator<T>::_host->pop_value();
-        Operator<T>::_host->push_value(Operator<T>::_host->get_value());
-        Operator<T>::_host->push_operator('*');
-        Operator<T>::_host->push_value(temp);
-        Operator<T>::_host->push_operator('/');
-        Operator<T>::_host->push_value(T(100));
-        Operator<T>::_host->evaluate_one();
-        Operator<T>::_host->evaluate_one();
-      }
-      return NO_ERROR;
-    }
-};
+template <typename T> Op_Err percent_operator(CoreCalculator<T>* host) {
+  // If the perator stack is empty, or has an open paren on top...
+  if(0 == host->operator_stack.size() || OPEN_PAREN_OPERATOR == host->operator_stack.back()) {
+    host->push_operator('/');
+    host->push_value(T(100));
+    host->evaluate_one();
+  }
+  else {
+    // BUGBUG: HOW SHOULD 30 / 6 % = ACT?
+    T temp = host->pop_value();
+    host->push_value(host->get_value());
+    host->push_operator('*');
+    host->push_value(temp);
+    host->push_operator('/');
+    host->push_value(T(100));
+    host->evaluate_one();
+    host->evaluate_one();
+  }
+  return NO_ERROR;
+}
+
+// Change the sign of the number on the stack
+//
+template <typename T> Op_Err negate_operator(CoreCalculator<T>* host) {
+  T temp = host->pop_value();
+  return host->push_value(-temp);
+}
 
 // Square the number on the stack
 //
-template <typename T>
-class SquareOperator : public Operator<T> {
-  public:
-    SquareOperator(CoreCalculator<T>* host) : Operator<T>(host) {
-      Operator<T>::id          = SQUARE_OPERATOR;
-      Operator<T>::precedence  = 150;
-    }
-    bool    enough_values() { return (1 <= Operator<T>::_host->value_stack.size()); }
-    Op_Err  operate() {
-      if(!enough_values()) return ERROR_TOO_FEW_OPERANDS;
-      T temp = Operator<T>::_host->pop_value();
-      temp = temp * temp;
-      Operator<T>::_host->push_value(temp);
-      return NO_ERROR;
-    }
-};
+template <typename T> Op_Err square_operator(CoreCalculator<T>* host) {
+  T temp = host->pop_value();
+  return host->push_value(temp * temp);
+}
 
 // Calculate the square root of the number on the stack
 //
-template <typename T>
-class SquareRootOperator : public Operator<T> {
-  public:
-    SquareRootOperator(CoreCalculator<T>* host) : Operator<T>(host) {
-      Operator<T>::id          = SQUARE_ROOT_OPERATOR;
-      Operator<T>::precedence  = 150;
-    }
-    bool    enough_values() { return (1 <= Operator<T>::_host->value_stack.size()); }
-    Op_Err  operate() {
-      if(!enough_values())  return ERROR_TOO_FEW_OPERANDS;
-      T temp = Operator<T>::_host->pop_value();
-      temp = T(sqrt(double(temp)));
-      Operator<T>::_host->push_value(temp);
-      return NO_ERROR;
-    }
-};
+template <typename T> Op_Err square_root_operator(CoreCalculator<T>* host) {
+  T temp = host->pop_value();
+  return host->push_value(T(sqrt(double(temp))));
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -313,14 +223,18 @@ class SquareRootOperator : public Operator<T> {
 ////////////////////////////////////////////////////////////////////////////////
 
 template <typename T> CoreCalculator<T>::CoreCalculator() {
-  set_error_state(NO_ERROR);
+  _error_state = NO_ERROR;        // set_error_state() refuses NO_ERROR, so initialize directly
   _initialize_operators();
 }
 
 // Push a value onto the stack to be processed later.
+// If the value_stack is full, or the value itself overflowed, set the global error state to ERROR_OVERFLOW.
 //
 template <typename T> Op_Err CoreCalculator<T>::push_value(T value) {
-  value_stack.push_back(value);
+  if(value_overflowed(value) || !value_stack.push_back(value)) {
+    set_error_state(ERROR_OVERFLOW);
+    return ERROR_OVERFLOW;
+  }
   return NO_ERROR;
 }
 
@@ -354,21 +268,23 @@ template <typename T> Op_Err CoreCalculator<T>::push_operator(Op_ID id) {
     return result;
   }
   if(DEBUG_OPERATORS) Serial.printf("\nPushing operator %c\n", id);
-  if(_operators.count(id)) {  // If it's a valid operator
-    Operator<T>* incoming = _operators[id];
+  if(_is_operator(id)) {  // If it's a valid operator
+    uint8_t precedence = _operators[id].precedence;
     if(DEBUG_OPERATORS) Serial.println("Operator valid");
-    while(true) {
+    while(!_operators[id].prefix) {
       Op_ID top = peek_operator();
-      if(!_operators.count(top)) break;
-      if(OPEN_PAREN_OPERATOR == top) break;   // Only the CloseParenOperator removes the OpenParenOperator
-      Operator<T>* top_op = _operators[top];
-      if(top_op->precedence < incoming->precedence) break;
+      if(!_is_operator(top)) break;
+      if(OPEN_PAREN_OPERATOR == top) break;   // Only the close paren operator removes the open paren operator
+      if(_operators[top].precedence < precedence) break;
       if(DEBUG_OPERATORS) Serial.printf("Forcing operator %c\n", top);
       result = evaluate_one();
       if(result) return result;
       if(DEBUG_OPERATORS) Serial.println("Forced operation successful\n");
     }
-    operator_stack.push_back(id);
+    if(!operator_stack.push_back(id)) {
+      set_error_state(ERROR_OVERFLOW);
+      return ERROR_OVERFLOW;
+    }
     return result;
   }
   return ERROR_UNKNOWN_OPERATOR;
@@ -431,18 +347,18 @@ template <typename T> Op_Err CoreCalculator<T>::evaluate_one() {
   if(1 <= operator_stack.size()) {
     Op_ID id = pop_operator();
     if(DEBUG_EVALUATION) Serial.printf("popped operator %c\n", id);
-    if(!_operators.count(id)) {
+    if(!_is_operator(id)) {
       if(DEBUG_EVALUATION) Serial.println("operator unknown; returning false");
       set_error_state(ERROR_UNKNOWN_OPERATOR);
       return ERROR_UNKNOWN_OPERATOR;
     }
-    Operator<T>* op = _operators[id];
-    if(!op->enough_values()) {
+    const Operator<T>& op = _operators[id];
+    if(value_stack.size() < op.arity) {
       if(DEBUG_EVALUATION) Serial.println("not enough operands; returning false");
       set_error_state(ERROR_TOO_FEW_OPERANDS);
       return ERROR_TOO_FEW_OPERANDS;
     }
-    Op_Err result = op->operate();
+    Op_Err result = op.operate(this);
     if(DEBUG_EVALUATION) Serial.printf("Result of %c operation: %d.  ", id, result);
     if(DEBUG_EVALUATION) _spew_stacks();
     if(result) set_error_state(result);
@@ -478,20 +394,47 @@ template <typename T> void CoreCalculator<T>::clear_error_state() {
   operator_stack.clear();
 }
 
-// Place all the operators we plan to use in the _operators vector.
-// This design makes it trivial to add additional operators.
+// Place all the operators we plan to use in the _operators table.
+// This design makes it trivial to add additional operators: a derived calculator can call
+// _set_operator() from its constructor to add, replace or remove (with a nullptr kernel) entries.
 // Note: OP_ID_NONE and EVALUATE_OPERATOR is not put in _operators, by design.
 //
 template <typename T> void CoreCalculator<T>::_initialize_operators() {
-  _operators.insert(std::pair<Op_ID, Operator<T>*>(ADDITION_OPERATOR,       new AdditionOperator<T>(this)));
-  _operators.insert(std::pair<Op_ID, Operator<T>*>(SUBTRACTION_OPERATOR,    new SubtractionOperator<T>(this)));
-  _operators.insert(std::pair<Op_ID, Operator<T>*>(MULTIPLICATION_OPERATOR, new MultiplicationOperator<T>(this)));
-  _operators.insert(std::pair<Op_ID, Operator<T>*>(DIVISION_OPERATOR,       new DivisionOperator<T>(this)));
-  _operators.insert(std::pair<Op_ID, Operator<T>*>(OPEN_PAREN_OPERATOR,     new OpenParenOperator<T>(this)));
-  _operators.insert(std::pair<Op_ID, Operator<T>*>(CLOSE_PAREN_OPERATOR,    new CloseParenOperator<T>(this)));
-  _operators.insert(std::pair<Op_ID, Operator<T>*>(PERCENT_OPERATOR,        new PercentOperator<T>(this)));
-  _operators.insert(std::pair<Op_ID, Operator<T>*>(SQUARE_OPERATOR,         new SquareOperator<T>(this)));
-  _operators.insert(std::pair<Op_ID, Operator<T>*>(SQUARE_ROOT_OPERATOR,    new SquareRootOperator<T>(this)));
+  memset(_operators, 0, sizeof(_operators));
+  _set_operator(ADDITION_OPERATOR,        50, 2, addition_operator<T>);
+  _set_operator(SUBTRACTION_OPERATOR,     50, 2, subtraction_operator<T>);
+  _set_operator(MULTIPLICATION_OPERATOR, 100, 2, multiplication_operator<T>);
+  _set_operator(DIVISION_OPERATOR,       100, 2, division_operator<T>);
+  _set_operator(OPEN_PAREN_OPERATOR,     250, 0, open_paren_operator<T>);
+  _set_operator(CLOSE_PAREN_OPERATOR,    250, 0, close_paren_operator<T>);
+  _set_operator(PERCENT_OPERATOR,        100, 1, percent_operator<T>);
+  _set_operator(SQUARE_OPERATOR,         150, 1, square_operator<T>);
+  _set_operator(SQUARE_ROOT_OPERATOR,    150, 1, square_root_operator<T>);
+  _set_operator(NEGATE_OPERATOR,         200, 1, negate_operator<T>, true);
+}
+
+// Add, replace or (with a nullptr kernel) remove the operator id in the _operators table.
+// id must be less than OPERATOR_TABLE_SIZE, and may not be OP_ID_NONE or EVALUATE_OPERATOR.
+//
+template <typename T> Op_Err CoreCalculator<T>::_set_operator(Op_ID id, uint8_t precedence, uint8_t arity, typename Operator<T>::Kernel kernel, bool prefix) {
+  if(OPERATOR_TABLE_SIZE <= id || OP_ID_NONE == id || EVALUATE_OPERATOR == id) return ERROR_UNKNOWN_OPERATOR;
+  _operators[id].precedence = precedence;
+  _operators[id].arity      = arity;
+  _operators[id].prefix     = prefix;
+  _operators[id].operate    = kernel;
+  return NO_ERROR;
+}
+
+// Precedence of the operator id, or 0 if it is not an operator
+//
+template <typename T> uint8_t CoreCalculator<T>::get_precedence(Op_ID id) {
+  return _is_operator(id) ? _operators[id].precedence : 0;
+}
+
+// Return true if id has an entry in the _operators table
+//
+template <typename T> bool CoreCalculator<T>::_is_operator(Op_ID id) {
+  return (OPERATOR_TABLE_SIZE > id) && (nullptr != _operators[id].operate);
 }
 
 // Writes operator_stack and value_stack to Serial for debugging
@@ -509,7 +452,7 @@ template <typename T> void CoreCalculator<T>::_spew_stacks() {
     str += "EMPTY ";
   }
   else {
-    for(int i = 0; i < value_stack.size(); i++) { str += value_stack[i]; str += ' '; }
+    for(int i = 0; i < value_stack.size(); i++) { str += double(value_stack[i]); str += ' '; }
   }
   str += "]";
   Serial.println(str.c_str());
@@ -0,0 +1,229 @@
+#pragma once
+
+// A 64-bit scaled-integer decimal type that can be used as the numeric type T of CoreCalculator<T>
+// and MemoryCalculator<T, M>. A value is stored as an int64_t count of 10^-S units, so addition and
+// subtraction are exact integer operations, and decimal fractions like 0.1 have no binary representation
+// error: 0.1 + 0.2 is exactly 0.3.
+// This is intended for targets like the ESP32, whose FPU handles only single-precision floats, so that
+// every double operation is emulated in software.
+//
+// S is the scale (number of decimal places, 0 - 18). The range is +/- 9.22e18 / 10^S.
+// R is the rounding mode used when a result has more than S decimal places (after * and /, or converting from double).
+// Results that don't fit, and division by zero, produce an overflow value that propagates through further
+// arithmetic; CoreCalculator reports it as ERROR_OVERFLOW when it is pushed onto the value_stack.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <math.h>
+
+
+// Rounding modes for Decimal64
+//
+enum DecimalRounding {
+  roundHalfEven,        // Round to nearest, ties to the even digit (banker's rounding; no bias)
+  roundHalfUp,          // Round to nearest, ties away from zero (as taught in school)
+  roundTowardZero,      // Truncate
+  roundFloor,           // Round toward negative infinity
+  roundCeiling          // Round toward positive infinity
+};
+
+// 10^n as an unsigned 64 bit integer (n <= 19)
+//
+constexpr uint64_t decimal_pow10(uint8_t n) { return n ? 10 * decimal_pow10(n - 1) : 1; }
+
+
+template <uint8_t S, DecimalRounding R = roundHalfEven>
+class Decimal64 {
+  static_assert(S <= 18, "Decimal64 scale must be 18 or less");
+  public:
+    static const int64_t  ONE       = int64_t(decimal_pow10(S));  // The raw value of 1
+    static const int64_t  OVERFLOW_MARKER = INT64_MIN;             // The raw value of the overflow marker
+
+    Decimal64()                         : _raw(0) {}
+    Decimal64(int value)                : _raw(_checked_multiply(value, ONE)) {}
+    explicit Decimal64(double value)    : _raw(_from_double(value)) {}
+    explicit operator double() const    { return overflowed() ? NAN : double(_raw) / double(ONE); }
+    static Decimal64  from_raw(int64_t raw)   { Decimal64 d; d._raw = raw; return d; }
+    int64_t           raw() const             { return _raw; }                 // The value in units of 10^-S
+    bool              overflowed() const      { return OVERFLOW_MARKER == _raw; }     // True if the value is the overflow marker
+
+    Decimal64         operator-() const                   { return from_raw(overflowed() ? OVERFLOW_MARKER : -_raw); }
+    Decimal64         operator+(const Decimal64& rhs) const;
+    Decimal64         operator-(const Decimal64& rhs) const;
+    Decimal64         operator*(const Decimal64& rhs) const;
+    Decimal64         operator/(const Decimal64& rhs) const;
+    Decimal64&        operator+=(const Decimal64& rhs)    { return *this = *this + rhs; }
+    Decimal64&        operator-=(const Decimal64& rhs)    { return *this = *this - rhs; }
+    Decimal64&        operator*=(const Decimal64& rhs)    { return *this = *this * rhs; }
+    Decimal64&        operator/=(const Decimal64& rhs)    { return *this = *this / rhs; }
+    bool              operator==(const Decimal64& rhs) const  { return _raw == rhs._raw; }
+    bool              operator!=(const Decimal64& rhs) const  { return _raw != rhs._raw; }
+    bool              operator< (const Decimal64& rhs) const  { return _raw <  rhs._raw; }
+    bool              operator> (const Decimal64& rhs) const  { return _raw >  rhs._raw; }
+    bool              operator<=(const Decimal64& rhs) const  { return _raw <= rhs._raw; }
+    bool              operator>=(const Decimal64& rhs) const  { return _raw >= rhs._raw; }
+
+  protected:
+    int64_t           _raw;                                       // The value in units of 10^-S
+
+    static int64_t    _checked_multiply(int64_t a, int64_t b);
+    static int64_t    _from_double(double value);
+    static int64_t    _divide_and_round(uint64_t hi, uint64_t lo, uint64_t divisor, bool negative);
+    static void       _multiply_128(uint64_t a, uint64_t b, uint64_t& hi, uint64_t& lo);
+    static void       _divide_128(uint64_t hi, uint64_t lo, uint64_t divisor, uint64_t& q_hi, uint64_t& q_lo, uint64_t& rem);
+    static uint64_t   _magnitude(int64_t value) { return 0 > value ? 0 - uint64_t(value) : uint64_t(value); }
+};
+
+
+// CoreCalculator asks the value type whether it overflowed (see value_overflowed in CoreCalculator.h)
+//
+template <uint8_t S, DecimalRounding R> inline bool value_overflowed(const Decimal64<S, R>& value) {
+  return value.overflowed();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Decimal64 Implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+template <uint8_t S, DecimalRounding R> Decimal64<S, R> Decimal64<S, R>::operator+(const Decimal64& rhs) const {
+  int64_t result;
+  if(overflowed() || rhs.overflowed() || __builtin_add_overflow(_raw, rhs._raw, &result)) result = OVERFLOW_MARKER;
+  return from_raw(result);
+}
+
+template <uint8_t S, DecimalRounding R> Decimal64<S, R> Decimal64<S, R>::operator-(const Decimal64& rhs) const {
+  int64_t result;
+  if(overflowed() || rhs.overflowed() || __builtin_sub_overflow(_raw, rhs._raw, &result)) result = OVERFLOW_MARKER;
+  return from_raw(result);
+}
+
+// (a / 10^S) * (b / 10^S) = (a * b / 10^S) / 10^S, with a 128 bit intermediate product
+//
+template <uint8_t S, DecimalRounding R> Decimal64<S, R> Decimal64<S, R>::operator*(const Decimal64& rhs) const {
+  if(overflowed() || rhs.overflowed()) return from_raw(OVERFLOW_MARKER);
+  uint64_t hi, lo;
+  _multiply_128(_magnitude(_raw), _magnitude(rhs._raw), hi, lo);
+  return from_raw(_divide_and_round(hi, lo, ONE, (0 > _raw) != (0 > rhs._raw)));
+}
+
+// (a / 10^S) / (b / 10^S) = (a * 10^S / b) / 10^S, with a 128 bit intermediate dividend
+//
+template <uint8_t S, DecimalRounding R> Decimal64<S, R> Decimal64<S, R>::operator/(const Decimal64& rhs) const {
+  if(overflowed() || rhs.overflowed() || 0 == rhs._raw) return from_raw(OVERFLOW_MARKER);
+  uint64_t hi, lo;
+  _multiply_128(_magnitude(_raw), ONE, hi, lo);
+  return from_raw(_divide_and_round(hi, lo, _magnitude(rhs._raw), (0 > _raw) != (0 > rhs._raw)));
+}
+
+template <uint8_t S, DecimalRounding R> int64_t Decimal64<S, R>::_checked_multiply(int64_t a, int64_t b) {
+  int64_t result;
+  if(__builtin_mul_overflow(a, b, &result)) return OVERFLOW_MARKER;
+  return result;
+}
+
+// Scale and round a double using the rounding mode. NaN, infinity and out of range values overflow.
+//
+template <uint8_t S, DecimalRounding R> int64_t Decimal64<S, R>::_from_double(double value) {
+  double scaled = value * double(ONE);
+  switch(R) {
+    case roundHalfEven:   scaled = rint(scaled);   break;   // The default floating point rounding mode is half even
+    case roundHalfUp:     scaled = round(scaled);  break;
+    case roundTowardZero: scaled = trunc(scaled);  break;
+    case roundFloor:      scaled = floor(scaled);  break;
+    case roundCeiling:    scaled = ceil(scaled);   break;
+  }
+  if(!(-9.2233720368547748e18 < scaled && 9.2233720368547748e18 > scaled)) return OVERFLOW_MARKER;   // Also catches NaN
+  return int64_t(scaled);
+}
+
+// Divide the unsigned 128 bit value hi:lo by divisor, round the quotient with the rounding mode, and apply the sign.
+// Return OVERFLOW_MARKER if the result doesn't fit.
+//
+template <uint8_t S, DecimalRounding R> int64_t Decimal64<S, R>::_divide_and_round(uint64_t hi, uint64_t lo, uint64_t divisor, bool negative) {
+  uint64_t q_hi, q, rem;
+  _divide_128(hi, lo, divisor, q_hi, q, rem);
+  if(q_hi) return OVERFLOW_MARKER;
+  bool up = false;
+  if(rem) {
+    uint64_t half = divisor - rem;                              // Compare rem to divisor / 2 without overflowing
+    switch(R) {
+      case roundHalfEven:   up = (rem > half) || (rem == half && (q & 1)); break;
+      case roundHalfUp:     up = (rem >= half);                          break;
+      case roundTowardZero: up = false;                                  break;
+      case roundFloor:      up = negative;                               break;
+      case roundCeiling:    up = !negative;                              break;
+    }
+  }
+  if(up) q++;
+  if(q > uint64_t(INT64_MAX)) return OVERFLOW_MARKER;
+  return negative ? -int64_t(q) : int64_t(q);
+}
+
+// Unsigned 64 x 64 -> 128 bit multiply
+//
+template <uint8_t S, DecimalRounding R> void Decimal64<S, R>::_multiply_128(uint64_t a, uint64_t b, uint64_t& hi, uint64_t& lo) {
+#if defined(__SIZEOF_INT128__) && !defined(DECIMAL_NO_INT128)
+  unsigned __int128 product = (unsigned __int128)a * b;
+  hi = uint64_t(product >> 64);
+  lo = uint64_t(product);
+#else
+  uint64_t a_lo = uint32_t(a), a_hi = a >> 32;
+  uint64_t b_lo = uint32_t(b), b_hi = b >> 32;
+  uint64_t p0   = a_lo * b_lo;
+  uint64_t p1   = a_lo * b_hi;
+  uint64_t p2   = a_hi * b_lo;
+  uint64_t p3   = a_hi * b_hi;
+  uint64_t mid  = (p0 >> 32) + uint32_t(p1) + uint32_t(p2);
+  lo = (mid << 32) | uint32_t(p0);
+  hi = p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32);
+#endif
+}
+
+// Unsigned 128 / 64 bit divide, producing a 128 bit quotient and a 64 bit remainder.
+// 32 bit targets have no 128 bit type: divisors that fit in 32 bits (including 10^S for S <= 9)
+// are divided a 32 bit limb at a time, and larger divisors fall back to shift-and-subtract.
+// Define DECIMAL_NO_INT128 to use the 32 bit code on a 64 bit host.
+//
+template <uint8_t S, DecimalRounding R> void Decimal64<S, R>::_divide_128(uint64_t hi, uint64_t lo, uint64_t divisor, uint64_t& q_hi, uint64_t& q_lo, uint64_t& rem) {
+#if defined(__SIZEOF_INT128__) && !defined(DECIMAL_NO_INT128)
+  unsigned __int128 dividend = ((unsigned __int128)hi << 64) | lo;
+  unsigned __int128 quotient = dividend / divisor;
+  q_hi = uint64_t(quotient >> 64);
+  q_lo = uint64_t(quotient);
+  rem  = uint64_t(dividend % divisor);
+#else
+  if(0xFFFFFFFFULL >= divisor) {
+    uint32_t  limbs[4] = { uint32_t(hi >> 32), uint32_t(hi), uint32_t(lo >> 32), uint32_t(lo) };
+    uint64_t  r        = 0;
+    for(int i = 0; i < 4; i++) {
+      uint64_t current = (r << 32) | limbs[i];
+      limbs[i] = uint32_t(current / divisor);
+      r        = current % divisor;
+    }
+    q_hi = (uint64_t(limbs[0]) << 32) | limbs[1];
+    q_lo = (uint64_t(limbs[2]) << 32) | limbs[3];
+    rem  = r;
+  }
+  else {
+    uint64_t r = 0;
+    q_hi = q_lo = 0;
+    for(int i = 127; i >= 0; i--) {
+      uint64_t bit   = (64 <= i) ? (hi >> (i - 64)) & 1 : (lo >> i) & 1;
+      bool     carry = r >> 63;
+      r = (r << 1) | bit;
+      if(carry || r >= divisor) {
+        r -= divisor;
+        if(64 <= i) q_hi |= 1ULL << (i - 64);
+        else        q_lo |= 1ULL << i;
+      }
+    }
+    rem = r;
+  }
+#endif
+}
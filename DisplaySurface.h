@@ -0,0 +1,77 @@
+#pragma once
+
+// The drawing operations the calculator screen is rendered with (see screen_ui.cpp), so that the same
+// rendering code can draw on the M5Stack's LCD (M5Surface.h) or into a framebuffer on a host (host/FramebufferSurface.h),
+// where it can be benchmarked and checked against golden images.
+// Colors are RGB565, and fonts are numbered as in TFT_eSPI. Text is drawn opaque: its background color
+// fills the cells behind the glyphs.
+// Text that is drawn over and over, like the digits of the value, can be rendered once into a GlyphAtlas
+// and copied from there, which is much cheaper than drawing it again.
+// Each surface counts the pixels it sends to the display, which on the device is the traffic on the LCD's SPI bus:
+// everything drawn on the display's own surface, but for an offscreen surface (a sprite) only what it pushes.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+
+// Colors, as the M5Stack library defines them
+#ifndef BLACK
+#define BLACK                 0x0000
+#define BLUE                  0x001F
+#define DARKGREY              0x7BEF
+#define RED                   0xF800
+#define WHITE                 0xFFFF
+#endif
+
+#define GLYPH_ATLAS_SIZE      16    // Most glyphs an atlas holds
+
+enum SurfaceAlign {
+  alignLeft,                  // x is the left edge of the text
+  alignCenter,                // x is the center of the text
+  alignRight                  // x is the right edge of the text
+};
+
+
+// Glyphs of one font in one pair of colors, each rendered once into a cell as wide as the glyph and as
+// high as the font. Made by a surface's make_atlas(), and only drawn by that surface's draw_glyph().
+//
+class GlyphAtlas {
+  public:
+    GlyphAtlas(const char* glyphs, int16_t height) : _height(height) { strncpy(_glyphs, glyphs, GLYPH_ATLAS_SIZE); }
+    virtual ~GlyphAtlas() {}
+    int16_t           height() const                            { return _height; }
+    bool              has(char c) const                         { return 0 <= index(c); }
+    int16_t           glyph_width(char c) const                 { return has(c) ? _widths[index(c)] : 0; }
+    int               index(char c) const                       { const char* p = c ? strchr(_glyphs, c) : nullptr; return p ? p - _glyphs : -1; }
+  protected:
+    char              _glyphs[GLYPH_ATLAS_SIZE + 1] = {0};
+    int16_t           _widths[GLYPH_ATLAS_SIZE]     = {0};
+    int16_t           _height;
+};
+
+
+class DisplaySurface {
+  public:
+    virtual ~DisplaySurface() {}
+    virtual int16_t   width()                                   = 0;
+    virtual int16_t   height()                                  = 0;
+    virtual void      fill_rect(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t color) = 0;
+    virtual int16_t   text_width(const char* text, uint8_t font) = 0;
+    virtual int16_t   font_height(uint8_t font)                 = 0;
+    virtual int16_t   draw_text(const char* text, int32_t x, int32_t y, uint8_t font, SurfaceAlign align, uint16_t fg, uint16_t bg) = 0;  // Return the width drawn
+    virtual void      draw_wrapped(const char* text, int32_t x, int32_t y, uint8_t font, uint16_t fg, uint16_t bg) = 0;  // Text that reaches the right edge continues at the left of the next line
+    virtual void      push(int32_t x, int32_t y)                = 0;  // Copy this (offscreen) surface onto the one it was made for, at x, y
+    virtual void      show_buttons(const char* buttons)         = 0;  // The button captions at the bottom, as M5ez's ez.buttons.show() takes them
+    virtual void      show_header(const char* title)            = 0;  // The title bar at the top
+    virtual GlyphAtlas* make_atlas(const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg) = 0;  // Return nullptr if this surface can't
+    virtual int16_t   draw_glyph(const GlyphAtlas& atlas, char c, int32_t x, int32_t y) = 0;  // Copy the glyph's cell. Return its width
+    virtual void      end_frame()                               {}    // Called after each complete redraw
+    uint32_t          pixels() const                            { return _pixels; }   // Pixels sent to the display so far
+  protected:
+    uint32_t          _pixels = 0;
+};
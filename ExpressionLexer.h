@@ -0,0 +1,138 @@
+#pragma once
+
+// A single-pass, table-driven lexer for calculator expressions, like "1 + 5 / 3.2e-1 * (7 - -8) =".
+// It works on a string view (pointer and length, no terminator needed), classifies each character
+// with one lookup in a 256 entry table, and never copies or allocates: tokens point into the text.
+// Numbers are converted as they are scanned, by parse_number (so 1e3, 0x1F and 1_000 are all numbers).
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include "CoreCalculator.h"
+#include "NumberParse.h"
+
+
+#define MEMORY_TOKEN_CHAR   'M'         // M or M[n] refers to simple or indexed memory
+
+// Character classes, used to index the lexer's decisions
+//
+enum CharClass {
+  charInvalid,          // Not part of the expression language
+  charSpace,            // Whitespace: skipped
+  charDigit,            // 0-9
+  charDot,              // Decimal point
+  charOperator,         // Operators, including the postfix s, r and %
+  charOpenParen,        // (
+  charCloseParen,       // )
+  charEvaluate,         // =
+  charMemory,           // M
+  charOpenBracket,      // [
+  charCloseBracket      // ]
+};
+
+// Token types produced by ExpressionLexer
+//
+enum TokenType {
+  tokenEnd,             // No more input
+  tokenNumber,          // A number; value holds it, text and length give its extent
+  tokenOperator,        // An operator; op holds its Op_ID
+  tokenOpenParen,       // (
+  tokenCloseParen,      // )
+  tokenEvaluate,        // =
+  tokenMemory,          // M
+  tokenOpenBracket,     // [
+  tokenCloseBracket,    // ]
+  tokenError            // A character that isn't part of the language, or a malformed or overflowing number
+};
+
+struct Token {
+  TokenType   type;     // What kind of token this is
+  Op_ID       op;       // The operator, for tokenOperator
+  double      value;    // The value, for tokenNumber
+  const char* text;     // Start of the token in the input
+  uint16_t    length;   // Number of characters in the token
+};
+
+
+// The character class table. Built once, the first time it is needed.
+//
+class CharClassTable {
+  public:
+    CharClassTable() {
+      memset(_classes, charInvalid, sizeof(_classes));
+      for(char c = '0'; c <= '9'; c++) _classes[uint8_t(c)] = charDigit;
+      _classes[uint8_t(' ')]  = _classes[uint8_t('\t')] = _classes[uint8_t('\n')] = _classes[uint8_t('\r')] = charSpace;
+      _classes[uint8_t('.')]  = charDot;
+      _classes[ADDITION_OPERATOR]       = _classes[SUBTRACTION_OPERATOR] = _classes[MULTIPLICATION_OPERATOR] = charOperator;
+      _classes[DIVISION_OPERATOR]       = _classes[PERCENT_OPERATOR]     = charOperator;
+      _classes[SQUARE_OPERATOR]         = _classes[SQUARE_ROOT_OPERATOR] = charOperator;
+      _classes[OPEN_PAREN_OPERATOR]     = charOpenParen;
+      _classes[CLOSE_PAREN_OPERATOR]    = charCloseParen;
+      _classes[EVALUATE_OPERATOR]       = charEvaluate;
+      _classes[uint8_t(MEMORY_TOKEN_CHAR)] = charMemory;
+      _classes[uint8_t('[')]  = charOpenBracket;
+      _classes[uint8_t(']')]  = charCloseBracket;
+    }
+    CharClass operator[](char c) const { return CharClass(_classes[uint8_t(c)]); }
+    static const CharClassTable& get() { static const CharClassTable table; return table; }
+  protected:
+    uint8_t _classes[256];
+};
+
+
+class ExpressionLexer {
+  public:
+    ExpressionLexer(const char* text, size_t length) : _p(text), _end(text + length), _classes(CharClassTable::get()) { next(); }
+    const Token&  peek() const    { return _token; }            // The current token
+    void          next();                                       // Advance to the next token
+    const char*   position() const { return _token.text; }      // Where the current token starts (for error reporting)
+  protected:
+    const char*           _p;                                   // Next character to scan
+    const char*           _end;                                 // One past the last character
+    const CharClassTable& _classes;                             // Character classifier
+    Token                 _token;                               // The current token
+    bool                  _scan_number();                       // Convert the number at _p and extend the token over it
+};
+
+
+// Scan the next token. Whitespace is skipped. One table lookup decides what the token is.
+//
+inline void ExpressionLexer::next() {
+  while(_p < _end && charSpace == _classes[*_p]) _p++;
+  _token.text   = _p;
+  _token.length = 1;
+  _token.op     = OP_ID_NONE;
+  if(_p >= _end) {
+    _token.type   = tokenEnd;
+    _token.length = 0;
+    return;
+  }
+  switch(_classes[*_p]) {
+    case charDigit:
+    case charDot:           _token.type = _scan_number() ? tokenNumber : tokenError;  return;
+    case charOperator:      _token.type = tokenOperator; _token.op = uint8_t(*_p);     break;
+    case charOpenParen:     _token.type = tokenOpenParen;                               break;
+    case charCloseParen:    _token.type = tokenCloseParen;                              break;
+    case charEvaluate:      _token.type = tokenEvaluate;                                break;
+    case charMemory:        _token.type = tokenMemory;                                  break;
+    case charOpenBracket:   _token.type = tokenOpenBracket;                             break;
+    case charCloseBracket:  _token.type = tokenCloseBracket;                            break;
+    default:                _token.type = tokenError;                                   return;
+  }
+  _p++;
+}
+
+
+// Numbers are whatever parse_number accepts. An 'e' not followed by a valid exponent is not part of the number.
+//
+inline bool ExpressionLexer::_scan_number() {
+  size_t consumed = 0;
+  bool   ok       = NO_ERROR == parse_number(_p, _end - _p, _token.value, &consumed);
+  if(0 == consumed) consumed = 1;                               // Skip the offending character
+  _p            += consumed;
+  _token.length  = uint16_t(consumed);
+  return ok;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+// A pushdown stack with a fixed capacity N, stored inline (no heap).
+// It supports the subset of the std::vector interface the calculator uses for its stacks,
+// but push_back() reports overflow by returning false instead of reallocating.
+// This keeps the calculator's hot paths from touching the heap, which fragments over a long session.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <string.h>
+
+
+template <typename T, uint8_t N>
+class FixedStack {
+  public:
+    FixedStack()                                            {}
+    FixedStack(const FixedStack& other)                     { *this = other; }
+    FixedStack& operator=(const FixedStack& other);             // Copies only the items in use, so snapshots of a shallow stack are cheap
+    bool      push_back(const T& value);                        // Push value onto the stack. Return false (and do nothing) if the stack is full.
+    void      pop_back();                                       // Remove the top item, if any
+    T&        back();                                           // Reference to the top item (the bottom slot if the stack is empty)
+    T&        operator[](uint8_t index) { return _items[index]; }
+    uint8_t   size() const              { return _size; }       // Number of items on the stack
+    uint8_t   capacity() const          { return N; }           // Maximum number of items on the stack
+    bool      full() const              { return N <= _size; }  // True if push_back() would fail
+    void      clear()                   { _size = 0; }          // Remove all items
+    bool      same(const FixedStack& other) const;              // True if other holds the same items, bit for bit
+  protected:
+    T         _items[N];                                        // Storage for the items; only the first _size are valid
+    uint8_t   _size = 0;                                        // Number of valid items
+};
+
+
+template <typename T, uint8_t N> FixedStack<T, N>& FixedStack<T, N>::operator=(const FixedStack& other) {
+  _size = other._size;
+  for(uint8_t i = 0; i < _size; i++) _items[i] = other._items[i];
+  return *this;
+}
+
+template <typename T, uint8_t N> bool FixedStack<T, N>::push_back(const T& value) {
+  if(N <= _size) return false;
+  _items[_size++] = value;
+  return true;
+}
+
+template <typename T, uint8_t N> void FixedStack<T, N>::pop_back() {
+  if(_size) _size--;
+}
+
+// Callers are expected to check size() first: a value written through back() on an empty stack is lost.
+// Returning the bottom slot keeps an unchecked call from reading or writing outside of _items.
+//
+template <typename T, uint8_t N> T& FixedStack<T, N>::back() {
+  return _items[_size ? _size - 1 : 0];
+}
+
+// Bit for bit, so 0.0 and -0.0 differ, and a NaN is the same as itself
+//
+template <typename T, uint8_t N> bool FixedStack<T, N>::same(const FixedStack& other) const {
+  return _size == other._size && 0 == memcmp(_items, other._items, _size * sizeof(T));
+}
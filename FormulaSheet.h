@@ -0,0 +1,272 @@
+#pragma once
+
+// Spreadsheet-style formula memories. An indexed memory may hold a formula over other memories,
+// like M[3] = M[1] * M[2] + 5, instead of a plain value. Formulas are compiled to RPN programs.
+// A dependency graph (which formulas read which memories) is kept, so that when a memory changes
+// only the formulas that depend on it, directly or indirectly, are recomputed, each once, in
+// topological order. A formula that would depend on its own value is rejected.
+// Setting a formula memory directly (with M= for example) replaces its formula with the value.
+// The formulas can be saved to a State and restored, for undo. A State shares a copy of the formulas with the
+// sheet and with every other State saved since they last changed, so saving is O(1) while they stay the same.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <map>
+#include <memory>
+#include <vector>
+#include "RpnProgram.h"
+
+
+#define FORMULA_SIMPLE_MEMORY   NO_MEMORY   // The dependency graph's name for M, the simple memory
+
+
+template <typename T, Mem_Index M>
+class FormulaSheet {
+  protected:
+    struct Formula;
+    typedef std::map<Mem_Index, Formula>  Formulas;
+  public:
+    class State {                                             // A snapshot of the formulas, for save_state() and restore_state()
+      friend class FormulaSheet;
+      std::shared_ptr<const Formulas> _formulas;              // Shared with the sheet until its formulas change
+    };
+    FormulaSheet(MemoryCalculator<T, M>& calc);
+    ~FormulaSheet();
+    Op_Err          set_formula(Mem_Index index, const char* text); // Compile, check for cycles, store and evaluate a formula for M[index]
+    bool            clear_formula(Mem_Index index);           // Turn a formula memory back into a plain value. Return false if it had none
+    const char*     get_formula(Mem_Index index);             // The formula's text, or nullptr if M[index] holds a plain value
+    Op_Err          get_formula_error(Mem_Index index);       // The error from the formula's last evaluation (NO_ERROR if none)
+    size_t          count();                                  // Number of formulas
+    void            clear();                                  // Remove every formula, leaving the values
+    void            save_state(State& state);                 // Snapshot the formulas (not their values) into state
+    void            restore_state(const State& state);        // Return to a snapshot. The values are left as they are
+    uint32_t        recomputed  = 0;                          // Formulas evaluated so far, for measuring incremental updates
+  protected:
+    struct Formula {
+      String        text;                                     // As given to set_formula
+      RpnProgram<T> program;                                  // Compiled text
+      Op_Err        error       = NO_ERROR;                   // Result of the last evaluation
+      uint32_t      mark        = 0;                          // Visit marker for graph walks (see _generation)
+    };
+    struct Frame {
+      Mem_Index     index;                                    // A memory being visited
+      size_t        next;                                     // Its next dependent to visit
+    };
+    typedef std::vector<Mem_Index>  Dependents;
+    MemoryCalculator<T, M>&         _calc;
+    RpnCompiler<T, M>               _compiler;
+    Formulas                        _formulas;                // Formula memories by index
+    std::shared_ptr<const Formulas> _saved;                   // A copy of _formulas for States, or null if they've changed since
+    std::map<Mem_Index, Dependents> _dependents;              // For each memory, the formulas that read it
+    std::vector<Frame>              _stack;                   // Scratch: the depth-first search's path
+    Dependents                      _pending;                 // Scratch: memories yet to visit in _reaches
+    Dependents                      _order;                   // Scratch: formulas to recompute, in reverse topological order
+    uint32_t                        _generation = 0;          // Bumped for each graph walk, so marks needn't be cleared
+    bool                            _updating   = false;      // True while writing formula results, so they aren't taken as user edits
+
+    static void     _memory_changed(void* context, Mem_Index index);
+    void            _inputs(const RpnProgram<T>& program, Dependents& inputs);
+    void            _link(Mem_Index index, const RpnProgram<T>& program);
+    void            _unlink(Mem_Index index, const RpnProgram<T>& program);
+    bool            _reaches(Mem_Index from, Mem_Index target);
+    void            _recompute_from(Mem_Index changed);
+    void            _evaluate(Mem_Index index, Formula& formula);
+  private:
+    FormulaSheet(const FormulaSheet&)             = delete;
+    FormulaSheet& operator=(const FormulaSheet&)  = delete;
+};
+
+
+template <typename T, Mem_Index M> FormulaSheet<T, M>::FormulaSheet(MemoryCalculator<T, M>& calc) : _calc(calc), _compiler(calc) {
+  _calc.set_memory_listener(_memory_changed, this);
+}
+
+template <typename T, Mem_Index M> FormulaSheet<T, M>::~FormulaSheet() {
+  _calc.set_memory_listener(nullptr, nullptr);
+}
+
+
+// A cycle exists if the new formula's memory can already reach one of its inputs through the graph,
+// since the formula adds edges from each input back to it.
+//
+template <typename T, Mem_Index M> Op_Err FormulaSheet<T, M>::set_formula(Mem_Index index, const char* text) {
+  if(M <= index) return ERROR_INVALID_FORMULA;
+  RpnProgram<T> program;
+  if(!_compiler.compile(text, strlen(text), program)) return ERROR_INVALID_FORMULA;
+  Dependents inputs;
+  _inputs(program, inputs);
+  for(Mem_Index input : inputs) {
+    if(input == index || _reaches(index, input)) return ERROR_CIRCULAR_REFERENCE;
+  }
+  auto existing = _formulas.find(index);
+  if(existing != _formulas.end()) _unlink(index, existing->second.program);
+  _saved.reset();
+  Formula& formula  = _formulas[index];
+  formula.text      = text;
+  formula.program   = program;
+  _link(index, program);
+  _evaluate(index, formula);
+  _recompute_from(index);
+  return formula.error;
+}
+
+template <typename T, Mem_Index M> bool FormulaSheet<T, M>::clear_formula(Mem_Index index) {
+  auto found = _formulas.find(index);
+  if(found == _formulas.end()) return false;
+  _unlink(index, found->second.program);
+  _formulas.erase(found);
+  _saved.reset();
+  return true;
+}
+
+template <typename T, Mem_Index M> const char* FormulaSheet<T, M>::get_formula(Mem_Index index) {
+  auto found = _formulas.find(index);
+  return (found == _formulas.end()) ? nullptr : found->second.text.c_str();
+}
+
+template <typename T, Mem_Index M> Op_Err FormulaSheet<T, M>::get_formula_error(Mem_Index index) {
+  auto found = _formulas.find(index);
+  return (found == _formulas.end()) ? NO_ERROR : found->second.error;
+}
+
+template <typename T, Mem_Index M> size_t FormulaSheet<T, M>::count() {
+  return _formulas.size();
+}
+
+template <typename T, Mem_Index M> void FormulaSheet<T, M>::clear() {
+  if(_formulas.empty()) return;
+  _formulas.clear();
+  _dependents.clear();
+  _saved.reset();
+}
+
+
+// The copy is made by the first save after the formulas change, and shared by every save until the next change
+//
+template <typename T, Mem_Index M> void FormulaSheet<T, M>::save_state(State& state) {
+  if(!_saved) _saved = std::make_shared<const Formulas>(_formulas);
+  state._formulas = _saved;
+}
+
+
+// The memories are restored with the formulas (see KeyCalculator::_restore()), and they already hold the formulas' values.
+// The dependency graph is rebuilt from the restored formulas, unless they are the ones the sheet has.
+//
+template <typename T, Mem_Index M> void FormulaSheet<T, M>::restore_state(const State& state) {
+  if(state._formulas == _saved && _saved) return;
+  _formulas.clear();
+  _dependents.clear();
+  if(state._formulas) _formulas = *state._formulas;
+  for(auto& entry : _formulas) _link(entry.first, entry.second.program);
+  _saved = state._formulas;
+}
+
+
+// The MemoryListener. A user edit to a formula memory replaces the formula; either way, dependents are brought up to date.
+//
+template <typename T, Mem_Index M> void FormulaSheet<T, M>::_memory_changed(void* context, Mem_Index index) {
+  FormulaSheet* sheet = static_cast<FormulaSheet*>(context);
+  if(sheet->_updating) return;
+  sheet->clear_formula(index);
+  if(sheet->_dependents.count(index)) sheet->_recompute_from(index);
+}
+
+
+// The distinct memories a program reads: its indexed addresses, and the simple memory if it uses M
+//
+template <typename T, Mem_Index M> void FormulaSheet<T, M>::_inputs(const RpnProgram<T>& program, Dependents& inputs) {
+  for(uint8_t i = 0; i < program.address_count; i++) inputs.push_back(program.addresses[i]);
+  for(uint8_t i = 0; i < program.length; i++) {
+    if(rpnMemory == program.code[i].opcode) {
+      inputs.push_back(FORMULA_SIMPLE_MEMORY);
+      break;
+    }
+  }
+}
+
+template <typename T, Mem_Index M> void FormulaSheet<T, M>::_link(Mem_Index index, const RpnProgram<T>& program) {
+  Dependents inputs;
+  _inputs(program, inputs);
+  for(Mem_Index input : inputs) _dependents[input].push_back(index);
+}
+
+template <typename T, Mem_Index M> void FormulaSheet<T, M>::_unlink(Mem_Index index, const RpnProgram<T>& program) {
+  Dependents inputs;
+  _inputs(program, inputs);
+  for(Mem_Index input : inputs) {
+    Dependents& readers = _dependents[input];
+    for(size_t i = 0; i < readers.size(); i++) {
+      if(readers[i] == index) {
+        readers[i] = readers.back();
+        readers.pop_back();
+        break;
+      }
+    }
+    if(readers.empty()) _dependents.erase(input);
+  }
+}
+
+
+// Depth-first search along dependent edges: is target affected by a change to from?
+//
+template <typename T, Mem_Index M> bool FormulaSheet<T, M>::_reaches(Mem_Index from, Mem_Index target) {
+  _pending.assign(1, from);
+  _generation++;
+  while(!_pending.empty()) {
+    Mem_Index index = _pending.back();
+    _pending.pop_back();
+    auto readers = _dependents.find(index);
+    if(readers == _dependents.end()) continue;
+    for(Mem_Index reader : readers->second) {
+      if(reader == target) return true;
+      Formula& formula = _formulas[reader];
+      if(formula.mark == _generation) continue;
+      formula.mark = _generation;
+      _pending.push_back(reader);
+    }
+  }
+  return false;
+}
+
+
+// Collect the formulas downstream of changed in depth-first post-order (an iterative DFS, so a long
+// chain of formulas can't overflow the stack), then evaluate them in reverse: every formula is
+// evaluated after all of the formulas it reads, and each only once.
+//
+template <typename T, Mem_Index M> void FormulaSheet<T, M>::_recompute_from(Mem_Index changed) {
+  _stack.assign(1, Frame{changed, 0});
+  _order.clear();
+  _generation++;
+  while(!_stack.empty()) {
+    Frame& frame    = _stack.back();
+    auto   readers  = _dependents.find(frame.index);
+    if(readers == _dependents.end() || frame.next == readers->second.size()) {
+      if(frame.index != changed) _order.push_back(frame.index);
+      _stack.pop_back();
+      continue;
+    }
+    Mem_Index reader  = readers->second[frame.next++];
+    Formula&  formula = _formulas[reader];
+    if(formula.mark == _generation) continue;
+    formula.mark = _generation;
+    _stack.push_back(Frame{reader, 0});
+  }
+  for(size_t i = _order.size(); 0 < i; i--) {
+    Mem_Index index = _order[i - 1];
+    _evaluate(index, _formulas[index]);
+  }
+}
+
+template <typename T, Mem_Index M> void FormulaSheet<T, M>::_evaluate(Mem_Index index, Formula& formula) {
+  T      result;
+  Op_Err error  = formula.error;
+  recomputed++;
+  formula.error = formula.program.run(_calc, result);
+  if(error != formula.error) _saved.reset();                // Saved States hold each formula's error
+  if(NO_ERROR != formula.error) return;                     // Leave the last good value in place
+  _updating = true;
+  _calc.set_memory(index, result);
+  _updating = false;
+}
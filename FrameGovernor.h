@@ -0,0 +1,123 @@
+#pragma once
+
+// Decides when loop() draws the screen, so keys that arrive faster than frames can be drawn share a frame.
+// loop() applies every key that's waiting to the KeyCalculator, telling the governor about each one that changed
+// the screen, and draws only when a frame is due: one is pending, and at least 1/frame_rate s has passed since
+// the last one started. The first key after a pause is drawn at once; under a burst, one frame shows all the keys that
+// arrived while the one before it was drawn, so the latency stays near a frame time instead of growing with the burst.
+// It also keeps statistics for the diagnostics menu and host/render: how many keys each frame absorbed, and the
+// latency from the oldest of them being pressed (see KeyEvent) to the end of the frame, over the last FRAME_STATS_SIZE frames.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <algorithm>
+
+
+#define FRAME_STATS_SIZE      64                                // Frames kept for frame_percentile()
+
+
+struct FrameStats {
+  uint16_t    keys;                                             // Keys the frame absorbed
+  uint32_t    latency;                                          // us from pressing the oldest of them to the end of the frame
+};
+
+
+class FrameGovernor {
+  public:
+    FrameGovernor(uint16_t frame_rate)  { set_frame_rate(frame_rate); }
+    void        set_frame_rate(uint16_t frame_rate);            // The most frames per second, or 0 for no cap. Clears the stats
+    uint16_t    frame_rate() const      { return _frame_rate; }
+    void        key(uint32_t time);                             // A key pressed at time (micros()) changed the screen
+    void        change()                { _pending = true; }    // Something other than a key (a button, a menu) changed it
+    bool        pending() const         { return _pending; }
+    uint32_t    wait(uint32_t now) const;                       // us until the pending frame is due; 0 if it is
+    bool        due(uint32_t now) const { return _pending && 0 == wait(now); }
+    uint32_t    oldest_key() const      { return _frame_keys ? _oldest : 0; }  // When the oldest key the pending frame shows was pressed, or 0
+    void        frame(uint32_t start, uint32_t end);            // The pending frame was drawn, from start to end (micros())
+    void        clear_stats();
+    uint32_t    frames() const          { return _frames; }     // Frames drawn for keys
+    uint32_t    keys() const            { return _keys; }       // Keys drawn in those frames
+    uint16_t    keys_max() const        { return _keys_max; }   // The most keys one frame absorbed
+    uint32_t    latency_max() const     { return _latency_max; }
+    FrameStats  frame_percentile(double fraction) const;        // Keys and latency at fraction, each over the recent frames
+  protected:
+    uint16_t    _frame_rate;
+    uint32_t    _interval;                                      // us between frames, at least
+    bool        _pending      = false;
+    bool        _drawn        = false;                          // A frame has been drawn, so _last is set
+    uint32_t    _last         = 0;                              // micros() at the start of the last frame
+    uint16_t    _frame_keys   = 0;                              // Keys waiting for the pending frame
+    uint32_t    _oldest       = 0;                              // When the oldest of them was pressed
+    FrameStats  _recent[FRAME_STATS_SIZE];
+    uint32_t    _frames;
+    uint32_t    _keys;
+    uint16_t    _keys_max;
+    uint32_t    _latency_max;
+};
+
+
+inline void FrameGovernor::set_frame_rate(uint16_t frame_rate) {
+  _frame_rate = frame_rate;
+  _interval   = frame_rate ? 1000000 / frame_rate : 0;
+  clear_stats();
+}
+
+
+inline void FrameGovernor::key(uint32_t time) {
+  if(!_frame_keys || int32_t(time - _oldest) < 0) _oldest = time;
+  _frame_keys++;
+  _pending = true;
+}
+
+
+inline uint32_t FrameGovernor::wait(uint32_t now) const {
+  uint32_t since = now - _last;
+  return (!_drawn || _interval <= since) ? 0 : _interval - since;
+}
+
+
+inline void FrameGovernor::frame(uint32_t start, uint32_t end) {
+  if(_frame_keys) {
+    FrameStats& stats = _recent[_frames % FRAME_STATS_SIZE];
+    stats.keys    = _frame_keys;
+    stats.latency = end - _oldest;
+    _frames++;
+    _keys        += _frame_keys;
+    _keys_max     = std::max(_keys_max, _frame_keys);
+    _latency_max  = std::max(_latency_max, stats.latency);
+  }
+  _pending    = false;
+  _drawn      = true;
+  _last       = start;
+  _frame_keys = 0;
+}
+
+
+inline void FrameGovernor::clear_stats() {
+  _frames       = 0;
+  _keys         = 0;
+  _keys_max     = 0;
+  _latency_max  = 0;
+}
+
+
+// Nearest rank, for keys and latency separately. Both are 0 before the first frame.
+//
+inline FrameStats FrameGovernor::frame_percentile(double fraction) const {
+  uint16_t  keys[FRAME_STATS_SIZE];
+  uint32_t  latencies[FRAME_STATS_SIZE];
+  uint32_t  count = std::min(_frames, uint32_t(FRAME_STATS_SIZE));
+  if(!count) return { 0, 0 };
+  for(uint32_t i = 0; i < count; i++) {
+    keys[i]       = _recent[i].keys;
+    latencies[i]  = _recent[i].latency;
+  }
+  std::sort(keys, keys + count);
+  std::sort(latencies, latencies + count);
+  uint32_t rank = uint32_t(fraction * count + 0.999999);
+  rank = rank ? std::min(rank, count) - 1 : 0;
+  return { keys[rank], latencies[rank] };
+}
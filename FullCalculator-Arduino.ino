@@ -3,7 +3,7 @@
 // This program represents the fifth and top level of the calculator, and provides a specifically M5Stack implementation.
 // The structure of the code at this point is:
 // CoreCalculator   template, used to generate a double-precision floating point calculator
-// MemoryCalculator template, used to add 101 memories plus a memory stack
+// MemoryCalculator template, used to add a simple memory, 100,000 sparse indexed memories and a memory stack
 // TextCalculator,            which provides a calculator that understand textual representations of numbers
 // KeyCalculator,             a TextCalculator specialized for calculator keyboard input, one key at a time
 // This program,              which is designed specifically for an M5Stack, and extends the calculator using its A/B/C buttons
@@ -13,7 +13,13 @@
 
 
 #include <M5ez.h>
+#include "FrameGovernor.h"
 #include "KeyCalculator.h"
+#include "KeyInput.h"
+#include "KeyTrace.h"
+#include "LatencyProbe.h"
+#include "M5Surface.h"
+#include "button_actions.h"
 #include "screen_layout.h"
 #include "screen_ui.h"
 #include "menu_ui.h"
@@ -21,53 +27,139 @@
 
 #define KEYBOARD_I2C_ADDR     0X08            // I2C address of the Calculator FACE
 #define KEYBOARD_INT          5               // Data ready pin for Calculator FACE (active low)
+#define KEYBOARD_WAIT_MS      10              // With no key, loop() sleeps this long between polls of the buttons
+#define INPUT_TASK_STACK      2048            // Bytes of stack for the input task
+#define INPUT_TASK_PRIORITY   2               // Above loop(), so a key is read as soon as it's ready
+#define FRAME_RATE            60              // Frames per second at most; keys that arrive faster share a frame
+#define LIVE_PREVIEW          1               // If non-zero, show what = would give while typing, and take it when = is pressed
+#define RENDER_TASK           1               // If non-zero, draw the calculator's bands on core 0 from snapshots loop() publishes
+#define RENDER_TASK_STACK     8192            // Bytes of stack for the render task
+#define RENDER_TASK_CORE      0               // loop() runs on core 1
 
 
 KeyCalculator calc;
+KeyTraceWriter key_trace;                     // What the user typed, for reproducing problems with host/replay
+LatencyProbe  latency_probe;                  // Where the time goes from a key press to the screen; see the settings menu
+KeyRing       key_ring;                       // Keys read by the input task, waiting for loop()
+FrameGovernor frame_governor(FRAME_RATE);     // When loop() shows the screen; settable in the settings menu
+TaskHandle_t  input_task_handle;
+TaskHandle_t  loop_task_handle;
+volatile uint32_t keyboard_pressed = 0;       // micros() when the keyboard interrupt last fired
 TFT_eSprite   sprite          = TFT_eSprite(&M5.Lcd);
-String        button_sets[]   = { BUTTONS_NORMAL_0, BUTTONS_NORMAL_1, BUTTONS_NORMAL_2, BUTTONS_NORMAL_3, BUTTONS_NORMAL_4 };
+M5Surface     lcd_surface(M5.Lcd, !RENDER_TASK);  // The render task leaves ez.yield() to loop()
+M5Surface     sprite_surface(sprite);
+String        button_sets[]   = { BUTTONS_NORMAL_0, BUTTONS_NORMAL_1, BUTTONS_NORMAL_2, BUTTONS_NORMAL_3, BUTTONS_NORMAL_4, BUTTONS_NORMAL_5 };
 uint8_t       button_set      = 0;
 bool          cancel_bs       = false;        // If true, override displaying the BS buttons
 bool          stacks_visible  = true;         // Can be turned off in settings menu
+bool          publish_pending = false;        // If true, the render task's queue was full; publish again
+uint32_t      pending_pressed = 0;            // The oldest key of the snapshot waiting to be published again
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Read a key from the calculator keyboard.
-//  Return true and change ref to input char if key is available, otherwise return false.
-//
-bool read_key(char& input) {
-  if(digitalRead(KEYBOARD_INT) == LOW) {      // If a character is ready
-    Wire.requestFrom(KEYBOARD_I2C_ADDR, 1);   // request 1 byte from keyboard
-    if(Wire.available()) {
-      char key_val = Wire.read();             // receive a byte as character
-      if(0 != key_val) {
-        input = key_val;
-        return true;
-      }
+//  The FACES calculator keyboard: while its data ready line is low, a key can be read over I2C.
+//
+class FacesKeyboard : public KeyTransport {
+  public:
+    bool key_ready() override {
+      return LOW == digitalRead(KEYBOARD_INT);
+    }
+    bool read_key(char& key) override {
+      Wire.requestFrom(KEYBOARD_I2C_ADDR, 1);   // request 1 byte from keyboard
+      if(!Wire.available()) return false;
+      key = Wire.read();                        // receive a byte as character
+      return 0 != key;
+    }
+} keyboard;
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The keyboard's data ready line fell: note when, and wake the input task, which can use I2C.
+//
+void IRAM_ATTR keyboard_isr() {
+  BaseType_t woken = pdFALSE;
+  keyboard_pressed = micros();
+  vTaskNotifyGiveFromISR(input_task_handle, &woken);
+  if(woken) portYIELD_FROM_ISR();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The input task: read the keys into key_ring as soon as they're ready, and wake loop().
+//  The timeout picks up a key whose interrupt was missed; its keys are timed from when they were read.
+//
+void input_task(void* parameter) {
+  for(;;) {
+    bool      interrupted = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(KEYBOARD_WAIT_MS));
+    uint32_t  start       = interrupted ? keyboard_pressed : micros();
+    if(pump_keys(keyboard, key_ring, interrupted ? start : 0)) {
+      latency_probe.record(stageReadKey, start, micros());
+      xTaskNotifyGive(loop_task_handle);
     }
   }
-  return false;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Read a key from the calculator keyboard, or a button from the M5Stack.
+//  Show the calculator's current state: hand a snapshot to the render task, or draw it here.
+//  pressed is when the oldest key it shows was pressed, or 0.
+//
+void show_display(uint32_t pressed = 0) {
+  if(RENDER_TASK) {
+    publish_pending = !publish_display(pressed);
+    pending_pressed = pressed;
+  }
+  else {
+    display_all(pressed);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The render task, on the other core: draw the latest snapshot whenever there is one.
+//  It draws only the calculator's bands, under the screen lock; loop() makes every ez.* call (see screen_ui.cpp).
+//
+void render_task(void* parameter) {
+  for(;;) {
+    if(!render_latest()) vTaskDelay(1);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Read every waiting key from the calculator keyboard, and a button from the M5Stack.
+//  Nothing is drawn here: frame_governor is told what changed the screen, and loop() shows it.
 //
 bool process_input() {
-  char input;
+  KeyEvent  event;
+  bool      changed = false;
 
   // Process keyboard input. calc does all the work.
-  if(read_key(input)) {
-    if(calc.key(input) || calc.get_error_state()) {
-      display_all();
-      return true;
+  while(key_ring.pop(event)) {
+    char      input     = event.key;
+    uint32_t  start     = micros();
+    latency_probe.record(stageKeyWait, event.time, start);
+    bool      accepted  = calc.key(input);
+    uint32_t  end       = micros();
+    latency_probe.record(stageKey, start, end);
+    key_trace.key(input, start, end - start);
+    if(accepted || calc.get_error_state()) {
+      frame_governor.key(event.time);
+      changed = true;
     }
   }
 
-  // See if any buttons have been pressed and if so, dispatch the indicated function
+  // See if any buttons have been pressed and if so, dispatch the indicated function.
+  // Polling can draw (it runs M5ez's events), so it holds the screen from the render task.
+  lock_screen();
   String result = ez.buttons.poll();
+  unlock_screen();
   if(result.length()) {
     if (result == "right") {
       if(!cancel_bs && calcEnteringNumber == calc.get_state()) {
@@ -80,40 +172,44 @@ bool process_input() {
         button_set = 0;
       }
     }
-    // memory mode
-    else if(result == "get")    calc.key('M');  // In memory mode: retrieve
-    else if(result == "set")    calc.key('=');  // In memory mode: st
-    else if(result == "clear")  calc.key('A');  // In memory mode: clear
-    else if(result == "M")      calc.key('M');  // In memory mode: retrieve
-    else if(result == "=")      calc.key('=');  // In memory mode: st
-    else if(result == "AC")     calc.key('A');  // In memory mode: clear
-    // number entry mode
-    else if(result == "BS")     calc.key('B');  // KeyCalculator command for backspace
-    else if(result == "cancel") calc.cancel_input();
-    // normal 0
-    else if(result == "help")   help_screen();
-    else if(result == "menu")   menu_menu();
-    // normal 1
-    else if(result == "(")      calc.key(OPEN_PAREN_OPERATOR);
-    else if(result == ")")      calc.key(CLOSE_PAREN_OPERATOR);
-    // normal 2
-    else if(result == "pi")     calc.set_value("3.14159265");
-    else if(result == "e")      calc.set_value("2.71828182");
-    // normal 3
-    else if(result == "push")   { calc.commit();  calc.push(); }
-    else if(result == "pop")    { calc.commit();  calc.pop(); }
-    // normal 4
-    else if(result == "square") calc.key(SQUARE_OPERATOR);
-    else if(result == "sqroot") calc.key(SQUARE_ROOT_OPERATOR);
+    else if(result == "help") {
+      hold_rendering();
+      help_screen();
+      release_rendering();
+    }
+    else if(result == "menu") {
+      hold_rendering();
+      menu_menu();
+      release_rendering();
+    }
+    else {
+      uint32_t start = micros();
+      if(do_button_action(calc, result)) key_trace.button(result.c_str(), start, micros() - start);
+    }
 
     if (result != "right") {
       cancel_bs = false; // get out of cancel_bs as soon as any non-right button pressed.
     }
 
-    display_all();
+    frame_governor.change();
     return true;
   }
-  return false;
+  return changed;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Show the screen if frame_governor says a frame is due. Return true if it was shown.
+//  With the render task, the frame's latency ends when its snapshot is published, not when it's drawn;
+//  latency_probe's stageKeyToScreen is the latency to the screen.
+//
+bool show_frame() {
+  uint32_t start = micros();
+  if(!frame_governor.due(start)) return false;
+  show_display(frame_governor.oldest_key());
+  frame_governor.frame(start, micros());
+  return true;
 }
 
 
@@ -139,9 +235,15 @@ void setup() {
   Wire.begin();
   pinMode(KEYBOARD_INT, INPUT_PULLUP);
   test_for_keyboard();
+  loop_task_handle = xTaskGetCurrentTaskHandle();
+  xTaskCreatePinnedToCore(input_task, "input", INPUT_TASK_STACK, nullptr, INPUT_TASK_PRIORITY, &input_task_handle, xPortGetCoreID());
+  attachInterrupt(digitalPinToInterrupt(KEYBOARD_INT), keyboard_isr, FALLING);
   sprite.createSprite(SCREEN_WIDTH - LEFT_MARGIN - RIGHT_MARGIN, NUM_HEIGHT);
   M5.Lcd.setTextSize(1);
-  display_all();
+  calc.set_speculation(LIVE_PREVIEW);
+  set_display_surfaces(lcd_surface, sprite_surface);
+  if(RENDER_TASK) xTaskCreatePinnedToCore(render_task, "render", RENDER_TASK_STACK, nullptr, 1, nullptr, RENDER_TASK_CORE);
+  show_display();
 }
 
 
@@ -150,6 +252,17 @@ void setup() {
 // Arduino loop function, called repeatedly
 //
 void loop() {
+  uint32_t wait = KEYBOARD_WAIT_MS;
+  if(frame_governor.pending()) wait = min(wait, (frame_governor.wait(micros()) + 999) / 1000);
+  if(key_ring.empty() && wait) ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait));  // Wakes at once for a key
   process_input();
-  delay(10);
+  bool shown = show_frame();
+  if(publish_pending) publish_pending = !publish_display(pending_pressed);
+  if(RENDER_TASK) {
+    uint32_t start = micros();
+    lock_screen();
+    ez.yield();
+    unlock_screen();
+    if(shown) latency_probe.record(stageYield, start, micros());   // Only the yields that hold up a frame's loop
+  }
 }
@@ -1,7 +1,5 @@
 #include "KeyCalculator.h"
 
-#define CHANGE_SIGN_OPERATOR    (uint8_t('`'))
-#define BACKSPACE_OPERATOR      (uint8_t('B'))
 #define MAX_ARR_MEM_TO_SHOW     8
 #define CALC_NUMERIC_PRECISION  8
 
@@ -10,6 +8,35 @@
 #define DEBUG_KEYCALC_MEMORY    0   // If non-zero, spew all memory operations
 
 
+// Classify a key code. Used only at compile time, to fill key_classes.
+//
+static constexpr uint8_t classify_key(uint8_t code) {
+  return ('0' <= code && '9' >= code)     ? keyDigit      :
+         ('.' == code)                    ? keyPoint      :
+         (BACKSPACE_OPERATOR == code)     ? keyBackspace  :
+         (OPEN_PAREN_OPERATOR == code)    ? keyOpenParen  :
+         (CLOSE_PAREN_OPERATOR == code)   ? keyCloseParen :
+         (EVALUATE_OPERATOR == code)      ? keyEvaluate   :
+         (ADDITION_OPERATOR == code || SUBTRACTION_OPERATOR == code ||
+          MULTIPLICATION_OPERATOR == code || DIVISION_OPERATOR == code) ? keyArithmetic :
+         (PERCENT_OPERATOR == code)       ? keyPercent    :
+         (SQUARE_OPERATOR == code || SQUARE_ROOT_OPERATOR == code)     ? keyFunction   :
+         (CHANGE_SIGN_OPERATOR == code)   ? keyChangeSign :
+         (CLEAR_OPERATOR == code)         ? keyClear      :
+         (MEMORY_OPERATOR == code)        ? keyMemory     : keyOther;
+}
+
+// The KeyClass of every key code, generated at compile time
+//
+#define KEY_CLASSES_4(c)    classify_key(c), classify_key(c + 1), classify_key(c + 2), classify_key(c + 3)
+#define KEY_CLASSES_16(c)   KEY_CLASSES_4(c), KEY_CLASSES_4(c + 4), KEY_CLASSES_4(c + 8), KEY_CLASSES_4(c + 12)
+#define KEY_CLASSES_64(c)   KEY_CLASSES_16(c), KEY_CLASSES_16(c + 16), KEY_CLASSES_16(c + 32), KEY_CLASSES_16(c + 48)
+static constexpr uint8_t key_classes[256] = { KEY_CLASSES_64(0), KEY_CLASSES_64(64), KEY_CLASSES_64(128), KEY_CLASSES_64(192) };
+static_assert(keyDigit == key_classes['7'] && keyMemory == key_classes['M'] && keyOther == key_classes[255], "key_classes is wrong");
+
+constexpr KeyCalculator::KeyAction KeyCalculator::_transitions[KEYCAL_STATES][KEYCAL_KEY_CLASSES];
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  Constructor
@@ -19,6 +46,18 @@ KeyCalculator::KeyCalculator() : TextCalculator(CALC_NUMERIC_PRECISION) {
   _num_buffer_index   = 0;
   _mem_buffer_index   = 0;
   _clear_press_count  = 0;
+  checkpoint();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Process a key, and record the result for undo if the key was accepted (or caused an error).
+//
+bool KeyCalculator::key(uint8_t code) {
+  bool result = _handle_key(code);
+  if(result || _calc.get_error_state()) checkpoint();
+  return result;
 }
 
 
@@ -26,113 +65,170 @@ KeyCalculator::KeyCalculator() : TextCalculator(CALC_NUMERIC_PRECISION) {
 //
 //  This is the workhorse routine for handling incoming keys from the keyboard.
 //  Keys build values, memory specs, or represent commands.
-//  _state controls how the key is handled, and is modified by key inputs.
+//  The key's class and _state select the action from the _transitions table.
 //
-bool KeyCalculator::key(uint8_t code) {
+bool KeyCalculator::_handle_key(uint8_t code) {
   if(DEBUG_KEYCALC_STATE) Serial.printf("Entering key() in %s state.\n", _state_to_name[_state]);
 
   // First, set error state if calculator has encountered exception.
+  // In the error state, no keys are accepted except AC (see _key_recover).
   if(_calc.get_error_state()) _change_state(calcError);
 
-  // If in error state, no keys are accepted except AC, which clears the error state
-  // as well as all memory and stacks.
-  if(calcError == _state) {
-    if(CLEAR_OPERATOR == code) {
-      _calc.clear_error_state();
-      _calc.push_value(0.0);
-      _change_state(calcReadyForAny);
-      return true;
-    }
-    return false;
-  }
-
   // See if we just pressed the AC key two times
-  if(_clear_press_count && CLEAR_OPERATOR == code) {
-    return _handle_clear(true);
-  }
-  _clear_press_count = 0;
-
-  // Next, see if we are entering a multi-key memory command
-  if(calcEnteringMemory == _state) {
-    return _handle_memory_command(code);
-  }
-
-  // Special case for chaining mode:
-  // On most calculators, if you press 1 + = + = + = you get 2, 4, 8, ...
-  // Only do this for +, -, *, /, not %, square, etc.
-  //
-  if(EVALUATE_OPERATOR == code) {
-    if(calcReadyForNumber == _state) {
-      Op_ID op = _calc.peek_operator();
-      if(ADDITION_OPERATOR      == op || SUBTRACTION_OPERATOR == op ||
-        MULTIPLICATION_OPERATOR == op || DIVISION_OPERATOR    == op) {
-        if(DEBUG_KEYCALC_STACK) Serial.printf("Pushing %.4f onto the value stack in key() (chaining mode)\n", _calc.get_value());
-        enter(value());
-        _change_state(calcReadyForOperator);  // So the '=' code is evaluated
-      }
+  if(calcError != _state) {
+    if(_clear_press_count && CLEAR_OPERATOR == code) {
+      return _handle_clear(true);
     }
+    _clear_press_count = 0;
   }
+  return (this->*_transitions[_state][key_classes[code]])(code);
+}
 
-  // If we are in calcReadyForNumber state, and there's an operator on the stack, we must be waiting for
-  // the second operator. If another operator comes in here, it should replace the operator on top of
-  // the operator_stack. For example:
-  // User inputs 15 + *.  Interpret this to mean: "I meant *, not +".
-  // Don't do this for parens, you may want multiple open parens and close parens get weird.
-  if((calcReadyForNumber == _state) && is_operator(code) && (OPEN_PAREN_OPERATOR != code) &&
-     (CLOSE_PAREN_OPERATOR != code) && (0 != _calc.operator_stack.size())) {
-    _calc.operator_stack.back() = code;
-    return true;  // Do not change the state
-  }
 
-  // Handle numbers. This may include 0-9, decimal, B for backspace and the open paren
-  if(calcReadyForAny == _state || calcReadyForNumber == _state || calcEnteringNumber == _state) {
-    // Next, see if a number is being entered (with B for Backspace)
-    if(('0' <= code && '9' >= code) || ('.' == code) || 'B' == code) {
-      return _build_number(code);
-    }
-    if(OPEN_PAREN_OPERATOR == code) {
-      enter(code);
-      _change_state(calcReadyForNumber);
-      return true;
+////////////////////////////////////////////////////////////////////////////////
+//
+//  In the error state, no keys are accepted except AC.
+//
+bool KeyCalculator::_key_reject(uint8_t code) {
+  if(DEBUG_KEYCALC_STATE) Serial.printf("Dropping key %c\n", code);
+  return false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  AC in the error state clears the error state and starts over with a zero value.
+//
+bool KeyCalculator::_key_recover(uint8_t code) {
+  _calc.clear_error_state();
+  _calc.push_value(0.0);
+  _change_state(calcReadyForAny);
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Where a number may be entered, an open paren is handled like a value, since it will evaluate to one.
+//
+bool KeyCalculator::_key_open_paren(uint8_t code) {
+  enter(code);
+  _change_state(calcReadyForNumber);
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Commit any number being entered, then enter the operator if an operator is expected.
+//  Close paren is rejected unless there's a matching open paren.
+//  %, square and square root are evaluated immediately, like most calculators do.
+//
+bool KeyCalculator::_key_operator(uint8_t code) {
+  commit(); // If input is in progress, commit pushes it to the stack and sets state to calcReadyForOperator. Else, noop.
+  if(!((calcReadyForAny == _state && 0 < _calc.value_stack.size()) || calcReadyForOperator == _state)) {
+    return _key_reject(code);
+  }
+  // Do not allow a CLOSE_PAREN_OPERATOR on the stack unless there's a matching OPEN_PAREN_OPERATOR
+  if(CLOSE_PAREN_OPERATOR == code && 0 == _count_open_parens()) {
+    if(DEBUG_KEYCALC_STACK) Serial.println("Rejecting close paren because there is no matching open paren.");
+    return false;
+  }
+  if(DEBUG_KEYCALC_STACK) Serial.printf("Pushing %c onto the operator stack in key()\n", code);
+  bool result = enter(code);
+  if(result) {
+    CalcState                        next = calcReadyForNumber;     // Normally, after entering an operator
+    if(EVALUATE_OPERATOR    == code) next = calcReadyForAny;        // Operation completed, ready for anything
+    if(CLOSE_PAREN_OPERATOR == code) next = calcReadyForOperator;   // Operation completed, ready for anything
+    // (Basically, unary operators are evaluated immediately)
+    if(PERCENT_OPERATOR == code || SQUARE_OPERATOR == code || SQUARE_ROOT_OPERATOR == code) {
+      result = (NO_ERROR == _calc.evaluate_one());
+      next   = calcReadyForAny;
     }
+    _change_state(next);
   }
-  commit(); // If input is in progress, commit pushes it to the stack and sets state to calcReadyForOperator. Else, noop.
+  return result;
+}
 
-  // See if its a simple operator
-  if((calcReadyForAny == _state && 0 < _calc.value_stack.size()) || calcReadyForOperator == _state) {
-    if(is_operator(code)) {
-      // Do not allow a CLOSE_PAREN_OPERATOR on the stack unless there's a matching OPEN_PAREN_OPERATOR
-      if(CLOSE_PAREN_OPERATOR == code && 0 == _count_open_parens()) {
-        if(DEBUG_KEYCALC_STACK) Serial.println("Rejecting close paren because there is no matching open paren.");
-        return false;
-      }
-      if(DEBUG_KEYCALC_STACK) Serial.printf("Pushing %c onto the operator stack in key()\n", code);
-      bool result = enter(code);
-      if(result) {
-        CalcState                        next = calcReadyForNumber;     // Normally, after entering an operator
-        if(EVALUATE_OPERATOR    == code) next = calcReadyForAny;        // Operation completed, ready for anything
-        if(CLOSE_PAREN_OPERATOR == code) next = calcReadyForOperator;   // Operation completed, ready for anything
-        // If the operator was %, square or SquareRoot, evaluate it immediately (like most calculators do) and set state to any
-        // (Basically, unary operators are evaluated immediately)
-        if(PERCENT_OPERATOR == code || SQUARE_OPERATOR == code || SQUARE_ROOT_OPERATOR == code) {
-          result = (NO_ERROR == _calc.evaluate_one());
-          next   = calcReadyForAny;
-        }
-        _change_state(next);
-      }
-      return result;
-    }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  = where it evaluates the stacks (see _transitions). If speculate() has already evaluated these same stacks
+//  successfully, take its result instead of evaluating them again; the state ends as _key_operator() leaves it.
+//
+bool KeyCalculator::_key_evaluate(uint8_t code) {
+  commit();
+  if(_speculation.ok && _speculation.values.same(_calc.value_stack) && _speculation.operators.same(_calc.operator_stack) &&
+     ((calcReadyForAny == _state && 0 < _calc.value_stack.size()) || calcReadyForOperator == _state)) {
+    _calc.value_stack = _speculation.result;
+    _calc.operator_stack.clear();
+    _speculations_used++;
+    _change_state(calcReadyForAny);
+    return true;
   }
+  return _key_operator(code);
+}
 
-  // These operations require more complex handling, and are permitted in any state
-  switch(code) {
-    case CHANGE_SIGN_OPERATOR:  return _handle_change_sign();
-    case CLEAR_OPERATOR:        return _handle_clear(false);
-    case MEMORY_OPERATOR:       return _handle_memory_command(code);
-    default:                    break;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  If we are in calcReadyForNumber state, and there's an operator on the stack, we must be waiting for
+//  the second operand. If another operator comes in here, it should replace the operator on top of
+//  the operator_stack. For example:
+//  User inputs 15 + *.  Interpret this to mean: "I meant *, not +".
+//  Parens are not replaced; you may want multiple open parens and close parens get weird.
+//
+bool KeyCalculator::_key_replace_operator(uint8_t code) {
+  if(0 == _calc.operator_stack.size()) return _key_operator(code);
+  _calc.operator_stack.back() = code;
+  return true;  // Do not change the state
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Special case for chaining mode:
+//  On most calculators, if you press 1 + = + = + = you get 2, 4, 8, ...
+//  Only do this for +, -, *, /, not %, square, etc.
+//
+bool KeyCalculator::_key_chain(uint8_t code) {
+  Op_ID op = _calc.peek_operator();
+  if(ADDITION_OPERATOR      != op && SUBTRACTION_OPERATOR != op &&
+     MULTIPLICATION_OPERATOR != op && DIVISION_OPERATOR    != op) {
+    return _key_replace_operator(code);
   }
-  if(DEBUG_KEYCALC_STATE) Serial.printf("Dropping key %c\n", code);
-  return false;
+  if(DEBUG_KEYCALC_STACK) Serial.printf("Pushing %.4f onto the value stack in key() (chaining mode)\n", _calc.get_value());
+  enter(value());
+  _change_state(calcReadyForOperator);  // So the '=' code is evaluated
+  return _key_operator(code);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  These keys are permitted in any state but calcEnteringMemory and calcError.
+//  Any number being entered is committed first.
+//
+bool KeyCalculator::_key_change_sign(uint8_t code) {
+  commit();
+  return _handle_change_sign();
+}
+
+bool KeyCalculator::_key_clear(uint8_t code) {
+  commit();
+  return _handle_clear(false);
+}
+
+bool KeyCalculator::_key_memory(uint8_t code) {
+  commit();
+  if(DEBUG_KEYCALC_MEMORY) Serial.println("Setting calcEnteringMemory state");
+  _change_state(calcEnteringMemory);
+  return true;
+}
+
+bool KeyCalculator::_key_ignore(uint8_t code) {
+  commit();
+  return _key_reject(code);
 }
 
 
@@ -144,9 +240,14 @@ bool KeyCalculator::key(uint8_t code) {
 //
 bool KeyCalculator::commit() {
   if(_num_buffer_index) {
-    String str = _convert_num_buffer(true);
-    if(DEBUG_KEYCALC_STACK) Serial.printf("Pushing %s onto the value stack in commit()\n", str.c_str());
-    enter(str);
+    double val;
+    if(DEBUG_KEYCALC_STACK) Serial.printf("Pushing %s onto the value stack in commit()\n", _num_buffer);
+    bool ok = true;
+    if(1 == _num_buffer_index && '.' == _num_buffer[0]) val = 0.0;      // A lone decimal point is zero, as on any calculator
+    else ok = _string_to_double(_num_buffer, _num_buffer_index, val);
+    _num_buffer_index = 0;
+    _num_buffer[0]    = '\0';
+    if(ok) _enter_value(val);
     _change_state(calcReadyForOperator);
     return true;
   }
@@ -154,6 +255,51 @@ bool KeyCalculator::commit() {
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The stacks = would evaluate if it were pressed now: the engine's, with any number being entered
+//  pushed as commit() would push it. Return false if = wouldn't evaluate them (see _transitions and
+//  _key_operator()), there is nothing to evaluate, or the number being entered wouldn't parse or fit.
+//
+bool KeyCalculator::_stacks_for_evaluate(FixedStack<double, CALC_STACK_DEPTH>& values, FixedStack<Op_ID, CALC_STACK_DEPTH>& operators) {
+  if(calcReadyForAny != _state && calcReadyForOperator != _state && calcEnteringNumber != _state) return false;
+  if(_calc.get_error_state() || 0 == _calc.operator_stack.size()) return false;
+  values    = _calc.value_stack;
+  operators = _calc.operator_stack;
+  if(_num_buffer_index) {
+    double val = 0.0;
+    if(!(1 == _num_buffer_index && '.' == _num_buffer[0]) && NO_ERROR != parse_number(_num_buffer, _num_buffer_index, val)) return false;
+    return values.push_back(val);                               // commit() leaves calcReadyForOperator
+  }
+  return (calcReadyForAny == _state && 0 < values.size()) || calcReadyForOperator == _state;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Speculative evaluation: work out what = would give, on copies of the stacks, so dispPreview can show it
+//  and = can take it without evaluating. Called between keys (the screen asks for dispPreview before each
+//  frame), so the stacks are only evaluated again when they've changed. Nothing in the engine changes.
+//  Return true if = would succeed now.
+//
+bool KeyCalculator::speculate() {
+  FixedStack<double, CALC_STACK_DEPTH>  values;
+  FixedStack<Op_ID, CALC_STACK_DEPTH>   operators;
+  if(!_speculating || !_stacks_for_evaluate(values, operators)) return false;
+  if(_speculation.valid && _speculation.values.same(values) && _speculation.operators.same(operators)) return _speculation.ok;
+  _speculation.values         = values;
+  _speculation.operators      = operators;
+  _speculation.valid          = true;
+  _speculator.value_stack     = values;
+  _speculator.operator_stack  = operators;
+  _speculation.ok             = (NO_ERROR == _speculator.evaluate_all() && NO_ERROR == _speculator.get_error_state());  // % can set it, yet succeed
+  if(_speculation.ok) _speculation.result = _speculator.value_stack;
+  _speculator.clear_error_state();
+  _speculations_run++;
+  return _speculation.ok;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  Push val onto the value stack.
@@ -199,58 +345,126 @@ CalcState KeyCalculator::get_state() {
 //  Get some textual information for display, identified by id
 //
 String KeyCalculator::get_display(CalcDisplay id) {
-  String str;
+  char buffer[KEYCAL_DISPLAY_SIZE];
+  get_display(id, buffer, sizeof(buffer));
+  return String(buffer);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Write the display identified by id into buffer, without allocating.
+//  Text that doesn't fit is cut short; KEYCAL_DISPLAY_SIZE holds any display. Return the length.
+//
+size_t KeyCalculator::get_display(CalcDisplay id, char* buffer, size_t size) {
+  TextBuilder str(buffer, size);
   switch(id) {
     case dispValue:     // If we're in number input mode, return the current _num_buffer. Else, return the value
       if(_num_buffer_index) {
-        return _convert_num_buffer(false);
+        str.add(_num_buffer, _num_buffer_index);
       }
-      return value();
+      else {
+        _add_number(str, _calc.get_value());
+      }
+      break;
 
     case dispMemoryID:  // Get the memory address that's being built up if _entering_memory
-      str = "M[";
-      switch(_mem_buffer_index) {
-        case 0:
-          str += "__";
-          break;
-        case 1:
-          str += "_";
-          str += _mem_buffer;
-          break;
-        case 2:
-          str += _mem_buffer;
-          break;
-        default: str += "?";  // error state
-      }
-      str += "]  (";
-      str += double_to_string(_mem_buffer_index ? _calc.get_memory(atoi(_mem_buffer)) : _calc.get_memory());
-      str += ")";
-      return str;
+      str.add("M[");
+      for(uint8_t i = _mem_buffer_index; i < KEYCAL_MEM_ADDRESS_DIGITS; i++) str.add('_');
+      str.add(_mem_buffer, _mem_buffer_index);
+      str.add("]  (");
+      _add_number(str, _mem_buffer_index ? _calc.get_memory(_mem_address()) : _calc.get_memory());
+      str.add(')');
+      break;
 
     case dispStatus:          // Get a status display showing open parens and memory usage
-      return _build_status_display();
+      _build_status_display(str);
+      break;
 
     case dispOpStack:         // Get a representation of the operator stack
-      str = "[ ";
+      str.add("[ ");
       for(int i = 0; i < _calc.operator_stack.size(); i++) {
-        str += char(_calc.operator_stack[i]);
-        str += " ";
+        str.add(char(_calc.operator_stack[i]));
+        str.add(' ');
       }
-      str += "]";
-      return str;
+      str.add(']');
+      break;
 
     case dispValStack:        // Get a representation of the value stack
-      str = "[ ";
-      for(int i = 0; i < _calc.value_stack.size(); i++) {
-        str += double_to_string(_calc.value_stack[i]);
-        str += " ";
+      _build_stack_display(str);
+      break;
+
+    case dispPreview:         // What = would give, worked out by speculate()
+      if(speculate()) {
+        str.add("= ");
+        _add_number(str, _speculation.result.size() ? _speculation.result.back() : 0.0);
       }
-      str += "]";
-      return str;
+      break;
 
     default:
-      return String("Unexpected");
+      str.add("Unexpected");
+      break;
   }
+  return str.length();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Step back through the history of snapshots. Only the stacks and buffers are copied; the memories, memory
+//  stack and formulas are shared with the snapshot, so this costs the same however much memory is in use.
+//
+bool KeyCalculator::undo() {
+  const Snapshot* snapshot = _history.undo();
+  if(!snapshot) return false;
+  _restore(*snapshot);
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Step forward again after undo()
+//
+bool KeyCalculator::redo() {
+  const Snapshot* snapshot = _history.redo();
+  if(!snapshot) return false;
+  _restore(*snapshot);
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Record the current state as a new snapshot, discarding anything that could have been redone.
+//  The formulas (see FormulaSheet.h) are saved with the memories, so undo can't leave one without the other.
+//
+void KeyCalculator::checkpoint() {
+  Snapshot& snapshot = _history.record();
+  _calc.save_state(snapshot.engine);
+  _formulas.save_state(snapshot.formulas);
+  memcpy(snapshot.num_buffer, _num_buffer, sizeof(_num_buffer));
+  memcpy(snapshot.mem_buffer, _mem_buffer, sizeof(_mem_buffer));
+  snapshot.num_buffer_index   = _num_buffer_index;
+  snapshot.mem_buffer_index   = _mem_buffer_index;
+  snapshot.clear_press_count  = _clear_press_count;
+  snapshot.state              = _state;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Return to a snapshot
+//
+void KeyCalculator::_restore(const Snapshot& snapshot) {
+  _calc.restore_state(snapshot.engine);
+  _formulas.restore_state(snapshot.formulas);
+  memcpy(_num_buffer, snapshot.num_buffer, sizeof(_num_buffer));
+  memcpy(_mem_buffer, snapshot.mem_buffer, sizeof(_mem_buffer));
+  _num_buffer_index   = snapshot.num_buffer_index;
+  _mem_buffer_index   = snapshot.mem_buffer_index;
+  _clear_press_count  = snapshot.clear_press_count;
+  _change_state(snapshot.state);
 }
 
 
@@ -319,89 +533,149 @@ bool KeyCalculator::_handle_change_sign() {
 //  M+   Simple memory opperation  (M + Value -> M)
 //  M0=  Store into M[0]           (Value -> M[0])
 //  M9=  Store into M[9]           (Value -> M[9])
+//  M12345=  Store into M[12345]   (Value -> M[12345])
 //  M.   Cancel out of memory mode (N/C)
-//  Note that there may be 10 or thousands of memories.
-//  The previous state is captured on entry and restored on exit from calcEnteringMemory
-//
-bool KeyCalculator::_handle_memory_command(uint8_t code) {
-  if(DEBUG_KEYCALC_MEMORY) Serial.printf("_handle_memory_command('%c')\n", code);
-  if(calcEnteringMemory != _state) {
-    if(DEBUG_KEYCALC_MEMORY) Serial.println("Setting calcEnteringMemory state");
-    assert(MEMORY_OPERATOR == code);
-    _change_state(calcEnteringMemory);
+//  Note that there may be 10 or 100,000 memories; addresses up to KEYCAL_MEM_ADDRESS_DIGITS long are accepted.
+//  _key_memory() enters calcEnteringMemory, and the _key_memory_ actions handle the keys that follow.
+//  Digits build the memory address:
+//
+bool KeyCalculator::_key_memory_digit(uint8_t code) {
+  // Make sure the number doesn't exceed the number of memories:
+  if(KEYCAL_MEM_ADDRESS_DIGITS <= _mem_buffer_index) return false;
+  _mem_buffer[_mem_buffer_index++] = code;
+  _mem_buffer[_mem_buffer_index]   = '\0';
+  if(NUM_CALC_MEMORIES <= _mem_address()) {
+    // roll back
+    if(DEBUG_KEYCALC_MEMORY) Serial.printf("Error setting memory address: '%s' would be too large.\n", _mem_buffer);
+    _mem_buffer[--_mem_buffer_index] = '\0';
+    return false;
+  }
+  if(DEBUG_KEYCALC_MEMORY) Serial.printf("Building memory address: '%s'\n", _mem_buffer);
+  return true;
+}
+
+
+// If it's a backspace, reduce the memory name buffer by one
+//
+bool KeyCalculator::_key_memory_backspace(uint8_t code) {
+  if(_mem_buffer_index) {
+    _mem_buffer_index--;
+    _mem_buffer[_mem_buffer_index] = '\0';
     return true;
   }
+  return false;
+}
+
+
+// If it's a second 'M', we want to recall memory from the given location
+//
+bool KeyCalculator::_key_memory_recall(uint8_t code) {
+  bool result = false;
+  if(0 == _mem_buffer_index) {
+    if(DEBUG_KEYCALC_MEMORY) Serial.println("Recalling simple memory");
+    result = recall_memory();
+  }
   else {
-    // If it's a '.', cancel calcEnteringMemory and return true
-    if('.' == code) {
-      _mem_buffer_index = 0;
-      _mem_buffer[0]    = '\0';
-      _change_state(calcReadyForAny);
-      return true;
-    }
-    // If it's a backspace, reduce the memory name buffer by one
-    if('B' == code) {
-      if(_mem_buffer_index) {
-        _mem_buffer_index--;
-        _mem_buffer[_mem_buffer_index] = '\0';
-        return true;
-      }
-      return false;
-    }
-    // Build memory name if it's a number
-    if('0' <= code && '9' >= code) {
-      // Make sure the number doesn't exceed the number of memories:
-      _mem_buffer[_mem_buffer_index++] = code;
-      _mem_buffer[_mem_buffer_index]   = '\0';
-      if(NUM_CALC_MEMORIES - 1 < atoi(_mem_buffer)) {
-        // roll back
-        if(DEBUG_KEYCALC_MEMORY) Serial.printf("Error setting memory address: '%s' would be too large.\n", _mem_buffer);
-        _mem_buffer[--_mem_buffer_index] = '\0';
-        return false;
-      }
-      if(DEBUG_KEYCALC_MEMORY) Serial.printf("Building memory address: '%s'\n", _mem_buffer);
-      return true;
-    }
+    Mem_Index index = _mem_address();
+    if(DEBUG_KEYCALC_MEMORY) Serial.printf("Recalling memory M[%u]\n", unsigned(index));
+    result = recall_memory(index);
+  }
+  _end_memory_command();
+  return result;
+}
 
-    // If it's a second 'M', we want to recall memory from the given location
-    if(MEMORY_OPERATOR == code) {
-      bool result = false;
-      if(0 == _mem_buffer_index) {
-        if(DEBUG_KEYCALC_MEMORY) Serial.println("Recalling simple memory");
-        result = recall_memory();
-      }
-      else {
-        uint8_t index = atoi(_mem_buffer);
-        if(DEBUG_KEYCALC_MEMORY) Serial.printf("Recalling memory M[%d]\n", index);
-        result = recall_memory(index);
-      }
-      _mem_buffer_index               = 0;
-      _mem_buffer[_mem_buffer_index]  = '\0';
-      _change_state(calcReadyForAny);
-      return result;
-    }
 
-    // If it's a memory operation, call the memory_operation and terminate _entering_memory
-    if(is_mem_operator(code)) {
-      if(0 == _mem_buffer_index) {
-        if(DEBUG_KEYCALC_MEMORY) Serial.printf("call memory_operation(Op_ID = '%c')\n\n", code);
-        _calc.memory_operation(code);
-      }
-      else {
-        if(DEBUG_KEYCALC_MEMORY) Serial.printf("call memory_operation: Op_ID = '%c', index = '%s'\n\n", code, _mem_buffer);
-        _calc.memory_operation(code, atoi(_mem_buffer));
-      }
-      _mem_buffer_index               = 0;
-      _mem_buffer[_mem_buffer_index]  = '\0';
-     _change_state(calcReadyForAny);
-      return true;
-    }
+// If it's a memory operation, call the memory_operation and terminate calcEnteringMemory
+//
+bool KeyCalculator::_key_memory_operation(uint8_t code) {
+  if(0 == _mem_buffer_index) {
+    if(DEBUG_KEYCALC_MEMORY) Serial.printf("call memory_operation(Op_ID = '%c')\n\n", code);
+    _calc.memory_operation(code);
+  }
+  else {
+    if(DEBUG_KEYCALC_MEMORY) Serial.printf("call memory_operation: Op_ID = '%c', index = '%s'\n\n", code, _mem_buffer);
+    _calc.memory_operation(code, _mem_address());
   }
-  // Some random command? Bail out of memory mode.
+  _end_memory_command();
+  return true;
+}
+
+
+// If it's a '.', cancel calcEnteringMemory and return true
+//
+bool KeyCalculator::_key_memory_cancel(uint8_t code) {
+  _end_memory_command();
+  return true;
+}
+
+
+// Some random command? Bail out of memory mode.
+//
+bool KeyCalculator::_key_memory_bail(uint8_t code) {
+  _end_memory_command();
+  return false;
+}
+
+
+void KeyCalculator::_end_memory_command() {
   _mem_buffer_index = 0;
   _mem_buffer[0]    = '\0';
   _change_state(calcReadyForAny);
-  return false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The memory address typed so far, from _mem_buffer
+//
+Mem_Index KeyCalculator::_mem_address() {
+  return Mem_Index(strtoul(_mem_buffer, nullptr, 10));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Construct the value stack display: [ 1 2.5 3 ]
+//  The screen is redrawn after every key, but usually only the top of the stack has changed, so the text
+//  of each value is kept in _stack_text. Values below the first one that was pushed or changed since the
+//  last time are not formatted again.
+//
+void KeyCalculator::_build_stack_display(TextBuilder& str) {
+  uint8_t count = _calc.value_stack.size();
+  uint8_t same  = 0;
+  if(_stack_precision == _precision) {
+    while(same < count && same < _stack_shown) {
+      uint64_t bits;
+      memcpy(&bits, &_calc.value_stack[same], sizeof(bits));
+      if(bits != _stack_bits[same]) break;
+      same++;
+    }
+  }
+  size_t      start = same ? _stack_ends[same - 1] : 2;
+  TextBuilder text(_stack_text + start, sizeof(_stack_text) - start);
+  for(uint8_t i = same; i < count; i++) {
+    _add_number(text, _calc.value_stack[i]);
+    text.add(' ');
+    memcpy(&_stack_bits[i], &_calc.value_stack[i], sizeof(_stack_bits[i]));
+    _stack_ends[i] = start + text.length();
+  }
+  _stack_reused    += same;
+  _stack_rendered  += count - same;
+  _stack_shown      = count;
+  _stack_precision  = _precision;
+  str.add(_stack_text, start + text.length());
+  str.add(']');
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Add val to str, formatted by the format cache
+//
+void KeyCalculator::_add_number(TextBuilder& str, double val) {
+  size_t      length;
+  const char* text = _formats.format(val, _precision, length);
+  str.add(text, length);
 }
 
 
@@ -410,67 +684,63 @@ bool KeyCalculator::_handle_memory_command(uint8_t code) {
 //  Construct a string for a calculator to display showing status.
 //  It may be entirely empty, or as complex as:  (( M[1,2,4,6,7,18.37,81,...]  S(5)  M=3.14159265
 //
-String KeyCalculator::_build_status_display() {
-  String  str         = "";
+void KeyCalculator::_build_status_display(TextBuilder& str) {
   uint8_t paren_count = _count_open_parens();
   uint8_t arr_count   = 0;
-  uint8_t stack_count = _calc.get_memory_depth();
+  size_t  stack_count = _calc.get_memory_depth();
   double  mem         = _calc.get_memory();
 
   // At least during development, show the KeyCalculator state first:
   switch(_state) {
-    case calcReadyForAny      : str += "A "; break;
-    case calcReadyForNumber   : str += "N "; break;
-    case calcReadyForOperator : str += "O "; break;
-    case calcEnteringNumber   : str += "> "; break;
-    case calcEnteringMemory   : str += "M "; break;
-    case calcError            : str += "X "; break;
+    case calcReadyForAny      : str.add("A "); break;
+    case calcReadyForNumber   : str.add("N "); break;
+    case calcReadyForOperator : str.add("O "); break;
+    case calcEnteringNumber   : str.add("> "); break;
+    case calcEnteringMemory   : str.add("M "); break;
+    case calcError            : str.add("X "); break;
   }
 
   // Show how many open parens there are on the stack (if any).
   // This part of the status string leads and looks like: (((
   if(paren_count) {
-    for(int i = 0; i < paren_count; i++) str += "(";
-    str += " ";
+    for(int i = 0; i < paren_count; i++) str.add('(');
+    str.add(' ');
   }
 
   // Next, display info about indexed memories. Show the indexes of up to
   // eight; if there are more add ...
   // This part of the status string looks like: M[0,1,2,3]
-  for(uint8_t i = 0; i < NUM_CALC_MEMORIES; i++) {
-    if(0.0 != _calc.get_memory(i)) {
-      if(0 == arr_count++) str += "M[";
-      if(MAX_ARR_MEM_TO_SHOW > arr_count) {
-        str += i;
-        str += ',';
-      }
-      else {
-        str += "...,";
-        break;
-      }
+  for(Mem_Index i = _calc.next_occupied_memory(); NO_MEMORY != i; i = _calc.next_occupied_memory(i + 1)) {
+    if(0 == arr_count++) str.add("M[");
+    if(MAX_ARR_MEM_TO_SHOW > arr_count) {
+      str.add(uint32_t(i));
+      str.add(',');
+    }
+    else {
+      str.add("...,");
+      break;
     }
   }
   if(arr_count) {
-    str[str.length() - 1] = ']';
-    str += "  ";
+    str.replace_last(']');
+    str.add("  ");
   }
 
   // Next, display info about the memory stack. If it is non-empty, add
   // S(n), where n is the number of items on the stack.
   // This part of the status string looks like: S(2)
   if(stack_count) {
-    str += "S(";
-    str += stack_count;
-    str += ")  ";
+    str.add("S(");
+    str.add(uint32_t(stack_count));
+    str.add(")  ");
   }
 
   // Finally, if simple memory is set, display its value.
   // This part of the status string looks like: M=3.14159265
   if(0.0 != mem) {
-    str += "M=";
-    str += double_to_string(mem);
+    str.add("M=");
+    _add_number(str, mem);
   }
-  return str;
 }
 
 
@@ -478,7 +748,7 @@ String KeyCalculator::_build_status_display() {
 //
 //  Build the display value from keystrokes
 //
-bool KeyCalculator::_build_number(uint8_t code) {
+bool KeyCalculator::_key_number(uint8_t code) {
   _change_state(calcEnteringNumber);
   if('B' == code) {
     // backspace one space
@@ -489,7 +759,7 @@ bool KeyCalculator::_build_number(uint8_t code) {
     }
     return false;
   }
-  if(KEYCAL_NUM_BUFFER_SIZE <= _num_buffer_index - 1) return false;
+  if(KEYCAL_NUM_BUFFER_SIZE - 1 <= _num_buffer_index) return false;   // Leave room for the terminator
   // One decimal point per number
   if('.' == code) {
     if(nullptr != strchr(_num_buffer, '.')) {
@@ -498,25 +768,11 @@ bool KeyCalculator::_build_number(uint8_t code) {
   }
   _num_buffer[_num_buffer_index++] = code;
   _num_buffer[_num_buffer_index]   = '\0';
-  if(DEBUG_KEYCALC_MEMORY) Serial.printf("_build_number: %s\n", _num_buffer);
+  if(DEBUG_KEYCALC_MEMORY) Serial.printf("_key_number: %s\n", _num_buffer);
   return true;
 }
 
 
-////////////////////////////////////////////////////////////////////////////////
-//
-//  Convert the buffer to a String and optionally clear it
-//
-String KeyCalculator::_convert_num_buffer(bool clear) {
-  String str(_num_buffer);
-  if(clear) {
-    _num_buffer_index = 0;
-    _num_buffer[0]    = '\0';
-  }
-  return str;
-}
-
-
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  Return the number of OPEN_PAREN operators on the operator_stack,
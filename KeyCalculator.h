@@ -10,9 +10,20 @@
 // In the year of the plague
 
 #include "TextCalculator.h"
+#include "UndoHistory.h"
+#include "TextBuilder.h"
 
-#define KEYCAL_NUM_BUFFER_SIZE  64
-#define KEYCAL_MEM_BUFFER_SIZE   8
+#define CHANGE_SIGN_OPERATOR        (uint8_t('`'))
+#define BACKSPACE_OPERATOR          (uint8_t('B'))
+
+#define KEYCAL_NUM_BUFFER_SIZE      64
+#define KEYCAL_MEM_BUFFER_SIZE       8
+#define KEYCAL_MEM_ADDRESS_DIGITS    5  // Digits in the largest memory address, NUM_CALC_MEMORIES - 1
+#define KEYCAL_DISPLAY_SIZE         (CALC_STACK_DEPTH * NUMBER_BUFFER_SIZE + 4)   // Holds any get_display() string (the value stack is the longest)
+#define KEYCAL_PREVIEW_SIZE         (NUMBER_BUFFER_SIZE + 2)  // Holds the dispPreview string: "= " and a value
+#ifndef KEYCAL_UNDO_DEPTH
+#define KEYCAL_UNDO_DEPTH           16  // States kept for undo and redo, including the current one
+#endif
 
 // KeyCalculator states, changed by key inputs, accessible by get_state()
 //
@@ -24,6 +35,26 @@ enum CalcState {
   calcEnteringMemory,   // M - A memory command is being entered. Expect M=A+-*/%
   calcError             // X - The calculator is in Global Error mode. Only AC accepted.
 };
+#define KEYCAL_STATES       6
+
+// Every key code falls into one class, which with the CalcState selects the key's action (see _transitions)
+//
+enum KeyClass {
+  keyDigit,             // 0-9
+  keyPoint,             // .
+  keyBackspace,         // B
+  keyOpenParen,         // (
+  keyCloseParen,        // )
+  keyEvaluate,          // =
+  keyArithmetic,        // + - * /    These chain: 2 + = = gives 4, 6
+  keyPercent,           // %          Evaluated at once, and a memory operation
+  keyFunction,          // s r        Square and square root, evaluated at once
+  keyChangeSign,        // `          The +/- key
+  keyClear,             // A          AC
+  keyMemory,            // M
+  keyOther              // Anything else is ignored
+};
+#define KEYCAL_KEY_CLASSES  13
 
 // get_display() selectors
 //
@@ -32,7 +63,8 @@ enum CalcDisplay {
   dispMemoryID,         // Get the current _mem_buffer, augmented. Empty when not in calcEnteringMemory
   dispStatus,           // Get a status display showing open parens and memory usage
   dispOpStack,          // Get a representation of the operator stack
-  dispValStack          // Get a representation of the value stack
+  dispValStack,         // Get a representation of the value stack
+  dispPreview           // What = would give, as "= 12.5", if speculating and = would evaluate something. Else empty
 };
 
 
@@ -45,8 +77,37 @@ class KeyCalculator : public TextCalculator {
     void        cancel_input();                                   // When inputing a number or memory, dump buffer and return to calcReadyForAny state
     CalcState   get_state();                                      // Get the current state of the KeyCalculator
     String      get_display(CalcDisplay id);                      // Return the specified string representation
+    size_t      get_display(CalcDisplay id, char* buffer, size_t size);  // Write it into buffer without allocating, cut short if needed. Return the length
+    bool        undo();                                           // Return to the state before the last key (or checkpoint). False if there's no more history
+    bool        redo();                                           // Reverse an undo. False if there's nothing to redo
+    void        checkpoint();                                     // Record the current state for undo. key() does this; call it after changing state in other ways
+    uint32_t    stack_segments_rendered() const { return _stack_rendered; }  // Values formatted for dispValStack so far
+    uint32_t    stack_segments_reused() const   { return _stack_reused; }    // Values whose dispValStack text was reused, unchanged since the last one
+    void        set_speculation(bool on)        { _speculating = on; }       // If on, speculate() works out = ahead of time, for dispPreview and an instant =
+    bool        speculation() const             { return _speculating; }
+    bool        speculate();                                      // Evaluate copies of the stacks as = would, unless they're unchanged. True if = would succeed
+    uint32_t    speculations_run() const        { return _speculations_run; }   // Copies of the stacks evaluated
+    uint32_t    speculations_used() const       { return _speculations_used; }  // = keys that took the speculated result
 
   protected:
+    typedef bool (KeyCalculator::*KeyAction)(uint8_t code);      // Handle a key. Return true if it was accepted
+    struct Speculation {                                          // What = would do to the stacks, worked out by speculate()
+      FixedStack<double, CALC_STACK_DEPTH>  values;               // The stacks = would start from
+      FixedStack<Op_ID, CALC_STACK_DEPTH>   operators;
+      FixedStack<double, CALC_STACK_DEPTH>  result;               // The value stack after =, which empties the operator stack
+      bool      valid = false;                                    // values and operators are set
+      bool      ok    = false;                                    // = would succeed, and result is set
+    };
+    struct Snapshot {                                             // Everything undo() restores
+      MemoryCalculator<double, NUM_CALC_MEMORIES>::State engine;
+      FormulaSheet<double, NUM_CALC_MEMORIES>::State     formulas;
+      char      num_buffer[KEYCAL_NUM_BUFFER_SIZE];
+      char      mem_buffer[KEYCAL_MEM_BUFFER_SIZE];
+      uint8_t   num_buffer_index;
+      uint8_t   mem_buffer_index;
+      uint8_t   clear_press_count;
+      CalcState state;
+    };
     const char* _state_to_name[6]                       = { "calcReadyForAny", "calcReadyForNumber", "calcReadyForOperator", "calcEnteringNumber", "calcEnteringMemory", "calcError" };
     char        _num_buffer[KEYCAL_NUM_BUFFER_SIZE]     = {0};    // Buffer for building a numeric entry
     char        _mem_buffer[KEYCAL_MEM_BUFFER_SIZE]     = {0};    // Buffer for building a memory address
@@ -54,13 +115,62 @@ class KeyCalculator : public TextCalculator {
     uint8_t     _mem_buffer_index                       =  0;     // Current position in mem_buffer
     uint8_t     _clear_press_count                      =  0;     // The number of times in a row the AC key has been pressed.
     CalcState   _state;                                           // Current state of the KeyCalculator
+    UndoHistory<Snapshot, KEYCAL_UNDO_DEPTH>  _history;           // Snapshots after each key, for undo() and redo()
+    char        _stack_text[KEYCAL_DISPLAY_SIZE]        = "[ ";   // dispValStack as last built, without the closing ]
+    uint16_t    _stack_ends[CALC_STACK_DEPTH];                    // Where each value's text ends in _stack_text
+    uint64_t    _stack_bits[CALC_STACK_DEPTH];                    // The values _stack_text shows, bit for bit
+    uint8_t     _stack_shown                            =  0;     // Number of values _stack_text shows
+    uint8_t     _stack_precision                        =  0;     // The _precision _stack_text was built with
+    uint32_t    _stack_rendered                         =  0;
+    uint32_t    _stack_reused                           =  0;
+    bool        _speculating                            = false;  // See set_speculation()
+    Speculation _speculation;
+    CoreCalculator<double> _speculator;                           // Evaluates the copies, so the engine's stacks and error state are untouched
+    uint32_t    _speculations_run                       =  0;
+    uint32_t    _speculations_used                      =  0;
 
+    bool      _handle_key(uint8_t code);                          // key(), without the checkpoint
+    bool      _key_reject(uint8_t code);                          // In calcError, only AC is accepted
+    bool      _key_recover(uint8_t code);                         // AC in calcError: clear the error
+    bool      _key_open_paren(uint8_t code);                      // Open a paren where a number is expected
+    bool      _key_operator(uint8_t code);                        // Commit any number being entered, then enter the operator
+    bool      _key_evaluate(uint8_t code);                        // = where it evaluates the stacks: take the speculated result if it's for these stacks
+    bool      _key_replace_operator(uint8_t code);                // Where a number is expected, an operator replaces the pending one
+    bool      _key_chain(uint8_t code);                           // Where a number is expected, = repeats the pending + - * or / (chaining mode)
+    bool      _key_change_sign(uint8_t code);                     // Commit any number being entered, then change the sign of the value
+    bool      _key_clear(uint8_t code);                           // Commit any number being entered, then AC
+    bool      _key_memory(uint8_t code);                          // Commit any number being entered, then start a memory command
+    bool      _key_ignore(uint8_t code);                          // Commit any number being entered, and reject the key
+    bool      _key_memory_digit(uint8_t code);                    // In calcEnteringMemory: add a digit to the address
+    bool      _key_memory_backspace(uint8_t code);                // In calcEnteringMemory: remove a digit from the address
+    bool      _key_memory_recall(uint8_t code);                   // In calcEnteringMemory: M recalls the memory
+    bool      _key_memory_operation(uint8_t code);                // In calcEnteringMemory: perform a memory operation (=A+-*/%)
+    bool      _key_memory_cancel(uint8_t code);                   // In calcEnteringMemory: . cancels the command
+    bool      _key_memory_bail(uint8_t code);                     // In calcEnteringMemory: any other key cancels it, and is rejected
+    void      _end_memory_command();                              // Clear the memory address and return to calcReadyForAny
+    void      _restore(const Snapshot& snapshot);                 // Return to a snapshot
     void      _change_state(CalcState state);                     // Always call this function to change _state; don't do it directly
     bool      _handle_clear(bool all_clear = false);              // Handle the AC key, with 1st & 2nd press actions
     bool      _handle_change_sign();                              // Handle +/- key, which is an input action, not a command
-    bool      _handle_memory_command(uint8_t code);               // Handle the rather complicated memory commands
-    String    _build_status_display();                            // Build the (complicated) dispStatus string
-    bool      _build_number(uint8_t code);                        // Build the display value from keystrokes
-    String    _convert_num_buffer(bool clear);                    // Convert the buffer to a String and clear it
+    void      _build_status_display(TextBuilder& str);            // Build the (complicated) dispStatus string
+    void      _build_stack_display(TextBuilder& str);             // Build the dispValStack string, reusing the text of values unchanged since last time
+    void      _add_number(TextBuilder& str, double val);          // Add val as double_to_string() would, from the format cache
+    bool      _stacks_for_evaluate(FixedStack<double, CALC_STACK_DEPTH>& values, FixedStack<Op_ID, CALC_STACK_DEPTH>& operators);  // The stacks = would evaluate now
+    Mem_Index _mem_address();                                     // Convert _mem_buffer to a memory address
+    bool      _key_number(uint8_t code);                          // Build the display value from keystrokes
     uint8_t   _count_open_parens();                               // Return the number of OPEN_PAREN operators on the operator_stack
+
+    // The action for each key class in each state: rows are CalcState, columns are KeyClass.
+    // The error and double AC checks in _handle_key() apply in every state, so they come before the table.
+#define KEYCAL_ACTION(name)   &KeyCalculator::_key_##name
+    static constexpr KeyAction _transitions[KEYCAL_STATES][KEYCAL_KEY_CLASSES] = {
+      // Digit                        Point                         Backspace                        OpenParen                   CloseParen                  Evaluate                         Arithmetic                       Percent                          Function                         ChangeSign                  Clear                            Memory                        Other
+      { KEYCAL_ACTION(number),       KEYCAL_ACTION(number),        KEYCAL_ACTION(number),           KEYCAL_ACTION(open_paren),  KEYCAL_ACTION(operator),    KEYCAL_ACTION(evaluate),         KEYCAL_ACTION(operator),         KEYCAL_ACTION(operator),         KEYCAL_ACTION(operator),         KEYCAL_ACTION(change_sign), KEYCAL_ACTION(clear),            KEYCAL_ACTION(memory),        KEYCAL_ACTION(ignore)       },  // calcReadyForAny
+      { KEYCAL_ACTION(number),       KEYCAL_ACTION(number),        KEYCAL_ACTION(number),           KEYCAL_ACTION(open_paren),  KEYCAL_ACTION(operator),    KEYCAL_ACTION(chain),            KEYCAL_ACTION(replace_operator), KEYCAL_ACTION(replace_operator), KEYCAL_ACTION(replace_operator), KEYCAL_ACTION(change_sign), KEYCAL_ACTION(clear),            KEYCAL_ACTION(memory),        KEYCAL_ACTION(ignore)       },  // calcReadyForNumber
+      { KEYCAL_ACTION(ignore),       KEYCAL_ACTION(ignore),        KEYCAL_ACTION(ignore),           KEYCAL_ACTION(operator),    KEYCAL_ACTION(operator),    KEYCAL_ACTION(evaluate),         KEYCAL_ACTION(operator),         KEYCAL_ACTION(operator),         KEYCAL_ACTION(operator),         KEYCAL_ACTION(change_sign), KEYCAL_ACTION(clear),            KEYCAL_ACTION(memory),        KEYCAL_ACTION(ignore)       },  // calcReadyForOperator
+      { KEYCAL_ACTION(number),       KEYCAL_ACTION(number),        KEYCAL_ACTION(number),           KEYCAL_ACTION(open_paren),  KEYCAL_ACTION(operator),    KEYCAL_ACTION(evaluate),         KEYCAL_ACTION(operator),         KEYCAL_ACTION(operator),         KEYCAL_ACTION(operator),         KEYCAL_ACTION(change_sign), KEYCAL_ACTION(clear),            KEYCAL_ACTION(memory),        KEYCAL_ACTION(ignore)       },  // calcEnteringNumber
+      { KEYCAL_ACTION(memory_digit), KEYCAL_ACTION(memory_cancel), KEYCAL_ACTION(memory_backspace), KEYCAL_ACTION(memory_bail), KEYCAL_ACTION(memory_bail), KEYCAL_ACTION(memory_operation), KEYCAL_ACTION(memory_operation), KEYCAL_ACTION(memory_operation), KEYCAL_ACTION(memory_bail),      KEYCAL_ACTION(memory_bail), KEYCAL_ACTION(memory_operation), KEYCAL_ACTION(memory_recall), KEYCAL_ACTION(memory_bail)  },  // calcEnteringMemory
+      { KEYCAL_ACTION(reject),       KEYCAL_ACTION(reject),        KEYCAL_ACTION(reject),           KEYCAL_ACTION(reject),      KEYCAL_ACTION(reject),      KEYCAL_ACTION(reject),           KEYCAL_ACTION(reject),           KEYCAL_ACTION(reject),           KEYCAL_ACTION(reject),           KEYCAL_ACTION(reject),      KEYCAL_ACTION(recover),          KEYCAL_ACTION(reject),        KEYCAL_ACTION(reject)       }   // calcError
+    };
+#undef KEYCAL_ACTION
 };
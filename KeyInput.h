@@ -0,0 +1,85 @@
+#pragma once
+
+// Keyboard input that doesn't wait for loop() to poll it.
+// A KeyTransport is how keys are read from a keyboard: on the device the FACES keyboard over I2C, with its
+// data ready line; on a host a mock (see host/input.cpp). When the data ready line falls, pump_keys() reads every
+// key the keyboard has into a KeyRing, stamped with the time it was pressed as near as that's known, and loop()
+// takes them out in order.
+// On the device the interrupt only wakes an input task, which does the reading: I2C can't be used in an interrupt.
+// The ring is lock-free for one producer (the input task) and one consumer (loop()). A key that arrives when it
+// is full is dropped and counted.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <Arduino.h>
+#include <atomic>
+
+
+#define KEY_RING_SIZE         32                                // Keys that can wait for loop() (a power of two)
+
+
+struct KeyEvent {
+  char        key;
+  uint32_t    time;                                             // micros() when the key was pressed: its interrupt, or when it was read
+};
+
+
+class KeyTransport {
+  public:
+    virtual ~KeyTransport() {}
+    virtual bool  key_ready()             = 0;                  // True if the data ready line says a key is waiting
+    virtual bool  read_key(char& key)     = 0;                  // Read the waiting key. Return false if there wasn't one
+};
+
+
+class KeyRing {
+  public:
+    bool      push(char key, uint32_t time);                    // Producer: queue a key. Return false, and count it dropped, if the ring is full
+    bool      pop(KeyEvent& event);                             // Consumer: take the oldest key. Return false if there is none
+    bool      empty() const           { return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_relaxed); }
+    uint32_t  received() const        { return _head.load(std::memory_order_relaxed) + _dropped.load(std::memory_order_relaxed); }
+    uint32_t  dropped() const         { return _dropped.load(std::memory_order_relaxed); }
+  protected:
+    KeyEvent              _events[KEY_RING_SIZE];
+    std::atomic<uint32_t> _head{0};                             // Count of keys queued; only the producer writes it
+    std::atomic<uint32_t> _tail{0};                             // Count of keys taken; only the consumer writes it
+    std::atomic<uint32_t> _dropped{0};                          // Only the producer writes it
+};
+
+
+inline bool KeyRing::push(char key, uint32_t time) {
+  uint32_t head = _head.load(std::memory_order_relaxed);
+  if(KEY_RING_SIZE <= head - _tail.load(std::memory_order_acquire)) {
+    _dropped.store(_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return false;
+  }
+  _events[head % KEY_RING_SIZE] = { key, time };
+  _head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+
+inline bool KeyRing::pop(KeyEvent& event) {
+  uint32_t tail = _tail.load(std::memory_order_relaxed);
+  if(_head.load(std::memory_order_acquire) == tail) return false;
+  event = _events[tail % KEY_RING_SIZE];
+  _tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+
+// Read every key the keyboard has waiting into the ring. Return how many were read.
+// pressed is when the interrupt that found them fired; the first key is stamped with it, and the rest with when
+// they were read. 0 stamps them all with when they were read.
+//
+inline uint16_t pump_keys(KeyTransport& transport, KeyRing& ring, uint32_t pressed = 0) {
+  uint16_t  count = 0;
+  char      key;
+  while(transport.key_ready() && transport.read_key(key)) {
+    ring.push(key, (pressed && !count) ? pressed : micros());
+    count++;
+  }
+  return count;
+}
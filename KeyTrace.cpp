@@ -0,0 +1,171 @@
+#include "BinaryDump.h"
+#include "KeyTrace.h"
+
+static const CalcDisplay trace_displays[] = { dispValue, dispMemoryID, dispStatus, dispOpStack, dispValStack };
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  KeyTraceWriter
+//
+KeyTraceWriter::KeyTraceWriter() {
+  clear();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Start a new, empty trace. A trace started mid_session is marked, since a replay starts from a fresh
+//  calculator and can't reach the displays recorded.
+//
+void KeyTraceWriter::clear(bool mid_session) {
+  _buffer[0]  = 'K';
+  _buffer[1]  = 'T';
+  _buffer[2]  = KEYTRACE_VERSION;
+  _buffer[3]  = mid_session ? KEYTRACE_MID_SESSION : 0;
+  _size       = KEYTRACE_HEADER_SIZE;
+  _last       = 0;
+  _started    = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Record a key passed to KeyCalculator::key()
+//
+bool KeyTraceWriter::key(uint8_t code, uint32_t start, uint32_t duration) {
+  if(!_begin(traceKey, start, duration, 1)) return false;
+  _buffer[_size++] = code;
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Record a button action passed to do_button_action()
+//
+bool KeyTraceWriter::button(const char* name, uint32_t start, uint32_t duration) {
+  size_t length = strlen(name);
+  if(!_begin(traceButton, start, duration, 1 + length)) return false;
+  return _text(name, length);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Record every display string, so that a replay can check that it ends up in the same place.
+//  Either all of them are recorded, or none.
+//
+bool KeyTraceWriter::display(KeyCalculator& calc, uint32_t now) {
+  if(truncated()) return false;
+  String  texts[sizeof(trace_displays) / sizeof(trace_displays[0])];
+  size_t  needed = 0;
+  for(size_t i = 0; i < sizeof(trace_displays) / sizeof(trace_displays[0]); i++) {
+    texts[i]  = calc.get_display(trace_displays[i]);
+    needed   += 1 + 2 * VARINT_MAX_SIZE + 2 + texts[i].length();
+  }
+  if(KEYTRACE_BUFFER_SIZE - _size < needed) {
+    _buffer[3] |= KEYTRACE_TRUNCATED;
+    return false;
+  }
+  for(size_t i = 0; i < sizeof(trace_displays) / sizeof(trace_displays[0]); i++) {
+    _begin(traceDisplay, now, 0, 2 + texts[i].length());
+    _buffer[_size++] = trace_displays[i];
+    _text(texts[i].c_str(), texts[i].length());
+  }
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Write the trace to Serial as lines of hex between BEGIN and END markers.
+//  Capture the Serial output to a file and give it to host/replay.
+//
+void KeyTraceWriter::dump() {
+  dump_hex("KEYTRACE", _buffer, _size);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Write the type and times of a record, if the record (payload bytes after the times) fits.
+//  Once one doesn't fit, mark the trace truncated and record nothing more, so a replay
+//  never skips a record in the middle.
+//
+bool KeyTraceWriter::_begin(KeyTraceType type, uint32_t start, uint32_t duration, size_t payload) {
+  if((_buffer[3] & KEYTRACE_TRUNCATED) || KEYTRACE_BUFFER_SIZE - _size < 1 + 2 * VARINT_MAX_SIZE + payload) {
+    _buffer[3] |= KEYTRACE_TRUNCATED;
+    return false;
+  }
+  if(!_started) {
+    _last     = start;
+    _started  = true;
+  }
+  _buffer[_size++] = type;
+  _size = varint_put(_buffer, _size, start - _last);
+  _size = varint_put(_buffer, _size, duration);
+  _last = start;
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Write a length byte and the text; text over 255 characters is cut short
+//
+bool KeyTraceWriter::_text(const char* text, size_t length) {
+  if(255 < length) length = 255;
+  _buffer[_size++] = length;
+  memcpy(_buffer + _size, text, length);
+  _size += length;
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  KeyTraceReader
+//
+KeyTraceReader::KeyTraceReader(const uint8_t* data, size_t size) : _data(data), _size(size), _position(KEYTRACE_HEADER_SIZE) {
+  _valid = KEYTRACE_HEADER_SIZE <= size && 'K' == data[0] && 'T' == data[1] && KEYTRACE_VERSION == data[2];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Read the next record into event. Return false at the end of the trace, or at a record that
+//  is malformed or runs past the end (in which case corrupt() is true).
+//
+bool KeyTraceReader::next(KeyTraceEvent& event) {
+  if(!_valid || _corrupt || _size <= _position) return false;
+  uint32_t delta;
+  event.type    = KeyTraceType(_data[_position++]);
+  event.text    = nullptr;
+  event.length  = 0;
+  if(!varint_get(_data, _size, _position, delta) || !varint_get(_data, _size, _position, event.duration) || _size <= _position) {
+    _corrupt = true;
+    return false;
+  }
+  _time      += delta;
+  event.time  = _time;
+  switch(event.type) {
+    case traceKey:
+      event.code = _data[_position++];
+      return true;
+    case traceDisplay:
+      event.code = _data[_position++];
+      if(_size <= _position) break;
+      // The text follows, as for a button
+    case traceButton:
+      event.length  = _data[_position++];
+      event.text    = reinterpret_cast<const char*>(_data + _position);
+      if(_size - _position < event.length) break;
+      _position    += event.length;
+      return true;
+    default:
+      break;
+  }
+  _corrupt = true;
+  return false;
+}
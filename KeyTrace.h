@@ -0,0 +1,84 @@
+#pragma once
+
+// A compact binary trace of what the user did, so that field problems (slowdowns in particular)
+// can be reproduced and measured on a host. See host/replay.cpp.
+// The KeyTraceWriter records each code given to KeyCalculator::key(), each calculator button action
+// (see button_actions.h), and from time to time every get_display() string, which a replay checks
+// against its own. It records into a fixed buffer; when that is full, recording stops and the trace
+// is marked truncated. The settings menu's memory stack operations are recorded as button actions; its other
+// settings don't change the calculator's results. A trace started after the calculator was used (after a dump)
+// is marked mid-session: a replay from a fresh calculator reports its timings but can't check its displays.
+//
+// Format: a 4 byte header ('K', 'T', version, flags), followed by records of:
+//   type (1 byte) | time since the previous record's start (varint, us) | time taken (varint, us) | payload
+// where the payload is the key code for traceKey, a length byte and the name for traceButton, and the
+// CalcDisplay selector, a length byte and the text for traceDisplay. Varints are as in BinaryDump.h.
+// A typical key takes 4 bytes.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include "KeyCalculator.h"
+
+
+#define KEYTRACE_BUFFER_SIZE    8192                            // Bytes of trace kept by a KeyTraceWriter
+#define KEYTRACE_HEADER_SIZE    4
+#define KEYTRACE_VERSION        1
+#define KEYTRACE_TRUNCATED      0x01                            // Header flag: the buffer filled, and later records were dropped
+#define KEYTRACE_MID_SESSION    0x02                            // Header flag: recording started on a calculator already in use, not at boot
+
+
+enum KeyTraceType {
+  traceKey      = 1,                                            // A code passed to KeyCalculator::key()
+  traceButton,                                                  // A button action passed to do_button_action()
+  traceDisplay                                                  // A get_display() string, to check a replay against
+};
+
+struct KeyTraceEvent {
+  KeyTraceType  type;
+  uint32_t      time;                                           // Start, in us since the first record started
+  uint32_t      duration;                                       // Time the device took to handle it, in us
+  uint8_t       code;                                           // traceKey: the key. traceDisplay: the CalcDisplay selector
+  const char*   text;                                           // traceButton: the name. traceDisplay: the string. Not terminated
+  uint8_t       length;                                         // Length of text
+};
+
+
+class KeyTraceWriter {
+  public:
+    KeyTraceWriter();
+    bool            key(uint8_t code, uint32_t start, uint32_t duration);       // Record a key. start and duration are from micros()
+    bool            button(const char* name, uint32_t start, uint32_t duration);  // Record a button action
+    bool            display(KeyCalculator& calc, uint32_t now); // Record every get_display() string
+    void            clear(bool mid_session = false);            // Start a new trace; mid_session if the calculator isn't fresh from boot
+    void            dump();                                     // Write the trace to Serial as hex, for host/replay
+    const uint8_t*  data() const      { return _buffer; }
+    size_t          size() const      { return _size; }
+    bool            truncated() const { return _buffer[3] & KEYTRACE_TRUNCATED; }
+  protected:
+    uint8_t         _buffer[KEYTRACE_BUFFER_SIZE];
+    size_t          _size;                                      // Bytes used in _buffer
+    uint32_t        _last;                                      // Start of the previous record
+    bool            _started;                                   // False until the first record, whose time is 0
+    bool            _begin(KeyTraceType type, uint32_t start, uint32_t duration, size_t payload);  // Write a record's header if the whole record fits
+    bool            _text(const char* text, size_t length);     // Write a length byte and text (cut to 255 characters)
+};
+
+
+class KeyTraceReader {
+  public:
+    KeyTraceReader(const uint8_t* data, size_t size);
+    bool            valid() const     { return _valid; }        // The header is good
+    bool            truncated() const { return _valid && (_data[3] & KEYTRACE_TRUNCATED); }
+    bool            mid_session() const { return _valid && (_data[3] & KEYTRACE_MID_SESSION); }  // A fresh calculator can't be expected to match its displays
+    bool            corrupt() const   { return _corrupt; }      // next() stopped at a bad record rather than the end
+    bool            next(KeyTraceEvent& event);                 // Read the next record. Return false at the end or at a bad record
+  protected:
+    const uint8_t*  _data;
+    size_t          _size;
+    size_t          _position;
+    uint32_t        _time     = 0;
+    bool            _valid;
+    bool            _corrupt  = false;
+};
@@ -0,0 +1,155 @@
+#include <Arduino.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "BinaryDump.h"
+#include "LatencyProbe.h"
+
+#define LATENCY_DUMP_SIZE     (LATENCY_HEADER_SIZE + LATENCY_STAGES * (1 + LATENCY_BUCKETS) * VARINT_MAX_SIZE + \
+                               VARINT_MAX_SIZE + LATENCY_RING_SIZE * (1 + 2 * VARINT_MAX_SIZE))
+
+static const char* stage_names[LATENCY_STAGES] = {
+  "read_key", "key wait", "key()", "snapshot", "display_value", "push", "display_status",
+  "display_memory", "set_buttons", "display_stacks", "end_frame", "ez.yield", "key to screen"
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Record one run of a stage. Only one thread may record each stage.
+//
+void LatencyProbe::record(LatencyStage stage, uint32_t start, uint32_t end) {
+  uint32_t  duration  = end - start;
+  uint8_t   bucket    = 0;
+  while(bucket < LATENCY_BUCKETS - 1 && (uint32_t(2) << bucket) <= duration) bucket++;
+  _histograms[stage][bucket]++;
+  if(_max[stage] < duration) _max[stage] = duration;
+  uint32_t slot = _head.fetch_add(1, std::memory_order_relaxed) % LATENCY_RING_SIZE;
+  _ring[slot] = { start, duration, stage };
+}
+
+
+void LatencyProbe::clear() {
+  memset(_histograms, 0, sizeof(_histograms));
+  memset(_max, 0, sizeof(_max));
+  _head = 0;
+}
+
+
+uint32_t LatencyProbe::count(LatencyStage stage) const {
+  uint32_t total = 0;
+  for(uint8_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) total += _histograms[stage][bucket];
+  return total;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Nearest rank in the histogram. The answer is only as fine as a bucket: a power of two.
+//  0 if the stage has no samples.
+//
+uint32_t LatencyProbe::percentile(LatencyStage stage, double fraction) const {
+  uint32_t total = count(stage);
+  if(!total) return 0;
+  uint32_t rank = uint32_t(fraction * total + 0.999999);
+  if(!rank) rank = 1;
+  uint32_t seen = 0;
+  uint8_t  bucket = 0;
+  for(; bucket < LATENCY_BUCKETS - 1; bucket++) {
+    seen += _histograms[stage][bucket];
+    if(rank <= seen) break;
+  }
+  if(LATENCY_BUCKETS - 1 == bucket) return _max[stage];         // The last bucket has no upper bound
+  return std::min(uint32_t(2) << bucket, _max[stage]);
+}
+
+
+bool LatencyProbe::sample(uint32_t index, LatencySample& sample) const {
+  uint32_t head = recorded();
+  uint32_t kept = std::min(head, uint32_t(LATENCY_RING_SIZE));
+  if(kept <= index) return false;
+  sample = _ring[(head - kept + index) % LATENCY_RING_SIZE];
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Write the dump format (see LatencyProbe.h) into buffer
+//
+size_t LatencyProbe::encode(uint8_t* buffer, size_t size) const {
+  if(size < LATENCY_DUMP_SIZE) return 0;
+  size_t position = 0;
+  buffer[position++] = 'L';
+  buffer[position++] = 'P';
+  buffer[position++] = LATENCY_VERSION;
+  buffer[position++] = LATENCY_STAGES;
+  buffer[position++] = LATENCY_BUCKETS;
+  for(uint8_t stage = 0; stage < LATENCY_STAGES; stage++) {
+    position = varint_put(buffer, position, _max[stage]);
+    for(uint8_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) position = varint_put(buffer, position, _histograms[stage][bucket]);
+  }
+  uint32_t      kept  = std::min(recorded(), uint32_t(LATENCY_RING_SIZE));
+  uint32_t      last  = 0;
+  LatencySample entry;
+  position = varint_put(buffer, position, kept);
+  for(uint32_t i = 0; i < kept && sample(i, entry); i++) {
+    buffer[position++] = entry.stage;
+    position  = varint_put(buffer, position, zigzag(int32_t(entry.start - last)));
+    position  = varint_put(buffer, position, entry.duration);
+    last      = entry.start;
+  }
+  return position;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Load a probe from its encoding, as host/replay does with a dump. On failure the probe is left clear.
+//
+bool LatencyProbe::decode(const uint8_t* data, size_t size) {
+  clear();
+  if(size < LATENCY_HEADER_SIZE || 'L' != data[0] || 'P' != data[1] || LATENCY_VERSION != data[2] ||
+     LATENCY_STAGES != data[3] || LATENCY_BUCKETS != data[4]) return false;
+  size_t position = LATENCY_HEADER_SIZE;
+  bool   ok       = true;
+  for(uint8_t stage = 0; ok && stage < LATENCY_STAGES; stage++) {
+    ok = varint_get(data, size, position, _max[stage]);
+    for(uint8_t bucket = 0; ok && bucket < LATENCY_BUCKETS; bucket++) ok = varint_get(data, size, position, _histograms[stage][bucket]);
+  }
+  uint32_t kept = 0;
+  uint32_t last = 0;
+  ok = ok && varint_get(data, size, position, kept) && kept <= LATENCY_RING_SIZE;
+  for(uint32_t i = 0; ok && i < kept; i++) {
+    uint32_t delta = 0;
+    ok = position < size && data[position] < LATENCY_STAGES;
+    if(!ok) break;
+    _ring[i].stage = LatencyStage(data[position++]);
+    ok = varint_get(data, size, position, delta) && varint_get(data, size, position, _ring[i].duration);
+    last           += unzigzag(delta);
+    _ring[i].start  = last;
+  }
+  if(!ok || position != size) {
+    clear();
+    return false;
+  }
+  _head = kept;
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Write the encoding to Serial as lines of hex between BEGIN and END markers.
+//  Capture the Serial output to a file and give it to host/replay.
+//
+void LatencyProbe::dump() const {
+  std::vector<uint8_t>  buffer(LATENCY_DUMP_SIZE);
+  size_t                size = encode(buffer.data(), buffer.size());
+  dump_hex("LATENCY", buffer.data(), size);
+}
+
+
+const char* LatencyProbe::stage_name(LatencyStage stage) {
+  return stage < LATENCY_STAGES ? stage_names[stage] : "?";
+}
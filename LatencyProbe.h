@@ -0,0 +1,76 @@
+#pragma once
+
+// Where the time goes between a key being pressed and the screen showing it.
+// Each stage of that path is timed with micros() by the code that runs it, and recorded here: into a ring of the
+// latest LATENCY_RING_SIZE samples, and into a histogram per stage of every sample since clear(), in powers of two
+// of us. The settings menu shows each stage's percentiles from its histogram, and dump() sends everything to
+// Serial for host/replay.
+// Stages are recorded on three threads (the input task, loop() and the render task), but each stage on only one,
+// so a histogram has a single writer; slots in the ring are claimed with an atomic count. A dump or a page of
+// percentiles taken while samples are being recorded can catch one of them half written.
+//
+// Dump format: a 5 byte header ('L', 'P', version, LATENCY_STAGES, LATENCY_BUCKETS); for each stage, its max
+// then the count in each bucket; then the count of samples and the samples, oldest first:
+//   stage (1 byte) | start less the previous sample's start (zigzag varint, us) | duration (varint, us)
+// The first sample's start is relative to 0. Varints and zigzag are as in BinaryDump.h.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+
+#define LATENCY_RING_SIZE     256                               // Samples kept for dump() (a power of two)
+#define LATENCY_BUCKETS       16                                // Bucket b counts [2^b, 2^(b+1)) us; 0 includes 0 us, the last is open
+#define LATENCY_HEADER_SIZE   5
+#define LATENCY_VERSION       1
+
+
+enum LatencyStage : uint8_t {
+  stageReadKey,                                                 // Keyboard interrupt to its keys being read into the key ring (read_key())
+  stageKeyWait,                                                 // Key pressed to loop() taking it from the key ring
+  stageKey,                                                     // KeyCalculator::key()
+  stageSnapshot,                                                // take_snapshot(), with the speculative = for the preview
+  stageValue,                                                   // display_value(), including the push
+  stagePush,                                                    // Pushing the value sprite, or its glyphs from the atlas, to the LCD
+  stageStatus,                                                  // display_status()
+  stageMemory,                                                  // display_memory_storage()
+  stageButtons,                                                 // set_buttons()
+  stageStacks,                                                  // display_stacks()
+  stageEndFrame,                                                // The screen's end_frame(): ez.yield() when there's no render task
+  stageYield,                                                   // ez.yield() in loop(), with the render task
+  stageKeyToScreen,                                             // The oldest key a frame shows being pressed, to the frame drawn
+  LATENCY_STAGES
+};
+
+struct LatencySample {
+  uint32_t      start;                                          // micros()
+  uint32_t      duration;                                       // us
+  LatencyStage  stage;
+};
+
+
+class LatencyProbe {
+  public:
+    LatencyProbe()                      { clear(); }
+    void        record(LatencyStage stage, uint32_t start, uint32_t end);   // stage ran from start to end (micros())
+    void        clear();
+    uint32_t    count(LatencyStage stage) const;                // Samples of stage since clear()
+    uint32_t    bucket(LatencyStage stage, uint8_t bucket) const  { return _histograms[stage][bucket]; }
+    uint32_t    max(LatencyStage stage) const                   { return _max[stage]; }
+    uint32_t    percentile(LatencyStage stage, double fraction) const;  // Upper bound of the bucket holding it (at most max), us
+    uint32_t    recorded() const        { return _head.load(std::memory_order_relaxed); }  // Samples since clear(); the ring keeps the latest
+    bool        sample(uint32_t index, LatencySample& sample) const;  // The index'th oldest sample still in the ring
+    size_t      encode(uint8_t* buffer, size_t size) const;     // Write the dump format. Return its length, or 0 if it doesn't fit
+    bool        decode(const uint8_t* data, size_t size);       // Replace everything with an encoded probe. Return false if it's bad
+    void        dump() const;                                   // Write the encoding to Serial as hex, for host/replay
+    static const char*  stage_name(LatencyStage stage);
+  protected:
+    LatencySample         _ring[LATENCY_RING_SIZE];
+    std::atomic<uint32_t> _head{0};                             // Samples recorded; record() claims _ring[_head % LATENCY_RING_SIZE]
+    uint32_t              _histograms[LATENCY_STAGES][LATENCY_BUCKETS];
+    uint32_t              _max[LATENCY_STAGES];
+};
@@ -0,0 +1,106 @@
+#include "M5Surface.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  M5GlyphAtlas
+//
+M5GlyphAtlas::M5GlyphAtlas(TFT_eSPI& tft, const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg) :
+    GlyphAtlas(glyphs, tft.fontHeight(font)) {
+  for(int i = 0; _glyphs[i]; i++) {
+    char text[2] = { _glyphs[i], '\0' };
+    _widths[i]   = tft.textWidth(text, font);
+    if(!_widths[i]) continue;
+    _sprites[i]  = new TFT_eSprite(&tft);
+    if(!_sprites[i]->createSprite(_widths[i], _height)) {
+      _ok = false;
+      return;
+    }
+    _sprites[i]->fillSprite(bg);
+    _sprites[i]->setTextColor(fg, bg);
+    _sprites[i]->drawString(text, 0, 0, font);
+  }
+}
+
+
+M5GlyphAtlas::~M5GlyphAtlas() {
+  for(TFT_eSprite* sprite : _sprites) {
+    if(!sprite) continue;
+    sprite->deleteSprite();
+    delete sprite;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  M5Surface
+//
+void M5Surface::fill_rect(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t color) {
+  if(0 >= w || 0 >= h) return;
+  _tft.fillRect(x, y, w, h, color);
+  if(!_sprite) _pixels += w * h;
+}
+
+
+int16_t M5Surface::draw_text(const char* text, int32_t x, int32_t y, uint8_t font, SurfaceAlign align, uint16_t fg, uint16_t bg) {
+  static const uint8_t datums[] = { TL_DATUM, TC_DATUM, TR_DATUM };
+  _tft.setTextColor(fg, bg);  // Blank space erases background w/ background color set
+  _tft.setTextDatum(datums[align]);
+  int16_t width = _tft.drawString(text, x, y, font);
+  _tft.setTextDatum(TL_DATUM);
+  if(!_sprite) _pixels += width * _tft.fontHeight(font);
+  return width;
+}
+
+
+void M5Surface::draw_wrapped(const char* text, int32_t x, int32_t y, uint8_t font, uint16_t fg, uint16_t bg) {
+  _tft.setTextFont(font);
+  _tft.setTextColor(fg, bg);
+  _tft.setTextWrap(true);
+  _tft.setCursor(x, y);
+  _tft.print(text);
+  if(!_sprite) _pixels += _tft.textWidth(text, font) * _tft.fontHeight(font);
+}
+
+
+// Only a sprite can be pushed: onto the LCD, which is when its pixels are sent
+//
+void M5Surface::push(int32_t x, int32_t y) {
+  if(!_sprite) return;
+  _sprite->pushSprite(x, y);
+  _pixels += _sprite->width() * _sprite->height();
+}
+
+
+// Glyph sprites can only be pushed to the LCD, so a sprite surface can't have an atlas.
+// Without the memory for every glyph, there's no atlas either.
+//
+GlyphAtlas* M5Surface::make_atlas(const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg) {
+  if(_sprite) return nullptr;
+  M5GlyphAtlas* atlas = new M5GlyphAtlas(_tft, glyphs, font, fg, bg);
+  if(atlas->ok()) return atlas;
+  delete atlas;
+  return nullptr;
+}
+
+
+int16_t M5Surface::draw_glyph(const GlyphAtlas& atlas, char c, int32_t x, int32_t y) {
+  TFT_eSprite* sprite = static_cast<const M5GlyphAtlas&>(atlas).sprite(c);
+  if(!sprite) return 0;
+  sprite->pushSprite(x, y);
+  _pixels += sprite->width() * sprite->height();
+  return sprite->width();
+}
+
+
+void M5Surface::show_buttons(const char* buttons) {
+  ez.buttons.show(buttons);
+  _pixels += _tft.width() * ez.theme->button_height;
+}
+
+
+void M5Surface::show_header(const char* title) {
+  ez.header.show(title);
+  _pixels += _tft.width() * ez.theme->header_height;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+// A DisplaySurface on the M5Stack: the LCD itself, or a sprite to be pushed to it. Buttons and the header are M5ez's.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <M5ez.h>
+#include "DisplaySurface.h"
+
+
+// Each glyph is a sprite of its own, pushed to the LCD to draw it
+//
+class M5GlyphAtlas : public GlyphAtlas {
+  public:
+    M5GlyphAtlas(TFT_eSPI& tft, const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg);
+    ~M5GlyphAtlas();
+    bool          ok() const                                    { return _ok; }  // False if a sprite couldn't be made
+    TFT_eSprite*  sprite(char c) const                          { return has(c) ? _sprites[index(c)] : nullptr; }
+  protected:
+    TFT_eSprite*  _sprites[GLYPH_ATLAS_SIZE] = {nullptr};       // nullptr for a glyph the font doesn't have
+    bool          _ok = true;
+};
+
+
+class M5Surface : public DisplaySurface {
+  public:
+    M5Surface(TFT_eSPI& lcd, bool yield = true) : _tft(lcd),    _sprite(nullptr), _yield(yield) {}  // If yield, end_frame() calls ez.yield()
+    M5Surface(TFT_eSprite& sprite)              : _tft(sprite), _sprite(&sprite), _yield(false) {}
+    int16_t   width() override                                  { return _tft.width(); }
+    int16_t   height() override                                 { return _tft.height(); }
+    void      fill_rect(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t color) override;
+    int16_t   text_width(const char* text, uint8_t font) override  { return _tft.textWidth(text, font); }
+    int16_t   font_height(uint8_t font) override                { return _tft.fontHeight(font); }
+    int16_t   draw_text(const char* text, int32_t x, int32_t y, uint8_t font, SurfaceAlign align, uint16_t fg, uint16_t bg) override;
+    void      draw_wrapped(const char* text, int32_t x, int32_t y, uint8_t font, uint16_t fg, uint16_t bg) override;
+    void      push(int32_t x, int32_t y) override;
+    void      show_buttons(const char* buttons) override;
+    void      show_header(const char* title) override;
+    GlyphAtlas* make_atlas(const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg) override;
+    int16_t   draw_glyph(const GlyphAtlas& atlas, char c, int32_t x, int32_t y) override;
+    void      end_frame() override                              { if(_yield) ez.yield(); }
+  protected:
+    TFT_eSPI&     _tft;
+    TFT_eSprite*  _sprite;                                      // Set if this surface is a sprite
+    bool          _yield;
+};
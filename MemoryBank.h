@@ -0,0 +1,278 @@
+#pragma once
+
+// A sparse bank of indexed memories of type T, with 32-bit addresses.
+// Storage is a 64-way radix tree: leaf pages hold 64 registers each, and interior nodes hold 64 children.
+// Every page and node carries a bit mask of its non-empty slots, and nodes keep a count of the registers
+// in use beneath them. Registers that are zero cost nothing: pages and nodes are allocated when a
+// register becomes non-zero and freed when their last register returns to zero.
+// A million registers take three levels of nodes above the pages; 2^32 registers take five.
+// Pages and nodes are reference counted and copied on write, so copying a bank is O(1): the copy
+// shares all of its storage with the original, and a later set() copies only the page and nodes on
+// its path.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+typedef uint32_t Mem_Index;                                     // Address of an indexed memory
+
+#define NO_MEMORY         (Mem_Index(0xFFFFFFFF))               // Result of MemoryBank::next when there are no more
+#define BANK_SLOT_BITS    6                                     // Each page or node has 2^6 slots
+#define BANK_SLOTS        (1 << BANK_SLOT_BITS)
+#define BANK_MAX_LEVELS   5                                     // Enough interior levels for 32-bit addresses (64^6 = 2^36)
+
+
+template <typename T>
+class MemoryBank {
+  public:
+    MemoryBank(Mem_Index capacity);
+    MemoryBank(const MemoryBank& other);                        // Share other's storage (O(1))
+    MemoryBank& operator=(const MemoryBank& other);             // Release this bank's storage and share other's (O(1))
+    ~MemoryBank();
+    T             get(Mem_Index address) const;                 // Value of a register (0 if unused or out of range)
+    bool          set(Mem_Index address, T value);              // Set a register. Return false if out of range
+    bool          is_occupied(Mem_Index address) const;         // Return true if the register is non-zero
+    Mem_Index     count(Mem_Index first, Mem_Index last) const; // Number of non-zero registers in [first, last]
+    Mem_Index     next(Mem_Index address) const;                // First non-zero register at or after address, or NO_MEMORY
+    void          clear();                                      // Set every register to zero, freeing all storage
+    Mem_Index     capacity() const  { return _capacity; }       // Number of addressable registers
+    size_t        bytes_used() const;                           // Heap used by pages and nodes (shared ones are counted by every bank using them)
+  protected:
+    struct Page {
+      uint32_t    refs;                                         // Banks and nodes pointing here
+      uint64_t    mask;                                         // Bit i is set if values[i] is in use
+      T           values[BANK_SLOTS];
+    };
+    struct Node {
+      uint32_t    refs;                                         // Banks and nodes pointing here
+      Mem_Index   count;                                        // Registers in use beneath this node
+      uint64_t    mask;                                         // Bit i is set if children[i] exists
+      void*       children[BANK_SLOTS];                         // Node* above level 1, Page* at level 1
+    };
+    void*         _root     = nullptr;                          // A Page if _levels is 0, otherwise a Node
+    uint8_t       _levels   = 0;                                // Interior levels above the pages
+    Mem_Index     _capacity;
+    Mem_Index     _pages    = 0;                                // Pages reachable from _root, for bytes_used()
+    Mem_Index     _nodes    = 0;                                // Nodes reachable from _root, for bytes_used()
+    static uint8_t  _slot(Mem_Index address, uint8_t level)   { return (address >> (BANK_SLOT_BITS * level)) & (BANK_SLOTS - 1); }
+    static Mem_Index _span(uint8_t level)                     { return Mem_Index(1) << (BANK_SLOT_BITS * level); }   // Registers under one slot at level
+    static uint64_t _mask(const void* p, uint8_t level)       { return level ? static_cast<const Node*>(p)->mask : static_cast<const Page*>(p)->mask; }
+    static uint32_t& _refs(void* p, uint8_t level)            { return level ? static_cast<Node*>(p)->refs : static_cast<Page*>(p)->refs; }
+    static void*  _own(void* p, uint8_t level);                 // p, or a private copy of it if it's shared
+    static void   _release(void* p, uint8_t level);             // Drop a reference, freeing p and its children when it was the last
+    Mem_Index     _count(const void* p, uint8_t level, Mem_Index base, Mem_Index first, Mem_Index last) const;
+    Mem_Index     _next(const void* p, uint8_t level, Mem_Index base, Mem_Index address) const;
+};
+
+
+template <typename T> MemoryBank<T>::MemoryBank(Mem_Index capacity) : _capacity(capacity) {
+  // Enough interior levels that the root's slots cover every address
+  while(_levels < BANK_MAX_LEVELS && uint64_t(capacity - 1) >> (BANK_SLOT_BITS * (_levels + 1))) _levels++;
+}
+
+template <typename T> MemoryBank<T>::MemoryBank(const MemoryBank& other) :
+    _root(other._root), _levels(other._levels), _capacity(other._capacity), _pages(other._pages), _nodes(other._nodes) {
+  if(_root) _refs(_root, _levels)++;
+}
+
+template <typename T> MemoryBank<T>& MemoryBank<T>::operator=(const MemoryBank& other) {
+  if(other._root) _refs(other._root, other._levels)++;            // First, in case other is this
+  clear();
+  _root     = other._root;
+  _levels   = other._levels;
+  _capacity = other._capacity;
+  _pages    = other._pages;
+  _nodes    = other._nodes;
+  return *this;
+}
+
+template <typename T> MemoryBank<T>::~MemoryBank() {
+  clear();
+}
+
+template <typename T> T MemoryBank<T>::get(Mem_Index address) const {
+  if(_capacity <= address) return T(0);
+  const void* p = _root;
+  for(uint8_t level = _levels; p && 0 < level; level--) p = static_cast<const Node*>(p)->children[_slot(address, level)];
+  if(!p) return T(0);
+  const Page* page = static_cast<const Page*>(p);
+  uint8_t     slot = _slot(address, 0);
+  return (page->mask >> slot & 1) ? page->values[slot] : T(0);
+}
+
+// Walk down from the root, creating the path for a non-zero value, or remembering it so that
+// emptied pages and nodes can be freed on the way back up for a zero value.
+// Shared pages and nodes on the path are copied first, so other banks sharing them don't see the change.
+//
+template <typename T> bool MemoryBank<T>::set(Mem_Index address, T value) {
+  if(_capacity <= address) return false;
+  bool    occupy  = !(T(0) == value);
+  if(!occupy && !is_occupied(address)) return true;             // Already zero
+  Node*   path[BANK_MAX_LEVELS + 1];
+  void**  link    = &_root;
+  for(uint8_t level = _levels; 0 < level; level--) {
+    if(!*link) {
+      Node* node  = new Node();
+      node->refs  = 1;
+      *link       = node;
+      _nodes++;
+    }
+    Node* node    = static_cast<Node*>(*link = _own(*link, level));
+    path[level]   = node;
+    link          = &node->children[_slot(address, level)];
+  }
+  if(!*link) {
+    Page* page    = new Page();
+    page->refs    = 1;
+    *link         = page;
+    _pages++;
+  }
+  Page*     page  = static_cast<Page*>(*link = _own(*link, 0));
+  uint8_t   slot  = _slot(address, 0);
+  uint64_t  bit   = uint64_t(1) << slot;
+  bool      was   = page->mask & bit;
+  if(occupy) {
+    page->values[slot] = value;
+    page->mask        |= bit;
+    if(was) return true;
+    for(uint8_t level = 1; level <= _levels; level++) {
+      path[level]->mask |= uint64_t(1) << _slot(address, level);
+      path[level]->count++;
+    }
+    return true;
+  }
+  if(!was) return true;
+  page->mask &= ~bit;
+  bool emptied = (0 == page->mask);
+  if(emptied) {
+    delete page;
+    _pages--;
+    if(0 == _levels) _root = nullptr;
+  }
+  for(uint8_t level = 1; level <= _levels; level++) {
+    Node* node = path[level];
+    node->count--;
+    if(emptied) {
+      uint8_t child = _slot(address, level);
+      node->children[child]  = nullptr;
+      node->mask            &= ~(uint64_t(1) << child);
+      emptied                = (0 == node->mask);
+      if(emptied) {
+        delete node;
+        _nodes--;
+        if(level == _levels) _root = nullptr;                   // Otherwise the parent unlinks it on the next pass
+      }
+    }
+  }
+  return true;
+}
+
+template <typename T> bool MemoryBank<T>::is_occupied(Mem_Index address) const {
+  if(_capacity <= address) return false;
+  const void* p = _root;
+  for(uint8_t level = _levels; p && 0 < level; level--) p = static_cast<const Node*>(p)->children[_slot(address, level)];
+  return p && (static_cast<const Page*>(p)->mask >> _slot(address, 0) & 1);
+}
+
+template <typename T> Mem_Index MemoryBank<T>::count(Mem_Index first, Mem_Index last) const {
+  if(_capacity <= last) last = _capacity - 1;
+  if(first > last || !_root) return 0;
+  return _count(_root, _levels, 0, first, last);
+}
+
+// Children wholly inside [first, last] contribute their stored count; only the two edges are descended.
+//
+template <typename T> Mem_Index MemoryBank<T>::_count(const void* p, uint8_t level, Mem_Index base, Mem_Index first, Mem_Index last) const {
+  uint64_t  mask  = _mask(p, level);
+  Mem_Index span  = _span(level);
+  uint8_t   lo    = (first > base) ? (first - base) / span : 0;
+  uint8_t   hi    = (Mem_Index(last - base) / span < BANK_SLOTS) ? (last - base) / span : BANK_SLOTS - 1;
+  mask &= ~uint64_t(0) << lo;
+  mask &= ~uint64_t(0) >> (BANK_SLOTS - 1 - hi);
+  if(0 == level) return __builtin_popcountll(mask);
+  const Node* node  = static_cast<const Node*>(p);
+  Mem_Index   total = 0;
+  while(mask) {
+    uint8_t   slot        = __builtin_ctzll(mask);
+    Mem_Index child_base  = base + slot * span;
+    Mem_Index child_last  = child_base + (span - 1);
+    const void* child     = node->children[slot];
+    if(first <= child_base && child_last <= last) total += (1 == level) ? __builtin_popcountll(static_cast<const Page*>(child)->mask) : static_cast<const Node*>(child)->count;
+    else                                          total += _count(child, level - 1, child_base, first, last);
+    mask &= mask - 1;
+  }
+  return total;
+}
+
+template <typename T> Mem_Index MemoryBank<T>::next(Mem_Index address) const {
+  if(_capacity <= address || !_root) return NO_MEMORY;
+  Mem_Index found = _next(_root, _levels, 0, address);
+  return (found < _capacity) ? found : NO_MEMORY;
+}
+
+// Skip empty slots with the mask; descend into the first child that may hold something at or after address.
+//
+template <typename T> Mem_Index MemoryBank<T>::_next(const void* p, uint8_t level, Mem_Index base, Mem_Index address) const {
+  uint64_t  mask  = _mask(p, level);
+  Mem_Index span  = _span(level);
+  if(address > base) mask &= ~uint64_t(0) << ((address - base) / span);
+  while(mask) {
+    uint8_t   slot        = __builtin_ctzll(mask);
+    Mem_Index child_base  = base + slot * span;
+    if(0 == level) return child_base;
+    Mem_Index found = _next(static_cast<const Node*>(p)->children[slot], level - 1, child_base, address);
+    if(NO_MEMORY != found) return found;
+    mask &= mask - 1;
+  }
+  return NO_MEMORY;
+}
+
+template <typename T> void MemoryBank<T>::clear() {
+  if(_root) _release(_root, _levels);
+  _root   = nullptr;
+  _pages  = 0;
+  _nodes  = 0;
+}
+
+// Copy a shared page or node. The copy's children gain a reference, since it points to them too.
+//
+template <typename T> void* MemoryBank<T>::_own(void* p, uint8_t level) {
+  if(1 == _refs(p, level)) return p;
+  _refs(p, level)--;
+  if(0 == level) {
+    Page* page  = new Page(*static_cast<Page*>(p));
+    page->refs  = 1;
+    return page;
+  }
+  Node*     node = new Node(*static_cast<Node*>(p));
+  uint64_t  mask = node->mask;
+  node->refs     = 1;
+  while(mask) {
+    _refs(node->children[__builtin_ctzll(mask)], level - 1)++;
+    mask &= mask - 1;
+  }
+  return node;
+}
+
+template <typename T> void MemoryBank<T>::_release(void* p, uint8_t level) {
+  if(0 != --_refs(p, level)) return;
+  if(0 == level) {
+    delete static_cast<Page*>(p);
+    return;
+  }
+  Node*     node = static_cast<Node*>(p);
+  uint64_t  mask = node->mask;
+  while(mask) {
+    _release(node->children[__builtin_ctzll(mask)], level - 1);
+    mask &= mask - 1;
+  }
+  delete node;
+}
+
+template <typename T> size_t MemoryBank<T>::bytes_used() const {
+  return _pages * sizeof(Page) + _nodes * sizeof(Node);
+}
@@ -1,10 +1,17 @@
 #pragma once
 #include "CoreCalculator.h"
+#include "MemoryBank.h"
+#include "MemoryStack.h"
 
 // This template wraps CoreCalculator and provides memories of type T
 // There is a simple memory: memory
-// There is an array of M memories: memories
+// There is a bank of M indexed memories: memories. It is sparse, so M may be as large as 2^32 - 1
+// and only the non-zero memories use any storage.
 // And there is a memory stack: memory_stack
+// Count, sum, mean, variance, min and max of the memory stack are kept with each entry (see MemoryStack.h),
+// so each can be read in constant time however deep the stack grows.
+// The whole engine can be saved to a State and restored. The bank and the memory stack share their storage
+// with the State, so saving is O(1) and a State costs only what has changed since.
 //
 // By Van Kichline
 // In the year of the plague
@@ -12,66 +19,91 @@
 
 #define CLEAR_OPERATOR   (uint8_t('A'))
 
-template <typename T, uint8_t M>
+typedef void (*MemoryListener)(void* context, Mem_Index index);  // Called after a memory is set. index is NO_MEMORY for the simple memory
+
+template <typename T, Mem_Index M>
 class MemoryCalculator : public CoreCalculator<T> {
   public:
+    struct State {                                              // A snapshot of the engine, for save_state() and restore_state()
+      State() : memories(M) {}
+      FixedStack<T, CALC_STACK_DEPTH>     value_stack;
+      FixedStack<Op_ID, CALC_STACK_DEPTH> operator_stack;
+      Op_Err                              error_state;
+      T                                   memory;
+      MemoryBank<T>                       memories;             // Shares pages with the live bank until either changes
+      MemoryStack<T>                      memory_stack;         // Shares blocks with the live stack
+    };
     MemoryCalculator();
     Op_Err          set_memory(T value);                        // Set the simple memory
     T               get_memory();                               // Get the simple memory
-    Op_Err          set_memory(uint8_t index, T value);         // Set one of the indexed memories
-    T               get_memory(uint8_t index);                  // Get one of the indexed memories
+    Op_Err          set_memory(Mem_Index index, T value);       // Set one of the indexed memories
+    T               get_memory(Mem_Index index);                // Get one of the indexed memories
     void            push_memory(T value);                       // Push a value onto the memory stack
     T               pop_memory();                               // Pop a value from the stack and return it
     T               peek_memory();                              // Return the value at the top of the memory stack idempotently
     Op_Err          memory_operation(Op_ID id);                 // Operation between Val and M -> M
-    Op_Err          memory_operation(Op_ID id, uint8_t index);  // Operation between Val and M[index] -> M[index]
-    uint16_t        get_memory_depth();                         // Get the number of items on the memory stack
+    Op_Err          memory_operation(Op_ID id, Mem_Index index);  // Operation between Val and M[index] -> M[index]
+    size_t          get_memory_depth();                         // Get the number of items on the memory stack
     void            clear_memory_stack();                       // Clear the memory stack
     void            clear_all_memory();                         // Clear simple, indexed and stack memory
-    uint8_t         get_mem_array_size();                       // The value of M
-    std::vector<T>  memory_stack;                               // A memory stack. It would be nice if <stack> compiled.
+    Mem_Index       get_mem_array_size();                       // The value of M
+    T               get_memory_sum();                           // Sum of the memory stack
+    T               get_memory_mean();                          // Mean of the memory stack (0 if empty)
+    T               get_memory_variance(bool sample = true);    // Sample (n-1) or population (n) variance of the memory stack
+    T               get_memory_min();                           // Smallest value on the memory stack (0 if empty)
+    T               get_memory_max();                           // Largest value on the memory stack (0 if empty)
+    bool            is_memory_occupied(Mem_Index index);        // Return true if M[index] is non-zero
+    Mem_Index       count_occupied_memories(Mem_Index first = 0, Mem_Index last = M - 1);  // Number of non-zero memories in M[first] - M[last]
+    Mem_Index       next_occupied_memory(Mem_Index index = 0);  // First non-zero memory at or after index, or NO_MEMORY. Iterate with next_occupied_memory(i + 1)
+    size_t          get_memory_bytes_used();                    // Heap used by the indexed memories
+    void            set_memory_listener(MemoryListener listener, void* context);  // Be told whenever set_memory changes a memory
+    void            save_state(State& state);                   // Snapshot the stacks, error state and memories into state
+    void            restore_state(const State& state);          // Return to a snapshot. The memory listener is not called
+    MemoryStack<T>  memory_stack;                               // A persistent memory stack, with its aggregates
 protected:
     T               memory;                                     // The simplest to access memory
-    T               memories[M];                                // The array of indexed memory
+    MemoryBank<T>   memories;                                   // The sparse bank of indexed memory
+    MemoryListener  _listener         = nullptr;                // Called by set_memory, if set
+    void*           _listener_context = nullptr;                // Passed to _listener
 };
 
 
-template <typename T, uint8_t M>MemoryCalculator<T, M>::MemoryCalculator() : CoreCalculator<T>() {
+template <typename T, Mem_Index M>MemoryCalculator<T, M>::MemoryCalculator() : CoreCalculator<T>(), memories(M) {
   clear_all_memory();
 }
 
-template <typename T, uint8_t M> Op_Err MemoryCalculator<T, M>::set_memory(T value) {
+template <typename T, Mem_Index M> Op_Err MemoryCalculator<T, M>::set_memory(T value) {
   memory = value;
+  if(_listener) _listener(_listener_context, NO_MEMORY);
   return NO_ERROR;
 }
 
-template <typename T, uint8_t M> T MemoryCalculator<T, M>::get_memory() {
+template <typename T, Mem_Index M> T MemoryCalculator<T, M>::get_memory() {
   return memory;
 }
 
-template <typename T, uint8_t M> Op_Err MemoryCalculator<T, M>::set_memory(uint8_t index, T value) {
-  if(M <= index) return false;  // Out of range
-  memories[index] = value;
+template <typename T, Mem_Index M> Op_Err MemoryCalculator<T, M>::set_memory(Mem_Index index, T value) {
+  if(M <= index) return ERROR_INVALID_MEMORY;
+  memories.set(index, value);
+  if(_listener) _listener(_listener_context, index);
   return NO_ERROR;
 }
 
-template <typename T, uint8_t M> T MemoryCalculator<T, M>::get_memory(uint8_t index) {
-  if(M <= index) return T(0);  // Out of range
-  return memories[index];
+template <typename T, Mem_Index M> T MemoryCalculator<T, M>::get_memory(Mem_Index index) {
+  return memories.get(index);   // Zero if out of range
 }
 
-template <typename T, uint8_t M> void MemoryCalculator<T, M>::push_memory(T value) {
+template <typename T, Mem_Index M> void MemoryCalculator<T, M>::push_memory(T value) {
   memory_stack.push_back(value);
 }
 
-template <typename T, uint8_t M> T MemoryCalculator<T, M>::pop_memory() {
-  if(0 == memory_stack.size()) return T(0);
+template <typename T, Mem_Index M> T MemoryCalculator<T, M>::pop_memory() {
   T value = memory_stack.back();
   memory_stack.pop_back();
   return value;
 }
 
-template <typename T, uint8_t M> T MemoryCalculator<T, M>::peek_memory() {
+template <typename T, Mem_Index M> T MemoryCalculator<T, M>::peek_memory() {
   return memory_stack.back();
 }
 
@@ -84,14 +116,14 @@ template <typename T, uint8_t M> T MemoryCalculator<T, M>::peek_memory() {
 //  /   M = M / Value
 //  %   M = M / 100 * Value
 //
-template <typename T, uint8_t M> Op_Err MemoryCalculator<T, M>::memory_operation(Op_ID id) {
+template <typename T, Mem_Index M> Op_Err MemoryCalculator<T, M>::memory_operation(Op_ID id) {
   switch(id) {
     case EVALUATE_OPERATOR:
       // M= means store Value in M
       return set_memory(CoreCalculator<T>::get_value());
     case CLEAR_OPERATOR:
       // MA means clear M
-      return set_memory(0.0);
+      return set_memory(T(0));
     case ADDITION_OPERATOR:
       return set_memory(get_memory() + CoreCalculator<T>::get_value());
     case SUBTRACTION_OPERATOR:
@@ -101,7 +133,7 @@ template <typename T, uint8_t M> Op_Err MemoryCalculator<T, M>::memory_operation
     case DIVISION_OPERATOR:
       return set_memory(get_memory() / CoreCalculator<T>::get_value());
     case PERCENT_OPERATOR:
-      return set_memory(get_memory() / 100.0 * CoreCalculator<T>::get_value());
+      return set_memory(get_memory() / T(100) * CoreCalculator<T>::get_value());
     default: Serial.printf("Error in memory_operation(%c): %c unknown\n", id, id);
              return ERROR_UNKNOWN_OPERATOR;
   }
@@ -110,14 +142,14 @@ template <typename T, uint8_t M> Op_Err MemoryCalculator<T, M>::memory_operation
 
 // Operation between Val and M[index] -> M[index]
 //
-template <typename T, uint8_t M> Op_Err MemoryCalculator<T, M>::memory_operation(Op_ID id, uint8_t index) {
+template <typename T, Mem_Index M> Op_Err MemoryCalculator<T, M>::memory_operation(Op_ID id, Mem_Index index) {
   switch(id) {
     case EVALUATE_OPERATOR:
       // M= means store Value in M
       return set_memory(index, CoreCalculator<T>::get_value());
     case CLEAR_OPERATOR:
       // MA means clear M
-      return set_memory(index, 0.0);
+      return set_memory(index, T(0));
     case ADDITION_OPERATOR:
       return set_memory(index, get_memory(index) + CoreCalculator<T>::get_value());
     case SUBTRACTION_OPERATOR:
@@ -127,27 +159,91 @@ template <typename T, uint8_t M> Op_Err MemoryCalculator<T, M>::memory_operation
     case DIVISION_OPERATOR:
       return set_memory(index, get_memory(index) / CoreCalculator<T>::get_value());
     case PERCENT_OPERATOR:
-      return set_memory(index, get_memory(index) / 100.0 * CoreCalculator<T>::get_value());
+      return set_memory(index, get_memory(index) / T(100) * CoreCalculator<T>::get_value());
     default: Serial.printf("Error in memory_operation(%c): %c unknown\n", id, id);
              return ERROR_UNKNOWN_OPERATOR;
   }
   return false;
 }
 
-template <typename T, uint8_t M> uint16_t MemoryCalculator<T, M>::get_memory_depth() {
+template <typename T, Mem_Index M> size_t MemoryCalculator<T, M>::get_memory_depth() {
   return memory_stack.size();
 }
 
-template <typename T, uint8_t M> void MemoryCalculator<T, M>::clear_memory_stack() {
+template <typename T, Mem_Index M> void MemoryCalculator<T, M>::clear_memory_stack() {
   memory_stack.clear();
 }
 
-template <typename T, uint8_t M> void MemoryCalculator<T, M>::clear_all_memory() {
+template <typename T, Mem_Index M> void MemoryCalculator<T, M>::clear_all_memory() {
   memory = T(0);
-  for(uint8_t i = 0; i < M; i++) memories[i] = T(0);
+  memories.clear();
   clear_memory_stack();
 }
 
-template <typename T, uint8_t M> uint8_t MemoryCalculator<T, M>::get_mem_array_size() {
+template <typename T, Mem_Index M> Mem_Index MemoryCalculator<T, M>::get_mem_array_size() {
   return M;
 }
+
+template <typename T, Mem_Index M> T MemoryCalculator<T, M>::get_memory_sum() {
+  return memory_stack.sum();
+}
+
+template <typename T, Mem_Index M> T MemoryCalculator<T, M>::get_memory_mean() {
+  return memory_stack.mean();
+}
+
+template <typename T, Mem_Index M> T MemoryCalculator<T, M>::get_memory_variance(bool sample) {
+  int count = int(memory_stack.size()) - (sample ? 1 : 0);
+  if(0 >= count) return T(0);
+  T variance = memory_stack.m2() / T(count);
+  return (variance < T(0)) ? T(0) : variance;                  // Rounding can leave a tiny negative
+}
+
+template <typename T, Mem_Index M> T MemoryCalculator<T, M>::get_memory_min() {
+  return memory_stack.min();
+}
+
+template <typename T, Mem_Index M> T MemoryCalculator<T, M>::get_memory_max() {
+  return memory_stack.max();
+}
+
+template <typename T, Mem_Index M> bool MemoryCalculator<T, M>::is_memory_occupied(Mem_Index index) {
+  return memories.is_occupied(index);
+}
+
+template <typename T, Mem_Index M> Mem_Index MemoryCalculator<T, M>::count_occupied_memories(Mem_Index first, Mem_Index last) {
+  return memories.count(first, last);
+}
+
+template <typename T, Mem_Index M> Mem_Index MemoryCalculator<T, M>::next_occupied_memory(Mem_Index index) {
+  return memories.next(index);
+}
+
+template <typename T, Mem_Index M> size_t MemoryCalculator<T, M>::get_memory_bytes_used() {
+  return memories.bytes_used();
+}
+
+template <typename T, Mem_Index M> void MemoryCalculator<T, M>::set_memory_listener(MemoryListener listener, void* context) {
+  _listener         = listener;
+  _listener_context = context;
+}
+
+// Saving copies the fixed-size calculation stacks, and shares the bank and memory stack (O(1) each).
+//
+template <typename T, Mem_Index M> void MemoryCalculator<T, M>::save_state(State& state) {
+  state.value_stack     = CoreCalculator<T>::value_stack;
+  state.operator_stack  = CoreCalculator<T>::operator_stack;
+  state.error_state     = CoreCalculator<T>::_error_state;
+  state.memory          = memory;
+  state.memories        = memories;
+  state.memory_stack    = memory_stack;
+}
+
+template <typename T, Mem_Index M> void MemoryCalculator<T, M>::restore_state(const State& state) {
+  CoreCalculator<T>::value_stack    = state.value_stack;
+  CoreCalculator<T>::operator_stack = state.operator_stack;
+  CoreCalculator<T>::_error_state   = state.error_state;
+  memory                            = state.memory;
+  memories                          = state.memories;
+  memory_stack                      = state.memory_stack;
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+// A persistent pushdown stack of type T: the calculator's memory stack.
+// Values are kept in blocks of STACK_BLOCK_SIZE entries, each block pointing to the full block below it.
+// A stack is its top block and how many of that block's entries it holds, so copying a stack is O(1): the
+// copy shares every block with the original, and either can push or pop without affecting the other.
+// A push writes the next entry of the top block in place when no other stack has written there, even if the
+// block is shared, so a push allocates only once per block. A stack that pushes where another stack has
+// already pushed first copies its part of the shared top block. Blocks are reference counted and freed
+// when no stack uses them.
+// Each entry also records the sum, mean, variance, min and max of the stack up to and including it,
+// so every aggregate is available in constant time, and popping restores the previous aggregates exactly.
+// The sum is compensated (Neumaier) and the mean and variance use Welford's method, so long runs of
+// readings don't accumulate error.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define STACK_BLOCK_SIZE  16                                    // Entries per block
+
+
+template <typename T>
+class MemoryStack {
+  public:
+    struct Entry {
+      T           value;                                        // The value pushed
+      T           sum;                                          // Aggregates of this entry and all those below it:
+      T           compensation;                                 //   Low-order part of the sum lost to rounding (Neumaier)
+      T           mean;                                         //   Running mean (Welford)
+      T           m2;                                           //   Running sum of squared differences from the mean (Welford)
+      T           min;
+      T           max;
+    };
+    class Walker;
+    MemoryStack()                                           {}
+    MemoryStack(const MemoryStack& other);                      // Share other's blocks (O(1))
+    MemoryStack& operator=(const MemoryStack& other);           // Release this stack's blocks and share other's (O(1))
+    ~MemoryStack();
+    void          push_back(T value);                           // Push value, folding it into the aggregates
+    void          pop_back();                                   // Remove the top value, if any
+    T             back() const  { return _block ? _top().value : T(0); }  // The top value (0 if empty)
+    size_t        size() const  { return _block ? _block->depth + _count : 0; }  // Number of values on the stack
+    bool          empty() const { return !_block; }
+    void          clear();                                      // Remove all values
+    T             operator[](size_t index) const;               // Value index places up from the bottom. Walks down from the top block; prefer a Walker
+    T             sum() const   { return _block ? _top().sum + _top().compensation : T(0); }
+    T             mean() const  { return _block ? _top().mean : T(0); }
+    T             m2() const    { return _block ? _top().m2   : T(0); }
+    T             min() const   { return _block ? _top().min  : T(0); }
+    T             max() const   { return _block ? _top().max  : T(0); }
+  protected:
+    struct Block {
+      uint32_t    refs;                                         // Stacks and blocks pointing here
+      uint32_t    used;                                         // Entries written by the stack that last pushed here
+      size_t      depth;                                        // Number of entries in the blocks below
+      Block*      below;                                        // The next block down, full, or nullptr
+      Entry       entries[STACK_BLOCK_SIZE];
+    };
+    Block*        _block  = nullptr;                            // Top block, or nullptr if empty
+    uint32_t      _count  = 0;                                  // Entries of _block in this stack (1 to STACK_BLOCK_SIZE)
+    const Entry&  _top() const  { return _block->entries[_count - 1]; }
+    static void   _release(Block* block);                        // Drop a reference, freeing blocks that are no longer used
+};
+
+
+// Visits a stack's values from the top down:
+//   MemoryStack<double>::Walker walker(stack);
+//   double value;
+//   while(walker.next(value)) ...
+// The stack must not change during the walk.
+//
+template <typename T>
+class MemoryStack<T>::Walker {
+  public:
+    Walker(const MemoryStack& stack) : _block(stack._block), _count(stack._count) {}
+    bool          next(T& value);                               // The next value down. Return false at the bottom
+  protected:
+    const Block*  _block;
+    uint32_t      _count;                                       // Entries of _block not yet visited
+};
+
+
+template <typename T> MemoryStack<T>::MemoryStack(const MemoryStack& other) : _block(other._block), _count(other._count) {
+  if(_block) _block->refs++;
+}
+
+template <typename T> MemoryStack<T>& MemoryStack<T>::operator=(const MemoryStack& other) {
+  if(other._block) other._block->refs++;                        // First, in case other is this
+  _release(_block);
+  _block = other._block;
+  _count = other._count;
+  return *this;
+}
+
+template <typename T> MemoryStack<T>::~MemoryStack() {
+  _release(_block);
+}
+
+// The new entry's aggregates are computed from the entry below: Welford's update for mean and m2,
+// and Neumaier's improvement on Kahan summation, which keeps the low-order bits lost by each addition
+// whichever operand is larger.
+// Then the entry goes in the next slot of the top block: a new block if it's full; in place if no other
+// stack has written that slot, or if no other stack uses the block; otherwise in a copy of this stack's part of it.
+//
+template <typename T> void MemoryStack<T>::push_back(T value) {
+  Entry   entry;
+  size_t  depth = size() + 1;
+  entry.value   = value;
+  if(!_block) {
+    entry.sum             = value;
+    entry.compensation    = T(0);
+    entry.mean            = value;
+    entry.m2              = T(0);
+    entry.min             = value;
+    entry.max             = value;
+  }
+  else {
+    const Entry& top      = _top();
+    T sum                 = top.sum + value;
+    T big_sum             = (top.sum < T(0)) ? -top.sum : top.sum;
+    T big_value           = (value < T(0))   ? -value   : value;
+    T lost                = (big_value <= big_sum) ? (top.sum - sum) + value : (value - sum) + top.sum;
+    T delta               = value - top.mean;
+    entry.sum             = sum;
+    entry.compensation    = top.compensation + lost;
+    entry.mean            = top.mean + delta / T(int(depth));
+    entry.m2              = top.m2 + delta * (value - entry.mean);
+    entry.min             = (value < top.min) ? value : top.min;
+    entry.max             = (top.max < value) ? value : top.max;
+  }
+  if(!_block || STACK_BLOCK_SIZE == _count) {
+    Block* block  = new Block();
+    block->refs   = 1;
+    block->used   = 0;
+    block->depth  = depth - 1;
+    block->below  = _block;                                     // Takes over this stack's reference to _block
+    _block        = block;
+    _count        = 0;
+  }
+  else if(_block->used != _count) {
+    if(1 == _block->refs) _block->used = _count;                // Only this stack can see the entries above _count
+    else {
+      Block* block  = new Block();
+      block->refs   = 1;
+      block->used   = _count;
+      block->depth  = _block->depth;
+      block->below  = _block->below;
+      if(block->below) block->below->refs++;
+      for(uint32_t i = 0; i < _count; i++) block->entries[i] = _block->entries[i];
+      _release(_block);
+      _block = block;
+    }
+  }
+  _block->entries[_count++] = entry;
+  _block->used              = _count;
+}
+
+template <typename T> void MemoryStack<T>::pop_back() {
+  if(!_block) return;
+  if(1 < _count) {
+    _count--;
+    return;
+  }
+  Block* below = _block->below;
+  if(below) below->refs++;
+  _release(_block);
+  _block = below;
+  _count = below ? STACK_BLOCK_SIZE : 0;
+}
+
+template <typename T> void MemoryStack<T>::clear() {
+  _release(_block);
+  _block = nullptr;
+  _count = 0;
+}
+
+template <typename T> T MemoryStack<T>::operator[](size_t index) const {
+  const Block* block = _block;
+  while(block && block->depth > index) block = block->below;
+  return (block && index < size()) ? block->entries[index - block->depth].value : T(0);
+}
+
+// A loop rather than recursion, so releasing a deep stack can't overflow the call stack.
+//
+template <typename T> void MemoryStack<T>::_release(Block* block) {
+  while(block && 0 == --block->refs) {
+    Block* below = block->below;
+    delete block;
+    block = below;
+  }
+}
+
+template <typename T> bool MemoryStack<T>::Walker::next(T& value) {
+  if(!_count) {
+    if(!_block || !_block->below) return false;
+    _block = _block->below;
+    _count = STACK_BLOCK_SIZE;
+  }
+  value = _block->entries[--_count].value;
+  return true;
+}
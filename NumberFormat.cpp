@@ -0,0 +1,397 @@
+#include <string.h>
+#include <math.h>
+#include "NumberFormat.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with Integers", 2010).
+//  A double is scaled by a cached power of ten into a 64-bit range where its digits can be generated
+//  with integer arithmetic, along with the boundaries of the interval that still rounds to it.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// A 64-bit significand f and binary exponent e: f * 2^e
+//
+struct DiyFp {
+  uint64_t  f;
+  int       e;
+  DiyFp(uint64_t f_, int e_) : f(f_), e(e_) {}
+};
+
+static DiyFp diy_subtract(const DiyFp& x, const DiyFp& y) {
+  return DiyFp(x.f - y.f, x.e);
+}
+
+// The upper 64 bits of the 128-bit product, rounded. Built from 32-bit halves so no 128-bit type is needed.
+//
+static DiyFp diy_multiply(const DiyFp& x, const DiyFp& y) {
+  uint64_t  u_lo  = x.f & 0xFFFFFFFFu;
+  uint64_t  u_hi  = x.f >> 32;
+  uint64_t  v_lo  = y.f & 0xFFFFFFFFu;
+  uint64_t  v_hi  = y.f >> 32;
+  uint64_t  p0    = u_lo * v_lo;
+  uint64_t  p1    = u_lo * v_hi;
+  uint64_t  p2    = u_hi * v_lo;
+  uint64_t  p3    = u_hi * v_hi;
+  uint64_t  q     = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu) + (uint64_t(1) << 31);
+  return DiyFp(p3 + (p1 >> 32) + (p2 >> 32) + (q >> 32), x.e + y.e + 64);
+}
+
+static DiyFp diy_normalize(DiyFp x) {
+  while(0 == (x.f >> 63)) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+
+// Cached powers of ten, 10^k for k = -300, -292, ... 324, as normalized 64-bit significands.
+//
+struct CachedPower {
+  uint64_t  f;
+  int16_t   e;
+  int16_t   k;
+};
+
+#define CACHED_POWERS_MIN_DEC_EXP   -300
+#define CACHED_POWERS_DEC_STEP      8
+#define GRISU_ALPHA                 -60   // Target range for the scaled exponent
+#define GRISU_GAMMA                 -32
+
+static const CachedPower cached_powers[] = {
+  { 0xAB70FE17C79AC6CAULL, -1060, -300 },
+  { 0xFF77B1FCBEBCDC4FULL, -1034, -292 },
+  { 0xBE5691EF416BD60CULL, -1007, -284 },
+  { 0x8DD01FAD907FFC3CULL,  -980, -276 },
+  { 0xD3515C2831559A83ULL,  -954, -268 },
+  { 0x9D71AC8FADA6C9B5ULL,  -927, -260 },
+  { 0xEA9C227723EE8BCBULL,  -901, -252 },
+  { 0xAECC49914078536DULL,  -874, -244 },
+  { 0x823C12795DB6CE57ULL,  -847, -236 },
+  { 0xC21094364DFB5637ULL,  -821, -228 },
+  { 0x9096EA6F3848984FULL,  -794, -220 },
+  { 0xD77485CB25823AC7ULL,  -768, -212 },
+  { 0xA086CFCD97BF97F4ULL,  -741, -204 },
+  { 0xEF340A98172AACE5ULL,  -715, -196 },
+  { 0xB23867FB2A35B28EULL,  -688, -188 },
+  { 0x84C8D4DFD2C63F3BULL,  -661, -180 },
+  { 0xC5DD44271AD3CDBAULL,  -635, -172 },
+  { 0x936B9FCEBB25C996ULL,  -608, -164 },
+  { 0xDBAC6C247D62A584ULL,  -582, -156 },
+  { 0xA3AB66580D5FDAF6ULL,  -555, -148 },
+  { 0xF3E2F893DEC3F126ULL,  -529, -140 },
+  { 0xB5B5ADA8AAFF80B8ULL,  -502, -132 },
+  { 0x87625F056C7C4A8BULL,  -475, -124 },
+  { 0xC9BCFF6034C13053ULL,  -449, -116 },
+  { 0x964E858C91BA2655ULL,  -422, -108 },
+  { 0xDFF9772470297EBDULL,  -396, -100 },
+  { 0xA6DFBD9FB8E5B88FULL,  -369,  -92 },
+  { 0xF8A95FCF88747D94ULL,  -343,  -84 },
+  { 0xB94470938FA89BCFULL,  -316,  -76 },
+  { 0x8A08F0F8BF0F156BULL,  -289,  -68 },
+  { 0xCDB02555653131B6ULL,  -263,  -60 },
+  { 0x993FE2C6D07B7FACULL,  -236,  -52 },
+  { 0xE45C10C42A2B3B06ULL,  -210,  -44 },
+  { 0xAA242499697392D3ULL,  -183,  -36 },
+  { 0xFD87B5F28300CA0EULL,  -157,  -28 },
+  { 0xBCE5086492111AEBULL,  -130,  -20 },
+  { 0x8CBCCC096F5088CCULL,  -103,  -12 },
+  { 0xD1B71758E219652CULL,   -77,   -4 },
+  { 0x9C40000000000000ULL,   -50,    4 },
+  { 0xE8D4A51000000000ULL,   -24,   12 },
+  { 0xAD78EBC5AC620000ULL,     3,   20 },
+  { 0x813F3978F8940984ULL,    30,   28 },
+  { 0xC097CE7BC90715B3ULL,    56,   36 },
+  { 0x8F7E32CE7BEA5C70ULL,    83,   44 },
+  { 0xD5D238A4ABE98068ULL,   109,   52 },
+  { 0x9F4F2726179A2245ULL,   136,   60 },
+  { 0xED63A231D4C4FB27ULL,   162,   68 },
+  { 0xB0DE65388CC8ADA8ULL,   189,   76 },
+  { 0x83C7088E1AAB65DBULL,   216,   84 },
+  { 0xC45D1DF942711D9AULL,   242,   92 },
+  { 0x924D692CA61BE758ULL,   269,  100 },
+  { 0xDA01EE641A708DEAULL,   295,  108 },
+  { 0xA26DA3999AEF774AULL,   322,  116 },
+  { 0xF209787BB47D6B85ULL,   348,  124 },
+  { 0xB454E4A179DD1877ULL,   375,  132 },
+  { 0x865B86925B9BC5C2ULL,   402,  140 },
+  { 0xC83553C5C8965D3DULL,   428,  148 },
+  { 0x952AB45CFA97A0B3ULL,   455,  156 },
+  { 0xDE469FBD99A05FE3ULL,   481,  164 },
+  { 0xA59BC234DB398C25ULL,   508,  172 },
+  { 0xF6C69A72A3989F5CULL,   534,  180 },
+  { 0xB7DCBF5354E9BECEULL,   561,  188 },
+  { 0x88FCF317F22241E2ULL,   588,  196 },
+  { 0xCC20CE9BD35C78A5ULL,   614,  204 },
+  { 0x98165AF37B2153DFULL,   641,  212 },
+  { 0xE2A0B5DC971F303AULL,   667,  220 },
+  { 0xA8D9D1535CE3B396ULL,   694,  228 },
+  { 0xFB9B7CD9A4A7443CULL,   720,  236 },
+  { 0xBB764C4CA7A44410ULL,   747,  244 },
+  { 0x8BAB8EEFB6409C1AULL,   774,  252 },
+  { 0xD01FEF10A657842CULL,   800,  260 },
+  { 0x9B10A4E5E9913129ULL,   827,  268 },
+  { 0xE7109BFBA19C0C9DULL,   853,  276 },
+  { 0xAC2820D9623BF429ULL,   880,  284 },
+  { 0x80444B5E7AA7CF85ULL,   907,  292 },
+  { 0xBF21E44003ACDD2DULL,   933,  300 },
+  { 0x8E679C2F5E44FF8FULL,   960,  308 },
+  { 0xD433179D9C8CB841ULL,   986,  316 },
+  { 0x9E19DB92B4E31BA9ULL,  1013,  324 },};
+
+
+// Find the cached power that brings binary exponent e into [GRISU_ALPHA, GRISU_GAMMA]
+//
+static const CachedPower& cached_power_for(int e) {
+  int f     = GRISU_ALPHA - e - 1;
+  int k     = (f * 78913) / (1 << 18) + (0 < f);                  // ceil(f * log10(2))
+  int index = (-CACHED_POWERS_MIN_DEC_EXP + k + (CACHED_POWERS_DEC_STEP - 1)) / CACHED_POWERS_DEC_STEP;
+  return cached_powers[index];
+}
+
+
+// Largest power of ten <= n (n < 10^10). Return its digit count.
+//
+static uint8_t largest_pow10(uint32_t n, uint32_t& pow10) {
+  static const uint32_t powers[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+  uint8_t count = 10;
+  while(1 < count && n < powers[count - 1]) count--;
+  pow10 = powers[count - 1];
+  return count;
+}
+
+
+// Move the last digit toward w while staying inside the interval, if that gets closer
+//
+static void grisu_round(char* digits, uint8_t length, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k) {
+  while(rest < dist && delta - rest >= ten_k && (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+    digits[length - 1]--;
+    rest += ten_k;
+  }
+}
+
+
+uint8_t shortest_digits(double val, char digits[NUMBER_MAX_DIGITS], int16_t& exponent) {
+  // Decompose val and compute the boundaries m- and m+ halfway to its neighbors
+  uint64_t  bits;
+  memcpy(&bits, &val, sizeof(bits));
+  uint64_t  fraction  = bits & ((uint64_t(1) << 52) - 1);
+  int       biased    = int(bits >> 52);
+  DiyFp     v         = biased ? DiyFp(fraction | (uint64_t(1) << 52), biased - 1075) : DiyFp(fraction, -1074);
+  bool      closer    = (0 == fraction && 1 < biased);          // The lower neighbor is half as far away
+  DiyFp     m_plus    = diy_normalize(DiyFp(2 * v.f + 1, v.e - 1));
+  DiyFp     m_minus   = closer ? DiyFp(4 * v.f - 1, v.e - 2) : DiyFp(2 * v.f - 1, v.e - 1);
+  m_minus.f         <<= m_minus.e - m_plus.e;
+  m_minus.e           = m_plus.e;
+  v                   = diy_normalize(v);
+
+  // Scale everything by the cached power, and shrink the interval by one unit for safety
+  const CachedPower& cached = cached_power_for(m_plus.e);
+  DiyFp     c(cached.f, cached.e);
+  DiyFp     w         = diy_multiply(v, c);
+  DiyFp     lo        = diy_multiply(m_minus, c);
+  DiyFp     hi        = diy_multiply(m_plus, c);
+  lo.f++;
+  hi.f--;
+  exponent            = -cached.k;
+
+  // Generate digits of hi until they fall within the interval
+  uint64_t  delta     = diy_subtract(hi, lo).f;
+  uint64_t  dist      = diy_subtract(hi, w).f;
+  int       shift     = -hi.e;
+  uint64_t  one       = uint64_t(1) << shift;
+  uint32_t  p1        = uint32_t(hi.f >> shift);                // Integral part
+  uint64_t  p2        = hi.f & (one - 1);                       // Fractional part
+  uint8_t   length    = 0;
+  uint32_t  pow10;
+  uint8_t   n         = largest_pow10(p1, pow10);
+  while(0 < n) {
+    digits[length++]  = '0' + p1 / pow10;
+    p1               %= pow10;
+    n--;
+    uint64_t rest     = (uint64_t(p1) << shift) + p2;
+    if(rest <= delta) {
+      exponent       += n;
+      grisu_round(digits, length, dist, delta, rest, uint64_t(pow10) << shift);
+      return length;
+    }
+    pow10            /= 10;
+  }
+  for(;;) {
+    p2               *= 10;
+    digits[length++]  = '0' + char(p2 >> shift);
+    p2               &= one - 1;
+    delta            *= 10;
+    dist             *= 10;
+    exponent--;
+    if(p2 <= delta) break;
+  }
+  grisu_round(digits, length, dist, delta, p2, one);
+  return length;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Formatting
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Round digits to keep the first count of them (half up), and strip trailing zeros.
+// A carry out of the first digit becomes a leading 1, and the decimal point moves right.
+// count may be zero or negative, meaning the value is rounded to zero or to one unit at that place.
+//
+static uint8_t round_digits(char* digits, uint8_t length, int count, int& point) {
+  if(count < length) {
+    if(0 > count) return 0;
+    bool up = ('5' <= digits[count]);
+    length  = count;
+    if(up) {
+      int i = length - 1;
+      while(0 <= i && '9' == digits[i]) i--;
+      if(0 <= i) {
+        digits[i]++;
+        length = i + 1;
+      }
+      else {
+        digits[0] = '1';
+        length    = 1;
+        point++;
+      }
+    }
+  }
+  while(0 < length && '0' == digits[length - 1]) length--;
+  return length;
+}
+
+
+// Writes characters into a bounded buffer, remembering whether it ran out of room
+//
+struct NumberWriter {
+  char*   p;
+  char*   end;                            // Leaves room for the terminator
+  bool    ok;
+  NumberWriter(char* buffer, size_t size) : p(buffer), end(buffer + size - 1), ok(true) {}
+  void    put(char c)                     { if(p < end) *p++ = c; else ok = false; }
+  void    put(const char* s, size_t n)    { while(n--) put(*s++); }
+  void    repeat(char c, int n)           { while(0 < n--) put(c); }
+};
+
+
+static size_t finish(NumberWriter& out, char* buffer) {
+  if(!out.ok) {
+    *buffer = '\0';
+    return 0;
+  }
+  *out.p = '\0';
+  return out.p - buffer;
+}
+
+
+size_t format_number(double val, char* buffer, size_t size, uint8_t precision, NumberFormat format) {
+  if(0 == size) return 0;
+  NumberWriter out(buffer, size);
+  if(isnan(val)) {
+    out.put("NaN", 3);
+    return finish(out, buffer);
+  }
+  if(signbit(val) && 0.0 != val) {
+    out.put('-');
+    val = -val;
+  }
+  if(isinf(val)) {
+    out.put("Inf", 3);
+    return finish(out, buffer);
+  }
+  if(0.0 == val) {
+    out.put('0');
+    return finish(out, buffer);
+  }
+
+  char    digits[NUMBER_MAX_DIGITS + 1];
+  int16_t exponent;
+  uint8_t length  = shortest_digits(val, digits, exponent);
+  int     point   = length + exponent;                          // Digits before the decimal point (may be <= 0)
+
+  if(formatFixed == format) {
+    char* start   = out.p;
+    int   fixed_point = point;
+    uint8_t n     = round_digits(digits, length, point + precision, fixed_point);
+    if(0 == n) {
+      out.p = buffer;                                           // Rounded away entirely, so no sign either
+      out.put('0');
+      return finish(out, buffer);
+    }
+    if(0 >= fixed_point) {
+      out.put("0.", 2);
+      out.repeat('0', -fixed_point);
+      out.put(digits, n);
+    }
+    else if(fixed_point >= n) {
+      out.put(digits, n);
+      out.repeat('0', fixed_point - n);
+    }
+    else {
+      out.put(digits, fixed_point);
+      out.put('.');
+      out.put(digits + fixed_point, n - fixed_point);
+    }
+    if(out.ok) return finish(out, buffer);
+    out.p   = start;                                            // Too long for fixed: use scientific instead
+    out.ok  = true;
+    length  = shortest_digits(val, digits, exponent);
+    point   = length + exponent;
+  }
+
+  uint8_t n       = round_digits(digits, length, precision + 1, point);
+  out.put(digits[0]);
+  if(1 < n) {
+    out.put('.');
+    out.put(digits + 1, n - 1);
+  }
+  out.put('e');
+  int e = point - 1;
+  if(0 > e) {
+    out.put('-');
+    e = -e;
+  }
+  if(100 <= e) out.put('0' + e / 100);
+  if(10 <= e)  out.put('0' + e / 10 % 10);
+  out.put('0' + e % 10);
+  return finish(out, buffer);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  FormatCache
+//
+#define FORMAT_CACHE_EMPTY  0xFF
+
+FormatCache::FormatCache() {
+  for(Entry& entry : _entries) entry.precision = FORMAT_CACHE_EMPTY;
+}
+
+
+// The slot is picked by the top bits of a Fibonacci hash, which depend on all the value's bits
+// (round numbers like 0.25 have none set at the bottom).
+// A miss formats into the slot, replacing whatever was there.
+//
+const char* FormatCache::format(double val, uint8_t precision, size_t& length) {
+  uint64_t bits;
+  memcpy(&bits, &val, sizeof(bits));
+  Entry& entry = _entries[((bits ^ precision) * 0x9E3779B97F4A7C15ull) >> (64 - FORMAT_CACHE_BITS)];
+  if(entry.bits == bits && entry.precision == precision) {
+    hits++;
+  }
+  else {
+    misses++;
+    entry.bits      = bits;
+    entry.precision = precision;
+    entry.length    = format_number(val, entry.text, sizeof(entry.text), precision);
+  }
+  length = entry.length;
+  return entry.text;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+// Fast double to text conversion for the display.
+// The digits are the shortest that read back as the same double (Grisu2), so 0.1 prints as 0.1,
+// then rounded (half up) to the requested number of decimal places and stripped of trailing zeros.
+// All the work is done in 64-bit integers: no pow(), log10() or floating point division per digit,
+// and no allocation. Output goes to a caller-supplied buffer.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define NUMBER_MAX_DIGITS   17          // Most significant digits a double ever needs
+#define NUMBER_BUFFER_SIZE  32          // A buffer this large holds any scientific result, and fixed results up to about 1e20
+#define FORMAT_CACHE_BITS   6           // A FormatCache has 2^FORMAT_CACHE_BITS entries
+
+enum NumberFormat {
+  formatFixed,          // 1234.5678, -0.0025. Falls back to scientific if the result doesn't fit the buffer.
+  formatScientific      // 1.2345678e3, -2.5e-3
+};
+
+// Write val into buffer as text, with at most precision digits after the decimal point.
+// NaN and infinities are written as NaN, Inf and -Inf.
+// Return the length of the text, or 0 if the buffer was too small (buffer then holds an empty string).
+//
+size_t format_number(double val, char* buffer, size_t size, uint8_t precision, NumberFormat format = formatFixed);
+
+// Generate the shortest digits that round-trip to val, which must be finite and greater than zero.
+// On return, val == digits * 10^exponent. digits is not terminated. Return the number of digits.
+//
+uint8_t shortest_digits(double val, char digits[NUMBER_MAX_DIGITS], int16_t& exponent);
+
+// A direct-mapped cache of formatted values keyed by the value's bits and the precision, so values
+// that are redisplayed unchanged (the value stack, memories, the status line) aren't formatted again.
+// Fixed format only. About 2.5KB.
+//
+class FormatCache {
+  public:
+    FormatCache();
+    const char*   format(double val, uint8_t precision, size_t& length);  // The text format_number() would write, and its length
+    uint32_t      hits    = 0;                                  // Number of lookups found in the cache
+    uint32_t      misses  = 0;                                  // Number of lookups that had to format
+  protected:
+    struct Entry {
+      uint64_t    bits;                                         // The value, bit for bit
+      uint8_t     precision;                                    // FORMAT_CACHE_EMPTY (0xFF) if the entry is unused
+      uint8_t     length;
+      char        text[NUMBER_BUFFER_SIZE];
+    };
+    Entry         _entries[1 << FORMAT_CACHE_BITS];
+};
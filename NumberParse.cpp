@@ -0,0 +1,369 @@
+#include <math.h>
+#include <string.h>
+#include "NumberParse.h"
+#include "pow5_table.h"
+
+
+#define BIG_LIMBS   112                 // 3584 bits: enough for 768 digits times 5^310, or 5^1093 shifted
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  A minimal fixed-capacity unsigned big integer, just enough for exact rounding
+//
+////////////////////////////////////////////////////////////////////////////////
+
+struct BigInt {
+  uint32_t  limbs[BIG_LIMBS];           // Least significant first
+  uint8_t   size = 0;                   // Limbs in use; the top one is non-zero
+
+  BigInt(uint64_t n = 0) {
+    while(n) {
+      limbs[size++] = uint32_t(n);
+      n >>= 32;
+    }
+  }
+
+  void multiply_add(uint32_t m, uint32_t a) {
+    uint64_t carry = a;
+    for(uint8_t i = 0; i < size; i++) {
+      carry    += uint64_t(limbs[i]) * m;
+      limbs[i]  = uint32_t(carry);
+      carry   >>= 32;
+    }
+    if(carry && size < BIG_LIMBS) limbs[size++] = uint32_t(carry);
+  }
+
+  void multiply_pow5(int n) {
+    while(13 <= n) {
+      multiply_add(1220703125u, 0);     // 5^13 is the largest power of 5 in 32 bits
+      n -= 13;
+    }
+    static const uint32_t pow5[] = { 1, 5, 25, 125, 625, 3125, 15625, 78125, 390625, 1953125, 9765625, 48828125, 244140625 };
+    if(n) multiply_add(pow5[n], 0);
+  }
+
+  void shift_left(int bits) {
+    int words = bits / 32;
+    bits     %= 32;
+    if(0 == size) return;
+    uint8_t new_size = size + words + 1;
+    if(BIG_LIMBS < new_size) new_size = BIG_LIMBS;
+    for(int i = new_size - 1; 0 <= i; i--) {
+      int      from = i - words;
+      uint32_t hi   = (0 <= from && from < size) ? limbs[from] : 0;
+      uint32_t lo   = (1 <= from && from - 1 < size) ? limbs[from - 1] : 0;
+      limbs[i]      = bits ? (hi << bits) | (lo >> (32 - bits)) : hi;
+    }
+    size = new_size;
+    trim();
+  }
+
+  void shift_right_one() {
+    for(uint8_t i = 0; i < size; i++) limbs[i] = (limbs[i] >> 1) | (i + 1 < size ? limbs[i + 1] << 31 : 0);
+    trim();
+  }
+
+  void trim() {
+    while(size && 0 == limbs[size - 1]) size--;
+  }
+
+  int bit_length() const {
+    if(0 == size) return 0;
+    int bits = 32 * (size - 1);
+    for(uint32_t top = limbs[size - 1]; top; top >>= 1) bits++;
+    return bits;
+  }
+
+  int compare(const BigInt& other) const {
+    if(size != other.size) return size < other.size ? -1 : 1;
+    for(int i = size - 1; 0 <= i; i--) {
+      if(limbs[i] != other.limbs[i]) return limbs[i] < other.limbs[i] ? -1 : 1;
+    }
+    return 0;
+  }
+
+  void subtract(const BigInt& other) {      // other must not be larger
+    int64_t borrow = 0;
+    for(uint8_t i = 0; i < size; i++) {
+      borrow   += int64_t(limbs[i]) - (i < other.size ? other.limbs[i] : 0);
+      limbs[i]  = uint32_t(borrow);
+      borrow    = (0 > borrow) ? -1 : 0;
+    }
+    trim();
+  }
+
+  // The top 64 bits, and whether any bits below them are set. Return the shift applied.
+  int top_bits(uint64_t& top, bool& sticky) const {
+    int shift = bit_length() - 64;
+    if(0 > shift) shift = 0;
+    int word  = shift / 32;
+    int bit   = shift % 32;
+    top       = 0;
+    for(int i = 2; 0 <= i; i--) {
+      uint64_t limb = (word + i < size) ? limbs[word + i] : 0;
+      top |= (0 <= 32 * i - bit) ? limb << (32 * i - bit) : limb >> (bit - 32 * i);
+    }
+    sticky    = 0 != (limbs[word] & ((uint32_t(1) << bit) - 1));
+    for(int i = 0; i < word && !sticky; i++) sticky = (0 != limbs[i]);
+    return shift;
+  }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Conversion
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Round bits * 2^exponent (plus a little more if sticky) to the nearest double, ties to even.
+// Handles subnormal results and overflow to infinity.
+//
+static double round_to_double(uint64_t bits, int exponent, bool sticky) {
+  int length = 0;
+  for(uint64_t b = bits; b; b >>= 1) length++;
+  int drop = length - 53;
+  if(drop < -1074 - exponent) drop = -1074 - exponent;        // Subnormal: fewer bits are available
+  if(0 < drop) {
+    if(64 < drop) return 0.0;                                 // Less than half the smallest subnormal
+    uint64_t  half  = uint64_t(1) << (drop - 1);
+    uint64_t  rest  = bits & ((half << 1) - 1);
+    bits           = (64 == drop) ? 0 : bits >> drop;
+    exponent      += drop;
+    if(rest > half || (rest == half && (sticky || (bits & 1)))) bits++;
+  }
+  return ldexp(double(bits), exponent);                       // bits <= 2^53, so this is exact or overflows to inf
+}
+
+
+// The high and low 64 bits of a * b. A 32-bit target (the ESP32) has no 128-bit type, so it builds the
+// product from four 32 x 32 bit multiplies.
+//
+static uint64_t multiply_128(uint64_t a, uint64_t b, uint64_t& low) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = __uint128_t(a) * b;
+  low = uint64_t(product);
+  return uint64_t(product >> 64);
+#else
+  uint64_t  a_lo  = uint32_t(a),  a_hi = a >> 32;
+  uint64_t  b_lo  = uint32_t(b),  b_hi = b >> 32;
+  uint64_t  lo_lo = a_lo * b_lo;
+  uint64_t  hi_lo = a_hi * b_lo;
+  uint64_t  lo_hi = a_lo * b_hi;
+  uint64_t  hi_hi = a_hi * b_hi;
+  uint64_t  cross = (lo_lo >> 32) + uint32_t(hi_lo) + lo_hi;  // Can't overflow
+  low = (cross << 32) | uint32_t(lo_lo);
+  return (hi_lo >> 32) + (cross >> 32) + hi_hi;
+#endif
+}
+
+
+// Eisel-Lemire: w * 10^q correctly rounded, for w non-zero, from w times the top 128 bits of 5^q (pow5_table.h).
+// The second 64 bits of the table are only needed when the first product leaves the rounding bits unsettled,
+// and with 128 bits the result is always settled (Mushtak and Lemire, "Fast Number Parsing Without Fallback").
+// Below the table the result is 0, and above it infinity.
+//
+static double eisel_lemire(uint64_t w, int q) {
+  if(POW5_TABLE_MIN > q) return 0.0;
+  if(POW5_TABLE_MAX < q) return HUGE_VAL;
+  int             zeros   = __builtin_clzll(w);
+  const uint64_t* power   = &pow5_table[2 * (q - POW5_TABLE_MIN)];
+  uint64_t        low;
+  w <<= zeros;
+  uint64_t        high    = multiply_128(w, power[0], low);
+  if(0x1FF == (high & 0x1FF)) {                               // The bits below the 55 that matter are all ones: a carry could change them
+    uint64_t      extra;
+    uint64_t      carry   = multiply_128(w, power[1], extra);
+    low  += carry;
+    high += (low < carry);
+  }
+  int       upper     = int(high >> 63);
+  int       shift     = upper + 9;                            // Keep 54 bits: the 53 of a double and one for rounding
+  uint64_t  mantissa  = high >> shift;
+  int       power2    = (((152170 + 65536) * q) >> 16) + 63 + upper - zeros + 1023;  // floor(q * log2(10)) + 63, biased
+  if(0 >= power2) {                                           // Subnormal
+    if(64 <= 1 - power2) return 0.0;
+    mantissa >>= 1 - power2;
+    mantissa  += mantissa & 1;
+    mantissa >>= 1;
+    return ldexp(double(mantissa), -1074);
+  }
+  // Round half up, unless the product is exactly halfway: only possible for small q, where the powers are exact
+  if(1 >= low && -4 <= q && 23 >= q && 1 == (mantissa & 3) && (mantissa << shift) == high) mantissa &= ~uint64_t(1);
+  mantissa  += mantissa & 1;
+  mantissa >>= 1;
+  if(uint64_t(2) << 52 <= mantissa) {
+    mantissa >>= 1;
+    power2++;
+  }
+  if(0x7FF <= power2) return HUGE_VAL;
+  return ldexp(double(mantissa), power2 - 1075);              // mantissa has 53 bits, so this is exact
+}
+
+
+static const double exact_powers_of_ten[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+  1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+static int digit_value(char c) {
+  if('0' <= c && '9' >= c) return c - '0';
+  if('a' <= c && 'f' >= c) return c - 'a' + 10;
+  if('A' <= c && 'F' >= c) return c - 'A' + 10;
+  return 99;
+}
+
+// Is p at a digit separator that sits between two digits of the radix?
+//
+static bool is_separator(const char* p, const char* start, const char* end, int radix) {
+  return ('_' == *p || '\'' == *p) && start < p && p + 1 < end && digit_value(p[-1]) < radix && digit_value(p[1]) < radix;
+}
+
+
+// An integer literal with a radix prefix: 0x, 0b or 0o. p points past the prefix.
+//
+static Op_Err parse_radix(const char* p, const char* end, int radix, double& val, const char*& stop) {
+  const char* start     = p;
+  uint64_t    n         = 0;
+  bool        digits    = false;
+  bool        overflow  = false;                              // More than 64 bits: keep consuming digits, then report it
+  for(; p < end; p++) {
+    if(is_separator(p, start, end, radix)) continue;
+    int d = digit_value(*p);
+    if(d >= radix) break;
+    if(n > (UINT64_MAX - d) / radix) overflow = true;
+    n       = n * radix + d;
+    digits  = true;
+  }
+  if(!digits) return ERROR_INVALID_NUMBER;
+  stop = p;
+  val  = double(n);                                           // Correctly rounded by the conversion
+  return overflow ? ERROR_OVERFLOW : NO_ERROR;
+}
+
+
+Op_Err parse_number(const char* text, size_t length, double& val, size_t* consumed) {
+  const char* p         = text;
+  const char* end       = text + length;
+  bool        negative  = false;
+  double      result    = 0.0;
+  Op_Err      err       = NO_ERROR;
+  if(p < end && ('-' == *p || '+' == *p)) negative = ('-' == *p++);
+
+  if(p + 1 < end && '0' == *p && p[1] && strchr("xXbBoO", p[1])) {
+    int radix = ('x' == (p[1] | 0x20)) ? 16 : ('b' == (p[1] | 0x20)) ? 2 : 8;
+    err       = parse_radix(p + 2, end, radix, result, p);
+    if(ERROR_INVALID_NUMBER == err) return err;
+  }
+  else {
+    // Collect significant digits into an integer w, so the value is w * 10^exponent
+    uint64_t    w         = 0;
+    int         kept      = 0;                                // Significant digits in w (or in big)
+    int         exponent  = 0;
+    bool        tail      = false;                            // Non-zero digits were dropped past NUMBER_MAX_PARSE_DIGITS
+    bool        digits    = false;
+    bool        dot       = false;
+    const char* start     = p;
+    BigInt      big;
+    for(; p < end; p++) {
+      if(is_separator(p, start, end, 10)) continue;
+      if('.' == *p) {
+        if(dot) break;
+        dot = true;
+        continue;
+      }
+      int d = digit_value(*p);
+      if(9 < d) break;
+      digits = true;
+      if(0 == kept && 0 == d) {                               // Leading zeros don't count
+        if(dot) exponent--;
+        continue;
+      }
+      if(kept < 19) w = w * 10 + d;
+      else if(kept < NUMBER_MAX_PARSE_DIGITS) {
+        if(19 == kept) big = BigInt(w);
+        big.multiply_add(10, d);
+      }
+      else {
+        if(d) tail = true;
+        if(!dot) exponent++;
+        continue;
+      }
+      kept++;
+      if(dot) exponent--;
+    }
+    if(!digits) return ERROR_INVALID_NUMBER;
+
+    // Optional exponent. An e without digits is not part of the number.
+    if(p < end && ('e' == *p || 'E' == *p)) {
+      const char* e     = p + 1;
+      bool        minus = false;
+      if(e < end && ('-' == *e || '+' == *e)) minus = ('-' == *e++);
+      if(e < end && '0' <= *e && '9' >= *e) {
+        int n = 0;
+        for(; e < end && '0' <= *e && '9' >= *e; e++) {
+          if(100000 > n) n = n * 10 + (*e - '0');             // Saturate: anything this large is 0 or infinity anyway
+        }
+        exponent += minus ? -n : n;
+        p         = e;
+      }
+    }
+
+    if(0 == kept) result = 0.0;
+    else if(kept + exponent > 310) err = ERROR_OVERFLOW;
+    else if(kept + exponent < -325) result = 0.0;
+    else if(kept <= 19 && w <= (uint64_t(1) << 53) && -22 <= exponent && 22 >= exponent) {
+      // Clinger's fast path: both operands are exact doubles, so one operation rounds correctly
+      result = (0 > exponent) ? double(w) / exact_powers_of_ten[-exponent] : double(w) * exact_powers_of_ten[exponent];
+    }
+    else if(kept <= 19) {
+      result = eisel_lemire(w, exponent);
+      if(isinf(result)) err = ERROR_OVERFLOW;
+    }
+    else if(eisel_lemire(w, exponent + kept - 19) == (result = eisel_lemire(w + 1, exponent + kept - 19))) {
+      // w holds the first 19 digits, so the value lies between w and w + 1 at that scale: if both round the
+      // same way, so does the value
+      if(isinf(result)) err = ERROR_OVERFLOW;
+    }
+    else {
+      if(kept <= 19) big = BigInt(w);
+      uint64_t  top;
+      bool      sticky;
+      if(0 <= exponent) {
+        // w * 10^e = (w * 5^e) * 2^e
+        big.multiply_pow5(exponent);
+        int shift = big.top_bits(top, sticky);
+        result    = round_to_double(top, shift + exponent, sticky || tail);
+      }
+      else {
+        // w / 10^-e = (w * 2^s / 5^-e) * 2^(e - s), with s chosen so the quotient has 55 or 56 bits
+        BigInt divisor(1);
+        divisor.multiply_pow5(-exponent);
+        int s = divisor.bit_length() - big.bit_length() + 55;
+        if(0 <= s) big.shift_left(s);
+        else       divisor.shift_left(-s);
+        int qbits = big.bit_length() - divisor.bit_length();  // The quotient has qbits or qbits + 1 bits
+        divisor.shift_left(qbits);
+        uint64_t quotient = 0;
+        for(int i = qbits; 0 <= i; i--) {
+          quotient <<= 1;
+          if(0 <= big.compare(divisor)) {
+            big.subtract(divisor);
+            quotient |= 1;
+          }
+          divisor.shift_right_one();
+        }
+        result = round_to_double(quotient, exponent - s, 0 != big.size || tail);
+      }
+      if(isinf(result)) err = ERROR_OVERFLOW;
+    }
+  }
+
+  if(nullptr == consumed && p != end) return ERROR_INVALID_NUMBER;
+  if(consumed) *consumed = p - text;
+  if(ERROR_OVERFLOW == err) result = HUGE_VAL;
+  val = negative ? -result : result;
+  return err;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+// Fast, correctly rounded text to double conversion, the counterpart of NumberFormat.
+// Accepts decimal numbers with an optional fraction and exponent (-12.5e-3, .5, 5.), and integer
+// literals in hexadecimal (0x1F), binary (0b101) and octal (0o17). Digits may be grouped with _ or '
+// (1_000_000, 0b1010'0101), but only between two digits.
+// Most numbers take the exact double arithmetic fast path (Clinger). Nearly all of the rest are rounded
+// from a 128-bit product with a table of powers of five (Eisel-Lemire, see pow5_table.h). Only numbers
+// of more than 19 digits that lie too close to a tie for their first 19 to decide are rounded exactly with
+// a small fixed-size big integer. The time is bounded, nothing is allocated and the locale is never consulted.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include "CoreCalculator.h"
+
+
+#define NUMBER_MAX_PARSE_DIGITS   768   // Significant digits kept exactly. Halfway cases never need more, so any beyond only break ties
+
+
+// Convert the number at the start of text (length characters, no terminator needed) to val.
+// If consumed is nullptr the whole text must be a number; otherwise *consumed is set to the
+// number of characters used, and anything may follow.
+// Return NO_ERROR, ERROR_INVALID_NUMBER (val is unchanged), or ERROR_OVERFLOW (val is +/- infinity).
+//
+Op_Err parse_number(const char* text, size_t length, double& val, size_t* consumed = nullptr);
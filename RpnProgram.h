@@ -0,0 +1,301 @@
+#pragma once
+
+// Compiled expressions. An expression like "M[1] * M[2] + 5 %" is compiled once into a compact RPN
+// (postfix) bytecode program, which can then be re-evaluated with new memory values by a tight stack
+// interpreter, without re-tokenizing the text or rebuilding the shunting-yard stacks.
+// Programs may refer to the simple memory (M) and indexed memories (M[n]) as inputs.
+// RpnCache keeps recently compiled programs, keyed by their expression text.
+//
+// % follows the calculator convention: a + b % is a + a * b / 100 (likewise for -), and otherwise b % is b / 100.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include "MemoryCalculator.h"
+#include "ExpressionLexer.h"
+
+
+#define RPN_MAX_CODE        64          // Maximum number of instructions in a program
+#define RPN_MAX_CONSTANTS   16          // Maximum number of distinct constants in a program
+#define RPN_MAX_ADDRESSES   16          // Maximum number of distinct indexed memories a program reads
+#define RPN_STACK_DEPTH     16          // Maximum evaluation stack depth a program may need
+#define RPN_CACHE_SIZE       8          // Number of programs kept by RpnCache
+
+// Instructions of the RPN interpreter
+//
+enum RpnOpcode {
+  rpnConstant,          // Push constants[operand]
+  rpnMemory,            // Push the simple memory
+  rpnIndexedMemory,     // Push M[addresses[operand]]
+  rpnAdd,               // a b -> a+b
+  rpnSubtract,          // a b -> a-b
+  rpnMultiply,          // a b -> a*b
+  rpnDivide,            // a b -> a/b
+  rpnNegate,            // a -> -a
+  rpnSquare,            // a -> a*a
+  rpnSquareRoot,        // a -> sqrt(a)
+  rpnPercent,           // a -> a/100
+  rpnPercentOf          // a b -> a a*b/100  (the right hand side of a + b % or a - b %)
+};
+
+struct RpnInstruction {
+  uint8_t   opcode;     // An RpnOpcode
+  uint8_t   operand;    // Index into constants or addresses, if the opcode uses one
+};
+
+
+template <typename T>
+struct RpnProgram {
+  RpnInstruction  code[RPN_MAX_CODE];             // The instructions, in execution order
+  T               constants[RPN_MAX_CONSTANTS];   // Constants referenced by rpnConstant
+  Mem_Index       addresses[RPN_MAX_ADDRESSES];   // Indexed memories referenced by rpnIndexedMemory
+  uint8_t         length          = 0;            // Number of instructions in code
+  uint8_t         constant_count  = 0;            // Number of constants
+  uint8_t         address_count   = 0;            // Number of addresses
+  uint8_t         max_depth       = 0;            // Deepest evaluation stack the program reaches
+
+  bool            emit(uint8_t opcode, uint8_t operand = 0, int8_t depth_change = 0);
+  bool            emit_constant(T value);
+  bool            emit_address(Mem_Index address);
+  template <Mem_Index M>
+  Op_Err          run(MemoryCalculator<T, M>& calc, T& result) const;
+  protected:
+    uint8_t       _depth          = 0;            // Stack depth while compiling
+};
+
+
+// Compiles expression text into an RpnProgram, using the calculator's operator precedences.
+//   expression := operand { binary-operator expression }
+//   operand    := { + | - } ( number | M | M[n] | '(' expression ')' ) { % | s | r }
+//
+template <typename T, Mem_Index M>
+class RpnCompiler {
+  public:
+    RpnCompiler(MemoryCalculator<T, M>& calc) : _calc(calc) {}
+    bool          compile(const char* text, size_t length, RpnProgram<T>& program);   // Return false on a syntax error or if a limit is exceeded
+  protected:
+    MemoryCalculator<T, M>& _calc;
+    bool          _expression(ExpressionLexer& lexer, RpnProgram<T>& program, uint8_t min_precedence, bool percent_of_lhs);
+    bool          _operand(ExpressionLexer& lexer, RpnProgram<T>& program, bool percent_of_lhs);
+};
+
+
+// A small cache of compiled programs keyed by expression text. Entries are replaced round-robin.
+//
+template <typename T, Mem_Index M>
+class RpnCache {
+  public:
+    RpnCache(MemoryCalculator<T, M>& calc) : _compiler(calc) {}
+    const RpnProgram<T>*  get(const char* text);                 // Return the compiled program for text (compiling on a miss), or nullptr on a syntax error
+    void                  clear();                              // Forget every program
+    uint32_t              hits    = 0;                          // Number of lookups found in the cache
+    uint32_t              misses  = 0;                          // Number of lookups that had to compile
+  protected:
+    RpnCompiler<T, M>     _compiler;
+    RpnProgram<T>         _programs[RPN_CACHE_SIZE];
+    String                _texts[RPN_CACHE_SIZE];
+    uint32_t              _hashes[RPN_CACHE_SIZE] = {0};
+    uint8_t               _next                   = 0;          // Next entry to replace
+    static uint32_t       _hash(const char* text, size_t length);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  RpnProgram Implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Append an instruction, tracking the stack depth so run() never needs to check it.
+//
+template <typename T> bool RpnProgram<T>::emit(uint8_t opcode, uint8_t operand, int8_t depth_change) {
+  if(RPN_MAX_CODE <= length) return false;
+  _depth += depth_change;
+  if(RPN_STACK_DEPTH < _depth) return false;
+  if(_depth > max_depth) max_depth = _depth;
+  code[length].opcode  = opcode;
+  code[length].operand = operand;
+  length++;
+  return true;
+}
+
+template <typename T> bool RpnProgram<T>::emit_constant(T value) {
+  uint8_t index = 0;
+  while(index < constant_count && !(constants[index] == value)) index++;
+  if(index == constant_count) {
+    if(RPN_MAX_CONSTANTS <= constant_count) return false;
+    constants[constant_count++] = value;
+  }
+  return emit(rpnConstant, index, 1);
+}
+
+template <typename T> bool RpnProgram<T>::emit_address(Mem_Index address) {
+  uint8_t index = 0;
+  while(index < address_count && addresses[index] != address) index++;
+  if(index == address_count) {
+    if(RPN_MAX_ADDRESSES <= address_count) return false;
+    addresses[address_count++] = address;
+  }
+  return emit(rpnIndexedMemory, index, 1);
+}
+
+// Evaluate the program with the current memory values of calc. The engine's stacks are not touched.
+//
+template <typename T> template <Mem_Index M> Op_Err RpnProgram<T>::run(MemoryCalculator<T, M>& calc, T& result) const {
+  T   stack[RPN_STACK_DEPTH];
+  T*  top = stack - 1;
+  for(const RpnInstruction* ip = code; ip < code + length; ip++) {
+    switch(ip->opcode) {
+      case rpnConstant:       *++top = constants[ip->operand];              break;
+      case rpnMemory:         *++top = calc.get_memory();                   break;
+      case rpnIndexedMemory:  *++top = calc.get_memory(addresses[ip->operand]); break;
+      case rpnAdd:            top--; *top = *top + top[1];                  break;
+      case rpnSubtract:       top--; *top = *top - top[1];                  break;
+      case rpnMultiply:       top--; *top = *top * top[1];                  break;
+      case rpnDivide:         top--;
+                              if(T(0) == top[1]) return ERROR_DIVIDE_BY_ZERO;
+                              *top = *top / top[1];                         break;
+      case rpnNegate:         *top = -*top;                                 break;
+      case rpnSquare:         *top = *top * *top;                           break;
+      case rpnSquareRoot:     *top = T(sqrt(double(*top)));                 break;
+      case rpnPercent:        *top = *top / T(100);                         break;
+      case rpnPercentOf:      *top = top[-1] * *top / T(100);               break;
+    }
+  }
+  if(top != stack) return ERROR_TOO_FEW_OPERANDS;   // Only an empty program can get here
+  result = *top;
+  if(value_overflowed(result)) return ERROR_OVERFLOW;
+  return NO_ERROR;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  RpnCompiler Implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T, Mem_Index M> bool RpnCompiler<T, M>::compile(const char* text, size_t length, RpnProgram<T>& program) {
+  program = RpnProgram<T>();
+  ExpressionLexer lexer(text, length);
+  if(!_expression(lexer, program, 0, false)) return false;
+  if(tokenEvaluate == lexer.peek().type) lexer.next();           // A trailing = is allowed
+  return tokenEnd == lexer.peek().type;
+}
+
+// Precedence climbing: an operand, then any binary operators that bind at least as tightly as
+// min_precedence, each followed by its right hand side, then the operator's instruction.
+//
+template <typename T, Mem_Index M> bool RpnCompiler<T, M>::_expression(ExpressionLexer& lexer, RpnProgram<T>& program, uint8_t min_precedence, bool percent_of_lhs) {
+  if(!_operand(lexer, program, percent_of_lhs)) return false;
+  while(tokenOperator == lexer.peek().type) {
+    Op_ID   id          = lexer.peek().op;
+    uint8_t opcode;
+    switch(id) {
+      case ADDITION_OPERATOR:       opcode = rpnAdd;      break;
+      case SUBTRACTION_OPERATOR:    opcode = rpnSubtract; break;
+      case MULTIPLICATION_OPERATOR: opcode = rpnMultiply; break;
+      case DIVISION_OPERATOR:       opcode = rpnDivide;   break;
+      default:                      return false;         // Postfix operators are consumed by _operand
+    }
+    uint8_t precedence = _calc.get_precedence(id);
+    if(precedence < min_precedence) break;
+    lexer.next();
+    if(!_expression(lexer, program, precedence + 1, rpnAdd == opcode || rpnSubtract == opcode)) return false;
+    if(!program.emit(opcode, 0, -1)) return false;
+  }
+  return true;
+}
+
+// Signs, then a number, memory or parenthesized expression, then any postfix operators.
+// percent_of_lhs is true for the first operand of the right hand side of + or -.
+//
+template <typename T, Mem_Index M> bool RpnCompiler<T, M>::_operand(ExpressionLexer& lexer, RpnProgram<T>& program, bool percent_of_lhs) {
+  bool negate = false;
+  while(tokenOperator == lexer.peek().type && (ADDITION_OPERATOR == lexer.peek().op || SUBTRACTION_OPERATOR == lexer.peek().op)) {
+    if(SUBTRACTION_OPERATOR == lexer.peek().op) negate = !negate;
+    lexer.next();
+  }
+  const Token& token = lexer.peek();
+  if(tokenNumber == token.type) {
+    if(!program.emit_constant(T(token.value))) return false;
+    lexer.next();
+  }
+  else if(tokenMemory == token.type) {
+    lexer.next();
+    if(tokenOpenBracket == lexer.peek().type) {
+      lexer.next();
+      if(tokenNumber != lexer.peek().type) return false;
+      double d = lexer.peek().value;
+      if(0.0 > d || double(M) <= d || double(Mem_Index(d)) != d) return false;
+      lexer.next();
+      if(tokenCloseBracket != lexer.peek().type) return false;
+      lexer.next();
+      if(!program.emit_address(Mem_Index(d))) return false;
+    }
+    else if(!program.emit(rpnMemory, 0, 1)) return false;
+  }
+  else if(tokenOpenParen == token.type) {
+    lexer.next();
+    if(!_expression(lexer, program, 0, false)) return false;
+    if(tokenCloseParen != lexer.peek().type) return false;
+    lexer.next();
+  }
+  else return false;
+  if(negate && !program.emit(rpnNegate)) return false;
+  while(tokenOperator == lexer.peek().type) {
+    switch(lexer.peek().op) {
+      case SQUARE_OPERATOR:       if(!program.emit(rpnSquare))      return false; break;
+      case SQUARE_ROOT_OPERATOR:  if(!program.emit(rpnSquareRoot))  return false; break;
+      case PERCENT_OPERATOR:      if(!program.emit(percent_of_lhs ? rpnPercentOf : rpnPercent)) return false; break;
+      default:                    return true;
+    }
+    lexer.next();
+  }
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  RpnCache Implementation
+//
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T, Mem_Index M> const RpnProgram<T>* RpnCache<T, M>::get(const char* text) {
+  size_t    length  = strlen(text);
+  uint32_t  hash    = _hash(text, length);
+  for(uint8_t i = 0; i < RPN_CACHE_SIZE; i++) {
+    if(hash == _hashes[i] && _texts[i] == text) {
+      hits++;
+      return &_programs[i];
+    }
+  }
+  misses++;
+  uint8_t i   = _next;
+  _hashes[i]  = 0;                    // The entry is being overwritten; don't let a failed compile leave it findable
+  if(!_compiler.compile(text, length, _programs[i])) return nullptr;
+  _hashes[i]  = hash;
+  _texts[i]   = text;
+  _next       = (_next + 1) % RPN_CACHE_SIZE;
+  return &_programs[i];
+}
+
+template <typename T, Mem_Index M> void RpnCache<T, M>::clear() {
+  for(uint8_t i = 0; i < RPN_CACHE_SIZE; i++) {
+    _hashes[i] = 0;
+    _texts[i]  = "";
+  }
+}
+
+// FNV-1a. Zero is reserved for empty entries.
+//
+template <typename T, Mem_Index M> uint32_t RpnCache<T, M>::_hash(const char* text, size_t length) {
+  uint32_t hash = 2166136261UL;
+  for(size_t i = 0; i < length; i++) {
+    hash ^= uint8_t(text[i]);
+    hash *= 16777619UL;
+  }
+  return hash ? hash : 1;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+// A lock-free queue of N snapshots from one producer thread to one consumer thread, where only the latest
+// snapshot matters: take_latest() returns the newest one queued and drops the ones before it.
+// Snapshots are copied in and out, so neither thread ever sees the other's copy while it's being written.
+// publish() returns false when the consumer has fallen N snapshots behind; the producer should publish again later.
+// On the device the producer is loop() and the consumer is the render task on the other core (see screen_ui.cpp);
+// on a host they are std::threads.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <atomic>
+
+
+template <typename T, uint8_t N>
+class SnapshotQueue {
+  static_assert(0 == (N & (N - 1)), "N must be a power of two, so slots stay in order when the counts wrap");
+  public:
+    bool      publish(const T& snapshot);                       // Producer: queue a copy of snapshot. Return false if the queue is full
+    bool      take_latest(T& snapshot);                         // Consumer: copy out the newest snapshot and drop the rest. Return false if empty
+    uint32_t  published() const       { return _head.load(std::memory_order_relaxed); }  // Snapshots queued so far
+    uint32_t  skipped() const         { return _skipped; }      // Snapshots the consumer dropped for newer ones
+  protected:
+    T                     _slots[N];
+    std::atomic<uint32_t> _head{0};                             // Count of snapshots published; only the producer writes it
+    std::atomic<uint32_t> _tail{0};                             // Count of snapshots consumed or dropped; only the consumer writes it
+    uint32_t              _skipped = 0;
+};
+
+
+template <typename T, uint8_t N> bool SnapshotQueue<T, N>::publish(const T& snapshot) {
+  uint32_t head = _head.load(std::memory_order_relaxed);
+  if(N <= head - _tail.load(std::memory_order_acquire)) return false;
+  _slots[head % N] = snapshot;
+  _head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+
+// The slot is copied before _tail moves past it, so the producer can't reuse it during the copy
+//
+template <typename T, uint8_t N> bool SnapshotQueue<T, N>::take_latest(T& snapshot) {
+  uint32_t tail = _tail.load(std::memory_order_relaxed);
+  uint32_t head = _head.load(std::memory_order_acquire);
+  if(head == tail) return false;
+  snapshot  = _slots[(head - 1) % N];
+  _skipped += head - 1 - tail;
+  _tail.store(head, std::memory_order_release);
+  return true;
+}
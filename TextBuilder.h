@@ -0,0 +1,73 @@
+#pragma once
+
+// Builds a string in a caller-supplied buffer, usually on the stack, without allocating.
+// Text that doesn't fit is cut short and truncated() is set; the buffer is always terminated.
+// This is what the display strings are built with, so that redrawing the screen doesn't churn the heap.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "NumberFormat.h"
+
+
+class TextBuilder {
+  public:
+    TextBuilder(char* buffer, size_t size);                     // size includes the terminator, and must be at least 1
+    TextBuilder&  add(const char* text);
+    TextBuilder&  add(const char* text, size_t length);
+    TextBuilder&  add(char c);
+    TextBuilder&  add(uint32_t number);                         // Decimal digits
+    TextBuilder&  add(double val, uint8_t precision);           // As format_number() writes it
+    void          replace_last(char c)    { if(_length && !_truncated) _buffer[_length - 1] = c; }  // Once cut short, the last character isn't the one meant
+    const char*   c_str() const           { return _buffer; }
+    size_t        length() const          { return _length; }
+    bool          truncated() const       { return _truncated; }
+  protected:
+    char*         _buffer;
+    size_t        _size;
+    size_t        _length     = 0;
+    bool          _truncated  = false;
+};
+
+
+inline TextBuilder::TextBuilder(char* buffer, size_t size) : _buffer(buffer), _size(size) {
+  _buffer[0] = '\0';
+}
+
+inline TextBuilder& TextBuilder::add(const char* text) {
+  return add(text, strlen(text));
+}
+
+inline TextBuilder& TextBuilder::add(const char* text, size_t length) {
+  if(_size - 1 - _length < length) {
+    length      = _size - 1 - _length;
+    _truncated  = true;
+  }
+  memcpy(_buffer + _length, text, length);
+  _length += length;
+  _buffer[_length] = '\0';
+  return *this;
+}
+
+inline TextBuilder& TextBuilder::add(char c) {
+  return add(&c, 1);
+}
+
+inline TextBuilder& TextBuilder::add(uint32_t number) {
+  char  digits[10];
+  char* p = digits + sizeof(digits);
+  do {
+    *--p    = '0' + number % 10;
+    number /= 10;
+  } while(number);
+  return add(p, digits + sizeof(digits) - p);
+}
+
+inline TextBuilder& TextBuilder::add(double val, uint8_t precision) {
+  char text[NUMBER_BUFFER_SIZE];
+  return add(text, format_number(val, text, sizeof(text), precision));
+}
@@ -4,51 +4,55 @@
 #define DEBUG_PURGE     0
 
 
-TextCalculator::TextCalculator(uint8_t precision) {
+TextCalculator::TextCalculator(uint8_t precision) : _programs(_calc), _formulas(_calc) {
   _precision  = precision;
   _ops        = { ADDITION_OPERATOR, SUBTRACTION_OPERATOR, MULTIPLICATION_OPERATOR, DIVISION_OPERATOR,
                   OPEN_PAREN_OPERATOR, CLOSE_PAREN_OPERATOR, EVALUATE_OPERATOR, PERCENT_OPERATOR,
                   SQUARE_OPERATOR, SQUARE_ROOT_OPERATOR };
   _mem_ops    = { ADDITION_OPERATOR, SUBTRACTION_OPERATOR, MULTIPLICATION_OPERATOR, DIVISION_OPERATOR,
                   EVALUATE_OPERATOR, PERCENT_OPERATOR, MEMORY_OPERATOR, CLEAR_OPERATOR };
-  _nums       = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '.' };
-  _wspace     = { ' ', '\t', '\n', '\r' };
   enter("0");   // Start with an empty value on the stack.
 }
 
 
 // Parse a string and return true if no errors encountered.
-// Issue: This approach doesn't handle unary +/-
 //
 bool TextCalculator::parse(const char* statement) {
-  int   index = 0;
-  char  buffer[64];
-  if(DEBUG_PARSING) Serial.printf("\nDebugging parse(%s)\n", statement);
-  while(index < strlen(statement)) {
-    char c = statement[index++];
-    // Skip over whitespace
-    if(!is_wspace(c)) {
-      if(is_operator(c)) {
-        if(DEBUG_PARSING) Serial.printf("Pushing operator %c\n", c);
-        if(!enter(c)) {
-          if(DEBUG_PARSING) Serial.println("Error pushing operator! Returning false\n");
-          return false;
-        }
-      }
-      if(is_numeric(c)) {
-        int bi = 1;
-        buffer[0] = c;
-        if(DEBUG_PARSING) Serial.println("Parsing number");
-        while(is_numeric(statement[index])) {
-          buffer[bi++] = statement[index++];
-        }
-        buffer[bi] = '\0';
-        if(DEBUG_PARSING) Serial.printf("Pushing value %s\n", buffer);
-        if(!enter(buffer)) {
-          if(DEBUG_PARSING) Serial.println("Error pushing value! Returning false\n");
-          return false;
-        }
-      }
+  return parse(statement, strlen(statement));
+}
+
+
+// Parse a string view in one pass and return true if no errors encountered.
+// Tokens are pushed straight into the calculator as they are recognized; the engine's shunting-yard
+// evaluation resolves precedence exactly as it does for keyboard input. The parser validates the grammar
+// and handles the cases the engine can't see: unary signs, exponents and matching parentheses.
+//   statement := { '=' | [ * / % s r ] expression }     (a leading operator continues from the current value)
+//   expression := operand { binary-operator expression }
+//   operand    := { + | - } ( number | '(' expression ')' ) { % | s | r }
+//
+bool TextCalculator::parse(const char* statement, size_t length) {
+  ExpressionLexer lexer(statement, length);
+  if(DEBUG_PARSING) Serial.printf("\nDebugging parse(%.*s)\n", int(length), statement);
+  while(tokenEnd != lexer.peek().type) {
+    const Token& token = lexer.peek();
+    if(tokenEvaluate == token.type) {
+      if(DEBUG_PARSING) Serial.println("Evaluating");
+      if(!enter(EVALUATE_OPERATOR)) return false;
+      lexer.next();
+      continue;
+    }
+    if(tokenOperator == token.type && ADDITION_OPERATOR != token.op && SUBTRACTION_OPERATOR != token.op) {
+      Op_ID id = token.op;
+      if(DEBUG_PARSING) Serial.printf("Continuing from current value with operator %c\n", id);
+      if(!enter(id)) return false;
+      lexer.next();
+      if(!_is_postfix_operator(id) && !_parse_expression(lexer, 0)) return false;
+      continue;
+    }
+    if(!_parse_expression(lexer, 0)) return false;
+    if(tokenEnd != lexer.peek().type && tokenEvaluate != lexer.peek().type) {
+      if(DEBUG_PARSING) Serial.printf("Unexpected '%c'. Returning false\n", *lexer.position());
+      return false;
     }
   }
   if(DEBUG_PARSING) Serial.println("Parse complete");
@@ -56,6 +60,143 @@ bool TextCalculator::parse(const char* statement) {
 }
 
 
+// Return true for the operators that follow their operand: % s r
+//
+bool TextCalculator::_is_postfix_operator(Op_ID id) {
+  return PERCENT_OPERATOR == id || SQUARE_OPERATOR == id || SQUARE_ROOT_OPERATOR == id;
+}
+
+
+// Precedence climbing: an operand, then any binary operators that bind at least as tightly as
+// min_precedence, each followed by its right hand side. Operators are left associative.
+//
+bool TextCalculator::_parse_expression(ExpressionLexer& lexer, uint8_t min_precedence) {
+  if(!_parse_operand(lexer)) return false;
+  while(tokenOperator == lexer.peek().type) {
+    Op_ID   id          = lexer.peek().op;
+    uint8_t precedence  = _calc.get_precedence(id);
+    if(precedence < min_precedence) break;
+    if(DEBUG_PARSING) Serial.printf("Pushing operator %c\n", id);
+    if(!enter(id)) return false;
+    lexer.next();
+    if(!_parse_expression(lexer, precedence + 1)) return false;
+  }
+  return true;
+}
+
+
+// Signs, then a number or a parenthesized expression, then any postfix operators (% s r).
+// Unary minus is pushed as the NEGATE_OPERATOR prefix; unary plus is ignored.
+//
+bool TextCalculator::_parse_operand(ExpressionLexer& lexer) {
+  while(tokenOperator == lexer.peek().type && (ADDITION_OPERATOR == lexer.peek().op || SUBTRACTION_OPERATOR == lexer.peek().op)) {
+    if(SUBTRACTION_OPERATOR == lexer.peek().op && !enter(NEGATE_OPERATOR)) return false;
+    lexer.next();
+  }
+  const Token& token = lexer.peek();
+  if(tokenNumber == token.type) {
+    if(DEBUG_PARSING) Serial.printf("Pushing value %.*s\n", int(token.length), token.text);
+    if(!_enter_value(token.value)) return false;
+    lexer.next();
+  }
+  else if(tokenOpenParen == token.type) {
+    if(!enter(OPEN_PAREN_OPERATOR)) return false;
+    lexer.next();
+    if(!_parse_expression(lexer, 0)) return false;
+    if(tokenCloseParen != lexer.peek().type) {
+      if(DEBUG_PARSING) Serial.println("Missing close paren. Returning false");
+      return false;
+    }
+    if(!enter(CLOSE_PAREN_OPERATOR)) return false;
+    lexer.next();
+  }
+  else {
+    if(DEBUG_PARSING) Serial.println("Expected a number or open paren. Returning false");
+    return false;
+  }
+  while(tokenOperator == lexer.peek().type) {
+    Op_ID id = lexer.peek().op;
+    if(!_is_postfix_operator(id)) break;
+    if(!enter(id)) return false;
+    lexer.next();
+  }
+  return true;
+}
+
+
+// Compile an expression to RPN bytecode, or find it already compiled in the cache.
+// Return nullptr if the expression is not valid. The program remains valid until evicted by later compiles.
+//
+const RpnProgram<double>* TextCalculator::compile(const char* expression) {
+  return _programs.get(expression);
+}
+
+
+// Run a compiled program against the current memories and enter the result as a value.
+// The operator stack is not involved, so this is much cheaper than parse() for a repeated calculation.
+//
+bool TextCalculator::evaluate(const RpnProgram<double>* program) {
+  if(nullptr == program) return false;
+  double  result;
+  Op_Err  err = program->run(_calc, result);
+  if(NO_ERROR != err) {
+    _calc.set_error_state(err);
+    return false;
+  }
+  return _enter_value(result);
+}
+
+
+bool TextCalculator::evaluate(const char* expression) {
+  return evaluate(compile(expression));
+}
+
+
+// Make M[index] a formula memory. Its value is computed now, and again whenever a memory it reads changes.
+// Return ERROR_INVALID_FORMULA if it doesn't compile, ERROR_CIRCULAR_REFERENCE if it would depend on itself,
+// or any error from evaluating it.
+//
+Op_Err TextCalculator::set_formula(Mem_Index index, const char* formula) {
+  return _formulas.set_formula(index, formula);
+}
+
+
+// Parse "M[n] = formula" and set the formula
+//
+Op_Err TextCalculator::set_formula(const char* statement) {
+  ExpressionLexer lexer(statement, strlen(statement));
+  if(tokenMemory != lexer.peek().type) return ERROR_INVALID_FORMULA;
+  lexer.next();
+  if(tokenOpenBracket != lexer.peek().type) return ERROR_INVALID_FORMULA;
+  lexer.next();
+  double index = lexer.peek().value;
+  if(tokenNumber != lexer.peek().type || 0.0 > index || NUM_CALC_MEMORIES <= index || double(Mem_Index(index)) != index) return ERROR_INVALID_FORMULA;
+  lexer.next();
+  if(tokenCloseBracket != lexer.peek().type) return ERROR_INVALID_FORMULA;
+  lexer.next();
+  if(tokenEvaluate != lexer.peek().type) return ERROR_INVALID_FORMULA;
+  lexer.next();
+  return set_formula(Mem_Index(index), lexer.position());
+}
+
+
+bool TextCalculator::clear_formula(Mem_Index index) {
+  return _formulas.clear_formula(index);
+}
+
+
+const char* TextCalculator::get_formula(Mem_Index index) {
+  return _formulas.get_formula(index);
+}
+
+
+// Formula evaluations so far, for measuring incremental updates
+//
+uint32_t TextCalculator::formulas_recomputed() {
+  return _formulas.recomputed;
+}
+
+
 // String overload for the parse command
 //
 String TextCalculator::parse(String statement) {
@@ -72,15 +213,33 @@ String TextCalculator::parse(String statement) {
 // Otherwise, 1+1= 1+1= 1+1= results in a useless value_stack containing [2 2 2]
 //
 bool TextCalculator::enter(const char* value) {
+  double val;
+  if(!_string_to_double(value, val)) return false;
+  return _enter_value(val);
+}
+
+
+// Push val, first clearing the value stack if the operator stack is empty (see above)
+//
+bool TextCalculator::_enter_value(double val) {
   if(0 == _calc.operator_stack.size()) {
-    if(DEBUG_PURGE) Serial.printf("Clearing value stack before entering %s\n", value);
+    if(DEBUG_PURGE) Serial.printf("Clearing value stack before entering %f\n", val);
     _calc.value_stack.clear();
   }
-  double val = _string_to_double(value);
   return NO_ERROR == _calc.push_value(val);
 }
 
 
+// Replace the top of the value stack with val, or push it if the stack is empty,
+// so the value isn't written into a slot outside the stack and lost
+//
+bool TextCalculator::_replace_value(double val) {
+  if(0 == _calc.value_stack.size()) return NO_ERROR == _calc.push_value(val);
+  _calc.value_stack.back() = val;
+  return true;
+}
+
+
 // String overload for enter value
 //
 bool TextCalculator::enter(String value) {
@@ -90,10 +249,10 @@ bool TextCalculator::enter(String value) {
 
 // Pushing the Open Paren operator is handled like pushing a value, because the paren will evaluate
 // to a value. Clear the value stack in this case if the operator stack is empty, or we get values
-// piled up which will never be evaluated.
+// piled up which will never be evaluated. The same goes for the prefix Negate operator.
 //
 bool TextCalculator::enter(Op_ID id) {
-  if((OPEN_PAREN_OPERATOR == id) && (0 == _calc.operator_stack.size())) _calc.value_stack.clear();
+  if((OPEN_PAREN_OPERATOR == id || NEGATE_OPERATOR == id) && (0 == _calc.operator_stack.size())) _calc.value_stack.clear();
   return (NO_ERROR == _calc.push_operator(id));
 }
 
@@ -114,7 +273,8 @@ String TextCalculator::value() {
 // Replace (do not push) current value
 //
 void TextCalculator::set_value(const char* value) {
-  _calc.value_stack.back() = _string_to_double(value);
+  double val;
+  if(_string_to_double(value, val)) _replace_value(val);
 }
 
 
@@ -134,7 +294,7 @@ void TextCalculator::copy_to_memory() {
 
 // Copy current value() to M[index]
 //
-bool TextCalculator::copy_to_memory(uint8_t index) {
+bool TextCalculator::copy_to_memory(Mem_Index index) {
   return NO_ERROR == _calc.set_memory(index, _calc.get_value());
 }
 
@@ -149,24 +309,22 @@ void TextCalculator::push() {
 // Replace value() with M
 //
 bool TextCalculator::recall_memory() {
-  _calc.value_stack.back() = _calc.get_memory();
-  return true;
+  return _replace_value(_calc.get_memory());
 }
 
 
 // Replace value() with M[index]
 //
-bool TextCalculator::recall_memory(uint8_t index) {
-  if(NUM_CALC_MEMORIES - 1 <= index) return false;
-  _calc.value_stack.back() = _calc.get_memory(index);
-  return true;
+bool TextCalculator::recall_memory(Mem_Index index) {
+  if(NUM_CALC_MEMORIES <= index) return false;
+  return _replace_value(_calc.get_memory(index));
 }
 
 
 // Pop a value off the memory stack and replace value() with it
 //
 void TextCalculator::pop() {
-  _calc.value_stack.back() = _calc.pop_memory();
+  _replace_value(_calc.pop_memory());
 }
 
 
@@ -180,6 +338,7 @@ void TextCalculator::clear_memory() {
 // Clear M, all M[], and the memory stack, plus op and value stack
 //
 void TextCalculator::clear_all() {
+  _formulas.clear();
   _calc.clear_all_memory();
   _calc.operator_stack.clear();
   _calc.value_stack.clear();
@@ -201,17 +360,18 @@ bool TextCalculator::is_mem_operator(Op_ID id) {
 }
 
 
-// Return true if c is in _nums
+// Return true if c is a digit or decimal point
 //
 bool TextCalculator::is_numeric(char c) {
-  return (_nums.find(Op_ID(c)) != _nums.end());
+  CharClass cc = CharClassTable::get()[c];
+  return charDigit == cc || charDot == cc;
 }
 
 
-// Return true if c is in _wspace
+// Return true if c is whitespace
 //
 bool TextCalculator::is_wspace(char c) {
-  return (_wspace.find(Op_ID(c)) != _wspace.end());
+  return charSpace == CharClassTable::get()[c];
 }
 
 
@@ -229,49 +389,40 @@ void TextCalculator::clear_error_state() {
 }
 
 
-// Convert the value to a string, with no trailing decimal point, with specified precision.
-// This algorithm only works for positive numbers, so for negative numbers
-// insert a - in the buffer and invert val
+// Convert the value to a string, with no trailing decimal point or zeros, rounded to _precision decimal places.
+// See NumberFormat.h: the digits are the shortest that round-trip, so 0.1 displays as 0.1.
 //
 String TextCalculator::double_to_string(double val) {
-  if(0.0 == val) return String("0");
-  double  threshold   = 1.0 / pow(10.0, _precision);  // Precision is a private member variable
-  int     m           = log10(ceil(abs(val)));
-  char    buffer[64]  = {0};
-  int     digit       = 0;
-  char*   p           = buffer;
-
-  if(0.0 > val) {
-    val    = -val;
-    *(p++) = '-';
-  }
-  while((0 <= m) || (val > threshold)) {
-    double weight = pow(10.0, m);
-    digit = floor(val / weight);
-    val  -= (digit * weight);
-    *(p++)= '0' + digit;
-    if(m == 0) *(p++) = '.';
-    *p    = '\0';
-    m--;
-  }
-  // if the last character is a '.', delete it
-  if('.' == *(p-1)) *(p-1) = '\0';
-
-  // Numbers like 9.9 produce the string 09.9. Also -09.9.
-  // reset p to beginning of buffer
-  p = buffer;
-  if(3 <= strlen(buffer) && '-' == buffer[0] && '0' == buffer[1] && '.' != buffer[2]) {
-    // We have -0N.NN Eliminate the second character of the buffer.
-    p++;      // Advance the pointer from - to 0
-    *p = '-'; // Replace the 0 with a -
-  }
-  else if(2 <= strlen(buffer) && '0' == buffer[0] && '.' != buffer[1]) {
-    p++;      // We have 0N or 0NN.NNN Eliminate the first character of the buffer.
+  char buffer[NUMBER_BUFFER_SIZE];
+  double_to_string(val, buffer, sizeof(buffer));
+  return String(buffer);
+}
+
+
+// Convert to a display string in buffer, without allocating. Values redisplayed unchanged come from _formats.
+//
+size_t TextCalculator::double_to_string(double val, char* buffer, size_t size) {
+  size_t      length;
+  const char* text = _formats.format(val, _precision, length);
+  if(size <= length) {
+    if(size) buffer[0] = '\0';
+    return 0;
   }
-  return String(p);
+  memcpy(buffer, text, length + 1);
+  return length;
+}
+
+
+// Convert val with parse_number. If it isn't a valid number, or overflows, set the error state and return false.
+//
+bool TextCalculator::_string_to_double(const char* val, double& result) {
+  return _string_to_double(val, strlen(val), result);
 }
 
 
-double TextCalculator::_string_to_double(const char* val) {
-  return atof(val);     // trivial implementation; will use precision and base later
+bool TextCalculator::_string_to_double(const char* val, size_t length, double& result) {
+  Op_Err err = parse_number(val, length, result);
+  if(NO_ERROR == err) return true;
+  _calc.set_error_state(err);
+  return false;
 }
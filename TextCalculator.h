@@ -12,8 +12,12 @@
 
 #include <set>
 #include "MemoryCalculator.h"
+#include "ExpressionLexer.h"
+#include "RpnProgram.h"
+#include "FormulaSheet.h"
+#include "NumberFormat.h"
 
-#define NUM_CALC_MEMORIES   100
+#define NUM_CALC_MEMORIES   100000              // M[0] - M[99999]. Memories are sparse: only those in use take space
 #define MEMORY_OPERATOR     (uint8_t('M'))
 
 // enum CalcMode { Calc_Mode_FP, Calc_Mode_Integer };
@@ -25,38 +29,56 @@ class TextCalculator {
   public:
     TextCalculator(uint8_t precision = 8);
     bool                parse(const char* statement);       // Evaluate a statement, like: "1 + 5 / 3.2 * 7.3167 - 8 * 33.33 ="
+    bool                parse(const char* statement, size_t length);  // Overload for a string view (need not be terminated)
     String              parse(String statement);            // Overload for String data type
     bool                enter(const char* value);           // Push a numeric value (expressed in characters) onto the value stack
     bool                enter(String value);                // Push numeric value overload for String data type
     bool                enter(Op_ID id);                    // Enter an operator, like '+', '-', '='
+    const RpnProgram<double>* compile(const char* expression);   // Compile an expression (using M and M[n] as inputs) to a cached program, or nullptr
+    bool                evaluate(const RpnProgram<double>* program);  // Run a compiled program with current memories and enter the result as a value
+    bool                evaluate(const char* expression);   // Compile (or find in the cache) and evaluate, like: "M[1] * M[2] + 5 %"
+    Op_Err              set_formula(Mem_Index index, const char* formula);  // Make M[index] a formula memory, like "M[1] * M[2] + 5"
+    Op_Err              set_formula(const char* statement); // Overload taking an assignment, like: "M[3] = M[1] * M[2] + 5"
+    bool                clear_formula(Mem_Index index);     // Keep M[index]'s value but drop its formula
+    const char*         get_formula(Mem_Index index);       // The formula of M[index], or nullptr if it holds a plain value
+    uint32_t            formulas_recomputed();              // Formula evaluations so far, for measuring incremental updates
+    const FormatCache&  format_cache() const { return _formats; }  // The double_to_string() cache, for its hit rate
     Op_Err              total();                            // Evaluate all operations (like pushing '=')
     String              value();                            // Returns the current value from the top of the value stack as a String
     void                set_value(const char* value);       // Replace (do not push) current value
     void                set_value(String value);            // String overload for set_value
 
     void                copy_to_memory();                   // Copy current value() to M
-    bool                copy_to_memory(uint8_t index);      // Copy current value() to M[index]
+    bool                copy_to_memory(Mem_Index index);    // Copy current value() to M[index]
     void                push();                             // Push a copy of the current value() onto the memory stack
     bool                recall_memory();                    // Replace value() with M
-    bool                recall_memory(uint8_t index);       // Replace value() with M[index]
+    bool                recall_memory(Mem_Index index);     // Replace value() with M[index]
     void                pop();                              // Pop a value off the memory stack and replace value() with it
     void                clear_memory();                     // Clear only M
     void                clear_all();                        // Clear M, all M[], and the memory stack, plus op and value stack
 
     bool                is_operator(Op_ID id);              // Return true if id is in _ops
     bool                is_mem_operator(Op_ID id);          // Return true if id is in _mem_ops
-    bool                is_numeric(char c);                 // Return true if c is in _nums
-    bool                is_wspace(char c);                  // Return true if c is in _wspace
+    bool                is_numeric(char c);                 // Return true if c is a digit or decimal point
+    bool                is_wspace(char c);                  // Return true if c is whitespace
 
     Op_Err              get_error_state();                  // Get the current calculator global error state
     void                clear_error_state();                // Clear the calculator global error state
     String              double_to_string(double val);       // Convert to a display string, eliminating unneeded characters
+    size_t              double_to_string(double val, char* buffer, size_t size);  // Write it into buffer without allocating. Return the length, or 0 if it doesn't fit
     MemoryCalculator<double, NUM_CALC_MEMORIES>   _calc;    // The calculator engine embedded within
   protected:
+    RpnCache<double, NUM_CALC_MEMORIES> _programs;          // Recently compiled expressions
+    FormulaSheet<double, NUM_CALC_MEMORIES> _formulas;      // Formula memories and their dependencies
     std::set<Op_ID>     _ops;                               // A set of all the known Op_IDs
     std::set<Op_ID>     _mem_ops;                           // A set of all the Op_IDs for memory mode
-    std::set<char>      _nums;                              // A set of all numeric characters (including . but not + -)
-    std::set<char>      _wspace;                            // A set of all whitespace characters
     uint8_t             _precision;                         // Precision to use in double_to_string()
-    double              _string_to_double(const char* val); // Convert string to a value
+    FormatCache         _formats;                           // Recently formatted values, for double_to_string()
+    bool                _string_to_double(const char* val, double& result);  // Convert string to a value, setting the error state on failure
+    bool                _string_to_double(const char* val, size_t length, double& result);  // Overload for a string view
+    bool                _enter_value(double val);           // Push a value, clearing the value stack if no operation is pending
+    bool                _replace_value(double val);         // Replace the top value, or push it if the value stack is empty
+    bool                _parse_expression(ExpressionLexer& lexer, uint8_t min_precedence);  // Parse operands and binary operators binding at least min_precedence
+    bool                _parse_operand(ExpressionLexer& lexer);       // Parse signs, a number or parenthesized expression, and postfix operators
+    bool                _is_postfix_operator(Op_ID id);     // Return true for the operators that follow their operand: % s r
 };
@@ -0,0 +1,55 @@
+#pragma once
+
+// A bounded undo/redo history of N states of type S, kept in a ring.
+// record() returns the slot for a new state after the current one, discarding any states that could have
+// been redone, and the oldest state when the ring is full. undo() and redo() move through the states.
+// S should be cheap to assign (see MemoryCalculator::State), since each record() assigns into a recycled slot.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdint.h>
+
+
+template <typename S, uint8_t N>
+class UndoHistory {
+  public:
+    S&        record();                                         // The slot for a new current state
+    const S*  undo();                                           // Step back to the previous state and return it, or nullptr if there is none
+    const S*  redo();                                           // Step forward to the next state and return it, or nullptr if there is none
+    bool      can_undo() const  { return 0 < _current; }
+    bool      can_redo() const  { return _current + 1 < _count; }
+    uint8_t   capacity() const  { return N; }                   // Maximum number of states, including the current one
+  protected:
+    S         _states[N];
+    uint8_t   _first    = 0;                                    // Ring index of the oldest state
+    uint8_t   _count    = 0;                                    // Number of states held
+    uint8_t   _current  = 0;                                    // The current state, counting from the oldest
+    S&        _at(uint8_t position) { return _states[(_first + position) % N]; }
+};
+
+
+template <typename S, uint8_t N> S& UndoHistory<S, N>::record() {
+  if(0 == _count) {
+    _count = 1;
+    return _at(0);
+  }
+  _count = _current + 1;                                        // Forget what could have been redone
+  if(N == _count) {
+    _first = (_first + 1) % N;                                  // Forget the oldest state
+    _count--;
+  }
+  _current = _count++;
+  return _at(_current);
+}
+
+template <typename S, uint8_t N> const S* UndoHistory<S, N>::undo() {
+  if(!can_undo()) return nullptr;
+  return &_at(--_current);
+}
+
+template <typename S, uint8_t N> const S* UndoHistory<S, N>::redo() {
+  if(!can_redo()) return nullptr;
+  return &_at(++_current);
+}
@@ -0,0 +1,46 @@
+#include "button_actions.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Perform the calculator action of the button whose caption is button.
+//  Actions that don't go through calc.key() record their own undo checkpoint.
+//  Return false if the button has no calculator action.
+//
+bool do_button_action(KeyCalculator& calc, const String& button) {
+  // memory mode
+  if     (button == "get")    calc.key('M');  // In memory mode: retrieve
+  else if(button == "set")    calc.key('=');  // In memory mode: st
+  else if(button == "clear")  calc.key('A');  // In memory mode: clear
+  else if(button == "M")      calc.key('M');  // In memory mode: retrieve
+  else if(button == "=")      calc.key('=');  // In memory mode: st
+  else if(button == "AC")     calc.key('A');  // In memory mode: clear
+  // number entry mode
+  else if(button == "BS")     calc.key('B');  // KeyCalculator command for backspace
+  else if(button == "cancel") { calc.cancel_input();  calc.checkpoint(); }
+  // normal 1
+  else if(button == "(")      calc.key(OPEN_PAREN_OPERATOR);
+  else if(button == ")")      calc.key(CLOSE_PAREN_OPERATOR);
+  // normal 2
+  else if(button == "pi")     { calc.set_value("3.14159265");  calc.checkpoint(); }
+  else if(button == "e")      { calc.set_value("2.71828182");  calc.checkpoint(); }
+  // normal 3
+  else if(button == "push")   { calc.commit();  calc.push();  calc.checkpoint(); }
+  else if(button == "pop")    { calc.commit();  calc.pop();   calc.checkpoint(); }
+  // normal 4
+  else if(button == "square") calc.key(SQUARE_OPERATOR);
+  else if(button == "sqroot") calc.key(SQUARE_ROOT_OPERATOR);
+  // normal 5
+  else if(button == "undo")   calc.undo();
+  else if(button == "redo")   calc.redo();
+  // settings menu: memory stack operations
+  else if(button == "stack clear")    { calc._calc.clear_memory_stack();                                            calc.checkpoint(); }
+  else if(button == "stack sum")      { calc.set_value(calc.double_to_string(calc._calc.get_memory_sum()));         calc.checkpoint(); }
+  else if(button == "stack average")  { calc.set_value(calc.double_to_string(calc._calc.get_memory_mean()));        calc.checkpoint(); }
+  else if(button == "stack std dev")  { calc.set_value(calc.double_to_string(sqrt(calc._calc.get_memory_variance())));  calc.checkpoint(); }
+  else if(button == "stack min")      { calc.set_value(calc.double_to_string(calc._calc.get_memory_min()));         calc.checkpoint(); }
+  else if(button == "stack max")      { calc.set_value(calc.double_to_string(calc._calc.get_memory_max()));         calc.checkpoint(); }
+  else if(button == "stack count")    { calc.set_value(calc.double_to_string(calc._calc.get_memory_depth()));       calc.checkpoint(); }
+  else return false;
+  return true;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// The calculator's side of the M5 buttons: the actions, by button caption, that change the calculator.
+// Buttons that only change the screen (right, help, menu) are handled by the sketch.
+// The settings menu's memory stack operations are here too, as "stack <operation>", so they're recorded
+// and replayed like buttons.
+// Keeping these apart from the M5ez code lets host/replay repeat a recorded trace (see KeyTrace.h).
+
+#include "KeyCalculator.h"
+
+bool do_button_action(KeyCalculator& calc, const String& button);  // Perform the button's action. Return false if it has none
@@ -0,0 +1,178 @@
+#include <Arduino.h>
+#include <chrono>
+#include <thread>
+
+// Host implementation of the Arduino shims declared in host/Arduino.h
+
+
+HardwareSerial Serial;
+
+static const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Timing
+//
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  String
+//
+String::String(const char* str) {
+  concat(str);
+}
+
+String::String(const String& str) {
+  concat(str.c_str());
+}
+
+String::String(char c) {
+  concat(c);
+}
+
+// Format an integer in the given base, the way Arduino's String does
+//
+static void format_unsigned(char* buffer, unsigned long value, unsigned char base) {
+  char  digits[33];
+  int   i = 0;
+  do {
+    unsigned long d = value % base;
+    digits[i++]     = char(d < 10 ? '0' + d : 'a' + d - 10);
+    value          /= base;
+  } while(value);
+  while(i) *(buffer++) = digits[--i];
+  *buffer = '\0';
+}
+
+String::String(unsigned char value, unsigned char base) : String((unsigned long)value, base) {}
+String::String(int value, unsigned char base) : String((long)value, base) {}
+String::String(unsigned int value, unsigned char base) : String((unsigned long)value, base) {}
+
+String::String(long value, unsigned char base) {
+  char buffer[34];
+  if(0 > value && 10 == base) {
+    buffer[0] = '-';
+    format_unsigned(buffer + 1, 0UL - (unsigned long)value, base);
+  }
+  else {
+    format_unsigned(buffer, (unsigned long)value, base);
+  }
+  concat(buffer);
+}
+
+String::String(unsigned long value, unsigned char base) {
+  char buffer[33];
+  format_unsigned(buffer, value, base);
+  concat(buffer);
+}
+
+String::String(double value, unsigned int decimal_places) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%.*f", decimal_places, value);
+  concat(buffer);
+}
+
+String::~String() {
+  delete[] _buffer;
+}
+
+String& String::operator=(const String& rhs) {
+  if(this != &rhs) *this = rhs.c_str();
+  return *this;
+}
+
+String& String::operator=(const char* rhs) {
+  _len = 0;
+  if(_buffer) _buffer[0] = '\0';
+  return concat(rhs);
+}
+
+// Grow the buffer so it can hold size characters. Like Arduino's String, it reallocates on demand only.
+//
+bool String::reserve(unsigned int size) {
+  if(size <= _capacity && _buffer) return true;
+  char* buffer = new char[size + 1];
+  memcpy(buffer, c_str(), _len + 1);
+  delete[] _buffer;
+  _buffer   = buffer;
+  _capacity = size;
+  return true;
+}
+
+String& String::concat(const char* str) {
+  if(nullptr == str) return *this;
+  unsigned int len = strlen(str);
+  if(0 == len && _buffer) return *this;
+  reserve(_len + len);
+  memmove(_buffer + _len, str, len + 1);
+  _len += len;
+  return *this;
+}
+
+String& String::concat(char c) {
+  char str[2] = { c, '\0' };
+  return concat(str);
+}
+
+char& String::operator[](unsigned int index) {
+  static char dummy;
+  if(index >= _len) { dummy = '\0'; return dummy; }
+  return _buffer[index];
+}
+
+char String::operator[](unsigned int index) const {
+  if(index >= _len) return '\0';
+  return _buffer[index];
+}
+
+bool String::startsWith(const char* prefix) const {
+  unsigned int len = strlen(prefix);
+  return len <= _len && 0 == strncmp(c_str(), prefix, len);
+}
+
+bool String::endsWith(const char* suffix) const {
+  unsigned int len = strlen(suffix);
+  return len <= _len && 0 == strcmp(c_str() + _len - len, suffix);
+}
+
+String operator+(const String& lhs, const String& rhs) { String str(lhs); str += rhs; return str; }
+String operator+(const String& lhs, const char* rhs)   { String str(lhs); str += rhs; return str; }
+String operator+(const char* lhs, const String& rhs)   { String str(lhs); str += rhs; return str; }
+String operator+(const String& lhs, char rhs)          { String str(lhs); str += rhs; return str; }
+String operator+(const String& lhs, int rhs)           { String str(lhs); str += rhs; return str; }
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  HardwareSerial
+//
+size_t HardwareSerial::write(const uint8_t* data, size_t size) {
+  if(!_enabled) return 0;
+  return fwrite(data, 1, size, stdout);
+}
+
+size_t HardwareSerial::print(const char* str) {
+  return write((const uint8_t*)str, strlen(str));
+}
+
+size_t HardwareSerial::printf(const char* format, ...) {
+  if(!_enabled) return 0;
+  va_list args;
+  va_start(args, format);
+  int len = vfprintf(stdout, format, args);
+  va_end(args);
+  return 0 > len ? 0 : len;
+}
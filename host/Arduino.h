@@ -0,0 +1,107 @@
+#pragma once
+
+// Minimal stand-in for <Arduino.h> so the calculator engine can be built and measured on a Linux host.
+// Only the parts of the Arduino API that the engine actually uses are provided: String, Serial,
+// and the timing functions. Output to Serial is discarded until Serial.begin() is called, as on the device.
+//
+// This file is only on the include path of the host build (see host/Makefile); the Arduino IDE never sees it.
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <assert.h>
+
+
+unsigned long     millis();                                     // Milliseconds since the program started
+unsigned long     micros();                                     // Microseconds since the program started
+void              delay(unsigned long ms);                      // Sleep for ms milliseconds
+
+
+// A subset of the Arduino String class. Like the original, it keeps its text in a single heap buffer
+// that grows as needed, so allocation counts measured on the host are representative of the device.
+//
+class String {
+  public:
+    String(const char* str = "");
+    String(const String& str);
+    explicit String(char c);
+    explicit String(unsigned char value, unsigned char base = 10);
+    explicit String(int value, unsigned char base = 10);
+    explicit String(unsigned int value, unsigned char base = 10);
+    explicit String(long value, unsigned char base = 10);
+    explicit String(unsigned long value, unsigned char base = 10);
+    explicit String(double value, unsigned int decimal_places = 2);
+    ~String();
+
+    String&       operator=(const String& rhs);
+    String&       operator=(const char* rhs);
+    String&       operator+=(const String& rhs)     { return concat(rhs.c_str()); }
+    String&       operator+=(const char* rhs)       { return concat(rhs); }
+    String&       operator+=(char rhs)              { return concat(rhs); }
+    String&       operator+=(unsigned char rhs)     { return concat(String(rhs)); }
+    String&       operator+=(int rhs)               { return concat(String(rhs)); }
+    String&       operator+=(unsigned int rhs)      { return concat(String(rhs)); }
+    String&       operator+=(long rhs)              { return concat(String(rhs)); }
+    String&       operator+=(unsigned long rhs)     { return concat(String(rhs)); }
+    String&       operator+=(double rhs)            { return concat(String(rhs)); }
+
+    String&       concat(const char* str);
+    String&       concat(const String& str)         { return concat(str.c_str()); }
+    String&       concat(char c);
+    bool          reserve(unsigned int size);
+    unsigned int  length() const                    { return _len; }
+    const char*   c_str() const                     { return _buffer ? _buffer : ""; }
+    char&         operator[](unsigned int index);
+    char          operator[](unsigned int index) const;
+    bool          equals(const char* str) const     { return 0 == strcmp(c_str(), str); }
+    bool          operator==(const String& rhs) const { return equals(rhs.c_str()); }
+    bool          operator==(const char* rhs) const   { return equals(rhs); }
+    bool          operator!=(const String& rhs) const { return !equals(rhs.c_str()); }
+    bool          operator!=(const char* rhs) const   { return !equals(rhs); }
+    bool          startsWith(const char* prefix) const;
+    bool          endsWith(const char* suffix) const;
+    bool          startsWith(const String& prefix) const { return startsWith(prefix.c_str()); }
+    bool          endsWith(const String& suffix) const   { return endsWith(suffix.c_str()); }
+    int           toInt() const                     { return atoi(c_str()); }
+    double        toDouble() const                  { return atof(c_str()); }
+
+  protected:
+    char*         _buffer   = nullptr;                          // Heap buffer, or nullptr for the empty string
+    unsigned int  _capacity = 0;                                // Usable size of _buffer, not counting the terminator
+    unsigned int  _len      = 0;                                // Length of the string
+};
+
+String operator+(const String& lhs, const String& rhs);
+String operator+(const String& lhs, const char* rhs);
+String operator+(const char* lhs, const String& rhs);
+String operator+(const String& lhs, char rhs);
+String operator+(const String& lhs, int rhs);
+
+
+// Stand-in for HardwareSerial. Text written before begin() (or after end()) is discarded.
+//
+class HardwareSerial {
+  public:
+    void          begin(unsigned long baud)         { (void)baud; _enabled = true; }
+    void          end()                             { _enabled = false; }
+    size_t        write(const uint8_t* data, size_t size);
+    size_t        write(uint8_t c)                  { return write(&c, 1); }
+    size_t        print(const char* str);
+    size_t        print(const String& str)          { return print(str.c_str()); }
+    size_t        print(char c)                     { return printf("%c", c); }
+    size_t        print(int value)                  { return printf("%d", value); }
+    size_t        print(double value)               { return printf("%.2f", value); }
+    size_t        println()                         { return print("\n"); }
+    template <typename V>
+    size_t        println(V value)                  { return print(value) + println(); }
+    size_t        printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+  protected:
+    bool          _enabled = false;
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "FramebufferSurface.h"
+
+#define GLYPH_COLUMNS   5                                       // Columns of a glyph in font5x7
+#define GLYPH_ROWS      8                                       // Rows of a cell (7 of glyph, 1 of space)
+#define GLYPH_ADVANCE   6                                       // Columns of a cell (5 of glyph, 1 of space)
+
+
+// The classic 5x7 font for ' ' to '~'. Each byte is a column, least significant bit at the top.
+//
+static const uint8_t font5x7[][GLYPH_COLUMNS] = {
+  {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7F,0x14,0x7F,0x14},  //  !"#
+  {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62}, {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00},  // $%&'
+  {0x00,0x1C,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1C,0x00}, {0x14,0x08,0x3E,0x08,0x14}, {0x08,0x08,0x3E,0x08,0x08},  // ()*+
+  {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02},  // ,-./
+  {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00}, {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31},  // 0123
+  {0x18,0x14,0x12,0x7F,0x10}, {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03},  // 4567
+  {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00},  // 89:;
+  {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14}, {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06},  // <=>?
+  {0x32,0x49,0x79,0x41,0x3E}, {0x7E,0x11,0x11,0x11,0x7E}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22},  // @ABC
+  {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x01,0x01}, {0x3E,0x41,0x41,0x51,0x32},  // DEFG
+  {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00}, {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41},  // HIJK
+  {0x7F,0x40,0x40,0x40,0x40}, {0x7F,0x02,0x04,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E},  // LMNO
+  {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31},  // PQRS
+  {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F}, {0x1F,0x20,0x40,0x20,0x1F}, {0x7F,0x20,0x18,0x20,0x7F},  // TUVW
+  {0x63,0x14,0x08,0x14,0x63}, {0x03,0x04,0x78,0x04,0x03}, {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7F,0x41,0x41,0x00},  // XYZ[
+  {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7F,0x00}, {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40},  // \]^_
+  {0x00,0x01,0x02,0x04,0x00}, {0x20,0x54,0x54,0x54,0x78}, {0x7F,0x48,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x20},  // `abc
+  {0x38,0x44,0x44,0x48,0x7F}, {0x38,0x54,0x54,0x54,0x18}, {0x08,0x7E,0x09,0x01,0x02}, {0x08,0x14,0x54,0x54,0x3C},  // defg
+  {0x7F,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7D,0x40,0x00}, {0x20,0x40,0x44,0x3D,0x00}, {0x00,0x7F,0x10,0x28,0x44},  // hijk
+  {0x00,0x41,0x7F,0x40,0x00}, {0x7C,0x04,0x18,0x04,0x78}, {0x7C,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38},  // lmno
+  {0x7C,0x14,0x14,0x14,0x08}, {0x08,0x14,0x14,0x18,0x7C}, {0x7C,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x20},  // pqrs
+  {0x04,0x3F,0x44,0x40,0x20}, {0x3C,0x40,0x40,0x20,0x7C}, {0x1C,0x20,0x40,0x20,0x1C}, {0x3C,0x40,0x30,0x40,0x3C},  // tuvw
+  {0x44,0x28,0x10,0x28,0x44}, {0x0C,0x50,0x50,0x50,0x3C}, {0x44,0x64,0x54,0x4C,0x44}, {0x00,0x08,0x36,0x41,0x00},  // xyz{
+  {0x00,0x00,0x7F,0x00,0x00}, {0x00,0x41,0x36,0x08,0x00}, {0x02,0x01,0x02,0x04,0x02}                               // |}~
+};
+
+
+// The scale of font5x7 that stands in for a TFT_eSPI font: 2 is 16 pixels high, 4 is 26 (here 24), 6 is 48
+//
+static uint8_t font_scale(uint8_t font) {
+  switch(font) {
+    case 2:   return 2;
+    case 4:   return 3;
+    case 6:   return 6;
+    default:  return 1;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  FramebufferGlyphAtlas
+//
+FramebufferGlyphAtlas::FramebufferGlyphAtlas(const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg) :
+    GlyphAtlas(glyphs, GLYPH_ROWS * font_scale(font)) {
+  for(int i = 0; _glyphs[i]; i++) {
+    char               text[2] = { _glyphs[i], '\0' };
+    FramebufferSurface glyph(GLYPH_ADVANCE * font_scale(font), _height);
+    glyph.draw_text(text, 0, 0, font, alignLeft, fg, bg);
+    _widths[i] = glyph.width();
+    _cells[i].assign(glyph.data(), glyph.data() + glyph.width() * _height);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  FramebufferSurface
+//
+FramebufferSurface::FramebufferSurface(int16_t width, int16_t height, FramebufferSurface* target) :
+    _width(width), _height(height), _target(target), _frame(width * height, BLACK) {
+}
+
+
+// Clipped to the surface
+//
+void FramebufferSurface::fill_rect(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t color) {
+  int32_t left    = std::max<int32_t>(x, 0);
+  int32_t top     = std::max<int32_t>(y, 0);
+  int32_t right   = std::min<int32_t>(x + w, _width);
+  int32_t bottom  = std::min<int32_t>(y + h, _height);
+  if(left >= right || top >= bottom) return;
+  for(int32_t row = top; row < bottom; row++) {
+    std::fill(&_frame[row * _width + left], &_frame[row * _width + right], color);
+  }
+  _count((right - left) * (bottom - top));
+}
+
+
+int16_t FramebufferSurface::text_width(const char* text, uint8_t font) {
+  return strlen(text) * GLYPH_ADVANCE * font_scale(font);
+}
+
+
+int16_t FramebufferSurface::font_height(uint8_t font) {
+  return GLYPH_ROWS * font_scale(font);
+}
+
+
+int16_t FramebufferSurface::draw_text(const char* text, int32_t x, int32_t y, uint8_t font, SurfaceAlign align, uint16_t fg, uint16_t bg) {
+  int16_t width = text_width(text, font);
+  if(alignCenter == align) x -= width / 2;
+  if(alignRight  == align) x -= width;
+  for(const char* p = text; *p; p++) x += _draw_glyph(*p, x, y, font_scale(font), fg, bg);
+  return width;
+}
+
+
+// Like TFT_eSPI's print() with text wrap: a character that won't fit on the line starts the next one at the left
+//
+void FramebufferSurface::draw_wrapped(const char* text, int32_t x, int32_t y, uint8_t font, uint16_t fg, uint16_t bg) {
+  uint8_t scale = font_scale(font);
+  for(const char* p = text; *p; p++) {
+    if(x + GLYPH_ADVANCE * scale > _width) {
+      x  = 0;
+      y += GLYPH_ROWS * scale;
+    }
+    x += _draw_glyph(*p, x, y, scale, fg, bg);
+  }
+}
+
+
+// Copy this surface onto the target
+//
+void FramebufferSurface::push(int32_t x, int32_t y) {
+  if(!_target) return;
+  _pixels += _target->_blit(_frame.data(), _width, _height, x, y);
+}
+
+
+// M5ez captions are separated by #: the first three are the short presses of buttons A, B and C
+//
+void FramebufferSurface::show_buttons(const char* buttons) {
+  int32_t top = _height - FRAMEBUFFER_BUTTON_HEIGHT;
+  fill_rect(0, top, _width, FRAMEBUFFER_BUTTON_HEIGHT, FRAMEBUFFER_CHROME_BG);
+  const char* caption = buttons;
+  for(int button = 0; button < 3 && *caption; button++) {
+    const char* end = strchr(caption, '#');
+    if(!end) end = caption + strlen(caption);
+    char text[32] = {0};
+    while(caption < end && ' ' == *caption) caption++;
+    size_t length = std::min<size_t>(end - caption, sizeof(text) - 1);
+    while(length && ' ' == caption[length - 1]) length--;
+    memcpy(text, caption, length);
+    draw_text(text, _width * (2 * button + 1) / 6, top + 2, 2, alignCenter, FRAMEBUFFER_CHROME_FG, FRAMEBUFFER_CHROME_BG);
+    caption = *end ? end + 1 : end;
+  }
+}
+
+
+void FramebufferSurface::show_header(const char* title) {
+  fill_rect(0, 0, _width, FRAMEBUFFER_HEADER_HEIGHT, FRAMEBUFFER_CHROME_BG);
+  draw_text(title, _width / 2, 4, 2, alignCenter, FRAMEBUFFER_CHROME_FG, FRAMEBUFFER_CHROME_BG);
+}
+
+
+// Glyphs are drawn as any surface draws them, at font_height(), onto surfaces of their own.
+// Every font has every glyph, so there is always an atlas.
+//
+GlyphAtlas* FramebufferSurface::make_atlas(const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg) {
+  return new FramebufferGlyphAtlas(glyphs, font, fg, bg);
+}
+
+
+int16_t FramebufferSurface::draw_glyph(const GlyphAtlas& atlas, char c, int32_t x, int32_t y) {
+  const uint16_t* cell  = static_cast<const FramebufferGlyphAtlas&>(atlas).cell(c);
+  int16_t         width = atlas.glyph_width(c);
+  if(!cell) return 0;
+  _count(_blit(cell, width, atlas.height(), x, y));
+  return width;
+}
+
+
+uint32_t FramebufferSurface::hash() const {
+  uint32_t hash = 2166136261u;
+  for(uint16_t pixel : _frame) {
+    hash = (hash ^ (pixel & 0xFF)) * 16777619u;
+    hash = (hash ^ (pixel >> 8))   * 16777619u;
+  }
+  return hash;
+}
+
+
+// RGB565 is expanded to 8 bits per channel
+//
+bool FramebufferSurface::write_ppm(const char* path) const {
+  FILE* file = fopen(path, "wb");
+  if(!file) return false;
+  fprintf(file, "P6\n%d %d\n255\n", _width, _height);
+  for(uint16_t pixel : _frame) {
+    uint8_t rgb[3] = { uint8_t((pixel >> 11) * 255 / 31), uint8_t((pixel >> 5 & 0x3F) * 255 / 63), uint8_t((pixel & 0x1F) * 255 / 31) };
+    fwrite(rgb, 1, sizeof(rgb), file);
+  }
+  return 0 == fclose(file);
+}
+
+
+// Copy w x h pixels onto this surface at x, y, clipped to it
+//
+uint32_t FramebufferSurface::_blit(const uint16_t* source, int32_t w, int32_t h, int32_t x, int32_t y) {
+  int32_t left    = std::max<int32_t>(x, 0);
+  int32_t top     = std::max<int32_t>(y, 0);
+  int32_t right   = std::min<int32_t>(x + w, _width);
+  int32_t bottom  = std::min<int32_t>(y + h, _height);
+  if(left >= right || top >= bottom) return 0;
+  for(int32_t row = top; row < bottom; row++) {
+    const uint16_t* line = &source[(row - y) * w + left - x];
+    std::copy(line, line + (right - left), &_frame[row * _width + left]);
+  }
+  return (right - left) * (bottom - top);
+}
+
+
+// A cell of the glyph: the glyph in fg, scaled, on bg. Characters outside the font are drawn as spaces.
+//
+int32_t FramebufferSurface::_draw_glyph(char c, int32_t x, int32_t y, uint8_t scale, uint16_t fg, uint16_t bg) {
+  const uint8_t* glyph = font5x7[(' ' <= c && '~' >= c) ? c - ' ' : 0];
+  fill_rect(x, y, GLYPH_ADVANCE * scale, GLYPH_ROWS * scale, bg);
+  for(int column = 0; column < GLYPH_COLUMNS; column++) {
+    for(int row = 0; row < GLYPH_ROWS - 1; row++) {
+      if(glyph[column] >> row & 1) {
+        uint32_t pixels = _pixels;
+        fill_rect(x + column * scale, y + row * scale, scale, scale, fg);
+        _pixels = pixels;                                       // Already counted with the cell
+      }
+    }
+  }
+  return GLYPH_ADVANCE * scale;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+// A DisplaySurface that rasterizes into an RGB565 framebuffer in memory, so the calculator screen can be
+// rendered, timed and checked on a host. Text uses a built-in 5x7 font, scaled to about the height of
+// the TFT_eSPI font of the same number; it doesn't look like the device, but it is deterministic, which
+// is what golden images need. Buttons and the header are drawn as plain bars with their captions.
+// An offscreen surface is made with the surface it will be pushed to.
+//
+// This file is only part of the host build (see host/Makefile).
+
+
+#include <vector>
+#include "../DisplaySurface.h"
+
+
+#define FRAMEBUFFER_WIDTH         320                           // The M5Stack's LCD
+#define FRAMEBUFFER_HEIGHT        240
+#define FRAMEBUFFER_HEADER_HEIGHT 23                            // M5ez's default theme
+#define FRAMEBUFFER_BUTTON_HEIGHT 19
+#define FRAMEBUFFER_CHROME_FG     WHITE                         // Header and button bar colors
+#define FRAMEBUFFER_CHROME_BG     0x0011
+
+
+// Each glyph's cell is kept as pixels, rendered by a FramebufferSurface of its size
+//
+class FramebufferGlyphAtlas : public GlyphAtlas {
+  public:
+    FramebufferGlyphAtlas(const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg);
+    const uint16_t* cell(char c) const                          { return has(c) ? _cells[index(c)].data() : nullptr; }
+  protected:
+    std::vector<uint16_t> _cells[GLYPH_ATLAS_SIZE];
+};
+
+
+class FramebufferSurface : public DisplaySurface {
+  public:
+    FramebufferSurface(int16_t width = FRAMEBUFFER_WIDTH, int16_t height = FRAMEBUFFER_HEIGHT, FramebufferSurface* target = nullptr);
+    int16_t         width() override                            { return _width; }
+    int16_t         height() override                           { return _height; }
+    void            fill_rect(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t color) override;
+    int16_t         text_width(const char* text, uint8_t font) override;
+    int16_t         font_height(uint8_t font) override;
+    int16_t         draw_text(const char* text, int32_t x, int32_t y, uint8_t font, SurfaceAlign align, uint16_t fg, uint16_t bg) override;
+    void            draw_wrapped(const char* text, int32_t x, int32_t y, uint8_t font, uint16_t fg, uint16_t bg) override;
+    void            push(int32_t x, int32_t y) override;
+    void            show_buttons(const char* buttons) override;
+    void            show_header(const char* title) override;
+    GlyphAtlas*     make_atlas(const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg) override;
+    int16_t         draw_glyph(const GlyphAtlas& atlas, char c, int32_t x, int32_t y) override;
+    const uint16_t* data() const                                { return _frame.data(); }
+    uint16_t        pixel(int32_t x, int32_t y) const           { return _frame[y * _width + x]; }
+    uint32_t        hash() const;                               // FNV-1a of the pixels, for golden image checks
+    bool            write_ppm(const char* path) const;          // Write a binary PPM (P6) snapshot. Return false if the file can't be written
+  protected:
+    int16_t               _width;
+    int16_t               _height;
+    FramebufferSurface*   _target;                              // Where push() copies to, or nullptr for the display itself
+    std::vector<uint16_t> _frame;
+    void                  _count(uint32_t pixels)               { if(!_target) _pixels += pixels; }
+    uint32_t              _blit(const uint16_t* source, int32_t w, int32_t h, int32_t x, int32_t y);  // Return the pixels copied
+    int32_t               _draw_glyph(char c, int32_t x, int32_t y, uint8_t scale, uint16_t fg, uint16_t bg);  // Return the width drawn
+};
@@ -0,0 +1,32 @@
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include "alloc_count.h"
+
+// Replacement global operator new/delete that count every allocation.
+// Counters are atomic, since render and input allocate from several threads; relaxed is enough,
+// as nothing is ordered by them.
+
+
+static std::atomic<uint64_t> _alloc_count{0};
+static std::atomic<uint64_t> _alloc_bytes{0};
+
+uint64_t alloc_count() { return _alloc_count.load(std::memory_order_relaxed); }
+uint64_t alloc_bytes() { return _alloc_bytes.load(std::memory_order_relaxed); }
+
+static void* counted_alloc(size_t size) {
+  _alloc_count.fetch_add(1, std::memory_order_relaxed);
+  _alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  void* p = malloc(size ? size : 1);
+  if(nullptr == p) throw std::bad_alloc();
+  return p;
+}
+
+void* operator new(size_t size)                                   { return counted_alloc(size); }
+void* operator new[](size_t size)                                 { return counted_alloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept   { try { return counted_alloc(size); } catch(...) { return nullptr; } }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { try { return counted_alloc(size); } catch(...) { return nullptr; } }
+void  operator delete(void* p) noexcept                           { free(p); }
+void  operator delete[](void* p) noexcept                         { free(p); }
+void  operator delete(void* p, size_t) noexcept                   { free(p); }
+void  operator delete[](void* p, size_t) noexcept                 { free(p); }
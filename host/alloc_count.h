@@ -0,0 +1,10 @@
+#pragma once
+
+// Counts heap allocations made through operator new on the host build.
+// Used by the benchmarks to report allocations/op; the device build never includes this.
+
+
+#include <stdint.h>
+
+uint64_t  alloc_count();                                        // Number of calls to operator new since the program started
+uint64_t  alloc_bytes();                                        // Number of bytes requested from operator new since the program started
@@ -0,0 +1,1374 @@
+#include <Arduino.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include "../KeyCalculator.h"
+#include "../KeyTrace.h"
+#include "../button_actions.h"
+#include "../Decimal.h"
+#include "../NumberParse.h"
+#include "bench.h"
+
+// Engine benchmark suite. Build and run with:  make -C host run
+// Each workload is fixed so results can be compared from one change to the next.
+
+
+volatile double bench_sink = 0.0;
+
+typedef Decimal64<6> Decimal;                                   // Six decimal places: range +/- 9.2e12
+template class MemoryCalculator<Decimal, 10>;                   // Instantiate every member, to prove Decimal64 plugs into the engine
+
+static const char*  parse_statement = "1 + 5 / 3.2 * 7.3167 - 8 * 33.33 =";
+static const char*  rpn_expression  = "M[1] * M[2] + 5 % - (M[3] - 2) / 4";
+static const char*  rpn_statement   = "12 * 7.5 + 5 % - (3.25 - 2) / 4 =";
+static const char*  number_texts[]  = { "0", "7", "12.5", "3.14159", "1234567.891", "0.000123", "98765432.1", "2.5e-7" };
+static const char*  hard_numbers[]  = { "6.02214076e23", "1.7976931348623157e308", "4.9406564584124654e-324",
+                                        "9007199254740993", "0.1000000000000000055511151231257827" };
+static const char*  bigint_numbers[] = { "9007199254740993.0000000000000000000001", "2.47032822920623272088e-324",
+                                        "1.00000000000000011102230246251565404236316680908203125" };
+static const double format_values[] = { 0.0, 1.0, -1.0, 0.1, 0.3, 3.14159265, -2.71828182, 1234567.891,
+                                        1.0 / 3.0, 100.0, 0.00012345, 98765432.1, 42.0, -0.5, 7e10, 2.5e-7 };
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  CoreCalculator<double>: 1.5 + 2.25 * 3 - 4 / 8 =
+//
+static void bench_core_push_operator() {
+  static CoreCalculator<double> core;
+  run_bench("CoreCalculator::push_operator", 1000000, []() {
+    core.push_value(1.5);
+    core.push_operator(ADDITION_OPERATOR);
+    core.push_value(2.25);
+    core.push_operator(MULTIPLICATION_OPERATOR);
+    core.push_value(3.0);
+    core.push_operator(SUBTRACTION_OPERATOR);
+    core.push_value(4.0);
+    core.push_operator(DIVISION_OPERATOR);
+    core.push_value(8.0);
+    core.push_operator(EVALUATE_OPERATOR);
+    bench_sink = core.pop_value();
+  });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  CoreCalculator<double>: evaluate a deep stack built without intermediate evaluation:  ((((1 + 1) + 1) ... ) =
+//
+static void bench_core_evaluate_all() {
+  static CoreCalculator<double> core;
+  run_bench("CoreCalculator::evaluate_all", 200000, []() {
+    for(int i = 0; i < 16; i++) core.push_operator(OPEN_PAREN_OPERATOR);
+    core.push_value(1.0);
+    for(int i = 0; i < 16; i++) {
+      core.push_operator(ADDITION_OPERATOR);
+      core.push_value(1.0);
+      core.push_operator(CLOSE_PAREN_OPERATOR);
+    }
+    core.evaluate_all();
+    bench_sink = core.pop_value();
+  });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  CoreCalculator<T> arithmetic: 1.25 + 2.5 * 3.75 - 4.125 / 0.5 =
+//  Run for double and Decimal64 to compare the numeric types.
+//
+template <typename T>
+static void bench_arithmetic(const char* name) {
+  static CoreCalculator<T> core;
+  static const T           values[] = { T(1.25), T(2.5), T(3.75), T(4.125), T(0.5) };
+  run_bench(name, 1000000, []() {
+    core.push_value(values[0]);
+    core.push_operator(ADDITION_OPERATOR);
+    core.push_value(values[1]);
+    core.push_operator(MULTIPLICATION_OPERATOR);
+    core.push_value(values[2]);
+    core.push_operator(SUBTRACTION_OPERATOR);
+    core.push_value(values[3]);
+    core.push_operator(DIVISION_OPERATOR);
+    core.push_value(values[4]);
+    core.push_operator(EVALUATE_OPERATOR);
+    bench_sink = double(core.pop_value());
+  });
+}
+
+// Accumulate 0.1 a million times in each type to show the binary fraction error double accrues
+//
+static void show_decimal_exactness() {
+  double  d_sum = 0.0;
+  Decimal x_sum = Decimal(0);
+  Decimal tenth = Decimal(1) / Decimal(10);
+  for(int i = 0; i < 1000000; i++) {
+    d_sum += 0.1;
+    x_sum += tenth;
+  }
+  printf("%-40s double: %.17g  Decimal64<6>: %lld.%06lld\n", "Sum of 1e6 x 0.1", d_sum,
+         (long long)(x_sum.raw() / Decimal::ONE), (long long)(x_sum.raw() % Decimal::ONE));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Memory stack aggregates: pushing and popping keep them current, so reading one doesn't depend on depth.
+//  One op is one push (or pop) plus a read of every aggregate.
+//
+static void bench_memory_stack() {
+  static MemoryCalculator<double, 10> calc;
+  static int                          i = 0;
+  run_bench("MemoryCalculator push_memory + aggregates", 100000, []() {
+    calc.push_memory(i++ % 1000 * 0.1);
+    bench_sink = calc.get_memory_sum() + calc.get_memory_mean() + calc.get_memory_variance() + calc.get_memory_min() + calc.get_memory_max();
+  });
+  run_bench("MemoryCalculator pop_memory + aggregates", 100000, []() {
+    calc.pop_memory();
+    bench_sink = calc.get_memory_sum() + calc.get_memory_mean() + calc.get_memory_variance() + calc.get_memory_min() + calc.get_memory_max();
+  });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The running aggregates must match values recomputed from the stack after a random mix of pushes and pops,
+//  and the compensated sum must stay exact where a plain sum drifts. Return false (and the suite fails) otherwise.
+//
+static bool check_memory_aggregates() {
+  MemoryCalculator<double, 10>  calc;
+  bool                          ok    = true;
+  uint32_t                      seed  = 12345;
+  for(int step = 0; step < 200000 && ok; step++) {
+    seed = seed * 1664525 + 1013904223;
+    if(0 == calc.get_memory_depth() || 3 > seed % 5) calc.push_memory(int(seed >> 8) % 20001 * 0.01 - 100.0);
+    else                                             calc.pop_memory();
+    if(step % 997) continue;
+    int     n     = calc.get_memory_depth();
+    double  sum   = 0.0;
+    double  low   = 0.0;
+    double  high  = 0.0;
+    double  v     = 0.0;
+    int     seen  = 0;
+    MemoryStack<double>::Walker values(calc.memory_stack);
+    while(values.next(v)) {
+      sum += v;
+      if(!seen || v < low)  low  = v;
+      if(!seen || v > high) high = v;
+      seen++;
+    }
+    double mean = n ? sum / n : 0.0;
+    double m2   = 0.0;
+    MemoryStack<double>::Walker again(calc.memory_stack);
+    while(again.next(v)) m2 += (v - mean) * (v - mean);
+    if(seen != n || (n && calc.memory_stack[n - 1] != calc.memory_stack.back())) {
+      printf("FAILED: walking the memory stack should visit all %d values\n", n);
+      ok = false;
+    }
+    double variance = (1 < n) ? m2 / (n - 1) : 0.0;
+    if(fabs(calc.get_memory_sum() - sum) > 1e-6 || fabs(calc.get_memory_mean() - mean) > 1e-9 ||
+       fabs(calc.get_memory_variance() - variance) > 1e-6 * (1.0 + variance) || calc.get_memory_min() != low || calc.get_memory_max() != high) {
+      printf("FAILED: memory stack aggregates disagree at step %d (depth %d)\n", step, n);
+      ok = false;
+    }
+  }
+  calc.clear_memory_stack();
+  double plain = 0.0;
+  for(int i = 0; i < 1000000; i++) {
+    calc.push_memory(0.1);
+    plain += 0.1;
+  }
+  printf("%-40s plain: %.17g  compensated: %.17g\n", "Memory stack sum of 1e6 x 0.1", plain, calc.get_memory_sum());
+  if(100000.0 != calc.get_memory_sum()) {
+    printf("FAILED: the compensated memory stack sum should be exact\n");
+    ok = false;
+  }
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  TextCalculator::parse of a fixed statement
+//
+static void bench_text_parse() {
+  static TextCalculator text;
+  run_bench("TextCalculator::parse", 200000, []() {
+    text.parse(parse_statement);
+    bench_sink = text._calc.get_value();
+  });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  TextCalculator::parse throughput, in MB/s of expression text, over a 4 KB statement
+//
+static void bench_parse_throughput() {
+  static TextCalculator text;
+  static String         statement;
+  while(statement.length() < 4096) statement += "(12.5 + 3.25e2 * -4) / 7 - 0.125 * (6 - 2) + ";
+  statement += "1 =";
+  double ns = run_bench("TextCalculator::parse (4 KB)", 20000, []() {
+    text.parse(statement.c_str(), statement.length());
+    bench_sink = text._calc.get_value();
+  });
+  printf("%-40s %10.1f MB/s\n", "TextCalculator::parse throughput", statement.length() / ns * 1000.0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  A compiled expression re-evaluated with new memory values, against parsing the same text each time.
+//  One op is one evaluation. The compiled program's M[n] inputs change on every iteration.
+//
+static void bench_rpn_evaluate() {
+  static TextCalculator text;
+  static const RpnProgram<double>* program = text.compile(rpn_expression);
+  static int i = 0;
+  run_bench("TextCalculator::parse (same expression)", 200000, []() {
+    text.parse(rpn_statement);
+    bench_sink = text._calc.get_value();
+  });
+  run_bench("TextCalculator::evaluate (cached text)", 1000000, []() {
+    text._calc.set_memory(1, i++);
+    text.evaluate(rpn_expression);
+    bench_sink = text._calc.get_value();
+  });
+  run_bench("TextCalculator::evaluate (program)", 1000000, []() {
+    text._calc.set_memory(1, i++);
+    text.evaluate(program);
+    bench_sink = text._calc.get_value();
+  });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Compiled programs must agree with parse() on the same expressions, and evaluating must not allocate.
+//  Return false (and the suite fails) on any disagreement.
+//
+static bool check_rpn_programs() {
+  static const char* expressions[] = {
+    "1 + 2 * 3", "(1 + 2) * 3", "8 / 4 / 2", "2 - 3 - 4", "-3s", "4r + 9r", "200 + 10 %", "200 - 10 %",
+    "50 * 10 %", "1.5e3 - -2", "((((7))))", "3 + 4 * (2 - 6) / 8 =",
+  };
+  TextCalculator  text;
+  bool            ok = true;
+  for(const char* expression : expressions) {
+    const RpnProgram<double>* program = text.compile(expression);
+    text.clear_all();
+    text.parse(expression);
+    text.total();
+    double expected = text._calc.get_value();
+    text.clear_all();
+    if(!text.evaluate(program) || text._calc.get_value() != expected) {
+      printf("FAILED: compiled \"%s\" gave %.17g, parse gave %.17g\n", expression, text._calc.get_value(), expected);
+      ok = false;
+    }
+  }
+  text._calc.set_memory(7);
+  text._calc.set_memory(2, 3);
+  if(!text.evaluate("M * M[2] - 1") || 20.0 != text._calc.get_value()) {
+    printf("FAILED: M * M[2] - 1 with M = 7, M[2] = 3\n");
+    ok = false;
+  }
+  if(text.compile("M[100000]") || text.compile("1 +") || text.compile("(2")) {
+    printf("FAILED: invalid expressions must not compile\n");
+    ok = false;
+  }
+  const RpnProgram<double>* program = text.compile(rpn_expression);
+  uint64_t allocs = alloc_count();
+  for(int i = 0; i < 10000; i++) text.evaluate(program);
+  if(alloc_count() != allocs) {
+    printf("FAILED: evaluating a compiled program must not allocate\n");
+    ok = false;
+  }
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Formula memories must recompute exactly the formulas downstream of a change, in dependency order,
+//  and reject cycles. Return false (and the suite fails) otherwise.
+//
+static bool check_formulas() {
+  static TextCalculator text;
+  bool                  ok = true;
+  char                  formula[32];
+  // A chain M[i] = M[i - 1] + 1 for i = 1..1000, and a diamond on top of it
+  for(Mem_Index i = 1; i <= 1000; i++) {
+    snprintf(formula, sizeof(formula), "M[%u] + 1", unsigned(i - 1));
+    ok = (NO_ERROR == text.set_formula(i, formula)) && ok;
+  }
+  ok = (NO_ERROR == text.set_formula("M[2000] = M[1000] * 2")) && ok;
+  ok = (NO_ERROR == text.set_formula("M[2001] = M[1000] + M[2000] + M") && ok);
+  uint32_t before = text.formulas_recomputed();
+  text._calc.set_memory(0, 5.0);
+  if(1002 != text.formulas_recomputed() - before || 1005.0 != text._calc.get_memory(1000) || 3015.0 != text._calc.get_memory(2001)) {
+    printf("FAILED: changing the head of a formula chain recomputed %u formulas, M[2001] = %g\n", unsigned(text.formulas_recomputed() - before), text._calc.get_memory(2001));
+    ok = false;
+  }
+  before = text.formulas_recomputed();
+  text._calc.set_memory(7.0);
+  if(1 != text.formulas_recomputed() - before || 3022.0 != text._calc.get_memory(2001)) {
+    printf("FAILED: changing M should recompute only the formula that reads it\n");
+    ok = false;
+  }
+  if(ERROR_CIRCULAR_REFERENCE != text.set_formula(1, "M[2001] - 1") || ERROR_CIRCULAR_REFERENCE != text.set_formula(5, "M[5] * 2")) {
+    printf("FAILED: formulas that depend on themselves must be rejected\n");
+    ok = false;
+  }
+  if(ERROR_INVALID_FORMULA != text.set_formula("M[3] = 1 +") || ERROR_INVALID_FORMULA != text.set_formula("M[100000] = 1")) {
+    printf("FAILED: invalid formulas must be rejected\n");
+    ok = false;
+  }
+  // Storing a value over a formula memory replaces the formula, and cuts the chain there
+  text._calc.memory_operation(CLEAR_OPERATOR, 500);
+  before = text.formulas_recomputed();
+  text._calc.set_memory(0, 6.0);
+  if(nullptr != text.get_formula(500) || 499 != text.formulas_recomputed() - before || 500.0 != text._calc.get_memory(1000)) {
+    printf("FAILED: a value stored over a formula should replace it\n");
+    ok = false;
+  }
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Changing one memory read by a fan of 100 formulas (one op is one change and its 100 recomputations)
+//
+static void bench_formulas() {
+  static TextCalculator text;
+  static double         value = 0.0;
+  char                  formula[32];
+  for(Mem_Index i = 1; i <= 100; i++) {
+    snprintf(formula, sizeof(formula), "M[0] * %u + M", unsigned(i));
+    text.set_formula(i, formula);
+  }
+  run_bench("Formula fan-out of 100, one change", 20000, []() {
+    text._calc.set_memory(0, value += 1.0);
+    bench_sink = text._calc.get_memory(100);
+  });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  parse_number against strtod over a set of literals (one op is one literal).
+//  Typical calculator numbers take the fast path; the hard ones take the Eisel-Lemire step, and the halfway
+//  ones, with more than 19 digits too close to a tie to settle from the first 19, need exact big integer rounding.
+//
+template <int N>
+static void bench_parse_number(const char* label, const char* (&texts)[N]) {
+  static const char** list  = texts;
+  static size_t       lengths[N];
+  static int          index = 0;
+  char                name[48];
+  for(int i = 0; i < N; i++) lengths[i] = strlen(texts[i]);
+  snprintf(name, sizeof(name), "strtod (%s)", label);
+  run_bench(name, 200000, []() {
+    bench_sink = strtod(list[index], nullptr);
+    if(N == ++index) index = 0;
+  });
+  snprintf(name, sizeof(name), "parse_number (%s)", label);
+  run_bench(name, 200000, []() {
+    double val;
+    parse_number(list[index], lengths[index], val);
+    bench_sink = val;
+    if(N == ++index) index = 0;
+  });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  parse_number must agree exactly with strtod on decimal text, accept the literal forms,
+//  and report malformed text. Return false (and the suite fails) on any disagreement.
+//
+static bool check_number_parsing() {
+  bool ok = true;
+  const char* texts[] = { number_texts[0], number_texts[2], number_texts[7], hard_numbers[0], hard_numbers[1],
+                          hard_numbers[2], hard_numbers[3], hard_numbers[4], bigint_numbers[0], bigint_numbers[1],
+                          bigint_numbers[2] };
+  for(const char* text : texts) {
+    double val = -1.0;
+    if(NO_ERROR != parse_number(text, strlen(text), val) || val != strtod(text, nullptr)) {
+      printf("FAILED: parse_number(\"%s\") gave %.17g, strtod gave %.17g\n", text, val, strtod(text, nullptr));
+      ok = false;
+    }
+  }
+  // Random doubles at every precision, and random digit strings of up to 40 digits at every scale
+  uint64_t seed = 88172645463325252ull;
+  char     text[96];
+  for(int i = 0; i < 200000 && ok; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    if(i & 1) {
+      double value;
+      uint64_t bits = seed & 0x7FEFFFFFFFFFFFFFull;
+      memcpy(&value, &bits, sizeof(value));
+      snprintf(text, sizeof(text), "%.*g", int(seed >> 59) % 17 + 1, value);
+    }
+    else {
+      int   digits  = int(seed >> 58) % 40 + 1;
+      char* p       = text;
+      for(int d = 0; d < digits; d++) *p++ = '0' + (seed >> (d % 20 * 3)) % 10;
+      snprintf(p, 16, "e%d", int(seed % 700) - 350);
+    }
+    double val = -1.0;
+    Op_Err err = parse_number(text, strlen(text), val);
+    if((NO_ERROR != err && ERROR_OVERFLOW != err) || val != strtod(text, nullptr)) {
+      printf("FAILED: parse_number(\"%s\") gave %.17g, strtod gave %.17g\n", text, val, strtod(text, nullptr));
+      ok = false;
+    }
+  }
+  struct { const char* text; Op_Err err; double val; } cases[] = {
+    { "0x1F", NO_ERROR, 31 },               { "0b1010'0101", NO_ERROR, 165 },       { "0o17", NO_ERROR, 15 },
+    { "1_000_000", NO_ERROR, 1e6 },         { "-12.5e-3", NO_ERROR, -0.0125 },      { "5.", NO_ERROR, 5 },
+    { "1__0", ERROR_INVALID_NUMBER, 0 },    { "1_", ERROR_INVALID_NUMBER, 0 },      { "0x", ERROR_INVALID_NUMBER, 0 },
+    { "1e", ERROR_INVALID_NUMBER, 0 },      { "", ERROR_INVALID_NUMBER, 0 },        { "2e400", ERROR_OVERFLOW, HUGE_VAL },
+  };
+  for(auto& c : cases) {
+    double val = 0.0;
+    Op_Err err = parse_number(c.text, strlen(c.text), val);
+    if(err != c.err || val != c.val) {
+      printf("FAILED: parse_number(\"%s\") returned %d, %.17g\n", c.text, err, val);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The pow/log10 digit loop double_to_string used before NumberFormat, kept for comparison
+//
+static String legacy_double_to_string(double val, uint8_t precision) {
+  if(0.0 == val) return String("0");
+  double  threshold   = 1.0 / pow(10.0, precision);
+  int     m           = log10(ceil(abs(val)));
+  char    buffer[64]  = {0};
+  int     digit       = 0;
+  char*   p           = buffer;
+  if(0.0 > val) {
+    val    = -val;
+    *(p++) = '-';
+  }
+  while((0 <= m) || (val > threshold)) {
+    double weight = pow(10.0, m);
+    digit = floor(val / weight);
+    val  -= (digit * weight);
+    *(p++)= '0' + digit;
+    if(m == 0) *(p++) = '.';
+    *p    = '\0';
+    m--;
+  }
+  if('.' == *(p-1)) *(p-1) = '\0';
+  p = buffer;
+  if(3 <= strlen(buffer) && '-' == buffer[0] && '0' == buffer[1] && '.' != buffer[2]) {
+    p++;
+    *p = '-';
+  }
+  else if(2 <= strlen(buffer) && '0' == buffer[0] && '.' != buffer[1]) {
+    p++;
+  }
+  return String(p);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Number formatting over a fixed set of values (one op is one value):
+//  the legacy loop, format_number into a buffer, and TextCalculator::double_to_string (which adds a String)
+//
+static void bench_double_to_string() {
+  static TextCalculator text;
+  static char           buffer[NUMBER_BUFFER_SIZE];
+  static const int      count = sizeof(format_values) / sizeof(format_values[0]);
+  static int            index = 0;
+  run_bench("legacy double_to_string", 500000, []() {
+    String str = legacy_double_to_string(format_values[index], 8);
+    bench_sink = str.length();
+    if(count == ++index) index = 0;
+  });
+  run_bench("format_number", 500000, []() {
+    bench_sink = format_number(format_values[index], buffer, sizeof(buffer), 8);
+    if(count == ++index) index = 0;
+  });
+  run_bench("format_number (scientific)", 500000, []() {
+    bench_sink = format_number(format_values[index], buffer, sizeof(buffer), 8, formatScientific);
+    if(count == ++index) index = 0;
+  });
+  run_bench("TextCalculator::double_to_string", 500000, []() {
+    String str = text.double_to_string(format_values[index]);
+    bench_sink = str.length();
+    if(count == ++index) index = 0;
+  });
+  for(int i = 0; i < 4; i++) {
+    format_number(format_values[3 + i], buffer, sizeof(buffer), 8);
+    printf("%-40s legacy: %-14s format_number: %s\n", "", legacy_double_to_string(format_values[3 + i], 8).c_str(), buffer);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  KeyCalculator::key over a fixed key trace (one op is one key)
+//
+static void bench_key() {
+  static KeyCalculator calc;
+  static const char* p = key_trace;
+  run_bench("KeyCalculator::key", 1000000, []() {
+    calc.key(*p++);
+    if('\0' == *p) p = key_trace;
+  });
+  bench_sink = calc._calc.get_value();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The if-chain KeyCalculator::_handle_key used before the _transitions table, kept for comparison
+//
+class LegacyKeyCalculator : public KeyCalculator {
+  public:
+    bool legacy_key(uint8_t code) {
+      bool result = _legacy_handle_key(code);
+      if(result || _calc.get_error_state()) checkpoint();
+      return result;
+    }
+  protected:
+    bool _legacy_handle_key(uint8_t code) {
+      if(_calc.get_error_state()) _change_state(calcError);
+      if(calcError == _state) {
+        if(CLEAR_OPERATOR == code) {
+          _calc.clear_error_state();
+          _calc.push_value(0.0);
+          _change_state(calcReadyForAny);
+          return true;
+        }
+        return false;
+      }
+      if(_clear_press_count && CLEAR_OPERATOR == code) {
+        return _handle_clear(true);
+      }
+      _clear_press_count = 0;
+      if(calcEnteringMemory == _state) {
+        return _legacy_handle_memory_command(code);
+      }
+      if(EVALUATE_OPERATOR == code) {
+        if(calcReadyForNumber == _state) {
+          Op_ID op = _calc.peek_operator();
+          if(ADDITION_OPERATOR      == op || SUBTRACTION_OPERATOR == op ||
+            MULTIPLICATION_OPERATOR == op || DIVISION_OPERATOR    == op) {
+            enter(value());
+            _change_state(calcReadyForOperator);
+          }
+        }
+      }
+      if((calcReadyForNumber == _state) && is_operator(code) && (OPEN_PAREN_OPERATOR != code) &&
+         (CLOSE_PAREN_OPERATOR != code) && (0 != _calc.operator_stack.size())) {
+        _calc.operator_stack.back() = code;
+        return true;
+      }
+      if(calcReadyForAny == _state || calcReadyForNumber == _state || calcEnteringNumber == _state) {
+        if(('0' <= code && '9' >= code) || ('.' == code) || 'B' == code) {
+          return _key_number(code);
+        }
+        if(OPEN_PAREN_OPERATOR == code) {
+          enter(code);
+          _change_state(calcReadyForNumber);
+          return true;
+        }
+      }
+      commit();
+      if((calcReadyForAny == _state && 0 < _calc.value_stack.size()) || calcReadyForOperator == _state) {
+        if(is_operator(code)) {
+          if(CLOSE_PAREN_OPERATOR == code && 0 == _count_open_parens()) return false;
+          bool result = enter(code);
+          if(result) {
+            CalcState                        next = calcReadyForNumber;
+            if(EVALUATE_OPERATOR    == code) next = calcReadyForAny;
+            if(CLOSE_PAREN_OPERATOR == code) next = calcReadyForOperator;
+            if(PERCENT_OPERATOR == code || SQUARE_OPERATOR == code || SQUARE_ROOT_OPERATOR == code) {
+              result = (NO_ERROR == _calc.evaluate_one());
+              next   = calcReadyForAny;
+            }
+            _change_state(next);
+          }
+          return result;
+        }
+      }
+      switch(code) {
+        case CHANGE_SIGN_OPERATOR:  return _handle_change_sign();
+        case CLEAR_OPERATOR:        return _handle_clear(false);
+        case MEMORY_OPERATOR:       return _legacy_handle_memory_command(code);
+        default:                    break;
+      }
+      return false;
+    }
+    bool _legacy_handle_memory_command(uint8_t code) {
+      if(calcEnteringMemory != _state) {
+        _change_state(calcEnteringMemory);
+        return true;
+      }
+      if('.' == code) {
+        _mem_buffer_index = 0;
+        _mem_buffer[0]    = '\0';
+        _change_state(calcReadyForAny);
+        return true;
+      }
+      if('B' == code) {
+        if(_mem_buffer_index) {
+          _mem_buffer_index--;
+          _mem_buffer[_mem_buffer_index] = '\0';
+          return true;
+        }
+        return false;
+      }
+      if('0' <= code && '9' >= code) {
+        if(KEYCAL_MEM_ADDRESS_DIGITS <= _mem_buffer_index) return false;
+        _mem_buffer[_mem_buffer_index++] = code;
+        _mem_buffer[_mem_buffer_index]   = '\0';
+        if(NUM_CALC_MEMORIES <= _mem_address()) {
+          _mem_buffer[--_mem_buffer_index] = '\0';
+          return false;
+        }
+        return true;
+      }
+      if(MEMORY_OPERATOR == code) {
+        bool result = _mem_buffer_index ? recall_memory(_mem_address()) : recall_memory();
+        _mem_buffer_index               = 0;
+        _mem_buffer[_mem_buffer_index]  = '\0';
+        _change_state(calcReadyForAny);
+        return result;
+      }
+      if(is_mem_operator(code)) {
+        if(0 == _mem_buffer_index) _calc.memory_operation(code);
+        else                       _calc.memory_operation(code, _mem_address());
+        _mem_buffer_index               = 0;
+        _mem_buffer[_mem_buffer_index]  = '\0';
+        _change_state(calcReadyForAny);
+        return true;
+      }
+      _mem_buffer_index = 0;
+      _mem_buffer[0]    = '\0';
+      _change_state(calcReadyForAny);
+      return false;
+    }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The legacy if-chain over the same key trace as bench_key, for comparison
+//
+static void bench_legacy_key() {
+  static LegacyKeyCalculator calc;
+  static const char* p = key_trace;
+  run_bench("legacy KeyCalculator::key", 1000000, []() {
+    calc.legacy_key(*p++);
+    if('\0' == *p) p = key_trace;
+  });
+  bench_sink = calc._calc.get_value();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Differential test of the _transitions table against the legacy if-chain: random key sequences
+//  (separated by AC AC) go to both, which must agree on every result, state, value and error, and on
+//  every display string at the end of each sequence. Return false (and the suite fails) otherwise.
+//
+static bool check_key_state_machine(uint32_t sequences) {
+  static LegacyKeyCalculator      legacy;
+  static KeyCalculator            table;
+  static const char               keys[]  = "0123456789.B()=+-*/%sr`AMx";
+  static const CalcDisplay        shown[] = { dispValue, dispMemoryID, dispStatus, dispOpStack, dispValStack };
+  uint32_t                        random  = 2463534242u;
+  uint64_t                        count   = 0;
+  for(uint32_t sequence = 0; sequence < sequences; sequence++) {
+    std::string typed;
+    random ^= random << 13;  random ^= random >> 17;  random ^= random << 5;
+    uint32_t length = 1 + random % 24;
+    for(uint32_t i = 0; i < length + 2; i++) {
+      random ^= random << 13;  random ^= random >> 17;  random ^= random << 5;
+      uint8_t code = (i < length) ? keys[random % (sizeof(keys) - 1)] : CLEAR_OPERATOR;
+      typed += char(code);
+      count++;
+      if(length == i) {
+        for(CalcDisplay display : shown) {
+          if(legacy.get_display(display) != table.get_display(display)) {
+            printf("FAILED: after \"%s\" display %d is \"%s\", the legacy state machine shows \"%s\"\n",
+                   typed.c_str(), display, table.get_display(display).c_str(), legacy.get_display(display).c_str());
+            return false;
+          }
+        }
+      }
+      bool expected = legacy.legacy_key(code);
+      bool actual   = table.key(code);
+      double a = table._calc.get_value(), b = legacy._calc.get_value();
+      if(expected != actual || legacy.get_state() != table.get_state() || (a != b && a == a) ||
+         legacy._calc.get_error_state() != table._calc.get_error_state()) {
+        printf("FAILED: after \"%s\" key() returned %d in state %d, the legacy state machine %d in state %d\n",
+               typed.c_str(), actual, table.get_state(), expected, legacy.get_state());
+        return false;
+      }
+    }
+  }
+  printf("%-40s %llu keys in %u sequences agree with the legacy state machine\n", "KeyCalculator transitions",
+         (unsigned long long)count, unsigned(sequences));
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The status line, with a few indexed memories in use (one op is one status string)
+//
+static void bench_status_display() {
+  static KeyCalculator calc;
+  calc._calc.set_memory(3, 1.5);
+  calc._calc.set_memory(40, 2.5);
+  calc._calc.set_memory(97, 3.5);
+  run_bench("KeyCalculator::get_display(dispStatus)", 200000, []() {
+    String str = calc.get_display(dispStatus);
+    bench_sink = str.length();
+  });
+  run_bench("get_display(dispStatus) into a buffer", 200000, []() {
+    char buffer[KEYCAL_DISPLAY_SIZE];
+    bench_sink = calc.get_display(dispStatus, buffer, sizeof(buffer));
+  });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Every display string, as display_all() redraws the screen after a key (one op is one redraw),
+//  as Strings and into buffers as screen_ui.cpp does. The buffers must not allocate.
+//
+static bool bench_redraw() {
+  static KeyCalculator      calc;
+  static const CalcDisplay  shown[] = { dispValue, dispMemoryID, dispStatus, dispOpStack, dispValStack };
+  for(const char* p = "M12=3.25M40=(1+2*(3.5+"; *p; p++) calc.key(*p);
+  run_bench("redraw with Strings", 200000, []() {
+    for(CalcDisplay display : shown) {
+      String str = calc.get_display(display);
+      bench_sink = str.length();
+    }
+  });
+  uint64_t allocs = alloc_count();
+  run_bench("redraw into buffers", 200000, []() {
+    static char buffer[KEYCAL_DISPLAY_SIZE];
+    for(CalcDisplay display : shown) bench_sink = calc.get_display(display, buffer, sizeof(buffer));
+  });
+  allocs = alloc_count() - allocs;
+  if(allocs) printf("FAILED: get_display into a buffer must not allocate.\n");
+  return 0 == allocs;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The format cache and the value stack display must show exactly what formatting from scratch would,
+//  however values collide in the cache and however the stack changes. Return false (and the suite fails) otherwise.
+//
+static bool check_format_cache() {
+  static KeyCalculator  calc;
+  FormatCache           cache;
+  bool                  ok      = true;
+  uint32_t              random  = 88172645u;
+  for(int i = 0; i < 200000 && ok; i++) {
+    random ^= random << 13;  random ^= random >> 17;  random ^= random << 5;
+    double      val       = (random % 2000) / 8.0 - 125.0;      // Few enough values that they repeat and collide
+    uint8_t     precision = 4 + (random >> 16) % 6;
+    char        expected[NUMBER_BUFFER_SIZE];
+    size_t      length;
+    const char* text      = cache.format(val, precision, length);
+    format_number(val, expected, sizeof(expected), precision);
+    if(strcmp(expected, text) || strlen(expected) != length) {
+      printf("FAILED: the format cache gave \"%s\" for %.17g at precision %d, expected \"%s\"\n", text, val, precision, expected);
+      ok = false;
+    }
+  }
+  for(int i = 0; i < 100000 && ok; i++) {
+    random ^= random << 13;  random ^= random >> 17;  random ^= random << 5;
+    calc.key("0123456789.+-*/(()=`sBr"[random % 23]);
+    if(calc.get_error_state()) {
+      calc.key('A');
+      calc.key('A');
+    }
+    char        shown[KEYCAL_DISPLAY_SIZE];
+    std::string expected = "[ ";
+    for(int j = 0; j < calc._calc.value_stack.size(); j++) {
+      char text[NUMBER_BUFFER_SIZE];
+      format_number(calc._calc.value_stack[j], text, sizeof(text), 8);
+      expected += text;
+      expected += ' ';
+    }
+    expected += ']';
+    calc.get_display(dispValStack, shown, sizeof(shown));
+    if(expected != shown) {
+      printf("FAILED: the value stack shows \"%s\", expected \"%s\"\n", shown, expected.c_str());
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The value stack display with a deep stack whose top changes every redraw (one op is one redraw).
+//  Reports how often the format cache hit and how many stack values were reused rather than formatted.
+//
+static void bench_stack_display() {
+  static KeyCalculator  calc;
+  static uint32_t       i = 0;
+  for(int n = 0; n < CALC_STACK_DEPTH - 1; n++) calc._calc.value_stack.push_back(n * 1.0625 - 7.3);
+  uint32_t hits     = calc.format_cache().hits;
+  uint32_t misses   = calc.format_cache().misses;
+  uint32_t reused   = calc.stack_segments_reused();
+  uint32_t rendered = calc.stack_segments_rendered();
+  run_bench("get_display(dispValStack), top changing", 200000, []() {
+    static char buffer[KEYCAL_DISPLAY_SIZE];
+    calc._calc.value_stack.back() = (i++ % 10) * 0.25;
+    bench_sink = calc.get_display(dispValStack, buffer, sizeof(buffer));
+  });
+  hits     = calc.format_cache().hits - hits;
+  misses   = calc.format_cache().misses - misses;
+  reused   = calc.stack_segments_reused() - reused;
+  rendered = calc.stack_segments_rendered() - rendered;
+  printf("%-40s format cache hit rate %.1f%%, %.1f%% of stack values reused\n", "", 100.0 * hits / (hits + misses),
+         100.0 * reused / (reused + rendered));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  get_display into a buffer must write exactly what the String version returns, and a buffer that's
+//  too small must hold as much as fits, terminated. Typing past the number buffer must be rejected, leaving
+//  the number entered terminated. Return false (and the suite fails) otherwise.
+//
+static bool check_display_buffers() {
+  static KeyCalculator      calc;
+  static const CalcDisplay  shown[] = { dispValue, dispMemoryID, dispStatus, dispOpStack, dispValStack };
+  bool                      ok      = true;
+  for(const char* p = key_trace; *p && ok; p++) {
+    calc.key(*p);
+    for(CalcDisplay display : shown) {
+      char    buffer[KEYCAL_DISPLAY_SIZE];
+      char    small[6];
+      String  str     = calc.get_display(display);
+      size_t  length  = calc.get_display(display, buffer, sizeof(buffer));
+      size_t  cut     = calc.get_display(display, small, sizeof(small));
+      if(str != buffer || str.length() != length || cut != std::min(length, sizeof(small) - 1) || strncmp(buffer, small, cut) || small[cut]) {
+        printf("FAILED: display %d into a buffer is \"%s\" (\"%s\" cut short), expected \"%s\"\n", display, buffer, small, str.c_str());
+        ok = false;
+      }
+    }
+  }
+  for(int i = 0; i < CALC_STACK_DEPTH; i++) calc._calc.value_stack.push_back(-1.2345678901234567e19);
+  char buffer[KEYCAL_DISPLAY_SIZE];
+  if(sizeof(buffer) - 1 == calc.get_display(dispValStack, buffer, sizeof(buffer))) {
+    printf("FAILED: KEYCAL_DISPLAY_SIZE must hold a full value stack\n");
+    ok = false;
+  }
+  calc._calc.clear_memory_stack();
+  for(int i = 0; i < 70000; i++) calc._calc.push_memory(i);
+  if(!strstr(calc.get_display(dispStatus).c_str(), "S(70000)")) {
+    printf("FAILED: the status should count 70000 readings on the memory stack: \"%s\"\n", calc.get_display(dispStatus).c_str());
+    ok = false;
+  }
+  calc._calc.clear_memory_stack();
+  calc.key('A');
+  calc.key('A');
+  int accepted = 0;
+  for(int i = 0; i < 80; i++) accepted += calc.key('1');
+  String entered = calc.get_display(dispValue);
+  if(KEYCAL_NUM_BUFFER_SIZE - 1 != accepted || KEYCAL_NUM_BUFFER_SIZE - 1 != entered.length() || !calc.commit()) {
+    printf("FAILED: typing past the number buffer should be rejected: %d digits accepted, \"%s\"\n", accepted, entered.c_str());
+    ok = false;
+  }
+  calc.key('A');
+  calc.key('A');
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Random reads from a sparse MemoryBank with 32-bit addresses, with count registers in use.
+//  Half the reads hit a register in use and half hit empty space (one op is one read).
+//
+static void bench_memory_bank(Mem_Index count) {
+  static MemoryBank<double>*  bank;
+  static Mem_Index            used;
+  static uint32_t             seed;
+  char                        name[48];
+  bank = new MemoryBank<double>(NO_MEMORY);
+  used = count;
+  seed = 1;
+  for(Mem_Index i = 0; i < count; i++) bank->set(i * 3, i + 1.0);  // Every third register, for some sparseness
+  snprintf(name, sizeof(name), "MemoryBank::get (%u in use)", unsigned(count));
+  run_bench(name, 1000000, []() {
+    seed = seed * 1664525 + 1013904223;
+    Mem_Index address = (seed & 1) ? (seed >> 1) % used * 3 : seed;
+    bench_sink = bank->get(address);
+  });
+  printf("%-40s %10.1f bytes/register\n", "", double(bank->bytes_used()) / count);
+  delete bank;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The occupancy masks must agree with the memories after a random mix of stores, operations and clears.
+//  Return false (and the suite fails) otherwise.
+//
+static bool check_memory_occupancy() {
+  MemoryCalculator<double, 100> calc;
+  uint32_t                      seed  = 987;
+  static const Op_ID            ops[] = { EVALUATE_OPERATOR, CLEAR_OPERATOR, ADDITION_OPERATOR, SUBTRACTION_OPERATOR, MULTIPLICATION_OPERATOR };
+  if(ERROR_INVALID_MEMORY != calc.set_memory(100, 1.0) || calc.count_occupied_memories()) {
+    printf("FAILED: setting a memory past the end should fail with ERROR_INVALID_MEMORY and change nothing\n");
+    return false;
+  }
+  for(int step = 0; step < 100000; step++) {
+    seed = seed * 1664525 + 1013904223;
+    calc.push_value(double(seed >> 28) - 4.0);
+    calc.memory_operation(ops[(seed >> 8) % 5], (seed >> 16) % 100);
+    calc.pop_value();
+    if(0 == step % 5000) calc.clear_all_memory();
+    Mem_Index next = calc.next_occupied_memory();
+    for(uint8_t i = 0; i < 100; i++) {
+      bool occupied = (0.0 != calc.get_memory(i));
+      if(occupied != calc.is_memory_occupied(i) || (occupied && next != i) || (!occupied && next == i)) {
+        printf("FAILED: occupancy of M[%d] is wrong at step %d\n", i, step);
+        return false;
+      }
+      if(occupied) next = calc.next_occupied_memory(i + 1);
+      if(0 == i % 10) {
+        uint8_t count = 0;
+        for(uint8_t j = i; j < i + 10; j++) count += (0.0 != calc.get_memory(j));
+        if(count != calc.count_occupied_memories(i, i + 9)) {
+          printf("FAILED: count of M[%d] - M[%d] is wrong at step %d\n", i, i + 9, step);
+          return false;
+        }
+      }
+    }
+    if(NO_MEMORY != next) {
+      printf("FAILED: next_occupied_memory found a memory past the end at step %d\n", step);
+      return false;
+    }
+  }
+
+  // A full 32-bit bank, against a std::map, with addresses clustered so pages and nodes fill and empty
+  MemoryBank<double>            bank(NO_MEMORY);
+  std::map<Mem_Index, double>   reference;
+  for(int step = 0; step < 200000; step++) {
+    seed = seed * 1664525 + 1013904223;
+    Mem_Index address = (seed >> 20) * 0x10001u + (seed & 0x3F) * 0x100000u;
+    double    value   = (seed >> 8) % 3 ? 0.0 : double(step + 1);
+    bank.set(address, value);
+    if(0.0 == value) reference.erase(address);
+    else             reference[address] = value;
+    if(step % 4999) continue;
+    Mem_Index found = bank.next(0);
+    for(auto& entry : reference) {
+      if(entry.first != found || entry.second != bank.get(entry.first)) {
+        printf("FAILED: MemoryBank iteration disagrees at M[%u], step %d\n", unsigned(entry.first), step);
+        return false;
+      }
+      found = bank.next(entry.first + 1);
+    }
+    Mem_Index first = seed % 0x80000000u;
+    Mem_Index last  = first + (seed >> 4);
+    Mem_Index count = 0;
+    for(auto it = reference.lower_bound(first); it != reference.end() && it->first <= last; it++) count++;
+    if(NO_MEMORY != found || count != bank.count(first, last)) {
+      printf("FAILED: MemoryBank count or end of iteration is wrong at step %d\n", step);
+      return false;
+    }
+  }
+  bank.clear();
+  if(bank.bytes_used()) {
+    printf("FAILED: MemoryBank::clear left storage allocated\n");
+    return false;
+  }
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  set_value, recall_memory and pop replace the value; with an empty value stack they must push it
+//  instead of writing outside the stack. Return false (and the suite fails) otherwise.
+//
+static bool check_replace_value() {
+  static TextCalculator calc;
+  calc.clear_all();
+  calc._calc.set_memory(4, 2.5);
+  calc._calc.push_memory(-3.0);
+  const double expected[] = { 7.0, 2.5, -3.0 };
+  for(int i = 0; i < 3; i++) {
+    calc._calc.value_stack.clear();
+    if(0 == i)      calc.set_value("7");
+    else if(1 == i) calc.recall_memory(4);
+    else            calc.pop();
+    if(1 != calc._calc.value_stack.size() || expected[i] != calc._calc.get_value()) {
+      printf("FAILED: replacing the value of an empty value stack lost it (case %d)\n", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Undo and redo must restore the value, memories and memory stack, even across AC AC, and snapshots
+//  must not see later changes to the memories they share. Return false (and the suite fails) otherwise.
+//
+static bool check_undo() {
+  static KeyCalculator  calc;
+  bool                  ok = true;
+  for(const char* p = "12+3=M5="; *p; p++) calc.key(*p);
+  calc.push();
+  calc.checkpoint();
+  calc.key('A');
+  calc.key('A');
+  if(0.0 != calc._calc.get_memory(5) || 0 != calc._calc.get_memory_depth()) {
+    printf("FAILED: AC AC should clear the memories\n");
+    ok = false;
+  }
+  calc.undo();
+  calc.undo();
+  if(15.0 != calc._calc.get_value() || 15.0 != calc._calc.get_memory(5) || 1 != calc._calc.get_memory_depth() || 15.0 != calc._calc.get_memory_sum()) {
+    printf("FAILED: undo should restore the value, memories and memory stack from before AC AC\n");
+    ok = false;
+  }
+  if(!calc.redo() || !calc.redo() || calc.redo() || 0.0 != calc._calc.get_memory(5)) {
+    printf("FAILED: redo should step forward to the cleared state, and no further\n");
+    ok = false;
+  }
+  calc.undo();
+  calc.key('7');
+  if(calc.redo() || calc.get_display(dispValue) != "7") {
+    printf("FAILED: a new key should discard what could have been redone\n");
+    ok = false;
+  }
+  for(int i = 0; i < 100; i++) calc.key("1+"[i & 1]);
+  int undos = 0;
+  while(calc.undo()) undos++;
+  if(KEYCAL_UNDO_DEPTH - 1 != undos) {
+    printf("FAILED: %d undos were possible, the history should hold %d\n", undos, KEYCAL_UNDO_DEPTH - 1);
+    ok = false;
+  }
+  static KeyCalculator sheet;
+  for(const char* p = "5M1="; *p; p++) sheet.key(*p);
+  sheet.set_formula(3, "M[1] * 2");
+  for(const char* p = "9M1="; *p; p++) sheet.key(*p);
+  for(int i = 0; i < 4; i++) sheet.undo();
+  for(const char* p = "7M1="; *p; p++) sheet.key(*p);
+  if(sheet.get_formula(3) || 0.0 != sheet._calc.get_memory(3) || 7.0 != sheet._calc.get_memory(1)) {
+    printf("FAILED: undo to before a formula was set should remove the formula, M[3] was %g\n", sheet._calc.get_memory(3));
+    ok = false;
+  }
+  sheet.set_formula(3, "M[1] * 2");
+  sheet.checkpoint();
+  sheet.key('A');
+  sheet.key('A');
+  sheet.undo();
+  sheet.undo();
+  for(const char* p = "4M1="; *p; p++) sheet.key(*p);
+  if(!sheet.get_formula(3) || 8.0 != sheet._calc.get_memory(3)) {
+    printf("FAILED: undo of AC AC should restore the formulas, M[3] was %g\n", sheet._calc.get_memory(3));
+    ok = false;
+  }
+  MemoryCalculator<double, 100000>          engine;
+  MemoryCalculator<double, 100000>::State   state;
+  for(Mem_Index i = 0; i < 100000; i++) engine.set_memory(i, i + 1.0);
+  engine.push_memory(1.0);
+  engine.push_memory(2.0);
+  engine.save_state(state);
+  engine.set_memory(500, 0.0);
+  engine.set_memory(70000, -1.0);
+  engine.pop_memory();
+  engine.push_memory(-5.0);
+  if(501.0 != state.memories.get(500) || 70001.0 != state.memories.get(70000) || 2.0 != state.memory_stack.back() || 3.0 != state.memory_stack.sum()) {
+    printf("FAILED: a snapshot should not see changes made after it\n");
+    ok = false;
+  }
+  engine.restore_state(state);
+  if(501.0 != engine.get_memory(500) || -1.0 == engine.get_memory(70000) || 100000 != engine.count_occupied_memories() || 2.0 != engine.get_memory_max()) {
+    printf("FAILED: restore_state should return to the snapshot\n");
+    ok = false;
+  }
+  MemoryStack<double> live;
+  for(int i = 1; i <= 40; i++) live.push_back(i);
+  MemoryStack<double> saved(live);
+  for(int i = 0; i < 20; i++) live.pop_back();
+  for(int i = 0; i < 30; i++) live.push_back(-1.0);
+  MemoryStack<double> branch(saved);
+  branch.push_back(41.0);
+  double  value = 0.0;
+  double  total = 0.0;
+  MemoryStack<double>::Walker walker(saved);
+  while(walker.next(value)) total += value;
+  if(40 != saved.size() || 820.0 != saved.sum() || 820.0 != total || 40.0 != saved.back() || 17.0 != saved[16] ||
+     50 != live.size() || 180.0 != live.sum() || 41.0 != branch.back() || 861.0 != branch.sum() || 20.0 != live[19]) {
+    printf("FAILED: copies of a memory stack should push and pop without affecting each other\n");
+    ok = false;
+  }
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Differential test of speculation: random key sequences (separated by AC AC) go to a calculator that asks
+//  for dispPreview after every key, as the screen does, and to one that doesn't speculate. They must agree on
+//  every result, state, value, error and display string, and whenever there is a preview, the value after =
+//  must be what it showed. Return false (and the suite fails) otherwise.
+//
+static bool check_speculation(uint32_t sequences) {
+  static KeyCalculator            speculating;
+  static KeyCalculator            plain;
+  static const char               keys[]  = "0123456789.B()==+-*/%sr`AMx";
+  static const CalcDisplay        shown[] = { dispValue, dispMemoryID, dispStatus, dispOpStack, dispValStack };
+  uint32_t                        random  = 2463534242u;
+  uint64_t                        count   = 0;
+  uint64_t                        equals  = 0;
+  speculating.set_speculation(true);
+  for(uint32_t sequence = 0; sequence < sequences; sequence++) {
+    std::string typed;
+    random ^= random << 13;  random ^= random >> 17;  random ^= random << 5;
+    uint32_t length = 1 + random % 24;
+    for(uint32_t i = 0; i < length + 2; i++) {
+      random ^= random << 13;  random ^= random >> 17;  random ^= random << 5;
+      uint8_t code = (i < length) ? keys[random % (sizeof(keys) - 1)] : CLEAR_OPERATOR;
+      String  preview = speculating.get_display(dispPreview);
+      typed += char(code);
+      count++;
+      if(EVALUATE_OPERATOR == code) equals++;
+      bool expected = plain.key(code);
+      bool actual   = speculating.key(code);
+      double a = speculating._calc.get_value(), b = plain._calc.get_value();
+      if(expected != actual || plain.get_state() != speculating.get_state() || (a != b && a == a) ||
+         plain._calc.get_error_state() != speculating._calc.get_error_state()) {
+        printf("FAILED: after \"%s\" key() returned %d in state %d while speculating, %d in state %d without\n",
+               typed.c_str(), actual, speculating.get_state(), expected, plain.get_state());
+        return false;
+      }
+      for(CalcDisplay display : shown) {
+        if(plain.get_display(display) != speculating.get_display(display)) {
+          printf("FAILED: after \"%s\" display %d is \"%s\" while speculating, \"%s\" without\n",
+                 typed.c_str(), display, speculating.get_display(display).c_str(), plain.get_display(display).c_str());
+          return false;
+        }
+      }
+      if(EVALUATE_OPERATOR == code && preview.length() && preview != String("= ") + speculating.get_display(dispValue)) {
+        printf("FAILED: after \"%s\" the preview was \"%s\", but = gave %s\n", typed.c_str(), preview.c_str(),
+               speculating.get_display(dispValue).c_str());
+        return false;
+      }
+    }
+  }
+  printf("%-40s %llu keys agree; %u of %llu = keys took the speculated result, from %u evaluations\n", "KeyCalculator speculation",
+         (unsigned long long)count, unsigned(speculating.speculations_used()), (unsigned long long)equals, unsigned(speculating.speculations_run()));
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  = at the end of a long expression, with and without the speculated result (one op is = and an undo of it).
+//  The undo brings back the stacks speculate() evaluated, so each = can take its result.
+//
+static void bench_evaluate_key() {
+  static KeyCalculator calc;
+  for(int speculate = 0; speculate < 2; speculate++) {
+    calc.set_speculation(speculate);
+    for(const char* p = "AA1+2*3-4/5+6*7-8/9+(2+3*(4-1.5)/2)*7-9/3+1.25"; *p; p++) calc.key(*p);
+    calc.speculate();
+    run_bench(speculate ? "= with speculation" : "= without speculation", 200000, []() {
+      calc.key(EVALUATE_OPERATOR);
+      calc.undo();
+    });
+  }
+  bench_sink = calc._calc.get_value();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Snapshots of a full engine (100,000 memories in use and 100,000 values stacked) share its storage,
+//  so saving one costs the same as for an empty engine. After a store, the next snapshot costs one copied
+//  page and the nodes above it (allocs/op), not a copy of the bank.
+//
+static void bench_snapshot() {
+  typedef MemoryCalculator<double, NUM_CALC_MEMORIES> Engine;
+  static Engine         calc;
+  static Engine::State  states[KEYCAL_UNDO_DEPTH];
+  static uint32_t       i = 0;
+  for(Mem_Index m = 0; m < NUM_CALC_MEMORIES; m++) calc.set_memory(m, m + 1.0);
+  for(int n = 0; n < 100000; n++) calc.push_memory(n);
+  run_bench("MemoryCalculator::save_state (full)", 1000000, []() {
+    calc.save_state(states[i++ % KEYCAL_UNDO_DEPTH]);
+  });
+  run_bench("set_memory + save_state (full)", 1000000, []() {
+    calc.set_memory(i * 7919 % NUM_CALC_MEMORIES, i);
+    calc.save_state(states[i++ % KEYCAL_UNDO_DEPTH]);
+  });
+  run_bench("push_memory + save_state (full)", 1000000, []() {
+    calc.push_memory(i);
+    calc.save_state(states[i++ % KEYCAL_UNDO_DEPTH]);
+  });
+  for(Engine::State& state : states) state = Engine::State();
+  calc.clear_all_memory();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Record a session of keys and buttons the way the sketch does, then replay the trace into a fresh calculator:
+//  every recorded display must match. A trace that overflows must stop cleanly. If path isn't nullptr,
+//  the session is saved there for host/replay. Return false (and the suite fails) otherwise.
+//
+static bool check_key_trace(const char* path) {
+  static KeyCalculator  recorded;
+  static KeyCalculator  replayed;
+  static KeyTraceWriter writer;
+  static const char*    buttons[] = { "push", "pi", "(", ")", "square", "undo", "pop", "redo", "e", "sqroot", "cancel", "right", "stack sum", "stack count" };
+  bool                  ok        = true;
+  for(int pass = 0; pass < 20; pass++) {
+    for(const char* p = key_trace; *p; p++) {
+      uint32_t start = micros();
+      recorded.key(*p);
+      writer.key(*p, start, micros() - start);
+    }
+    const char* button = buttons[pass % (sizeof(buttons) / sizeof(buttons[0]))];
+    uint32_t    start  = micros();
+    if(do_button_action(recorded, button)) writer.button(button, start, micros() - start);
+    writer.display(recorded, micros());
+  }
+  KeyTraceReader  reader(writer.data(), writer.size());
+  KeyTraceEvent   event;
+  int             checked = 0;
+  while(reader.next(event)) {
+    if(traceKey    == event.type) replayed.key(event.code);
+    if(traceButton == event.type) do_button_action(replayed, String(std::string(event.text, event.length).c_str()));
+    if(traceDisplay != event.type) continue;
+    checked++;
+    if(std::string(event.text, event.length) != replayed.get_display(CalcDisplay(event.code)).c_str()) {
+      printf("FAILED: replayed display %d was \"%s\", recorded \"%.*s\"\n", event.code, replayed.get_display(CalcDisplay(event.code)).c_str(), event.length, event.text);
+      ok = false;
+    }
+  }
+  if(100 != checked || reader.corrupt() || reader.truncated()) {
+    printf("FAILED: the key trace should replay 100 displays, got %d%s\n", checked, reader.corrupt() ? " (corrupt)" : "");
+    ok = false;
+  }
+  printf("%-40s %10u bytes %9.2f bytes/key\n", "Key trace of 20 sessions", unsigned(writer.size()), double(writer.size()) / (20 * strlen(key_trace)));
+  if(path) {
+    FILE* file = fopen(path, "wb");
+    if(file) {
+      fwrite(writer.data(), 1, writer.size(), file);
+      fclose(file);
+    }
+  }
+  if(reader.mid_session()) {
+    printf("FAILED: a key trace started at boot shouldn't be marked mid-session\n");
+    ok = false;
+  }
+  writer.clear(true);
+  writer.key('1', 0, 1);
+  KeyTraceReader later(writer.data(), writer.size());
+  if(!later.mid_session() || later.truncated() || !later.next(event) || traceKey != event.type) {
+    printf("FAILED: a key trace started mid-session should be marked, and still read cleanly\n");
+    ok = false;
+  }
+  writer.clear();
+  for(int i = 0; i < KEYTRACE_BUFFER_SIZE; i++) writer.key('1', i, 1);
+  int keys = 0;
+  KeyTraceReader full(writer.data(), writer.size());
+  while(full.next(event)) keys++;
+  if(!writer.truncated() || !full.truncated() || full.corrupt() || writer.display(recorded, 0) || 0 == keys) {
+    printf("FAILED: a full key trace should be marked truncated, and still read cleanly\n");
+    ok = false;
+  }
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Drive the engine directly with a long trace of keyboard-style input and verify that
+//  push_value, push_operator and evaluate_all never touch the heap.
+//  A fresh calculator is used for each pass so that no capacity is carried over.
+//  Return false (and the suite fails) if any allocation was made.
+//
+static bool check_engine_allocations() {
+  uint64_t allocs = alloc_count();
+  for(int i = 0; i < 100000; i++) {
+    CoreCalculator<double> core;
+    for(const char* p = key_trace; *p; p++) {
+      if('0' <= *p && '9' >= *p) core.push_value(*p - '0');
+      else                       core.push_operator(*p);
+    }
+    core.evaluate_all();
+    bench_sink = core.get_value();
+  }
+  allocs = alloc_count() - allocs;
+  printf("%-40s %10d ops %12s       %10llu allocs\n", "Engine key trace", 100000, "", (unsigned long long)allocs);
+  if(allocs) printf("FAILED: push_value, push_operator and evaluate_all must not allocate.\n");
+  return 0 == allocs;
+}
+
+
+int main(int argc, char** argv) {
+  bool ok = check_engine_allocations();
+  bench_core_push_operator();
+  bench_core_evaluate_all();
+  bench_arithmetic<double>("CoreCalculator<double> arithmetic");
+  bench_arithmetic<Decimal>("CoreCalculator<Decimal64<6>> arithmetic");
+  show_decimal_exactness();
+  ok = check_memory_aggregates() && ok;
+  bench_memory_stack();
+  bench_text_parse();
+  bench_parse_throughput();
+  ok = check_formulas() && ok;
+  bench_formulas();
+  ok = check_number_parsing() && ok;
+  bench_parse_number("typical", number_texts);
+  bench_parse_number("hard", hard_numbers);
+  bench_parse_number("halfway", bigint_numbers);
+  ok = check_rpn_programs() && ok;
+  bench_rpn_evaluate();
+  bench_double_to_string();
+  bench_key();
+  bench_legacy_key();
+  ok = check_key_state_machine(1000000) && ok;
+  ok = check_replace_value() && ok;
+  ok = check_undo() && ok;
+  ok = check_speculation(200000) && ok;
+  bench_evaluate_key();
+  ok = check_key_trace(1 < argc ? argv[1] : nullptr) && ok;
+  bench_snapshot();
+  ok = check_memory_occupancy() && ok;
+  bench_status_display();
+  ok = check_display_buffers() && ok;
+  ok = bench_redraw() && ok;
+  ok = check_format_cache() && ok;
+  bench_stack_display();
+  bench_memory_bank(1000);
+  bench_memory_bank(65536);
+  bench_memory_bank(1000000);
+  return ok ? 0 : 1;
+}
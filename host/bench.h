@@ -0,0 +1,41 @@
+#pragma once
+
+// Tiny benchmark harness for the host build.
+// Each benchmark runs a workload a fixed number of times and reports ns/op and allocations/op,
+// so every performance change to the engine can be compared against the same baseline.
+// Also the helpers the host tools share: the sample key trace they type, and nearest rank percentiles.
+
+
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "alloc_count.h"
+
+extern volatile double bench_sink;                              // Results are written here so the optimizer can't discard the work
+
+// A session at the calculator keyboard: numbers, operators, parens, memories, AC, square and root
+static const char* const key_trace = "12.5+7*3=M=A(4+6)/2=MM*1.05=M7=AA3.14159s=r=M7M-0.5=";
+
+
+// The sample at fraction of the way through sorted (nearest rank)
+//
+inline double percentile(const std::vector<double>& sorted, double fraction) {
+  size_t rank = size_t(fraction * sorted.size() + 0.999999);
+  return sorted[rank ? rank - 1 : 0];
+}
+
+
+// Run op() iterations times after a short warm-up and print one line of results. Return ns/op.
+//
+template <typename Op>
+double run_bench(const char* name, unsigned long iterations, Op op) {
+  for(unsigned long i = 0; i < iterations / 10 + 1; i++) op();
+  uint64_t  allocs  = alloc_count();
+  auto      start   = std::chrono::steady_clock::now();
+  for(unsigned long i = 0; i < iterations; i++) op();
+  auto      stop    = std::chrono::steady_clock::now();
+  allocs = alloc_count() - allocs;
+  double    ns      = std::chrono::duration<double, std::nano>(stop - start).count();
+  printf("%-40s %10lu ops %12.1f ns/op %10.2f allocs/op\n", name, iterations, ns / iterations, double(allocs) / iterations);
+  return ns / iterations;
+}
@@ -0,0 +1,196 @@
+// Drive the keyboard input layer (KeyInput.h) with a mock keyboard on the host, and compare it with polling.
+// A keyboard thread presses keys in bursts; like the FACES keyboard, the mock holds one key until it's read,
+// and a key pressed before the last one was read replaces it (that key is dropped).
+//   interrupt   the press wakes an input thread that pumps the keys into a KeyRing, which wakes the main
+//               thread; the main thread sleeps at most 10 ms, as loop() does, when the ring is empty
+//   polling     the main thread reads one key if there is one, then sleeps 10 ms, as loop() used to
+// The main thread hands every key to a KeyCalculator. For each mode and burst pattern, reports the latency from
+// press to KeyCalculator::key() returning, with p50/p99/max, and the keys dropped. Exits with 1 if the interrupt
+// mode drops a key, or delivers keys out of order.
+//
+//   build/input
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../KeyCalculator.h"
+#include "../KeyInput.h"
+#include "bench.h"
+
+#define INPUT_WAIT_MS         10                                // How long loop() sleeps with nothing to do
+
+
+struct Pattern {
+  const char* name;
+  int         bursts;
+  int         keys;                                             // Keys in a burst
+  int         spacing;                                          // us between the keys of a burst
+  int         gap;                                              // us between bursts
+};
+
+static const Pattern patterns[] = {
+  { "typing, a key every 30 ms",      60,   1,    0, 30000 },
+  { "bursts of 8 keys 1 ms apart",    20,   8, 1000, 50000 },
+  { "bursts of 24 keys 500 us apart", 10,  24,  500, 60000 },
+};
+
+
+// Stand-in for a task notification: give() wakes one take(), or the next one
+//
+class Signal {
+  public:
+    void give() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _given = true;
+      _condition.notify_one();
+    }
+    void take(unsigned ms) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _condition.wait_for(lock, std::chrono::milliseconds(ms), [this]() { return _given; });
+      _given = false;
+    }
+  protected:
+    std::mutex              _mutex;
+    std::condition_variable _condition;
+    bool                    _given = false;
+};
+
+
+// The FACES keyboard: one key register and a data ready line. Keys are numbered 1 to 255, in the order pressed,
+// so the main thread can tell which press each key it gets came from.
+//
+class MockKeyboard : public KeyTransport {
+  public:
+    Signal*   interrupt = nullptr;                              // Given when the data ready line falls
+    uint32_t  pressed[256];                                     // micros() when each key number was last pressed
+    uint32_t  replaced  = 0;                                    // Keys pressed over an unread key
+    void press(char key) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        pressed[uint8_t(key)] = micros();
+        if(_ready) replaced++;
+        _key    = key;
+        _ready  = true;
+      }
+      if(interrupt) interrupt->give();
+    }
+    bool key_ready() override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      return _ready;
+    }
+    bool read_key(char& key) override {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if(!_ready) return false;
+      key     = _key;
+      _ready  = false;
+      return true;
+    }
+  protected:
+    std::mutex  _mutex;
+    char        _key    = 0;
+    bool        _ready  = false;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Press the keys of pattern, then stop the other threads
+//
+static void press_keys(MockKeyboard& keyboard, const Pattern& pattern, std::atomic<bool>& running) {
+  uint8_t number = 0;
+  for(int burst = 0; burst < pattern.bursts; burst++) {
+    for(int key = 0; key < pattern.keys; key++) {
+      if(key) std::this_thread::sleep_for(std::chrono::microseconds(pattern.spacing));
+      number = number % 255 + 1;
+      keyboard.press(char(number));
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(pattern.gap));
+  }
+  running = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Run pattern through one mode and report it. Return false if interrupt mode lost a key or reordered them.
+//
+static bool run_pattern(const Pattern& pattern, bool interrupt) {
+  static KeyCalculator  calc;
+  MockKeyboard          keyboard;
+  KeyRing               ring;
+  Signal                input_wake;
+  Signal                loop_wake;
+  std::atomic<bool>     running{true};
+  std::atomic<bool>     input_done{false};
+  std::vector<double>   latencies;
+  uint8_t               expected  = 1;
+  bool                  in_order  = true;
+  auto handle = [&](char key) {
+    calc.key(key_trace[uint8_t(key) % strlen(key_trace)]);
+    latencies.push_back(micros() - keyboard.pressed[uint8_t(key)]);
+    if(uint8_t(key) != expected) in_order = false;
+    expected = expected % 255 + 1;
+  };
+
+  std::thread input;
+  if(interrupt) {
+    keyboard.interrupt = &input_wake;
+    input = std::thread([&]() {
+      while(running || keyboard.key_ready()) {
+        input_wake.take(INPUT_WAIT_MS);
+        if(pump_keys(keyboard, ring)) loop_wake.give();
+      }
+      input_done = true;
+      loop_wake.give();
+    });
+  }
+  std::thread presser(press_keys, std::ref(keyboard), std::cref(pattern), std::ref(running));
+  if(interrupt) {
+    KeyEvent event;
+    while(!input_done || !ring.empty()) {
+      if(ring.empty()) loop_wake.take(INPUT_WAIT_MS);
+      if(ring.pop(event)) handle(event.key);
+    }
+  }
+  else {
+    char key;
+    while(running || keyboard.key_ready()) {
+      if(keyboard.key_ready() && keyboard.read_key(key)) handle(key);
+      delay(INPUT_WAIT_MS);
+    }
+  }
+  presser.join();
+  if(interrupt) input.join();
+
+  uint32_t pressed = pattern.bursts * pattern.keys;
+  uint32_t dropped = keyboard.replaced + ring.dropped();
+  std::sort(latencies.begin(), latencies.end());
+  printf("  %-10s %-32s %6u %6u %9.0f %9.0f %9.0f us\n", interrupt ? "interrupt" : "polling", pattern.name,
+         unsigned(pressed), unsigned(dropped), percentile(latencies, 0.50), percentile(latencies, 0.99), latencies.back());
+  if(!interrupt) return true;
+  if(dropped || !in_order || latencies.size() != pressed) {
+    printf("FAILED: the interrupt driven input lost or reordered keys\n");
+    return false;
+  }
+  return true;
+}
+
+
+int main(int argc, char** argv) {
+  bool ok = true;
+  printf("  %-10s %-32s %6s %6s %9s %9s %9s\n", "Input", "Keys pressed", "keys", "drops", "p50", "p99", "max");
+  for(const Pattern& pattern : patterns) {
+    ok = run_pattern(pattern, true) && ok;
+    ok = run_pattern(pattern, false) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,502 @@
+// Render the calculator screen (screen_ui.cpp) on the host, into a FramebufferSurface.
+// Checks a set of scenes against golden image hashes, checks that retained redraws after every key, and values
+// composed from the glyph atlas, leave exactly the pixels a full redraw in the sprite would, and reports
+// display_all() frame times and pixel throughput. Also stress tests the snapshot queue between threads, and
+// drawing on a render thread while the main thread types, that the frame governor keeps the latency of fast
+// typing bounded by coalescing keys into frames, and that the latency probe times every display stage and
+// survives its dump format.
+// Exits with 1 if any check fails.
+//
+//   build/render               check and benchmark
+//   build/render snapshots     also write each scene as snapshots/<scene>.ppm, to look at or to diff
+//
+// When a rendering change is intended, check the new snapshots by eye, then paste the printed hashes into golden.
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <Arduino.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../FrameGovernor.h"
+#include "../KeyCalculator.h"
+#include "../SnapshotQueue.h"
+#include "../screen_layout.h"
+#include "../screen_ui.h"
+#include "FramebufferSurface.h"
+#include "bench.h"
+
+volatile double bench_sink = 0.0;
+
+// The sketch's globals that screen_ui.cpp draws from
+KeyCalculator calc;
+String        button_sets[]   = { BUTTONS_NORMAL_0, BUTTONS_NORMAL_1, BUTTONS_NORMAL_2, BUTTONS_NORMAL_3, BUTTONS_NORMAL_4, BUTTONS_NORMAL_5 };
+uint8_t       button_set      = 0;
+bool          cancel_bs       = false;
+bool          stacks_visible  = true;
+LatencyProbe  latency_probe;
+
+// A screen without a glyph atlas, so every value is drawn in the sprite and pushed, for comparison
+class RasterSurface : public FramebufferSurface {
+  public:
+    GlyphAtlas* make_atlas(const char* glyphs, uint8_t font, uint16_t fg, uint16_t bg) override { return nullptr; }
+};
+
+// The LCD, watched as the device's is shared: M5ez's buttons and header must be drawn on the main thread,
+// and no two threads may draw at once
+class SharedSurface : public FramebufferSurface {
+  public:
+    std::thread::id   main_thread   = std::this_thread::get_id();
+    std::atomic<int>  drawing{0};                               // Threads drawing
+    std::atomic<bool> overlapped{false};                        // Two threads drew at once
+    std::atomic<bool> chrome_off_main{false};                   // The buttons or header were drawn on another thread
+    void fill_rect(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t color) override {
+      _enter();
+      FramebufferSurface::fill_rect(x, y, w, h, color);
+      _leave();
+    }
+    int16_t draw_text(const char* text, int32_t x, int32_t y, uint8_t font, SurfaceAlign align, uint16_t fg, uint16_t bg) override {
+      _enter();
+      int16_t width = FramebufferSurface::draw_text(text, x, y, font, align, fg, bg);
+      _leave();
+      return width;
+    }
+    int16_t draw_glyph(const GlyphAtlas& atlas, char c, int32_t x, int32_t y) override {
+      _enter();
+      int16_t width = FramebufferSurface::draw_glyph(atlas, c, x, y);
+      _leave();
+      return width;
+    }
+    void show_buttons(const char* buttons) override {
+      if(std::this_thread::get_id() != main_thread) chrome_off_main = true;
+      FramebufferSurface::show_buttons(buttons);
+    }
+    void show_header(const char* title) override {
+      if(std::this_thread::get_id() != main_thread) chrome_off_main = true;
+      FramebufferSurface::show_header(title);
+    }
+  protected:
+    static thread_local int _depth;                             // This thread's draw calls in progress: one may call another
+    void _enter() {
+      if(_depth++) return;
+      if(drawing++) overlapped = true;
+      std::this_thread::yield();                                // Give another thread the chance to overlap
+    }
+    void _leave() {
+      if(!--_depth) drawing--;
+    }
+};
+
+thread_local int SharedSurface::_depth = 0;
+
+static SharedSurface      lcd;
+static FramebufferSurface value_sprite(SCREEN_WIDTH - LEFT_MARGIN - RIGHT_MARGIN, NUM_HEIGHT, &lcd);
+static RasterSurface      raster_lcd;
+static FramebufferSurface raster_sprite(SCREEN_WIDTH - LEFT_MARGIN - RIGHT_MARGIN, NUM_HEIGHT, &raster_lcd);
+
+struct Scene {
+  const char* name;
+  const char* keys;                                             // Typed after AC AC
+  bool        preview;                                          // Speculate, so the preview of = is shown
+  uint32_t    golden;                                           // hash() of the screen
+};
+
+static const Scene scenes[] = {
+  { "clear",        "",                                 false,  0xdbec0315u },
+  { "entering",     "12.5",                             false,  0x892703e5u },
+  { "result",       "12.5+7*3=",                        false,  0x3c060d35u },
+  { "parens",       "(4+6)/(2",                         false,  0x0e4769b5u },
+  { "memory",       "M12=3.25M40=M",                    false,  0xa4ef10a6u },
+  { "long_value",   "123456789*987654321*1000=",        false,  0x980acdb5u },
+  { "error",        "1/0=",                             false,  0x1f844035u },
+  { "preview",      "12.5+7*3",                         true,   0x1161c977u },
+};
+
+static const char* entry_keys = "3.14159265358979BBBBBBBBBBBBBBBB";  // Number entry, typed and backspaced
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Start from a blank screen and a cleared calculator with no memories, as the sketch does at startup
+//
+static void reset_screen(FramebufferSurface& screen = lcd, FramebufferSurface& sprite = value_sprite) {
+  calc.key(CLEAR_OPERATOR);
+  calc.key(CLEAR_OPERATOR);
+  calc._calc.clear_all_memory();
+  button_set  = 0;
+  cancel_bs   = false;
+  screen.fill_rect(0, 0, screen.width(), screen.height(), BLACK);
+  set_display_surfaces(screen, sprite);
+  display_all();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Type keys, redrawing after each one as the sketch does. If full is true, every redraw is a full one.
+//
+static void type(const char* keys, bool full) {
+  for(const char* p = keys; *p; p++) {
+    if(calc.key(*p) || calc.get_error_state()) {
+      if(full) invalidate_display();
+      display_all();
+    }
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Each scene must render to its golden hash. If directory isn't nullptr, write the scenes there as PPM files.
+//  Return false (and the run fails) otherwise.
+//
+static bool check_scenes(const char* directory) {
+  bool ok = true;
+  for(const Scene& scene : scenes) {
+    calc.set_speculation(scene.preview);
+    reset_screen();
+    type(scene.keys, false);
+    uint32_t hash = lcd.hash();
+    printf("%-40s 0x%08xu%s\n", scene.name, unsigned(hash), hash == scene.golden ? "" : "  (golden mismatch)");
+    if(hash != scene.golden) ok = false;
+    if(directory) {
+      std::string path = std::string(directory) + "/" + scene.name + ".ppm";
+      if(!lcd.write_ppm(path.c_str())) {
+        printf("FAILED: can't write %s\n", path.c_str());
+        ok = false;
+      }
+    }
+  }
+  calc.set_speculation(false);
+  if(!ok) printf("FAILED: the screen doesn't match the golden images\n");
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Type the key trace three times: redrawing only what changed, redrawing everything, and redrawing only
+//  what changed without the glyph atlas, so every value is drawn in the sprite and pushed. The preview of =
+//  is shown, so its region changes with most keys. The screens must be identical after every key.
+//  Return false (and the run fails) otherwise.
+//
+static bool check_redraws() {
+  static const char*    passes[] = { "a full redraw", "a redraw without the glyph atlas" };
+  std::vector<uint32_t> hashes[3];
+  calc.set_speculation(true);
+  for(int pass = 0; pass < 3; pass++) {
+    FramebufferSurface& screen = (2 == pass) ? static_cast<FramebufferSurface&>(raster_lcd) : lcd;
+    reset_screen(screen, (2 == pass) ? raster_sprite : value_sprite);
+    for(const char* p = key_trace; *p; p++) {
+      char key[2] = { *p, '\0' };
+      type(key, 1 == pass);
+      hashes[pass].push_back(screen.hash());
+    }
+  }
+  calc.set_speculation(false);
+  for(int pass = 1; pass < 3; pass++) {
+    for(size_t i = 0; i < hashes[0].size(); i++) {
+      if(hashes[0][i] != hashes[pass][i]) {
+        printf("FAILED: after \"%.*s\" the retained screen differs from %s\n", int(i + 1), key_trace, passes[pass - 1]);
+        return false;
+      }
+    }
+  }
+  printf("%-40s %u keys redrawn identically\n", "Retained, full and rasterized redraws", unsigned(hashes[0].size()));
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  display_all() after each of keys, cycling through them (one op is one key and its redraw).
+//  Also reports the pixels sent to the display per frame.
+//
+static void bench_keys(const char* name, const char* keys, FramebufferSurface& screen, FramebufferSurface& sprite) {
+  static const char*  p;
+  static const char*  cycle;
+  uint32_t            pixels = screen.pixels() + sprite.pixels();
+  uint32_t            frames = 0;
+  reset_screen(screen, sprite);
+  p     = keys;
+  cycle = keys;
+  double ns = run_bench(name, 20000, [&frames]() {
+    if(!*p) p = cycle;
+    calc.key(*p++);
+    display_all();
+    frames++;
+  });
+  double per_frame = double(screen.pixels() + sprite.pixels() - pixels) / frames;
+  printf("%-40s %10.0f pixels/frame %9.1f Mpixels/s\n", "", per_frame, per_frame / ns * 1000.0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  display_all() frame time and pixel throughput (one op is one frame):
+//  full redraws of a busy screen, retained redraws after each key of the key trace, and the echo of
+//  number entry, with the glyph atlas and without it.
+//
+static void bench_display_all() {
+  reset_screen();
+  type("M12=3.25M40=(1+2*(3.5+", false);
+  double ns = run_bench("display_all() full redraw", 20000, []() {
+    invalidate_display();
+    display_all();
+  });
+  printf("%-40s %10u pixels/frame %9.1f Mpixels/s\n", "", unsigned(screen_pixels_last), screen_pixels_last / ns * 1000.0);
+  bench_keys("display_all() after a key", key_trace, lcd, value_sprite);
+  bench_keys("number entry echo", entry_keys, lcd, value_sprite);
+  bench_keys("number entry echo without the atlas", entry_keys, raster_lcd, raster_sprite);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  One thread publishes a million numbered snapshots as fast as it can while another takes the latest:
+//  every snapshot taken must be whole (all its words agree with its number), newer than the last one taken,
+//  and the last one published must be taken. Return false (and the run fails) otherwise.
+//
+struct Numbered {
+  uint32_t  number;
+  uint32_t  words[255];
+};
+
+static bool check_snapshot_queue() {
+  static SnapshotQueue<Numbered, 4> queue;
+  static Numbered                   published;
+  const uint32_t                    count   = 1000000;
+  std::atomic<bool>                 ok{true};
+  uint32_t                          full    = 0;
+  uint32_t                          taken   = 0;
+  std::thread consumer([&ok, &taken, count]() {
+    Numbered  snapshot;
+    uint32_t  last = 0;
+    while(last < count) {
+      if(!queue.take_latest(snapshot)) {
+        std::this_thread::yield();
+        continue;
+      }
+      taken++;
+      for(uint32_t word : snapshot.words) {
+        if(word != snapshot.number * 2654435761u) ok = false;
+      }
+      if(snapshot.number <= last) ok = false;
+      last = snapshot.number;
+    }
+  });
+  for(uint32_t number = 1; number <= count; number++) {
+    published.number = number;
+    for(uint32_t& word : published.words) word = number * 2654435761u;
+    while(!queue.publish(published)) {
+      full++;
+      std::this_thread::yield();
+    }
+  }
+  consumer.join();
+  printf("%-40s %10u published %9u taken %9u skipped %9u full\n", "SnapshotQueue between threads",
+         unsigned(count), unsigned(taken), unsigned(queue.skipped()), unsigned(full));
+  if(!ok || taken + queue.skipped() != count) printf("FAILED: the snapshot queue took a torn, stale or lost snapshot\n");
+  return ok && taken + queue.skipped() == count;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Type the key trace 100 times with a render thread drawing the latest snapshot, holding it now and then
+//  as a menu would. Once it has drawn the last one, the screen must be what display_all() draws for the same
+//  state. Return false (and the run fails) otherwise.
+//
+static bool check_render_thread() {
+  std::atomic<bool> running{true};
+  uint32_t          published = snapshots_published();
+  uint32_t          skipped   = snapshots_skipped();
+  uint32_t          full      = 0;
+  uint32_t          frames    = 0;
+  reset_screen();
+  std::thread render([&running, &frames]() {
+    while(running) {
+      if(render_latest()) frames++;
+      else                std::this_thread::yield();
+    }
+  });
+  for(int pass = 0; pass < 100; pass++) {
+    for(const char* p = key_trace; *p; p++) {
+      calc.key(*p);
+      while(!publish_display()) {
+        full++;
+        std::this_thread::yield();
+      }
+    }
+    if(0 == pass % 10) {
+      hold_rendering();
+      lcd.fill_rect(0, 0, lcd.width(), lcd.height(), WHITE);  // What a menu might leave behind
+      release_rendering();
+      while(!publish_display()) {
+        full++;
+        std::this_thread::yield();
+      }
+    }
+  }
+  while(rendered_sequence() != snapshots_published()) std::this_thread::yield();
+  running = false;
+  render.join();
+  uint32_t threaded = lcd.hash();
+  raster_lcd.fill_rect(0, 0, raster_lcd.width(), raster_lcd.height(), WHITE);  // As the last "menu" left the screen
+  set_display_surfaces(raster_lcd, raster_sprite);
+  display_all();
+  printf("%-40s %10u published %9u drawn %9u skipped %9u full\n", "Render thread", unsigned(snapshots_published() - published),
+         unsigned(frames), unsigned(snapshots_skipped() - skipped), unsigned(full));
+  if(threaded != raster_lcd.hash()) printf("FAILED: the render thread's screen differs from display_all()'s\n");
+  if(lcd.chrome_off_main)           printf("FAILED: the render thread drew M5ez's buttons or header\n");
+  if(lcd.overlapped)                printf("FAILED: the render thread drew while the main thread was drawing\n");
+  return threaded == raster_lcd.hash() && !lcd.chrome_off_main && !lcd.overlapped;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Run the sketch's loop() on a simulated clock, in us: a key of the key trace arrives every spacing us, and
+//  every frame takes cost us to draw. If coalesce is true, each pass applies every key that has arrived, as
+//  loop() does now; if not, it applies one, as it used to. Frames are drawn when governor says they're due.
+//
+static void simulate_typing(FrameGovernor& governor, bool coalesce, uint32_t keys, uint32_t spacing, uint32_t cost) {
+  uint32_t now  = 0;
+  uint32_t next = 0;                                            // The next key to arrive
+  while(next < keys || governor.pending()) {
+    while(next < keys && next * spacing <= now) {
+      char key = key_trace[next % strlen(key_trace)];
+      if(calc.key(key) || calc.get_error_state()) governor.key(next * spacing);
+      next++;
+      if(!coalesce) break;
+    }
+    if(governor.due(now)) {
+      display_all();
+      governor.frame(now, now + cost);
+      now += cost;
+    }
+    else if(governor.pending()) now += governor.wait(now);
+    else if(next < keys)        now = std::max(now, next * spacing);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Type the key trace 20 times, a key every 4 ms, where every frame takes 10 ms to draw: once drawing after
+//  every key, as the sketch used to, and once with the keys coalesced into frames at most 60 a second.
+//  Reports keys per frame and the latency from each frame's oldest key to the end of the frame.
+//  The coalesced latency must stay within a frame plus the longer of a frame and the frame interval, and the screen must end up as
+//  display_all() draws the final state. Return false (and the run fails) otherwise.
+//
+static bool check_frame_governor() {
+  const uint32_t  keys    = 20 * strlen(key_trace);
+  const uint32_t  spacing = 4000;
+  const uint32_t  cost    = 10000;
+  bool            ok      = true;
+  for(int coalesce = 0; coalesce < 2; coalesce++) {
+    FrameGovernor governor(coalesce ? 60 : 0);
+    reset_screen();
+    simulate_typing(governor, coalesce, keys, spacing, cost);
+    FrameStats p50 = governor.frame_percentile(0.50);
+    FrameStats p99 = governor.frame_percentile(0.99);
+    printf("%-40s %10u keys %9u frames %4u max keys/frame %9.1f %9.1f %9.1f ms latency p50/p99/max\n",
+           coalesce ? "Keys coalesced into frames" : "A frame for every key", unsigned(governor.keys()), unsigned(governor.frames()),
+           unsigned(governor.keys_max()), p50.latency / 1000.0, p99.latency / 1000.0, governor.latency_max() / 1000.0);
+    if(coalesce && std::max(cost, uint32_t(1000000 / 60)) + cost < governor.latency_max()) {
+      printf("FAILED: coalescing keys into frames didn't bound the latency\n");
+      ok = false;
+    }
+  }
+  uint32_t governed = lcd.hash();
+  raster_lcd.fill_rect(0, 0, raster_lcd.width(), raster_lcd.height(), BLACK);
+  set_display_surfaces(raster_lcd, raster_sprite);
+  invalidate_display();
+  display_all();
+  if(governed != raster_lcd.hash()) {
+    printf("FAILED: the last coalesced frame differs from display_all()'s\n");
+    ok = false;
+  }
+  return ok;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Type the key trace 20 times, timing each key from its press to the end of its frame as the sketch does,
+//  and report the latency probe's stages. Every display stage must have a sample for every frame, and a key to
+//  screen sample for every key; the probe must come back the same from its encoding, and a cut short encoding
+//  must be refused. Return false (and the run fails) otherwise.
+//
+static bool check_latency_probe() {
+  static LatencyProbe decoded;
+  static uint8_t      buffer[8192];
+  static const LatencyStage display_stages[] = { stageSnapshot, stageValue, stageStatus, stageMemory, stageButtons, stageStacks, stageEndFrame };
+  bool                ok      = true;
+  uint32_t            frames  = 0;
+  reset_screen();
+  latency_probe.clear();
+  for(int pass = 0; pass < 20; pass++) {
+    for(const char* p = key_trace; *p; p++) {
+      uint32_t pressed = micros();
+      if(calc.key(*p) || calc.get_error_state()) {
+        display_all(pressed);
+        frames++;
+      }
+    }
+  }
+  printf("%-40s %10s %9s %9s %9s\n", "Latency probe, us", "count", "p50", "p99", "max");
+  for(uint8_t i = 0; i < LATENCY_STAGES; i++) {
+    LatencyStage stage = LatencyStage(i);
+    if(!latency_probe.count(stage)) continue;
+    printf("  %-38s %10u %9u %9u %9u\n", LatencyProbe::stage_name(stage), unsigned(latency_probe.count(stage)),
+           unsigned(latency_probe.percentile(stage, 0.50)), unsigned(latency_probe.percentile(stage, 0.99)), unsigned(latency_probe.max(stage)));
+  }
+  for(LatencyStage stage : display_stages) {
+    if(frames != latency_probe.count(stage)) {
+      printf("FAILED: the latency probe has %u samples of %s for %u frames\n", unsigned(latency_probe.count(stage)),
+             LatencyProbe::stage_name(stage), unsigned(frames));
+      ok = false;
+    }
+  }
+  if(frames != latency_probe.count(stageKeyToScreen) || !latency_probe.count(stagePush)) {
+    printf("FAILED: the latency probe missed keys to the screen, or pushes\n");
+    ok = false;
+  }
+  size_t size = latency_probe.encode(buffer, sizeof(buffer));
+  if(!size || !decoded.decode(buffer, size)) {
+    printf("FAILED: the latency probe's encoding doesn't decode\n");
+    return false;
+  }
+  LatencySample original, copy;
+  bool          same = latency_probe.recorded() >= LATENCY_RING_SIZE && LATENCY_RING_SIZE == decoded.recorded();
+  for(uint8_t i = 0; same && i < LATENCY_STAGES; i++) {
+    LatencyStage stage = LatencyStage(i);
+    same = latency_probe.max(stage) == decoded.max(stage);
+    for(uint8_t bucket = 0; same && bucket < LATENCY_BUCKETS; bucket++) same = latency_probe.bucket(stage, bucket) == decoded.bucket(stage, bucket);
+  }
+  for(uint32_t i = 0; same && latency_probe.sample(i, original); i++) {
+    same = decoded.sample(i, copy) && original.start == copy.start && original.duration == copy.duration && original.stage == copy.stage;
+  }
+  if(!same || decoded.decode(buffer, size - 1)) {
+    printf("FAILED: the latency probe changed in its encoding (%u bytes), or a cut short one was taken\n", unsigned(size));
+    ok = false;
+  }
+  return ok;
+}
+
+
+int main(int argc, char** argv) {
+  bool ok = check_scenes(1 < argc ? argv[1] : nullptr);
+  ok = check_redraws() && ok;
+  ok = check_snapshot_queue() && ok;
+  ok = check_render_thread() && ok;
+  ok = check_frame_governor() && ok;
+  ok = check_latency_probe() && ok;
+  bench_display_all();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,202 @@
+// Replay a key trace recorded on the device (see KeyTrace.h) through a KeyCalculator on the host.
+// Reports how long each key and button took, both as recorded on the device and as replayed here,
+// with a histogram and p50/p99/max for every key, and checks that the display strings recorded in
+// the trace match the replay's, unless the trace was started mid-session. Exits with 1 if any don't, or if the
+// trace is bad.
+// If the file is a Serial capture that also holds a latency dump (see LatencyProbe.h), prints the device's latency
+// from key press to screen, stage by stage; a capture with only a latency dump is fine.
+//
+//   build/replay trace.ktr     the trace, either binary or as captured from Serial by "Dump Key Trace"
+//
+// By Van Kichline
+// In the year of the plague
+
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../KeyTrace.h"
+#include "../LatencyProbe.h"
+#include "../button_actions.h"
+#include "bench.h"
+
+#define REPLAY_HISTOGRAM_BUCKETS  24                            // Powers of two: [1, 2) ns up to [2^23, inf) ns
+#define REPLAY_MAX_MISMATCHES     10                            // Mismatches described before the rest are just counted
+
+
+struct Latencies {
+  std::vector<double>   replayed;                               // ns on the host
+  std::vector<double>   recorded;                               // us on the device
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Read the whole file. If it starts with magic, it's binary; if it holds a Serial capture, decode the hex
+//  between BEGIN <marker> and END <marker>.
+//
+static bool load_dump(const char* path, const char* magic, const char* marker, std::vector<uint8_t>& trace) {
+  FILE* file = fopen(path, "rb");
+  if(!file) return false;
+  std::vector<uint8_t> raw;
+  uint8_t              chunk[4096];
+  size_t               count;
+  while(0 < (count = fread(chunk, 1, sizeof(chunk), file))) raw.insert(raw.end(), chunk, chunk + count);
+  fclose(file);
+  if(2 <= raw.size() && magic[0] == raw[0] && magic[1] == raw[1]) {
+    trace.swap(raw);
+    return true;
+  }
+  std::string text(raw.begin(), raw.end());
+  size_t      begin = text.find(std::string("BEGIN ") + marker);
+  size_t      end   = text.find(std::string("END ") + marker, begin);
+  if(std::string::npos == begin || std::string::npos == end) return false;
+  begin = text.find('\n', begin);
+  int high = -1;
+  for(size_t i = begin; i < end; i++) {
+    char c     = text[i];
+    int  digit = ('0' <= c && '9' >= c) ? c - '0' : ('A' <= c && 'F' >= c) ? c - 'A' + 10 : ('a' <= c && 'f' >= c) ? c - 'a' + 10 : -1;
+    if(0 > digit) continue;
+    if(0 > high) high = digit;
+    else {
+      trace.push_back(uint8_t(high << 4 | digit));
+      high = -1;
+    }
+  }
+  return true;
+}
+
+
+static void print_latencies(const std::string& name, std::vector<double> samples, const char* unit) {
+  std::sort(samples.begin(), samples.end());
+  printf("  %-24s %8zu %10.1f %10.1f %10.1f %s\n", name.c_str(), samples.size(),
+         percentile(samples, 0.50), percentile(samples, 0.99), samples.back(), unit);
+}
+
+
+static void print_histogram(const std::vector<double>& samples) {
+  size_t buckets[REPLAY_HISTOGRAM_BUCKETS] = {0};
+  size_t most = 0;
+  for(double ns : samples) {
+    int bucket = 0;
+    while(bucket < REPLAY_HISTOGRAM_BUCKETS - 1 && double(2u << bucket) <= ns) bucket++;
+    most = std::max(most, ++buckets[bucket]);
+  }
+  for(int i = 0; i < REPLAY_HISTOGRAM_BUCKETS; i++) {
+    if(!buckets[i]) continue;
+    printf("  %9u ns  %8zu  %s\n", 1u << i, buckets[i], std::string(50 * buckets[i] / most + 1, '#').c_str());
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The name a key or button is reported under
+//
+static std::string event_name(const KeyTraceEvent& event) {
+  char name[32];
+  if(traceKey == event.type) {
+    if(' ' < event.code && 127 > event.code) snprintf(name, sizeof(name), "key '%c'", event.code);
+    else                                     snprintf(name, sizeof(name), "key 0x%02X", event.code);
+    return name;
+  }
+  return "button " + std::string(event.text, event.length);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Print each stage of a latency dump that has samples. p50 and p99 are from the device's histograms,
+//  so they are the power of two of us they fall under.
+//
+static void print_latency_probe(const LatencyProbe& probe) {
+  printf("\n  %-24s %8s %10s %10s %10s\n", "Key to screen on the device", "count", "p50", "p99", "max");
+  for(uint8_t i = 0; i < LATENCY_STAGES; i++) {
+    LatencyStage stage = LatencyStage(i);
+    if(!probe.count(stage)) continue;
+    printf("  %-24s %8u %10u %10u %10u us\n", LatencyProbe::stage_name(stage), unsigned(probe.count(stage)),
+           unsigned(probe.percentile(stage, 0.50)), unsigned(probe.percentile(stage, 0.99)), unsigned(probe.max(stage)));
+  }
+}
+
+
+int main(int argc, char** argv) {
+  if(2 != argc) {
+    fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+    return 2;
+  }
+  std::vector<uint8_t> trace;
+  std::vector<uint8_t> latency;
+  static LatencyProbe  probe;
+  bool                 has_latency = load_dump(argv[1], "LP", "LATENCY", latency);
+  if(has_latency && !probe.decode(latency.data(), latency.size())) {
+    fprintf(stderr, "%s: not a version %d latency dump\n", argv[1], LATENCY_VERSION);
+    return 1;
+  }
+  if(!load_dump(argv[1], "KT", "KEYTRACE", trace)) {
+    if(has_latency) {
+      printf("%s: no key trace\n", argv[1]);
+      print_latency_probe(probe);
+      return 0;
+    }
+    fprintf(stderr, "%s: can't read a key trace\n", argv[1]);
+    return 1;
+  }
+  KeyTraceReader reader(trace.data(), trace.size());
+  if(!reader.valid()) {
+    fprintf(stderr, "%s: not a version %d key trace\n", argv[1], KEYTRACE_VERSION);
+    return 1;
+  }
+
+  static KeyCalculator              calc;
+  std::map<std::string, Latencies>  latencies;
+  Latencies                         all;
+  KeyTraceEvent                     event;
+  size_t                            checked     = 0;
+  size_t                            mismatches  = 0;
+  uint32_t                          last        = 0;
+  while(reader.next(event)) {
+    last = event.time + event.duration;
+    if(traceDisplay == event.type) {
+      if(reader.mid_session()) continue;                        // Recorded from a state this replay didn't start in
+      String      actual = calc.get_display(CalcDisplay(event.code));
+      std::string expected(event.text, event.length);
+      checked++;
+      if(expected != actual.c_str() && REPLAY_MAX_MISMATCHES > mismatches++) {
+        printf("Display %d at %.3f s: recorded \"%s\", replayed \"%s\"\n", event.code, event.time / 1e6, expected.c_str(), actual.c_str());
+      }
+      continue;
+    }
+    auto start = std::chrono::steady_clock::now();
+    if(traceKey == event.type) calc.key(event.code);
+    else                       do_button_action(calc, String(std::string(event.text, event.length).c_str()));
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    Latencies& entry = latencies[event_name(event)];
+    entry.replayed.push_back(ns);
+    entry.recorded.push_back(event.duration);
+    all.replayed.push_back(ns);
+    all.recorded.push_back(event.duration);
+  }
+
+  printf("%s: %zu keys and buttons over %.3f s%s\n", argv[1], all.replayed.size(), last / 1e6,
+         reader.truncated() ? " (truncated: the device's trace buffer was full)" : "");
+  if(all.replayed.size()) {
+    printf("\n  %-24s %8s %10s %10s %10s\n", "Recorded on the device", "count", "p50", "p99", "max");
+    print_latencies("all", all.recorded, "us");
+    for(auto& entry : latencies) print_latencies(entry.first, entry.second.recorded, "us");
+    printf("\n  %-24s %8s %10s %10s %10s\n", "Replayed on this host", "count", "p50", "p99", "max");
+    print_latencies("all", all.replayed, "ns");
+    for(auto& entry : latencies) print_latencies(entry.first, entry.second.replayed, "ns");
+    printf("\n  Replay latency histogram (each row counts samples from its value up to the next power of two)\n");
+    print_histogram(all.replayed);
+  }
+  if(has_latency) print_latency_probe(probe);
+  if(reader.mid_session()) printf("\nThe trace was started mid-session, so its display strings weren't checked\n");
+  else                     printf("\n%zu display strings checked, %zu mismatched\n", checked, mismatches);
+  if(reader.corrupt()) printf("The trace is corrupt after %.3f s\n", last / 1e6);
+  return (mismatches || reader.corrupt()) ? 1 : 0;
+}
@@ -1,51 +1,55 @@
 #include <M5ez.h>
+#include "FrameGovernor.h"
 #include "KeyCalculator.h"
+#include "KeyTrace.h"
+#include "LatencyProbe.h"
+#include "button_actions.h"
 #include "menu_ui.h"
 #include "help_text.h"
 
 // This file displays all the menus and text boxes associated with the UI, using M5ez UI.
 
+#define MEMORY_MENU_ROWS      10    // Most items in an indexed memory menu: each is a String on the heap
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Display a menu of ten indexed memory values, starting at index
+//  Display a menu of the indexed memories in use (non-zero) in M[first] - M[last], in address order.
+//  Every item is a heap String, and there may be 100,000 memories in use, so no menu has more than
+//  MEMORY_MENU_ROWS items: a range holding more is split into MEMORY_MENU_ROWS smaller ranges, and those
+//  in use are listed with their counts, to be opened in turn. Changes no values; display only.
 //
-void show_indexed_memory_group(uint8_t index) {
-  ezMenu menu("Indexed Memory");
+static void show_memory_range(Mem_Index first, Mem_Index last) {
+  ezMenu    menu("Indexed Memory");
+  Mem_Index count = calc._calc.count_occupied_memories(first, last);
   menu.txtSmall();
-  menu.buttons("up # back # down");
-  for(int i = 0; i < 10; i++) {
-    menu.addItem(String("M[") + String(index) + "]\t" + String(calc._calc.get_memory(index)));
-    index++;
+  if(count <= MEMORY_MENU_ROWS) {
+    menu.buttons("up # back # down");
+    for(Mem_Index i = calc._calc.next_occupied_memory(first); NO_MEMORY != i && i <= last; i = calc._calc.next_occupied_memory(i + 1)) {
+      menu.addItem(String("M[") + String(i) + "]\t" + calc.double_to_string(calc._calc.get_memory(i)));
+    }
+    menu.run();
+    return;
+  }
+  Mem_Index span = (last - first) / MEMORY_MENU_ROWS + 1;
+  menu.buttons("up # back # select ## down #");
+  for(Mem_Index low = first; low <= last && low >= first; low += span) {
+    Mem_Index high = std::min(last, low + (span - 1));
+    Mem_Index used = calc._calc.count_occupied_memories(low, high);
+    if(used) menu.addItem(String(low) + " | M[" + String(low) + "] - M[" + String(high) + "]\t" + String(used));
+  }
+  while(menu.runOnce()) {
+    Mem_Index low = menu.pickName().toInt();
+    show_memory_range(low, std::min(last, low + (span - 1)));
   }
-  menu.run();
 }
 
-
-////////////////////////////////////////////////////////////////////////////////
-//
-//  Display a menu for selecting a sub-group of indexed memories, broken up
-//  by groups of ten. By each group, display how many memories in that group
-//  are non-zero. Display the sub-group if selected.
-//  Changes no values; display only.
-//
 void show_indexed_memory() {
-  int index = 0;
-  ezMenu menu("Indexed Memory");
-  menu.txtSmall();
-  menu.buttons("up # back # select ## down#");
-  // Add ten menus, reading like: "M[50] - M[59]    3"
-  for(int i = 0; i < 10; i++) {
-    int count = 0;
-    // count how many in this group are non-zero values
-    for(int j = 0; j < 10; j++) if(00 != calc._calc.get_memory(i*10+j)) count++;
-    menu.addItem(String("M[") + index + "] - M[" + (index+9) + "]\t" + (count ? String(count) : ""));
-    index += 10;
-  }
-  menu.addItem("back | Back to Calculator Settings");
-  while(menu.runOnce()) {
-    show_indexed_memory_group((menu.pick() - 1) * 10);
+  if(0 == calc._calc.count_occupied_memories()) {
+    ez.msgBox("Indexed Memory Empty", "There are no values in indexed memory.");
+    return;
   }
+  show_memory_range(0, NUM_CALC_MEMORIES - 1);
 }
 
 
@@ -61,9 +65,9 @@ void show_memory_stack() {
     ezMenu menu("Memory Stack");
     menu.txtSmall();
     menu.buttons("up # back #  down");
-    for(int i = calc._calc.get_memory_depth() - 1; i >= 0; i--) {
-      menu.addItem(calc.double_to_string(calc._calc.memory_stack[i]));
-    }
+    MemoryStack<double>::Walker walker(calc._calc.memory_stack);
+    double                      value;
+    while(walker.next(value)) menu.addItem(calc.double_to_string(value));
     menu.run();
   }
 }
@@ -71,7 +75,8 @@ void show_memory_stack() {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Perform a few simple operations on the memory stack
+//  Perform a few simple operations on the memory stack. They are button actions ("stack sum" and so on),
+//  so the key trace records them and host/replay can repeat them.
 //
 void memory_stack_operations() {
   ezMenu menu("Memory Stack Ops");
@@ -80,33 +85,111 @@ void memory_stack_operations() {
   menu.addItem("Clear");
   menu.addItem("Sum");
   menu.addItem("Average");
+  menu.addItem("Std Dev");
+  menu.addItem("Min");
+  menu.addItem("Max");
   menu.addItem("Count");
   menu.addItem("back | Back to Calculator Settings");
   while(menu.runOnce()) {
-    if(menu.pickName() == "Clear") calc._calc.clear_memory_stack();
-    else if(menu.pickName() == "Sum") {
-      double total = 0.0;
-      for(int i = 0; i < calc._calc.memory_stack.size(); i++)
-        total += calc._calc.memory_stack[i];
-      calc.set_value(calc.double_to_string(total));
-    }
-    else if(menu.pickName() == "Average") {
-      double total = 0.0;
-      int    depth = calc._calc.memory_stack.size();
-      if(depth) {
-        for(int i = 0; i < depth; i++)
-          total += calc._calc.memory_stack[i];
-        total /= depth;
-      }
-      calc.set_value(calc.double_to_string(total));
-    }
-    else if(menu.pickName() == "Count") {
-      calc.set_value(calc.double_to_string(calc._calc.memory_stack.size()));
+    String    action = "stack " + menu.pickName();
+    uint32_t  start  = micros();
+    action.toLowerCase();
+    if(do_button_action(calc, action)) key_trace.button(action.c_str(), start, micros() - start);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Record the displays at the end of the key trace, so a replay can check that it got the same results,
+//  then send the trace to Serial for host/replay and start a new one.
+//
+void dump_key_trace() {
+  key_trace.display(calc, micros());
+  key_trace.dump();
+  String message = String(key_trace.size()) + " bytes were sent to Serial.";
+  if(key_trace.truncated()) message += "\nThe trace was full, so the latest keys are missing.";
+  key_trace.clear(true);
+  ez.msgBox("Key Trace", message);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Show how many keys each frame absorbed and how long the oldest of them waited to be shown, then start over.
+//
+void show_frame_stats() {
+  if(0 == frame_governor.frames()) {
+    ez.msgBox("Frame Stats", "No keys have been shown since the stats were cleared.");
+    return;
+  }
+  FrameStats  p50 = frame_governor.frame_percentile(0.50);
+  FrameStats  p99 = frame_governor.frame_percentile(0.99);
+  String      message;
+  message += String(frame_governor.keys()) + " keys in " + String(frame_governor.frames()) + " frames\n";
+  message += "Keys/frame p50 " + String(p50.keys) + ", p99 " + String(p99.keys) + ", max " + String(frame_governor.keys_max()) + "\n";
+  message += "Latency p50 " + String(p50.latency / 1000.0, 1) + " ms, p99 " + String(p99.latency / 1000.0, 1) + " ms\n";
+  message += "Latency max " + String(frame_governor.latency_max() / 1000.0, 1) + " ms";
+  frame_governor.clear_stats();
+  ez.msgBox("Frame Stats", message);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Show each stage from a key press to the screen that has been timed since the samples were cleared.
+//  p50 and p99 come from the stage's histogram, so they are the power of two of us they fall under.
+//
+void show_latency() {
+  if(0 == latency_probe.recorded()) {
+    ez.msgBox("Latency", "No keys have been timed since the samples were cleared.");
+    return;
+  }
+  ezMenu menu("Latency us: p50 p99 max");
+  menu.txtSmall();
+  menu.buttons("up # back # down");
+  for(uint8_t i = 0; i < LATENCY_STAGES; i++) {
+    LatencyStage stage = LatencyStage(i);
+    if(0 == latency_probe.count(stage)) continue;
+    menu.addItem(String(LatencyProbe::stage_name(stage)) + "\t" + String(latency_probe.percentile(stage, 0.50)) + " " +
+                 String(latency_probe.percentile(stage, 0.99)) + " " + String(latency_probe.max(stage)));
+  }
+  menu.run();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Key to screen latency diagnostics: show the stages, send them to Serial for host/replay, or start over
+//
+void latency_menu() {
+  ezMenu menu("Key to Screen Latency");
+  menu.txtSmall();
+  menu.buttons("up # back # select ## down #");
+  menu.addItem("Stages | Latency of Each Stage");
+  menu.addItem("Dump | Send Latency to Serial");
+  menu.addItem("Clear | Clear Latency Samples");
+  menu.addItem("back | Back to Calculator Settings");
+  while(menu.runOnce()) {
+    if(menu.pickName() == "Stages") show_latency();
+    else if(menu.pickName() == "Dump") {
+      latency_probe.dump();
+      ez.msgBox("Latency", String(std::min(latency_probe.recorded(), uint32_t(LATENCY_RING_SIZE))) + " samples and the histograms were sent to Serial.");
     }
+    else if(menu.pickName() == "Clear") latency_probe.clear();
   }
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//  The frame rate cap, as the settings menu shows it
+//
+String frame_rate_setting() {
+  return frame_governor.frame_rate() ? String(frame_governor.frame_rate()) : String("Off");
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  Display a menu of miscellaneous functions
@@ -116,9 +199,14 @@ void menu_menu() {
   menu.txtSmall();
   menu.buttons("up # back # select ## down #");
   menu.addItem(String("Stacks | Display Calculator Stacks\t") + (stacks_visible ? "On" : "Off"));
+  menu.addItem(String("Preview | Live Preview of =\t") + (calc.speculation() ? "On" : "Off"));
   menu.addItem("View Indexed Memory");
   menu.addItem("View Memory Stack");
   menu.addItem("Memory Stack Operations");
+  menu.addItem(String("Frame Rate | Frame Rate Cap\t") + frame_rate_setting());
+  menu.addItem("Frame Stats | Keys per Frame and Latency");
+  menu.addItem("Latency | Key to Screen Latency");
+  menu.addItem("Dump Key Trace | Send Key Trace to Serial");
   menu.addItem("Exit | Back to Calculator");
   while(menu.runOnce()) {
     if(menu.pickName() == "Exit") return;
@@ -132,6 +220,10 @@ void menu_menu() {
         stacks_visible = true;
       }
     }
+    else if(menu.pickName() == "Preview") {
+      calc.set_speculation(!calc.speculation());
+      menu.setCaption("Preview", String("Live Preview of =\t") + (calc.speculation() ? "On" : "Off"));
+    }
     else if(menu.pickName() == "View Indexed Memory") {
       show_indexed_memory();
     }
@@ -141,6 +233,22 @@ void menu_menu() {
     else if(menu.pickName() == "Memory Stack Operations") {
       memory_stack_operations();
     }
+    else if(menu.pickName() == "Frame Rate") {
+      static const uint16_t rates[] = { 60, 30, 15, 0 };
+      uint8_t next = 0;
+      while(next < 3 && rates[next] != frame_governor.frame_rate()) next++;
+      frame_governor.set_frame_rate(rates[(next + 1) % 4]);
+      menu.setCaption("Frame Rate", String("Frame Rate Cap\t") + frame_rate_setting());
+    }
+    else if(menu.pickName() == "Frame Stats") {
+      show_frame_stats();
+    }
+    else if(menu.pickName() == "Latency") {
+      latency_menu();
+    }
+    else if(menu.pickName() == "Dump Key Trace") {
+      dump_key_trace();
+    }
   }
 }
 
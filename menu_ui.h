@@ -1,6 +1,9 @@
 #pragma once
 
 extern KeyCalculator  calc;
+extern FrameGovernor  frame_governor;
+extern KeyTraceWriter key_trace;
+extern LatencyProbe   latency_probe;
 extern bool           stacks_visible;
 
 void menu_menu();
@@ -5,6 +5,7 @@
 // The top row is a status display, which is only shown when there are open parens or stored memory.
 // The next row is the main calculator value display. It's rendered from a sprite and can be two lines long.
 // The next area is shared by the Memory Mode display, and Global Error display. They are mutually exclusive.
+// When neither is shown, it shows a preview of what = would give, if the calculator is speculating.
 // The lowest row shows the operator and value stacks. It's normally visible, but can be disabled.
 // At the bottom of the screen are three buttons, whose captions change based on context.
 
@@ -30,15 +31,17 @@
 #define NUM_V_MARGIN          4             // Offset from top to top text
 #define NUM_H_MARGIN          16            // Left/right margin of the number
 #define NUM_FONT              6             // Number font
+#define NUM_LINES             2             // Lines of NUM_FONT the number display holds
 #define NUM_FG_COLOR          FG_COLOR      // Number display foreground color
 #define NUM_BG_COLOR          BG_COLOR      // Number display background color
 
-#define MEM_TOP               135           // Top of the memory storage display
-#define MEM_HEIGHT            32            // Height of the memory storage display
-#define MEM_V_MARGIN          4             // Offset from top to top text
+#define MEM_TOP               140           // Top of the memory storage display, just below the number display
+#define MEM_HEIGHT            27            // Height of the memory storage display
+#define MEM_V_MARGIN          0             // Offset from top to top text
 #define MEM_FONT              4             // Font used for the memory storage display
 #define MEM_FG_COLOR          BLUE          // Foreground (text) color of the memory storage display
 #define MEM_BG_COLOR          BG_COLOR      // Background color of the memory storage display
+#define PREVIEW_FG_COLOR      DARKGREY      // Foreground (text) color of the preview of =, in the memory storage display
 
 #define STACK_TOP             185           // Top of the calculator stacks display
 #define STACK_HEIGHT          24            // Height of the calculator stacks display
@@ -1,45 +1,272 @@
-#include <M5ez.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include "KeyCalculator.h"
+#include "SnapshotQueue.h"
 #include "screen_layout.h"
 #include "screen_ui.h"
 
 // This file contains the functions that render the screen display.
-// Only display_all() is of interest to the main program.
+// Only the functions in screen_ui.h are of interest to the main program.
+// It draws on DisplaySurfaces, so it runs on the M5Stack (M5Surface.h) and on a host (host/FramebufferSurface.h).
+// What the screen shows is taken from calc in a DisplaySnapshot, and drawn from there. display_all() does both;
+// with a render thread, the main thread publishes snapshots and the render thread draws the latest one's bands
+// (value, status, memory and stacks). The buttons and header are M5ez's, so the main thread draws them as it
+// publishes, keeping every ez.* call on one thread. Each thread holds the screen lock while it draws, and the
+// main thread holds it around ez.buttons.poll() and ez.yield(), which can draw too: the LCD can't be shared.
+// Display strings are written into the snapshot, so a redraw doesn't allocate.
+// Rendering is retained: each region remembers what it last drew, and is only drawn again when that changes.
+// Text is drawn with its background color, so only the parts of the old text the new text doesn't
+// cover need erasing, not the whole band.
+// The value is composed from a GlyphAtlas of its font, so a key during number entry only copies the glyphs
+// that moved or changed, not the whole value.
+// Each display function is timed into latency_probe, as is a frame from its oldest key being pressed.
+
+#define DEBUG_SCREEN_PIXELS   0   // If non-zero, spew the pixels each display_all() pushes to the LCD
+#define NUM_GLYPHS            "0123456789.-e"   // The glyphs of NUM_FONT in value_atlas
+#define VALUE_CELLS           (KEYCAL_NUM_BUFFER_SIZE - 1)  // The most glyphs a composed value has: a number being entered, less its terminator
+
+static_assert(NUMBER_BUFFER_SIZE - 1 <= VALUE_CELLS, "a formatted value must fit in VALUE_CELLS");
+
+static char display_text[KEYCAL_DISPLAY_SIZE];
+
+static DisplaySnapshot  engine_snapshot;                        // Taken by display_all() or publish_display()
+static DisplaySnapshot  render_snapshot;                        // Drawn by render_latest()
+static uint32_t         invalidations           = 0;            // invalidate_display() calls, on the main thread
+static uint32_t         rendered_invalidations  = 0;            // The invalidations the bands have caught up with
+static uint32_t         chrome_invalidations    = 0;            // The invalidations the buttons and header have caught up with
+static std::mutex       screen_mutex;                           // See lock_screen(). On the ESP32, a FreeRTOS mutex underneath
+
+static SnapshotQueue<DisplaySnapshot, RENDER_QUEUE_SIZE> render_queue;
+static std::atomic<bool>      render_held{false};               // Set by hold_rendering()
+static std::atomic<bool>      render_busy{false};               // Set while render_latest() runs
+static std::atomic<uint32_t>  render_sequence{0};               // Sequence of the last snapshot render_latest() drew
+
+uint32_t    screen_pixels_last  = 0;
+uint32_t    screen_pixels_total = 0;
+
+static DisplaySurface* screen;    // The LCD
+static DisplaySurface* value_sprite;  // Offscreen, for the main value
+static GlyphAtlas*     value_atlas;   // NUM_GLYPHS in NUM_FG_COLOR, or nullptr if the screen can't have one
+
+struct Extent {                   // Columns covered by a text: [left, right)
+  int16_t   left    = 0;
+  int16_t   right   = 0;
+};
+
+struct Region {                   // What a region of the screen last showed
+  uint32_t  hash;                 // Hash of everything that determines its pixels
+  bool      valid   = false;      // False until drawn, and after invalidate_display()
+  Extent    texts[2];             // Where its texts were drawn
+};
+
+struct Cell {                     // A glyph of the value, where it was copied from value_atlas
+  char      c;
+  uint8_t   line;
+  int16_t   x;
+};
+
+static Region status_region;
+static Region value_region;
+static Region memory_region;
+static Region stacks_region;
+static Region buttons_region;
+static bool   header_valid = false;
+static Cell   value_cells[VALUE_CELLS];           // What the value band shows, if value_composed
+static size_t value_cell_count  = 0;
+static Extent value_lines[NUM_LINES];             // Where each line of value_cells is
+static bool   value_composed    = false;          // False if the band was drawn some other way
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  FNV-1a hashes of what a region shows
+//
+static uint32_t hash_text(const char* text, uint32_t hash = 2166136261u) {
+  while(*text) {
+    hash ^= uint8_t(*text++);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t hash_value(uint32_t value, uint32_t hash) {
+  for(int i = 0; i < 4; i++) {
+    hash ^= uint8_t(value >> (8 * i));
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Return true if the region must be drawn to show what hash describes, and remember it
+//
+static bool region_changed(Region& region, uint32_t hash) {
+  if(region.valid && region.hash == hash) return false;
+  region.hash = hash;
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Record a stage that started at start and ends now; return now, for the next stage to start at
+//
+static uint32_t probe(LatencyStage stage, uint32_t start) {
+  uint32_t end = micros();
+  latency_probe.record(stage, start, end);
+  return end;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Fill a rectangle of the screen
+//
+static void fill(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t color) {
+  screen->fill_rect(x, y, w, h, color);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Get a region's band ready for drawing: if the region isn't valid, fill the whole band.
+//  Then erase_uncovered() erases only the columns of a text's old extent that its new extent won't cover.
+//
+static void prepare_band(Region& region, int32_t band_top, int32_t band_height, uint16_t color) {
+  if(!region.valid) {
+    fill(0, band_top, SCREEN_WIDTH, band_height, color);
+    region.texts[0] = region.texts[1] = Extent();
+  }
+  region.valid = true;
+}
+
+static void erase_uncovered(Extent& old, int16_t left, int16_t right, int32_t top, int32_t height, uint16_t color) {
+  if(left >= right) {
+    fill(old.left, top, old.right - old.left, height, color);
+  }
+  else {
+    fill(old.left, top, std::min(old.right, left) - old.left, height, color);
+    fill(std::max(old.left, right), top, old.right - std::max(old.left, right), height, color);
+  }
+  old.left  = left;
+  old.right = right;
+}
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 //  Display the calculator status in small text above the value.
 //
-void display_status() {
-  M5.Lcd.setTextFont(STAT_FONT);
-  M5.Lcd.setTextDatum(TL_DATUM);
-  M5.Lcd.setTextColor(STAT_FG_COLOR, STAT_BG_COLOR);  // Blank space erases background w/ background color set
-  M5.Lcd.fillRect(0, STAT_TOP, SCREEN_WIDTH, STAT_HEIGHT, STAT_BG_COLOR);
-  M5.Lcd.drawString(calc.get_display(dispStatus), STAT_LEFT_MARGIN, STAT_TOP, STAT_FONT);
+void display_status(const DisplaySnapshot& snapshot) {
+  if(!region_changed(status_region, hash_text(snapshot.status))) return;
+  int16_t width  = screen->text_width(snapshot.status, STAT_FONT);
+  int16_t height = screen->font_height(STAT_FONT);
+  prepare_band(status_region, STAT_TOP, STAT_HEIGHT, STAT_BG_COLOR);
+  erase_uncovered(status_region.texts[0], STAT_LEFT_MARGIN, STAT_LEFT_MARGIN + width, STAT_TOP, height, STAT_BG_COLOR);
+  screen->draw_text(snapshot.status, STAT_LEFT_MARGIN, STAT_TOP, STAT_FONT, alignLeft, STAT_FG_COLOR, STAT_BG_COLOR);
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Main numeric display; show the number being entered or the current value.
-//  Since the number can be wider than the display, and text wrapping always wraps to zero,
-//  and a left margin is desired, a sprite is used to render the characters to the screen.
+//  Lay out the value as TFT_eSPI prints it with text wrap in the value sprite: right aligned if it fits
+//  on a line, else from the left, wrapping to the left. Lines past NUM_LINES, and cells past VALUE_CELLS, are clipped.
+//  Return the number of cells, or -1 if a glyph isn't in value_atlas.
 //
-void display_value() {
-  bool is_err = calc.get_error_state();
-  sprite.fillSprite(NUM_BG_COLOR);
-  sprite.setTextFont(NUM_FONT);
-  sprite.setTextColor(is_err ? ERROR_COLOR :NUM_FG_COLOR, NUM_BG_COLOR);  // Blank space erases background w/ background color set
-  sprite.setTextWrap(true);
+static int layout_value(const char* text, Cell* cells) {
+  int16_t left  = LEFT_MARGIN;
+  int16_t right = SCREEN_WIDTH - RIGHT_MARGIN;
+  int16_t width = 0;
+  for(const char* p = text; *p; p++) {
+    if(!value_atlas->has(*p)) return -1;
+    width += value_atlas->glyph_width(*p);
+  }
+  int     count = 0;
+  uint8_t line  = 0;
+  int16_t x     = (right - left > width) ? right - width : left;
+  for(const char* p = text; *p; p++) {
+    int16_t w = value_atlas->glyph_width(*p);
+    if(x + w > right) {
+      x = left;
+      line++;
+    }
+    if(NUM_LINES <= line || VALUE_CELLS <= count) break;
+    cells[count++] = { *p, line, x };
+    x += w;
+  }
+  return count;
+}
+
 
-  String   disp_value = calc.get_display(dispValue);
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Draw the value from value_atlas. Erase what the old value covered and the new one doesn't,
+//  then copy only the cells whose glyph or place changed: typing a digit into a value that fits on a line
+//  moves every glyph, but a wrapped value only gains a cell at its tail.
+//  Return false, having drawn nothing, if the value can't be composed.
+//
+static bool compose_value(const char* text) {
+  Cell  cells[VALUE_CELLS];                                     // Small: this runs on the render task's stack
+  int   count = layout_value(text, cells);
+  if(0 > count) return false;
+  int16_t height = value_atlas->height();
+  if(!value_composed) {
+    fill(LEFT_MARGIN, NUM_TOP, SCREEN_WIDTH - LEFT_MARGIN - RIGHT_MARGIN, NUM_HEIGHT, NUM_BG_COLOR);
+    for(Extent& extent : value_lines) extent = Extent();
+    value_cell_count = 0;
+  }
+  for(uint8_t line = 0; line < NUM_LINES; line++) {
+    int16_t left = 0, right = 0;
+    for(int i = 0; i < count; i++) {
+      if(line != cells[i].line) continue;
+      if(left == right) left = cells[i].x;
+      right = cells[i].x + value_atlas->glyph_width(cells[i].c);
+    }
+    erase_uncovered(value_lines[line], left, right, NUM_TOP + line * height, height, NUM_BG_COLOR);
+  }
+  size_t    old   = 0;                                          // Both layouts are in order of line, then x
+  uint32_t  start = micros();
+  for(int i = 0; i < count; i++) {
+    const Cell& cell = cells[i];
+    while(old < value_cell_count && (value_cells[old].line < cell.line || (value_cells[old].line == cell.line && value_cells[old].x < cell.x))) old++;
+    if(old < value_cell_count && value_cells[old].line == cell.line && value_cells[old].x == cell.x && value_cells[old].c == cell.c) continue;
+    screen->draw_glyph(*value_atlas, cell.c, cell.x, NUM_TOP + cell.line * height);
+  }
+  probe(stagePush, start);
+  memcpy(value_cells, cells, count * sizeof(Cell));
+  value_cell_count  = count;
+  value_composed    = true;
+  return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Main numeric display; show the number being entered or the current value.
+//  It's composed from value_atlas when it can be. Otherwise (an error, or a value with other characters),
+//  since the number can be wider than the display, and text wrapping always wraps to zero,
+//  and a left margin is desired, an offscreen sprite is used to render the characters to the screen.
+//  The sprite is pushed whole, but only when the value or its color changes.
+//
+void display_value(const DisplaySnapshot& snapshot) {
+  bool        is_err  = snapshot.error;
+  const char* text    = snapshot.value;
+  if(!region_changed(value_region, hash_value(is_err, hash_text(text)))) return;
+  value_composed      = value_composed && value_region.valid;
+  value_region.valid  = true;
+  if(!is_err && value_atlas && compose_value(text)) return;
   uint16_t margin     = 0;
-  uint16_t wid        = sprite.textWidth(disp_value);
-  if(sprite.width() > wid) margin = sprite.width() - wid;
-  sprite.setCursor(margin, 0);
-  sprite.print(disp_value);
-  sprite.pushSprite(LEFT_MARGIN, NUM_TOP);
+  uint16_t wid        = value_sprite->text_width(text, NUM_FONT);
+  if(value_sprite->width() > wid) margin = value_sprite->width() - wid;
+  value_sprite->fill_rect(0, 0, value_sprite->width(), value_sprite->height(), NUM_BG_COLOR);
+  value_sprite->draw_wrapped(text, margin, 0, NUM_FONT, is_err ? ERROR_COLOR : NUM_FG_COLOR, NUM_BG_COLOR);
+  uint32_t start      = micros();
+  value_sprite->push(LEFT_MARGIN, NUM_TOP);
+  probe(stagePush, start);
+  value_composed      = false;
 }
 
 
@@ -49,32 +276,40 @@ void display_value() {
 //  If the user has pressed the M key, show the memory location we're building up (M, M[n], M[nn])
 //  along with the current value at that location.
 //  If we're in global error mode, show the error instead.
+//  Otherwise, show the preview of what = would give, if there is one.
 //
-void display_memory_storage() {
-  String disp_value;
-  M5.Lcd.fillRect(0, MEM_TOP, SCREEN_WIDTH, MEM_HEIGHT, MEM_BG_COLOR);
-  Op_Err err = calc.get_error_state();
+void display_memory_storage(const DisplaySnapshot& snapshot) {
+  const char* disp_value = "";
+  uint16_t    color      = MEM_FG_COLOR;
+  Op_Err      err        = snapshot.error;
   if(err) {
-    M5.Lcd.setTextFont(MEM_FONT);
-    M5.Lcd.setTextColor(ERROR_COLOR, MEM_BG_COLOR);
+    color = ERROR_COLOR;
     switch (err) {
       case ERROR_TOO_FEW_OPERANDS:  disp_value = "Too Few Operands";      break;
       case ERROR_UNKNOWN_OPERATOR:  disp_value = "Unknown Operator";      break;
       case ERROR_DIVIDE_BY_ZERO:    disp_value = "Divide by Zero";        break;
       case ERROR_NO_MATCHING_PAREN: disp_value = "No Matching (";         break;
       case ERROR_OVERFLOW:          disp_value = "Overflow";              break;
-      default:                      disp_value = "Unknown Error: " + err; break;
+      case ERROR_INVALID_NUMBER:    disp_value = "Invalid Number";        break;
+      case ERROR_INVALID_FORMULA:   disp_value = "Invalid Formula";       break;
+      case ERROR_CIRCULAR_REFERENCE: disp_value = "Circular Reference";   break;
+      case ERROR_INVALID_MEMORY:    disp_value = "Invalid Memory";        break;
+      default:                      snprintf(display_text, sizeof(display_text), "Unknown Error: %d", err); disp_value = display_text; break;
     }
-    M5.Lcd.drawCentreString(disp_value.c_str(), SCREEN_H_CENTER, MEM_TOP + MEM_V_MARGIN, MEM_FONT);
   }
-  else {
-    M5.Lcd.setTextFont(MEM_FONT);
-    if(calcEnteringMemory == calc.get_state()) {
-      disp_value = calc.get_display(dispMemoryID);
-      M5.Lcd.setTextColor(MEM_FG_COLOR, MEM_BG_COLOR);  // Blank space erases background w/ background color set
-      M5.Lcd.drawCentreString(disp_value.c_str(), SCREEN_H_CENTER, MEM_TOP + MEM_V_MARGIN, MEM_FONT);
-    }
+  else if(calcEnteringMemory == snapshot.state) {
+    disp_value = snapshot.memory_id;
+  }
+  else if(snapshot.preview[0]) {
+    color      = PREVIEW_FG_COLOR;
+    disp_value = snapshot.preview;
   }
+  if(!region_changed(memory_region, hash_value(color, hash_text(disp_value)))) return;
+  int16_t width  = screen->text_width(disp_value, MEM_FONT);
+  int16_t height = screen->font_height(MEM_FONT);
+  prepare_band(memory_region, MEM_TOP, MEM_HEIGHT, MEM_BG_COLOR);
+  erase_uncovered(memory_region.texts[0], SCREEN_H_CENTER - width / 2, SCREEN_H_CENTER - width / 2 + width, MEM_TOP + MEM_V_MARGIN, height, MEM_BG_COLOR);
+  if(width) screen->draw_text(disp_value, SCREEN_H_CENTER, MEM_TOP + MEM_V_MARGIN, MEM_FONT, alignCenter, color, MEM_BG_COLOR);
 }
 
 
@@ -83,51 +318,261 @@ void display_memory_storage() {
 //  Display the operator stack at the lower left, and value stack at the lower right.
 //  This feature is non-standard and can be turned off, but it makes it easy to spot errors
 //  that would otherwise be difficult to track down.
+//  The stacks can overlap, so when either changes the old text is erased first and both are drawn, in order.
 //
-void display_stacks() {
-  bool   is_err    = calc.get_error_state();
-  String op_stack  = calc.get_display(dispOpStack);
-  String val_stack = calc.get_display(dispValStack);
-  M5.Lcd.fillRect(0, STACK_TOP, SCREEN_WIDTH, STACK_HEIGHT,STACK_BG_COLOR);
-  if(stacks_visible && (3 < op_stack.length() || 3 < val_stack.length())) {
-    M5.Lcd.setTextDatum(TL_DATUM);
-    M5.Lcd.setTextFont(STACK_FONT);
-    M5.Lcd.setTextColor(is_err ? ERROR_COLOR : STACK_FG_COLOR, STACK_BG_COLOR);  // Blank space erases background w/ background color set
-    M5.Lcd.drawString(op_stack.c_str(), LEFT_MARGIN, STACK_TOP + STACK_V_MARGIN, STACK_FONT);
-    M5.Lcd.setTextDatum(TR_DATUM);
-    M5.Lcd.drawString(val_stack.c_str(), SCREEN_WIDTH - RIGHT_MARGIN, STACK_TOP + STACK_V_MARGIN, STACK_FONT);
-    M5.Lcd.setTextDatum(TL_DATUM);
+void display_stacks(const DisplaySnapshot& snapshot) {
+  bool        is_err    = snapshot.error;
+  const char* op_stack  = snapshot.op_stack;
+  const char* val_stack = snapshot.val_stack;
+  bool        visible   = snapshot.stacks_shown;
+  if(!region_changed(stacks_region, hash_value(is_err, hash_value(visible, hash_text(val_stack, hash_text(op_stack)))))) return;
+  uint16_t color     = is_err ? ERROR_COLOR : STACK_FG_COLOR;
+  int16_t  op_width  = visible ? screen->text_width(op_stack, STACK_FONT)  : 0;
+  int16_t  val_width = visible ? screen->text_width(val_stack, STACK_FONT) : 0;
+  int16_t  height    = screen->font_height(STACK_FONT);
+  prepare_band(stacks_region, STACK_TOP, STACK_HEIGHT, STACK_BG_COLOR);
+  erase_uncovered(stacks_region.texts[0], LEFT_MARGIN, LEFT_MARGIN + op_width, STACK_TOP + STACK_V_MARGIN, height, STACK_BG_COLOR);
+  erase_uncovered(stacks_region.texts[1], SCREEN_WIDTH - RIGHT_MARGIN - val_width, SCREEN_WIDTH - RIGHT_MARGIN, STACK_TOP + STACK_V_MARGIN, height, STACK_BG_COLOR);
+  if(visible) {
+    screen->draw_text(op_stack, LEFT_MARGIN, STACK_TOP + STACK_V_MARGIN, STACK_FONT, alignLeft, color, STACK_BG_COLOR);
+    screen->draw_text(val_stack, SCREEN_WIDTH - RIGHT_MARGIN, STACK_TOP + STACK_V_MARGIN, STACK_FONT, alignRight, color, STACK_BG_COLOR);
   }
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Set the buttons at the bottom of the screen appropriately, depending on the mode
+//  Show the buttons at the bottom of the screen
 //
-void set_buttons() {
-  if(calcEnteringMemory == calc.get_state()) {
-    ez.buttons.show(BUTTONS_MEM_MODE);
+void set_buttons(const DisplaySnapshot& snapshot) {
+  if(!region_changed(buttons_region, hash_text(snapshot.buttons))) return;
+  screen->show_buttons(snapshot.buttons);
+  buttons_region.valid = true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Forget what's on the screen, so every region is drawn again: the bands, and M5ez's buttons and header
+//
+static void forget_bands() {
+  status_region.valid   = false;
+  value_region.valid    = false;
+  memory_region.valid   = false;
+  stacks_region.valid   = false;
+}
+
+static void forget_chrome() {
+  buttons_region.valid  = false;
+  header_valid          = false;
+}
+
+static void forget_regions() {
+  forget_bands();
+  forget_chrome();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Set where display_all() draws: the screen, and an offscreen surface as wide as the value display
+//  (SCREEN_WIDTH less the margins) and NUM_HEIGHT high, which is pushed to the screen.
+//  The screen makes the atlas of the value's glyphs. Call this before the render thread starts.
+//
+void set_display_surfaces(DisplaySurface& lcd, DisplaySurface& value) {
+  screen        = &lcd;
+  value_sprite  = &value;
+  delete value_atlas;
+  value_atlas   = screen->make_atlas(NUM_GLYPHS, NUM_FONT, NUM_FG_COLOR, NUM_BG_COLOR);
+  forget_regions();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Forget what's on the screen, so the next snapshot drawn draws everything.
+//  Call this after anything else (a menu or message box) has drawn on the screen.
+//  It only counts the call: the count travels in the next snapshot, so it's safe with a render thread.
+//
+void invalidate_display() {
+  invalidations++;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Take everything the screen shows from calc and the button state. Main thread only.
+//
+void take_snapshot(DisplaySnapshot& snapshot) {
+  uint32_t    start   = micros();
+  const char* buttons;
+  snapshot.invalidations  = invalidations;
+  snapshot.pressed        = 0;
+  snapshot.state          = calc.get_state();
+  snapshot.error          = calc.get_error_state();
+  calc.get_display(dispValue,     snapshot.value,     sizeof(snapshot.value));
+  calc.get_display(dispStatus,    snapshot.status,    sizeof(snapshot.status));
+  calc.get_display(dispMemoryID,  snapshot.memory_id, sizeof(snapshot.memory_id));
+  calc.get_display(dispPreview,   snapshot.preview,   sizeof(snapshot.preview));
+  size_t op_length  = calc.get_display(dispOpStack,  snapshot.op_stack,  sizeof(snapshot.op_stack));
+  size_t val_length = calc.get_display(dispValStack, snapshot.val_stack, sizeof(snapshot.val_stack));
+  snapshot.stacks_shown   = stacks_visible && (3 < op_length || 3 < val_length);
+  if(calcEnteringMemory == snapshot.state) {
+    buttons = BUTTONS_MEM_MODE;
   }
-  else if(!cancel_bs && calcEnteringNumber == calc.get_state()) {
-    ez.buttons.show(BUTTONS_NUM_MODE);
+  else if(!cancel_bs && calcEnteringNumber == snapshot.state) {
+    buttons = BUTTONS_NUM_MODE;
   }
   else {
-    ez.buttons.show(button_sets[button_set]);
+    buttons = button_sets[button_set].c_str();
+  }
+  strncpy(snapshot.buttons, buttons, sizeof(snapshot.buttons) - 1);
+  snapshot.buttons[sizeof(snapshot.buttons) - 1] = '\0';
+  probe(stageSnapshot, start);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Draw the buttons and the header, which M5ez draws: on the main thread, which makes every ez.* call
+//
+static void display_chrome(const DisplaySnapshot& snapshot) {
+  if(chrome_invalidations != snapshot.invalidations) {
+    forget_chrome();
+    chrome_invalidations = snapshot.invalidations;
+  }
+  uint32_t time = micros();
+  set_buttons(snapshot);
+  probe(stageButtons, time);
+  if(!header_valid) {
+    screen->show_header("Calculator");   // restore the header after its been reused
+    header_valid = true;
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Draw a snapshot's bands, and its buttons and header if chrome. Only regions whose content changed are drawn;
+//  screen_pixels_last counts the pixels pushed. The frame is on the screen when end_frame() returns, which ends
+//  stageKeyToScreen.
+//
+static void draw_snapshot(const DisplaySnapshot& snapshot, bool chrome) {
+  if(rendered_invalidations != snapshot.invalidations) {
+    forget_bands();
+    rendered_invalidations = snapshot.invalidations;
   }
+  uint32_t pixels = screen->pixels() + value_sprite->pixels();
+  uint32_t time   = micros();
+  display_value(snapshot);            time = probe(stageValue,    time);
+  display_status(snapshot);           time = probe(stageStatus,   time);
+  display_memory_storage(snapshot);   time = probe(stageMemory,   time);
+  if(chrome) display_chrome(snapshot);
+  time = micros();
+  display_stacks(snapshot);           probe(stageStacks, time);
+  screen_pixels_last   = screen->pixels() + value_sprite->pixels() - pixels;
+  screen_pixels_total += screen_pixels_last;
+  if(DEBUG_SCREEN_PIXELS) Serial.printf("display_all() pushed %u pixels\n", unsigned(screen_pixels_last));
+  time = micros();
+  screen->end_frame();
+  time = probe(stageEndFrame, time);
+  if(snapshot.pressed) latency_probe.record(stageKeyToScreen, snapshot.pressed, time);
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-//  Consolidated function to call repeatedly to render the calculator screen.
+//  Draw a whole snapshot, on a thread that owns the screen: without a render thread, the main thread
 //
-void display_all() {
-  display_value();
-  display_status();
-  display_memory_storage();
-  set_buttons();
-  display_stacks();
-  ez.header.show("Calculator");   // restore the header after its been reused
-  ez.yield();
+void display_snapshot(const DisplaySnapshot& snapshot) {
+  draw_snapshot(snapshot, true);
 }
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Consolidated function to call repeatedly to render the calculator screen, on the main thread,
+//  when there is no render thread. pressed is when the oldest key it shows was pressed, or 0.
+//
+void display_all(uint32_t pressed) {
+  take_snapshot(engine_snapshot);
+  engine_snapshot.pressed = pressed;
+  display_snapshot(engine_snapshot);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Main thread: take a snapshot, draw its buttons and header, and queue it for the render thread to draw the rest.
+//  Return false if the render thread is RENDER_QUEUE_SIZE snapshots behind; publish again later.
+//  pressed is as for display_all(). A snapshot the render thread skips takes its pressed with it,
+//  so stageKeyToScreen misses those keys.
+//
+bool publish_display(uint32_t pressed) {
+  take_snapshot(engine_snapshot);
+  engine_snapshot.sequence = render_queue.published() + 1;
+  engine_snapshot.pressed  = pressed;
+  if(!render_held) {
+    lock_screen();
+    display_chrome(engine_snapshot);
+    unlock_screen();
+  }
+  return render_queue.publish(engine_snapshot);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Render thread: draw the latest snapshot published, skipping older ones.
+//  Return false if there was none, or rendering is held.
+//  busy is set before held is read, and hold_rendering() sets held before it reads busy,
+//  so one of them always sees the other.
+//
+bool render_latest() {
+  render_busy = true;
+  bool drawn  = !render_held && render_queue.take_latest(render_snapshot);
+  if(drawn) {
+    lock_screen();
+    draw_snapshot(render_snapshot, false);
+    unlock_screen();
+    render_sequence = render_snapshot.sequence;
+  }
+  render_busy = false;
+  return drawn;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Main thread: wait for the render thread to finish drawing, and keep it from drawing again until
+//  release_rendering(). Call these around anything else that draws on the screen, like a menu.
+//  release_rendering() invalidates the display; publish a snapshot after it.
+//
+void hold_rendering() {
+  render_held = true;
+  while(render_busy) delay(1);
+}
+
+void release_rendering() {
+  invalidate_display();
+  render_held = false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  Hold the screen while drawing on it, or calling M5ez code that may, from any thread but a held render thread.
+//  Not recursive.
+//
+void lock_screen() {
+  screen_mutex.lock();
+}
+
+void unlock_screen() {
+  screen_mutex.unlock();
+}
+
+
+uint32_t snapshots_published()  { return render_queue.published(); }
+uint32_t snapshots_skipped()    { return render_queue.skipped(); }
+uint32_t rendered_sequence()    { return render_sequence; }
@@ -1,11 +1,16 @@
 #pragma once
 
+#include "DisplaySurface.h"
+#include "LatencyProbe.h"
+
 extern KeyCalculator          calc;
-extern TFT_eSprite            sprite;
 extern String                 button_sets[];
 extern uint8_t                button_set;
 extern bool                   cancel_bs;
 extern bool                   stacks_visible;
+extern LatencyProbe           latency_probe;          // Times each display function, and key to screen
+extern uint32_t               screen_pixels_last;     // Pixels pushed to the LCD by the last display_all()
+extern uint32_t               screen_pixels_total;    // Pixels pushed to the LCD by every display_all()
 
 #define BUTTONS_NUM_MODE      "BS # cancel # right"
 #define BUTTONS_MEM_MODE      "get # M # set # = # clear # AC"
@@ -14,7 +19,43 @@ extern bool                   stacks_visible;
 #define BUTTONS_NORMAL_2      "pi # e # right"
 #define BUTTONS_NORMAL_3      "push # pop # right"
 #define BUTTONS_NORMAL_4      "square # sqroot # right"
-#define NUM_BUTTON_SETS       5
+#define BUTTONS_NORMAL_5      "undo # redo # right"
+#define NUM_BUTTON_SETS       6
+#define SNAPSHOT_BUTTONS_SIZE 48                      // Holds any of the button captions above
+#define RENDER_QUEUE_SIZE     2                       // Snapshots the render thread can fall behind (a power of two)
+
+
+// Everything the screen shows, taken from calc and the button state at one moment, so it can be drawn on another thread
+struct DisplaySnapshot {
+  uint32_t    sequence;                               // Numbers the snapshots published
+  uint32_t    invalidations;                          // invalidate_display() calls when it was taken
+  uint32_t    pressed;                                // micros() when the oldest key it shows was pressed, or 0
+  CalcState   state;
+  Op_Err      error;
+  bool        stacks_shown;                           // stacks_visible, and there is something on the stacks
+  char        value[KEYCAL_DISPLAY_SIZE];
+  char        status[KEYCAL_DISPLAY_SIZE];
+  char        memory_id[KEYCAL_DISPLAY_SIZE];
+  char        op_stack[KEYCAL_DISPLAY_SIZE];
+  char        val_stack[KEYCAL_DISPLAY_SIZE];
+  char        preview[KEYCAL_PREVIEW_SIZE];
+  char        buttons[SNAPSHOT_BUTTONS_SIZE];
+};
+
 
+void      set_display_surfaces(DisplaySurface& lcd, DisplaySurface& value);
+void      display_all(uint32_t pressed = 0);          // pressed: the oldest key the frame shows, for stageKeyToScreen
+void      invalidate_display();
+void      take_snapshot(DisplaySnapshot& snapshot);
+void      display_snapshot(const DisplaySnapshot& snapshot);
 
-void display_all();
+// With a render thread: the main thread publishes snapshots, and the render thread calls render_latest() to draw them
+bool      publish_display(uint32_t pressed = 0);      // Draws the buttons and header. Return false if the queue is full; publish again later
+bool      render_latest();                            // Return false if there was nothing to draw
+void      hold_rendering();                           // Wait for the render thread to finish, and keep it from drawing
+void      release_rendering();                        // Let it draw again, from scratch
+void      lock_screen();                              // Hold the LCD: around anything else that draws, or ez.* that may, while the render thread can run
+void      unlock_screen();
+uint32_t  snapshots_published();
+uint32_t  snapshots_skipped();                        // Snapshots the render thread dropped for newer ones
+uint32_t  rendered_sequence();                        // The sequence of the last snapshot it drew